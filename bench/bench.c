@@ -0,0 +1,142 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define BENCH_MAX_RESULTS 512
+
+struct bench_row {
+    char name[48];
+    char params[64];
+    char metric[32];
+    double value;
+    char unit[16];
+};
+
+bool bench_quick;
+static const char *bench_suite;
+static const char *bench_out = ".";
+static struct bench_row bench_rows[BENCH_MAX_RESULTS];
+static int bench_num_rows;
+
+void bench_init(int argc, char **argv, const char *suite){
+    bench_suite = suite;
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "--quick") == 0) bench_quick = true;
+        else if(strcmp(argv[i], "--out") == 0 && i + 1 < argc) bench_out = argv[++i];
+    }
+    mkdir(bench_out, 0777);
+}
+
+uint64_t bench_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+const char *bench_path(const char *file){
+    static char path[512];
+    snprintf(path, sizeof(path), "%s/%s", bench_out, file);
+    return path;
+}
+
+void bench_result(const char *name, const char *metric, double value, const char *unit, const char *params_fmt, ...){
+    char params[64];
+    va_list ap;
+    va_start(ap, params_fmt);
+    vsnprintf(params, sizeof(params), params_fmt, ap);
+    va_end(ap);
+    printf("%-22s %-28s %-18s %14.3f %s\n", name, params, metric, value, unit);
+    if(bench_num_rows == BENCH_MAX_RESULTS) return;
+    struct bench_row *row = &bench_rows[bench_num_rows++];
+    snprintf(row->name, sizeof(row->name), "%s", name);
+    snprintf(row->params, sizeof(row->params), "%s", params);
+    snprintf(row->metric, sizeof(row->metric), "%s", metric);
+    row->value = value;
+    snprintf(row->unit, sizeof(row->unit), "%s", unit);
+}
+
+static int bench_cmp(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double bench_percentile(double *values, int n, double p){
+    if(n == 0) return 0;
+    qsort(values, n, sizeof(double), bench_cmp);
+    int idx = (int)(p / 100 * n);
+    return values[idx < n ? idx : n - 1];
+}
+
+//"a=1 b=2" as the JSON object {"a": 1, "b": 2}
+static void bench_json_params(FILE *f, const char *params){
+    fputc('{', f);
+    const char *p = params;
+    bool first = true;
+    while(*p != '\0'){
+        while(*p == ' ') p++;
+        const char *eq = strchr(p, '=');
+        if(*p == '\0' || eq == NULL) break;
+        const char *end = strchr(eq, ' ');
+        if(end == NULL) end = eq + strlen(eq);
+        fprintf(f, "%s\"%.*s\": %.*s", first ? "" : ", ", (int)(eq - p), p, (int)(end - eq - 1), eq + 1);
+        first = false;
+        p = end;
+    }
+    fputc('}', f);
+}
+
+int bench_finish(void){
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s.json", bench_out, bench_suite);
+    FILE *json = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s/%s.csv", bench_out, bench_suite);
+    FILE *csv = fopen(path, "w");
+    if(json == NULL || csv == NULL){
+        fprintf(stderr, "Cannot write results to %s\n", bench_out);
+        if(json != NULL) fclose(json);
+        if(csv != NULL) fclose(csv);
+        return 1;
+    }
+    fprintf(json, "{\"suite\": \"%s\", \"quick\": %s, \"results\": [", bench_suite, bench_quick ? "true" : "false");
+    fprintf(csv, "suite,case,params,metric,value,unit\n");
+    for(int i = 0; i < bench_num_rows; i++){
+        struct bench_row *row = &bench_rows[i];
+        fprintf(json, "%s\n  {\"case\": \"%s\", \"params\": ", i > 0 ? "," : "", row->name);
+        bench_json_params(json, row->params);
+        fprintf(json, ", \"metric\": \"%s\", \"value\": %.6g, \"unit\": \"%s\"}", row->metric, row->value, row->unit);
+        fprintf(csv, "%s,%s,%s,%s,%.6g,%s\n", bench_suite, row->name, row->params, row->metric, row->value, row->unit);
+    }
+    fprintf(json, "\n]}\n");
+    fclose(json);
+    fclose(csv);
+    return 0;
+}
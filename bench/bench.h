@@ -0,0 +1,58 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Benchmark harness. Each benchmark is a program that measures cases at growing sizes and records
+//one row per measurement. Rows are written as <out>/<suite>.json and <out>/<suite>.csv on exit.
+//  bench_x [--quick] [--out dir]
+//--quick runs small sizes only, as ctest does to keep the benchmarks working.
+
+#ifndef CS_ESPNOW_BENCH_H
+#define CS_ESPNOW_BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    extern bool bench_quick;
+    void bench_init(int argc, char **argv, const char *suite);
+    //Write the results, returns the exit code for main
+    int bench_finish(void);
+    uint64_t bench_now_ns(void);
+    //Path of a scratch file in the output directory
+    const char *bench_path(const char *file);
+    //One measurement: case name, metric, value and unit, then what it was measured at as printf
+    //formatted key=number pairs separated by spaces ("peers=%d callbacks=%d")
+    void bench_result(const char *name, const char *metric, double value, const char *unit, const char *params_fmt, ...)
+        __attribute__((format(printf, 5, 6)));
+    //Percentile p (0-100) of n values, sorts them
+    double bench_percentile(double *values, int n, double p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
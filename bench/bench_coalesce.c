@@ -0,0 +1,79 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Coalescing packing ratio and added latency against the message rate and size. Messages go to one
+//peer at a steady rate in virtual time, latency is the time they waited in the coalescing buffer.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_co_sizes[] = {10, 20, 30};
+//Messages per 10 ms
+static const int bench_co_rates[] = {2, 10, 40, 160};
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "coalesce");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_coalesce(true);
+    mgos_espnow_init();
+    uint8_t mac[6];
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    uint8_t msg[64];
+    memset(msg, 0x42, sizeof(msg));
+    int ms = bench_quick ? 100 : 5000;
+    for(size_t s = 0; s < sizeof(bench_co_sizes) / sizeof(bench_co_sizes[0]); s++){
+        for(size_t r = 0; r < sizeof(bench_co_rates) / sizeof(bench_co_rates[0]); r++){
+            int size = bench_co_sizes[s], rate = bench_co_rates[r];
+            struct mgos_espnow_coalesce_stats before, after;
+            mgos_espnow_get_coalesce_stats(&before);
+            int sent = 0;
+            uint64_t cpu = 0;
+            for(int t = 0; t < ms; t++){
+                //rate messages every 10 ms, spread over the ms
+                int num = (t + 1) * rate / 10 - t * rate / 10;
+                uint64_t start = bench_now_ns();
+                for(int i = 0; i < num; i++) mgos_espnow_send("peer0", msg, size);
+                cpu += bench_now_ns() - start;
+                sent += num;
+                host_advance_ms(1);
+            }
+            host_advance_ms(50);
+            mgos_espnow_get_coalesce_stats(&after);
+            uint32_t messages = after.messages - before.messages, frames = after.frames - before.frames;
+            double delay = ((double)after.avg_delay_us * after.messages - (double)before.avg_delay_us * before.messages) / messages;
+            //Averages are whole microseconds
+            if(delay < 0) delay = 0;
+            if((int)messages != sent) fprintf(stderr, "%u messages coalesced of %d\n", messages, sent);
+            bench_result("steady", "messages_per_frame", frames ? (double)messages / frames : 0, "", "bytes=%d per_10ms=%d", size, rate);
+            bench_result("steady", "added_latency", delay / 1000, "ms", "bytes=%d per_10ms=%d", size, rate);
+            bench_result("steady", "frames_saved_per_sec", (double)(messages - frames) * 1000 / ms, "1/s", "bytes=%d per_10ms=%d", size, rate);
+            bench_result("steady", "ns_per_message", sent ? (double)cpu / sent : 0, "ns", "bytes=%d per_10ms=%d", size, rate);
+        }
+    }
+    return bench_finish();
+}
@@ -0,0 +1,77 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Fragmented message throughput through the loopback radio: each message is split, queued, completed
+//by the driver and reassembled on the way back, at growing message sizes. Completions come on the
+//next event loop pass, so this is the library's own cost per byte.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_frag_lens[] = {250, 1000, 4096, 6000};
+static int bench_frag_delivered;
+
+static void bench_frag_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    bench_frag_delivered++;
+    (void)mac;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "frag");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_frag_max_len(6000);
+    mgos_sys_config_set_espnow_frag_rx_budget(32768);
+    mgos_espnow_init();
+    uint8_t mac[6];
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, bench_frag_recv_cb, NULL);
+    host_radio_loopback = true;
+    static uint8_t msg[6000];
+    for(int i = 0; i < (int)sizeof(msg); i++) msg[i] = (uint8_t)(i * 7);
+    for(size_t l = 0; l < sizeof(bench_frag_lens) / sizeof(bench_frag_lens[0]); l++){
+        int len = bench_frag_lens[l];
+        int fragments = (len + MGOS_ESPNOW_FRAG_LEN - 1) / MGOS_ESPNOW_FRAG_LEN;
+        //The whole message must fit in the TX queue
+        if(fragments > MGOS_ESPNOW_TX_QUEUE_LEN - MGOS_ESPNOW_TX_HIGH_SLOTS) continue;
+        int messages = bench_quick ? 20 : 200000 / fragments;
+        bench_frag_delivered = 0;
+        uint64_t start = bench_now_ns();
+        for(int i = 0; i < messages; i++){
+            mgos_espnow_send_large("peer0", msg, len, NULL, NULL, NULL);
+            for(int pass = 0; bench_frag_delivered <= i && pass < 1000; pass++) host_advance_ms(0);
+        }
+        double secs = (double)(bench_now_ns() - start) / 1e9;
+        if(bench_frag_delivered != messages) fprintf(stderr, "%d bytes: %d delivered of %d\n", len, bench_frag_delivered, messages);
+        bench_result("loopback", "throughput", (double)len * messages / secs / 1e6, "MB/s", "bytes=%d fragments=%d", len, fragments);
+        bench_result("loopback", "us_per_message", secs * 1e6 / messages, "us", "bytes=%d fragments=%d", len, fragments);
+    }
+    return bench_finish();
+}
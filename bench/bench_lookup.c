@@ -0,0 +1,149 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Peer lookup by MAC and by name through the peer index, against walking peer_list as the lookups
+//did before the index, at growing peer counts. Half the lookups are for peers not loaded.
+//Removing a peer and adding it back, which deletes it from the index and inserts it again.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_lookup_peers[] = {10, 100, 1000};
+
+static struct mgos_espnow_peer *bench_walk_mac(const uint8_t *mac){
+    struct mgos_espnow_peer *peer;
+    SLIST_FOREACH(peer, &peer_list, next){
+        if(memcmp(mac, peer->mac, 6) == 0) return peer;
+    }
+    return NULL;
+}
+
+static struct mgos_espnow_peer *bench_walk_name(const char *name){
+    struct mgos_espnow_peer *peer;
+    SLIST_FOREACH(peer, &peer_list, next){
+        if(strcmp(name, peer->name) == 0) return peer;
+    }
+    return NULL;
+}
+
+static int bench_walk_count(void){
+    int num = 0;
+    struct mgos_espnow_peer *peer;
+    SLIST_FOREACH(peer, &peer_list, next){
+        num++;
+    }
+    return num;
+}
+
+//Keys of lookups, the odd ones are not loaded
+#define BENCH_LOOKUP_KEYS 1024
+static uint8_t bench_macs[BENCH_LOOKUP_KEYS][6];
+static char bench_names[BENCH_LOOKUP_KEYS][16];
+
+static void bench_lookup_keys(int num_peers){
+    uint32_t r = 12345;
+    for(int i = 0; i < BENCH_LOOKUP_KEYS; i++){
+        r = r * 1103515245 + 12345;
+        int idx = (int)((r >> 8) % num_peers);
+        if(i & 1) idx += num_peers;
+        host_peer_mac(idx, bench_macs[i]);
+        host_peer_name(idx, bench_names[i], sizeof(bench_names[i]));
+    }
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "peer_lookup");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    //Peers past MGOS_ESPNOW_MAX_PEERS take heap memory
+    mgos_sys_config_set_espnow_max_peers(-1);
+    mgos_espnow_init();
+    int loaded = 0;
+    for(size_t p = 0; p < sizeof(bench_lookup_peers) / sizeof(bench_lookup_peers[0]); p++){
+        int num_peers = bench_lookup_peers[p];
+        if(bench_quick && num_peers > 100) break;
+        for(; loaded < num_peers; loaded++){
+            char name[16];
+            uint8_t mac[6];
+            host_peer_name(loaded, name, sizeof(name));
+            host_peer_mac(loaded, mac);
+            mgos_espnow_add_peer(name, mac, false, 1, false);
+        }
+        bench_lookup_keys(num_peers);
+        int rounds = bench_quick ? 10 : (num_peers >= 1000 ? 200 : 2000);
+        int lookups = rounds * BENCH_LOOKUP_KEYS;
+        int found = 0, found_walk = 0;
+
+        uint64_t start = bench_now_ns();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < BENCH_LOOKUP_KEYS; i++) found += mgos_espnow_get_peer_by_mac(bench_macs[i]) != NULL;
+        }
+        bench_result("by_mac", "ns_per_lookup", (double)(bench_now_ns() - start) / lookups, "ns", "peers=%d", num_peers);
+        start = bench_now_ns();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < BENCH_LOOKUP_KEYS; i++) found_walk += bench_walk_mac(bench_macs[i]) != NULL;
+        }
+        bench_result("by_mac_list_walk", "ns_per_lookup", (double)(bench_now_ns() - start) / lookups, "ns", "peers=%d", num_peers);
+        if(found != found_walk || found != lookups / 2) fprintf(stderr, "by mac: %d found, %d walking, of %d\n", found, found_walk, lookups / 2);
+
+        found = found_walk = 0;
+        start = bench_now_ns();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < BENCH_LOOKUP_KEYS; i++) found += mgos_espnow_get_peer_by_name(bench_names[i]) != NULL;
+        }
+        bench_result("by_name", "ns_per_lookup", (double)(bench_now_ns() - start) / lookups, "ns", "peers=%d", num_peers);
+        start = bench_now_ns();
+        for(int r = 0; r < rounds; r++){
+            for(int i = 0; i < BENCH_LOOKUP_KEYS; i++) found_walk += bench_walk_name(bench_names[i]) != NULL;
+        }
+        bench_result("by_name_list_walk", "ns_per_lookup", (double)(bench_now_ns() - start) / lookups, "ns", "peers=%d", num_peers);
+        if(found != found_walk || found != lookups / 2) fprintf(stderr, "by name: %d found, %d walking, of %d\n", found, found_walk, lookups / 2);
+
+        int total = 0;
+        start = bench_now_ns();
+        for(int r = 0; r < lookups; r++) total += mgos_espnow_total_peers();
+        bench_result("count", "ns_per_call", (double)(bench_now_ns() - start) / lookups, "ns", "peers=%d", num_peers);
+        start = bench_now_ns();
+        for(int r = 0; r < rounds; r++) total -= bench_walk_count() * BENCH_LOOKUP_KEYS;
+        bench_result("count_list_walk", "ns_per_call", (double)(bench_now_ns() - start) / rounds, "ns", "peers=%d", num_peers);
+        if(total != 0) fprintf(stderr, "count differs from the list\n");
+
+        int cycles = bench_quick ? 100 : 10000;
+        start = bench_now_ns();
+        for(int c = 0; c < cycles; c++){
+            char name[16];
+            uint8_t mac[6];
+            int i = (int)(((uint32_t)c * 2654435761u) % (uint32_t)num_peers);
+            host_peer_name(i, name, sizeof(name));
+            host_peer_mac(i, mac);
+            mgos_espnow_remove_peer(name, false);
+            mgos_espnow_add_peer(name, mac, false, 1, false);
+        }
+        bench_result("remove_add", "ns_per_cycle", (double)(bench_now_ns() - start) / cycles, "ns", "peers=%d", num_peers);
+        if(mgos_espnow_total_peers() != num_peers) fprintf(stderr, "%d peers after removing and adding, %d expected\n", mgos_espnow_total_peers(), num_peers);
+    }
+    return bench_finish();
+}
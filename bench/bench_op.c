@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Opcode dispatch against the usual pattern it replaces: N ALL callbacks that each look at the first
+//payload byte and return unless it is theirs. Frames go through the driver receive callback with a
+//random opcode among the N handled ones.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_op_handlers[] = {1, 8, 32, 128};
+static uint32_t bench_op_calls;
+
+static void bench_op_all_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    if(len < 1 || data[0] != (uint8_t)(intptr_t)ud) return;
+    bench_op_calls++;
+    (void)mac;
+}
+
+static void bench_op_cb(const uint8_t *mac, uint8_t op, const uint8_t *data, int len, void *ud){
+    bench_op_calls++;
+    (void)mac;
+    (void)op;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static double bench_op_run(int num_handlers, int frames){
+    uint8_t payload[32] = "?sensor:23.5,hum:40,bat:3.71";
+    uint8_t mac[6];
+    uint32_t r = 12345;
+    host_peer_mac(0, mac);
+    uint64_t start = bench_now_ns();
+    for(int i = 0; i < frames; i++){
+        r = r * 1103515245 + 12345;
+        payload[0] = (uint8_t)((r >> 8) % num_handlers);
+        host_radio_rx(mac, payload, sizeof(payload));
+        if(i % 32 == 31) host_run_invokes();
+    }
+    host_run_invokes();
+    return (double)(bench_now_ns() - start) / frames;
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "op_dispatch");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_espnow_init();
+    uint8_t mac[6];
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    int frames = bench_quick ? 2000 : 200000;
+    for(size_t h = 0; h < sizeof(bench_op_handlers) / sizeof(bench_op_handlers[0]); h++){
+        int num = bench_op_handlers[h];
+        if(bench_quick && num > 8) break;
+        for(int i = 0; i < num; i++){
+            mgos_espnow_register_recv_mac_cb(NULL, ALL, bench_op_all_cb, (void *)(intptr_t)i);
+        }
+        bench_op_calls = 0;
+        bench_result("all_callbacks", "ns_per_frame", bench_op_run(num, frames), "ns", "handlers=%d", num);
+        if(bench_op_calls != (uint32_t)frames) fprintf(stderr, "%u of %d frames handled by ALL callbacks\n", bench_op_calls, frames);
+        for(int i = 0; i < num; i++){
+            mgos_espnow_remove_recv_mac_cb(bench_op_all_cb, NULL, ALL);
+        }
+
+        mgos_sys_config_set_espnow_op_dispatch(true);
+        for(int i = 0; i < num; i++){
+            mgos_espnow_register_op_cb(NULL, (uint8_t)i, bench_op_cb, NULL);
+        }
+        bench_op_calls = 0;
+        bench_result("opcode_table", "ns_per_frame", bench_op_run(num, frames), "ns", "handlers=%d", num);
+        if(bench_op_calls != (uint32_t)frames) fprintf(stderr, "%u of %d frames handled by opcode\n", bench_op_calls, frames);
+        //Per peer handlers are looked up first
+        for(int i = 0; i < num; i++){
+            mgos_espnow_remove_op_cb(NULL, (uint8_t)i);
+            mgos_espnow_register_op_cb("peer0", (uint8_t)i, bench_op_cb, NULL);
+        }
+        bench_op_calls = 0;
+        bench_result("opcode_peer_table", "ns_per_frame", bench_op_run(num, frames), "ns", "handlers=%d", num);
+        for(int i = 0; i < num; i++){
+            mgos_espnow_remove_op_cb("peer0", (uint8_t)i);
+        }
+        mgos_sys_config_set_espnow_op_dispatch(false);
+    }
+    return bench_finish();
+}
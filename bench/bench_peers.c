@@ -0,0 +1,110 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Peer add and remove cost, and loading all peers from the JSON peer file and from the binary store,
+//at growing peer counts.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "bench.h"
+
+static const int bench_peers_counts[] = {10, 100, 500, 1000};
+
+static void bench_peers_add(int num_peers, bool save){
+    for(int i = 0; i < num_peers; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        if(mgos_espnow_add_peer(name, mac, false, 1, save) != ESPNOW_OK) fprintf(stderr, "add %s failed\n", name);
+    }
+}
+
+static void bench_peers_remove(int num_peers, bool save){
+    for(int i = 0; i < num_peers; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_remove_peer(name, save);
+    }
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "peers");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    //Peers past MGOS_ESPNOW_MAX_PEERS take heap memory
+    mgos_sys_config_set_espnow_max_peers(-1);
+    mgos_espnow_init();
+    for(size_t p = 0; p < sizeof(bench_peers_counts) / sizeof(bench_peers_counts[0]); p++){
+        int num_peers = bench_peers_counts[p];
+        if(bench_quick && num_peers > 100) break;
+        uint64_t start = bench_now_ns();
+        bench_peers_add(num_peers, false);
+        bench_result("add", "ns_per_peer", (double)(bench_now_ns() - start) / num_peers, "ns", "peers=%d", num_peers);
+        if(mgos_espnow_total_peers() != num_peers) fprintf(stderr, "%d peers loaded of %d\n", mgos_espnow_total_peers(), num_peers);
+        //Lookups by name and MAC of every peer
+        start = bench_now_ns();
+        for(int i = 0; i < num_peers; i++){
+            char name[16];
+            uint8_t mac[6];
+            host_peer_name(i, name, sizeof(name));
+            host_peer_mac(i, mac);
+            if(mgos_espnow_get_peer_by_name(name) == NULL || mgos_espnow_get_peer_by_mac(mac) == NULL) fprintf(stderr, "%s not found\n", name);
+        }
+        bench_result("lookup", "ns_per_peer", (double)(bench_now_ns() - start) / num_peers, "ns", "peers=%d", num_peers);
+
+        //JSON peer file
+        const char *json = bench_path("peers.json");
+        mgos_espnow_export_json(json);
+        bench_peers_remove(num_peers, false);
+        start = bench_now_ns();
+        int loaded = mgos_espnow_import_json(json, false);
+        bench_result("json_load", "ns_per_peer", (double)(bench_now_ns() - start) / num_peers, "ns", "peers=%d", num_peers);
+        if(loaded != num_peers) fprintf(stderr, "%d peers from %s of %d\n", loaded, json, num_peers);
+
+        //Binary store
+        mgos_sys_config_set_espnow_store_filename(bench_path("peers.bin"));
+        mgos_espnow_store_compact();
+        bench_peers_remove(num_peers, false);
+        start = bench_now_ns();
+        espnow_store_load();
+        bench_result("store_load", "ns_per_peer", (double)(bench_now_ns() - start) / num_peers, "ns", "peers=%d", num_peers);
+        if(mgos_espnow_total_peers() != num_peers) fprintf(stderr, "%d peers from the store of %d\n", mgos_espnow_total_peers(), num_peers);
+
+        //Saved removes and adds append a record each, committed by the flush timer
+        start = bench_now_ns();
+        bench_peers_remove(num_peers, true);
+        bench_peers_add(num_peers, true);
+        mgos_espnow_store_commit();
+        bench_result("store_update", "ns_per_peer", (double)(bench_now_ns() - start) / (2 * num_peers), "ns", "peers=%d", num_peers);
+        mgos_sys_config_set_espnow_store_filename("");
+
+        start = bench_now_ns();
+        bench_peers_remove(num_peers, false);
+        bench_result("remove", "ns_per_peer", (double)(bench_now_ns() - start) / num_peers, "ns", "peers=%d", num_peers);
+    }
+    return bench_finish();
+}
@@ -0,0 +1,131 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Queueing latency of a few urgent messages under a saturating load. The radio completes one frame per
+//virtual millisecond and the load keeps every queue slot it may take filled. Probe messages go to their
+//own peer every 10 ms and their latency, from the first send attempt to the completion, is measured in
+//that virtual time. Also
+//the latency of a quiet peer next to a chatty one, with and without espnow.tx_peer_rate.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+#define BENCH_PRIO_MAX_PROBES 5000
+
+static double bench_prio_lat[BENCH_PRIO_MAX_PROBES];
+static int bench_prio_done;
+static uint32_t bench_prio_load_sent;
+
+static void bench_prio_probe_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    int64_t sent_at = (int64_t)(intptr_t)ud;
+    if(success && bench_prio_done < BENCH_PRIO_MAX_PROBES) bench_prio_lat[bench_prio_done++] = (mgos_uptime_micros() - sent_at) / 1000.0;
+    (void)handle;
+    (void)mac;
+}
+
+static void bench_prio_load_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    bench_prio_load_sent += success;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+//Send probes to "probe" every 10 ms while load peers keep their class saturated. peer_rate only applies
+//to load frames, probes are sent too rarely to be held by it.
+static void bench_prio_run(const char *name, mgos_espnow_prio_t probe_prio, mgos_espnow_prio_t load_prio, int load_peers, int probes){
+    static const uint8_t payload[200] = "telemetry";
+    bench_prio_done = 0;
+    bench_prio_load_sent = 0;
+    int sent = 0, turn = 0;
+    uint64_t ticks = 0;
+    int64_t probe_since = -1;
+    for(int tick = 0; bench_prio_done < probes && tick < probes * 100; tick++){
+        //A probe refused with ESPNOW_QUEUE_FULL is retried every ms, its latency counts from the first try
+        if(tick % 10 == 0 && sent < probes && probe_since < 0) probe_since = mgos_uptime_micros();
+        if(probe_since >= 0 && mgos_espnow_send_msg_prio("probe", payload, 16, probe_prio, bench_prio_probe_cb, (void *)(intptr_t)probe_since, NULL) == ESPNOW_OK){
+            probe_since = -1;
+            sent++;
+        }
+        //Top up the load until the queue takes no more of its class
+        for(int tries = 0; tries < load_peers; tries++){
+            char peer[16];
+            host_peer_name(turn++ % load_peers, peer, sizeof(peer));
+            while(mgos_espnow_send_msg_prio(peer, payload, sizeof(payload), load_prio, bench_prio_load_cb, NULL, NULL) == ESPNOW_OK);
+        }
+        host_advance_ms(1);
+        host_radio_complete(true);
+        host_run_invokes();
+        ticks++;
+    }
+    //Drain before the next case
+    for(int i = 0; i < 1000 && (host_radio_pending() > 0 || host_run_invokes() > 0); i++){
+        host_advance_ms(1);
+        while(host_radio_complete(true)){
+            host_run_invokes();
+        }
+    }
+    host_advance_ms(100);
+    if(bench_prio_done < probes) fprintf(stderr, "%s: %d probes of %d completed\n", name, bench_prio_done, probes);
+    int n = bench_prio_done;
+    if(n == 0) return;
+    bench_result(name, "p50_ms", bench_percentile(bench_prio_lat, n, 50), "ms", "load_peers=%d", load_peers);
+    bench_result(name, "p99_ms", bench_percentile(bench_prio_lat, n, 99), "ms", "load_peers=%d", load_peers);
+    bench_result(name, "max_ms", bench_percentile(bench_prio_lat, n, 100), "ms", "load_peers=%d", load_peers);
+    bench_result(name, "load_frames_per_ms", (double)bench_prio_load_sent / ticks, "frames", "load_peers=%d", load_peers);
+}
+
+int main(int argc, char **argv){
+    static const int load_peers[] = {1, 8};
+    bench_init(argc, argv, "tx_priority");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    host_radio_manual = true;
+    mgos_espnow_init();
+    for(int i = 0; i < 8; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_add_peer(name, mac, false, 1, false);
+    }
+    uint8_t mac[6];
+    host_peer_mac(100, mac);
+    mgos_espnow_add_peer("probe", mac, false, 1, false);
+    int probes = bench_quick ? 100 : 2000;
+    for(size_t l = 0; l < sizeof(load_peers) / sizeof(load_peers[0]); l++){
+        int num = load_peers[l];
+        bench_prio_run("high_under_normal", ESPNOW_PRIO_HIGH, ESPNOW_PRIO_NORMAL, num, probes);
+        bench_prio_run("normal_under_normal", ESPNOW_PRIO_NORMAL, ESPNOW_PRIO_NORMAL, num, probes);
+        bench_prio_run("high_under_bulk", ESPNOW_PRIO_HIGH, ESPNOW_PRIO_BULK, num, probes);
+        bench_prio_run("normal_under_bulk", ESPNOW_PRIO_NORMAL, ESPNOW_PRIO_BULK, num, probes);
+    }
+    //A quiet NORMAL peer next to a chatty one, the rate limit keeps the chatty one to its burst
+    bench_prio_run("quiet_peer_no_rate", ESPNOW_PRIO_NORMAL, ESPNOW_PRIO_NORMAL, 1, probes);
+    mgos_sys_config_set_espnow_tx_peer_rate(500);
+    bench_prio_run("quiet_peer_rate_500", ESPNOW_PRIO_NORMAL, ESPNOW_PRIO_NORMAL, 1, probes);
+    mgos_sys_config_set_espnow_tx_peer_rate(0);
+    return bench_finish();
+}
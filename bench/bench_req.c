@@ -0,0 +1,97 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Request throughput with one and with many requests in flight. The loopback radio serves the requests
+//as the peer and takes 2 virtual ms per frame, so one request at a time waits out every round trip while
+//pipelined ones fill espnow.tx_window. Requests per second are counted in that virtual time, the CPU cost
+//per request in real time.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static int bench_req_left, bench_req_done, bench_req_failed;
+
+static void bench_req_echo_cb(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    mgos_espnow_respond(req, ESPNOW_REQ_OK, data, len);
+    (void)ud;
+}
+
+static void bench_req_send(void);
+
+static void bench_req_resp_cb(uint16_t id, const uint8_t *mac, mgos_espnow_req_status_t status, const uint8_t *data, int len, void *ud){
+    bench_req_done++;
+    if(status != ESPNOW_REQ_OK) bench_req_failed++;
+    bench_req_send();
+    (void)id;
+    (void)mac;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static void bench_req_send(void){
+    static const uint8_t payload[32] = "get:temperature";
+    if(bench_req_left == 0) return;
+    if(mgos_espnow_request("peer0", 1, payload, sizeof(payload), 1000, bench_req_resp_cb, NULL, NULL) == ESPNOW_OK) bench_req_left--;
+}
+
+static void bench_req_run(int in_flight, int requests){
+    bench_req_left = requests;
+    bench_req_done = bench_req_failed = 0;
+    int64_t start = mgos_uptime_micros();
+    uint64_t cpu = bench_now_ns();
+    for(int i = 0; i < in_flight; i++){
+        bench_req_send();
+    }
+    for(int ms = 0; bench_req_done < requests && ms < requests * 100; ms++){
+        host_advance_ms(1);
+        //Top up to in_flight after requests refused while the TX queue was full
+        if(bench_req_done + in_flight > requests - bench_req_left) bench_req_send();
+    }
+    double secs = (mgos_uptime_micros() - start) / 1e6;
+    bench_result("pipelined", "requests_per_sec", secs > 0 ? bench_req_done / secs : 0, "req/s", "in_flight=%d", in_flight);
+    bench_result("pipelined", "ns_per_request", (double)(bench_now_ns() - cpu) / requests, "ns", "in_flight=%d", in_flight);
+    if(bench_req_failed > 0 || bench_req_done < requests) fprintf(stderr, "in_flight=%d: %d done, %d failed of %d\n", in_flight, bench_req_done, bench_req_failed, requests);
+}
+
+int main(int argc, char **argv){
+    static const int in_flight[] = {1, 2, 4, 8, 16};
+    bench_init(argc, argv, "req_throughput");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_espnow_init();
+    uint8_t mac[6];
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    mgos_espnow_register_req_cb(1, bench_req_echo_cb, NULL);
+    host_radio_loopback = true;
+    host_radio_latency_ms = 2;
+    int requests = bench_quick ? 200 : 5000;
+    for(size_t i = 0; i < sizeof(in_flight) / sizeof(in_flight[0]); i++){
+        bench_req_run(in_flight[i], requests);
+    }
+    return bench_finish();
+}
@@ -0,0 +1,120 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//RX dispatch cost per frame, at growing peer and callback counts. Frames from random loaded peers
+//go through the driver receive callback of the mock radio, as the WiFi task would pass them.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_rx_peers[] = {10, 100, 1000};
+static const int bench_rx_cbs[] = {1, 8, 32};
+static uint32_t bench_rx_calls;
+
+static void bench_rx_mac_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    bench_rx_calls++;
+    (void)mac;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static void bench_rx_peer_cb(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    bench_rx_calls++;
+    (void)peer;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+//ns per frame for frames from random peers among the first num_peers, draining the deferred ring
+//every drain frames when not 0
+static double bench_rx_run(int num_peers, int frames, int drain){
+    static const uint8_t payload[32] = "sensor:23.5,hum:40,bat:3.71";
+    uint8_t mac[6];
+    uint32_t r = 12345;
+    uint64_t start = bench_now_ns();
+    for(int i = 0; i < frames; i++){
+        r = r * 1103515245 + 12345;
+        host_peer_mac((r >> 8) % num_peers, mac);
+        host_radio_rx(mac, payload, sizeof(payload));
+        if(drain > 0 && i % drain == drain - 1) host_run_invokes();
+    }
+    host_run_invokes();
+    return (double)(bench_now_ns() - start) / frames;
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "rx_dispatch");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    //Peers past MGOS_ESPNOW_MAX_PEERS take heap memory
+    mgos_sys_config_set_espnow_max_peers(-1);
+    mgos_espnow_init();
+    int frames = bench_quick ? 2000 : 200000;
+    int loaded = 0;
+    for(size_t p = 0; p < sizeof(bench_rx_peers) / sizeof(bench_rx_peers[0]); p++){
+        int num_peers = bench_rx_peers[p];
+        if(bench_quick && num_peers > 100) break;
+        for(; loaded < num_peers; loaded++){
+            char name[16];
+            uint8_t mac[6];
+            host_peer_name(loaded, name, sizeof(name));
+            host_peer_mac(loaded, mac);
+            mgos_espnow_add_peer(name, mac, false, 1, false);
+        }
+        bench_result("no_callbacks", "ns_per_frame", bench_rx_run(num_peers, frames, 0), "ns", "peers=%d callbacks=0", num_peers);
+        for(size_t c = 0; c < sizeof(bench_rx_cbs) / sizeof(bench_rx_cbs[0]); c++){
+            int num_cbs = bench_rx_cbs[c];
+            //ALL callbacks run for every frame
+            for(int i = 0; i < num_cbs; i++) mgos_espnow_register_recv_mac_cb(NULL, ALL, bench_rx_mac_cb, NULL);
+            bench_rx_calls = 0;
+            double ns = bench_rx_run(num_peers, frames, 0);
+            if(bench_rx_calls != (uint32_t)frames * num_cbs) fprintf(stderr, "all_callbacks: %u calls for %d frames\n", bench_rx_calls, frames);
+            bench_result("all_callbacks", "ns_per_frame", ns, "ns", "peers=%d callbacks=%d", num_peers, num_cbs);
+            bench_result("all_callbacks", "ns_per_callback", ns / num_cbs, "ns", "peers=%d callbacks=%d", num_peers, num_cbs);
+            //Through the deferred ring, drained by the event loop in batches
+            mgos_sys_config_set_espnow_rx_defer(true);
+            ns = bench_rx_run(num_peers, frames, 8);
+            mgos_sys_config_set_espnow_rx_defer(false);
+            bench_result("all_callbacks_deferred", "ns_per_frame", ns, "ns", "peers=%d callbacks=%d", num_peers, num_cbs);
+            for(int i = 0; i < num_cbs; i++) mgos_espnow_remove_recv_mac_cb(bench_rx_mac_cb, NULL, ALL);
+            //Peer callbacks on num_cbs of the peers, the others cost nothing
+            int with_cb = num_cbs < num_peers ? num_cbs : num_peers;
+            for(int i = 0; i < with_cb; i++){
+                char name[16];
+                host_peer_name(i * (num_peers / with_cb), name, sizeof(name));
+                mgos_espnow_register_recv_peer_cb(name, bench_rx_peer_cb, NULL);
+            }
+            bench_result("peer_callbacks", "ns_per_frame", bench_rx_run(num_peers, frames, 0), "ns", "peers=%d callbacks=%d", num_peers, with_cb);
+            for(int i = 0; i < with_cb; i++){
+                char name[16];
+                host_peer_name(i * (num_peers / with_cb), name, sizeof(name));
+                mgos_espnow_remove_recv_peer_cb(bench_rx_peer_cb, name);
+            }
+        }
+    }
+    return bench_finish();
+}
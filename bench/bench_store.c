@@ -0,0 +1,132 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Cost of saving one more peer with a full peer list: appending a record to the binary store, at once or
+//batched by espnow.store_commit_ms, against rewriting the JSON peer list as when espnow.store_filename is
+//empty. Also the boot time load of the whole list from each format.
+
+#include <sys/stat.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "bench.h"
+
+#define BENCH_STORE_EXTRA 64
+
+static char bench_store_json[512], bench_store_bin[512];
+
+static long bench_store_size(const char *filename){
+    struct stat st;
+    return stat(filename, &st) == 0 ? (long)st.st_size : 0;
+}
+
+static void bench_store_add(int first, int num, bool save){
+    for(int i = first; i < first + num; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        if(mgos_espnow_add_peer(name, mac, false, 1, save) != ESPNOW_OK) fprintf(stderr, "add %s failed\n", name);
+    }
+}
+
+static void bench_store_remove(int first, int num, bool save){
+    for(int i = first; i < first + num; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_remove_peer(name, save);
+    }
+}
+
+//Save BENCH_STORE_EXTRA more peers on top of num_peers, one at a time. Bytes written are the file growth
+//for the store, and the whole file for every JSON rewrite.
+static void bench_store_saves(const char *mode, int num_peers, int commit_ms){
+    const char *file = commit_ms < 0 ? bench_store_json : bench_store_bin;
+    mgos_sys_config_set_espnow_store_filename(commit_ms < 0 ? "" : bench_store_bin);
+    mgos_sys_config_set_espnow_peers_filename(bench_store_json);
+    mgos_sys_config_set_espnow_store_commit_ms(commit_ms < 0 ? 0 : commit_ms);
+    if(commit_ms < 0) mgos_espnow_export_json(bench_store_json);
+    else mgos_espnow_store_compact();
+    long written = 0, before = bench_store_size(file);
+    struct mgos_espnow_store_stats st;
+    mgos_espnow_get_store_stats(&st);
+    uint32_t compactions = st.compactions, commits = st.commits;
+    uint64_t start = bench_now_ns();
+    for(int i = 0; i < BENCH_STORE_EXTRA; i++){
+        bench_store_add(num_peers + i, 1, true);
+        if(commit_ms < 0) written += bench_store_size(file);
+    }
+    mgos_espnow_store_commit();
+    double ns = (double)(bench_now_ns() - start) / BENCH_STORE_EXTRA;
+    mgos_espnow_get_store_stats(&st);
+    //A compaction rewrites the file, count it as written in full
+    if(commit_ms >= 0) written = st.compactions == compactions ? bench_store_size(file) - before : st.file_size;
+    bench_result(mode, "ns_per_add", ns, "ns", "peers=%d", num_peers);
+    bench_result(mode, "bytes_per_add", (double)written / BENCH_STORE_EXTRA, "bytes", "peers=%d", num_peers);
+    if(commit_ms >= 0) bench_result(mode, "commits_per_add", (double)(st.commits - commits + st.compactions - compactions) / BENCH_STORE_EXTRA, "writes", "peers=%d", num_peers);
+    bench_store_remove(num_peers, BENCH_STORE_EXTRA, false);
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_peers_filename("");
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "store");
+    snprintf(bench_store_json, sizeof(bench_store_json), "%s", bench_path("store.json"));
+    snprintf(bench_store_bin, sizeof(bench_store_bin), "%s", bench_path("store.bin"));
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    //Peers past MGOS_ESPNOW_MAX_PEERS take heap memory
+    mgos_sys_config_set_espnow_max_peers(-1);
+    mgos_espnow_init();
+    int num_peers = bench_quick ? 50 : 500;
+    bench_store_add(0, num_peers, false);
+
+    //Boot: the whole list from each format
+    mgos_espnow_export_json(bench_store_json);
+    bench_store_remove(0, num_peers, false);
+    uint64_t start = bench_now_ns();
+    int loaded = mgos_espnow_import_json(bench_store_json, false);
+    bench_result("json_boot", "ms", (double)(bench_now_ns() - start) / 1e6, "ms", "peers=%d", num_peers);
+    if(loaded != num_peers) fprintf(stderr, "%d peers from %s of %d\n", loaded, bench_store_json, num_peers);
+    mgos_sys_config_set_espnow_store_filename(bench_store_bin);
+    mgos_espnow_store_compact();
+    bench_store_remove(0, num_peers, false);
+    start = bench_now_ns();
+    espnow_store_load();
+    bench_result("store_boot", "ms", (double)(bench_now_ns() - start) / 1e6, "ms", "peers=%d", num_peers);
+    if(mgos_espnow_total_peers() != num_peers) fprintf(stderr, "%d peers from the store of %d\n", mgos_espnow_total_peers(), num_peers);
+    mgos_sys_config_set_espnow_store_filename("");
+
+    //One more peer saved on top of the list
+    bench_store_saves("json_rewrite", num_peers, -1);
+    bench_store_saves("store_append", num_peers, 0);
+    bench_store_saves("store_batched", num_peers, 500);
+
+    bench_store_remove(0, num_peers, false);
+    remove(bench_store_json);
+    remove(bench_store_bin);
+    return bench_finish();
+}
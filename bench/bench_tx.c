@@ -0,0 +1,108 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//TX completion cost per frame, at growing peer and send callback counts: queueing the frame, the
+//driver completion and the completion work on the event loop. Completions are driven by hand.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "bench.h"
+
+static const int bench_tx_peers[] = {10, 100, 1000};
+static const int bench_tx_cbs[] = {0, 1, 8, 32};
+static uint32_t bench_tx_calls;
+
+static void bench_tx_mac_cb(const uint8_t *mac, bool success, void *ud){
+    bench_tx_calls++;
+    (void)mac;
+    (void)success;
+    (void)ud;
+}
+
+static void bench_tx_msg_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    bench_tx_calls++;
+    (void)handle;
+    (void)mac;
+    (void)success;
+    (void)ud;
+}
+
+//ns per frame sent to the first targets peers in turn, or to random ones among num_peers for 0
+static double bench_tx_run(int num_peers, int targets, int frames, bool msg_cb){
+    static const uint8_t payload[32] = "sensor:23.5,hum:40,bat:3.71";
+    uint32_t r = 12345;
+    uint64_t start = bench_now_ns();
+    for(int i = 0; i < frames; i++){
+        char name[16];
+        r = r * 1103515245 + 12345;
+        host_peer_name(targets > 0 ? i % targets : (int)((r >> 8) % num_peers), name, sizeof(name));
+        if(msg_cb) mgos_espnow_send_msg(name, payload, sizeof(payload), bench_tx_msg_cb, NULL, NULL);
+        else mgos_espnow_send(name, payload, sizeof(payload));
+        while(host_radio_complete(true)){
+            host_run_invokes();
+        }
+    }
+    return (double)(bench_now_ns() - start) / frames;
+}
+
+int main(int argc, char **argv){
+    bench_init(argc, argv, "tx_completion");
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    host_radio_manual = true;
+    //Peers past MGOS_ESPNOW_MAX_PEERS take heap memory
+    mgos_sys_config_set_espnow_max_peers(-1);
+    mgos_espnow_init();
+    int frames = bench_quick ? 2000 : 100000;
+    int loaded = 0;
+    for(size_t p = 0; p < sizeof(bench_tx_peers) / sizeof(bench_tx_peers[0]); p++){
+        int num_peers = bench_tx_peers[p];
+        if(bench_quick && num_peers > 100) break;
+        for(; loaded < num_peers; loaded++){
+            char name[16];
+            uint8_t mac[6];
+            host_peer_name(loaded, name, sizeof(name));
+            host_peer_mac(loaded, mac);
+            mgos_espnow_add_peer(name, mac, false, 1, false);
+        }
+        for(size_t c = 0; c < sizeof(bench_tx_cbs) / sizeof(bench_tx_cbs[0]); c++){
+            int num_cbs = bench_tx_cbs[c];
+            for(int i = 0; i < num_cbs; i++) mgos_espnow_register_send_mac_cb(NULL, ALL, bench_tx_mac_cb, NULL);
+            bench_tx_calls = 0;
+            //Peers that stay in the driver table
+            bench_result("resident_peers", "ns_per_frame", bench_tx_run(num_peers, 10, frames, false), "ns", "peers=%d callbacks=%d", num_peers, num_cbs);
+            //Random peers, beyond the driver table they are swapped in and out
+            bench_result("random_peers", "ns_per_frame", bench_tx_run(num_peers, 0, frames, false), "ns", "peers=%d callbacks=%d", num_peers, num_cbs);
+            if(bench_tx_calls != (uint32_t)(2 * frames * num_cbs)) fprintf(stderr, "%u send callbacks for %d frames\n", bench_tx_calls, 2 * frames);
+            for(int i = 0; i < num_cbs; i++) mgos_espnow_remove_send_mac_cb(bench_tx_mac_cb, NULL, ALL);
+        }
+        //With a completion callback per message
+        bench_result("message_callback", "ns_per_frame", bench_tx_run(num_peers, 10, frames, true), "ns", "peers=%d callbacks=1", num_peers);
+    }
+    struct mgos_espnow_peer_table_stats ts;
+    mgos_espnow_get_peer_table_stats(&ts);
+    bench_result("driver_table", "miss_ratio", ts.hits + ts.misses > 0 ? (double)ts.misses / (ts.hits + ts.misses) : 0, "", "peers=%d", loaded);
+    return bench_finish();
+}
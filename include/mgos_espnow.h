@@ -31,16 +31,56 @@ SOFTWARE.
 #include <queue.h>
 
 #define MGOS_ESPNOW_MAX_LEN ESP_NOW_MAX_DATA_LEN 
+//Payload bytes carried by each fragment of mgos_espnow_send_large, leaves room for the reliable channel header
+#define MGOS_ESPNOW_FRAG_LEN (MGOS_ESPNOW_MAX_LEN - 9)
+//Payload of a mesh frame, see mgos_espnow_mesh_send
+#define MGOS_ESPNOW_MESH_MAX_LEN (MGOS_ESPNOW_MAX_LEN - 25)
+//Bytes kept for a peer name, terminator included
+#ifndef MGOS_ESPNOW_PEER_NAME_LEN
+#define MGOS_ESPNOW_PEER_NAME_LEN 32
+#endif
 typedef enum {
     ESPNOW_OK,
     ESPNOW_SEND_FAILED,
     ESPNOW_NOT_INIT, //Lib not init
-    ESPNOW_MAX_PEERS, //ESPNOW cannot register any more peers
+    ESPNOW_MAX_PEERS, //espnow.max_peers peers, MGOS_ESPNOW_MAX_PEERS by default, are registered already
     ESPNOW_PEER_NOT_FOUND, //Peer not found
     ESPNOW_PAYLOAD_LEN_ERR, //Payload length exceeds maximum. Macro is ESP_NOW_MAX_DATA_LEN 
-    ESPNOW_NO_MEM
+    ESPNOW_NO_MEM,
+    ESPNOW_QUEUE_FULL, //TX queue has no free slot, try again after some frames complete
+    ESPNOW_NAME_TOO_LONG //Peer name does not fit in MGOS_ESPNOW_PEER_NAME_LEN
 } mgos_espnow_result_t;
 
+//Priority of queued frames. HIGH frames go first, NORMAL and BULK share the rest of the airtime
+//in proportion to espnow.tx_weight_normal and espnow.tx_weight_bulk.
+typedef enum {
+    ESPNOW_PRIO_HIGH,
+    ESPNOW_PRIO_NORMAL,
+    ESPNOW_PRIO_BULK
+} mgos_espnow_prio_t;
+#define MGOS_ESPNOW_PRIO_CLASSES 3
+
+//Outcome of a request, see mgos_espnow_request
+typedef enum {
+    ESPNOW_REQ_OK,
+    ESPNOW_REQ_ERROR,       //The handler answered with an error
+    ESPNOW_REQ_NO_HANDLER,  //The peer has no handler for the opcode
+    ESPNOW_REQ_TIMEOUT,
+    ESPNOW_REQ_SEND_FAILED  //The request frame was not sent
+} mgos_espnow_req_status_t;
+//Opcode used by the mgos RPC bridge (espnow.rpc_bridge)
+#define MGOS_ESPNOW_REQ_OP_RPC 0xFF
+
+//Outcome of a file transfer, see mgos_espnow_send_file
+typedef enum {
+    ESPNOW_XFER_OK,
+    ESPNOW_XFER_RUNNING,    //Not finished yet
+    ESPNOW_XFER_REJECTED,   //The peer does not accept files (espnow.xfer_accept) or could not create it
+    ESPNOW_XFER_CRC_ERROR,  //The file received does not match the one sent, it is deleted
+    ESPNOW_XFER_IO_ERROR,   //Reading or writing the file failed
+    ESPNOW_XFER_TIMEOUT     //Nothing heard from the peer for espnow.xfer_timeout_ms
+} mgos_espnow_xfer_status_t;
+
 enum mac_cb_type {
     MAC,
     BCAST,
@@ -48,27 +88,353 @@ enum mac_cb_type {
     ALL
 };
 
+struct espnow_recv_peer_cb;
+struct espnow_send_peer_cb;
+struct espnow_rel;
+struct espnow_op_table;
+
+//Traffic counters of a peer
+struct mgos_espnow_peer_stats {
+    uint32_t rx_frames;  //Frames received, library frames included
+    uint32_t rx_bytes;
+    uint32_t tx_frames;  //Frames sent successfully
+    uint32_t tx_bytes;
+    uint32_t tx_failed;  //Frames the driver reported failed or rejected
+    uint32_t tx_dropped; //Frames refused because the TX queue was full
+};
+
+//Buckets of the TX latency histogram, see struct mgos_espnow_stats
+#define MGOS_ESPNOW_LAT_BUCKETS 20
+
+//Global counters, same meaning as the peer ones for all traffic
+struct mgos_espnow_stats {
+    uint32_t rx_frames;
+    uint32_t rx_bytes;
+    uint32_t tx_frames;
+    uint32_t tx_bytes;
+    uint32_t tx_failed;
+    uint32_t tx_dropped;
+    uint32_t cb_runs;    //Received or sent frames dispatched to the callbacks
+    uint32_t cb_time_us; //Time spent in those callbacks
+    uint32_t cb_max_us;  //Longest dispatch
+    //Time from queueing a frame to its completion. Bucket i counts frames that took 2^i to 2^(i+1)
+    //microseconds, the last bucket also counts anything slower.
+    uint32_t tx_latency[MGOS_ESPNOW_LAT_BUCKETS];
+};
+
+//Link quality estimators of a peer, see mgos_espnow_get_link_stats
+struct mgos_espnow_link {
+    int32_t tx_fail;      //Share of frames the peer did not ACK, smoothed, 65536 for all of them
+    int32_t srtt_us;      //Smoothed ping round trip, 0 until the first echo
+    int32_t rttvar_us;
+    int32_t rssi_x16;     //Smoothed RSSI in 1/16 dBm, 0 until reported
+    bool degraded;        //Frames to the peer are paced, see espnow.link_degraded_pct
+    bool ping_pending;
+    uint8_t ping_seq;
+    uint32_t ping_sent_at;
+    uint32_t pings;
+    uint32_t echoes;
+    uint32_t pings_lost;
+};
+
 struct mgos_espnow_peer {
     uint8_t mac[6];
     bool softap;
     int channel;
-    char *name;
+    char name[MGOS_ESPNOW_PEER_NAME_LEN];
     bool encrypt;
     uint8_t lmk[16];
     
+    //Callbacks registered for this peer, NULL terminated, rebuilt on register/remove
+    struct espnow_recv_peer_cb **recv_cbs;
+    struct espnow_send_peer_cb **send_cbs;
+    //Reliable channel state, NULL until used
+    struct espnow_rel *rel;
+    //Opcode handlers of this peer, NULL if none
+    struct espnow_op_table *op_table;
+    //In the driver peer table, and when it was last sent to
+    bool resident;
+    uint32_t last_used;
+    //TX rate limit, time the token bucket will be full again, and frames waiting in the TX queue
+    int64_t tx_tat;
+    int tx_queued;
+    //Whether the peer decodes compressed frames, learnt from its CAPS frame, and when it was asked
+    uint8_t lz;
+    uint8_t lz_tries;
+    uint32_t lz_asked_at;
+    struct mgos_espnow_link link;
+    struct mgos_espnow_peer_stats stats;
+    
     SLIST_ENTRY(mgos_espnow_peer) next;
+    //The link pointing at this peer in peer_list, removing it doesn't walk the list
+    struct mgos_espnow_peer **prev_next;
 };
 
 //RX Callbacks
 typedef void(*espnow_recv_peer_cb_t)(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud);
 typedef void(*espnow_recv_mac_cb_t)(const uint8_t *mac, const uint8_t *data, int len, void *ud);
 
+//Received frame in a shared buffer. Every buffer callback matching a frame gets the same buffer,
+//valid during the call. Call mgos_espnow_rxbuf_retain to keep it and mgos_espnow_rxbuf_release when done.
+struct mgos_espnow_rxbuf {
+    uint8_t mac[6];
+    int len;
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+    int refs; //Internal
+};
+typedef void(*espnow_recv_buf_cb_t)(struct mgos_espnow_rxbuf *buf, void *ud);
+//Typed message handler, data and len exclude the opcode byte
+typedef void(*espnow_op_cb_t)(const uint8_t *mac, uint8_t op, const uint8_t *data, int len, void *ud);
+
 //TX Callbacks.
 //Status tells if the message was sent properly. Messages sent to a registered peer will only succeed if the peer is ready to receive messages
 typedef void(*espnow_send_peer_cb_t)(struct mgos_espnow_peer *peer, bool success, void *ud);
 typedef void(*espnow_send_mac_cb_t)(const uint8_t *mac, bool success, void *ud);
 
 
+//Handle of a queued message, never 0
+typedef uint32_t mgos_espnow_handle_t;
+//Per message completion, called from the mgos event loop once the driver reports the frame sent or failed
+typedef void(*espnow_msg_cb_t)(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud);
+//Group send completion, called once every member reported
+typedef void(*espnow_group_cb_t)(mgos_espnow_handle_t handle, int sent, int failed, void *ud);
+//Request received from a peer. It can be copied to answer later with mgos_espnow_respond.
+struct mgos_espnow_req_info {
+    uint8_t mac[6];
+    uint16_t id;
+    uint8_t op;
+};
+typedef void(*espnow_req_cb_t)(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud);
+//Called once per request from the mgos event loop, data is NULL unless the peer answered
+typedef void(*espnow_resp_cb_t)(uint16_t id, const uint8_t *mac, mgos_espnow_req_status_t status, const uint8_t *data, int len, void *ud);
+//File transfer, sent or received
+struct mgos_espnow_xfer_info {
+    uint8_t mac[6];
+    uint8_t id;
+    bool sender;
+    const char *name;   //Name the file is sent under
+    const char *path;   //Local file
+    uint32_t size;
+    uint32_t done;      //Bytes acknowledged, received in order on the receiving side
+};
+typedef void(*espnow_xfer_cb_t)(const struct mgos_espnow_xfer_info *info, mgos_espnow_xfer_status_t status, void *ud);
+//Payload segment for mgos_espnow_sendv
+struct mgos_espnow_seg {
+    const void *data;
+    int len;
+};
+
+//TX queue counters
+struct mgos_espnow_tx_stats {
+    int queue_slots;      //Slots in the queue, MGOS_ESPNOW_TX_QUEUE_LEN
+    int queue_depth;      //Frames waiting to be handed to the driver
+    int queue_high_water; //Max frames waiting at the same time
+    int in_flight;        //Frames handed to the driver and not completed yet
+    uint32_t sent;        //Frames completed successfully
+    uint32_t failed;      //Frames failed or rejected by the driver
+    uint32_t retries;     //Sends retried because the driver queue was full
+    uint32_t queue_full;  //Sends rejected with ESPNOW_QUEUE_FULL
+    uint32_t rate_limited; //Frames held back by the rate limit of their peer (espnow.tx_peer_rate)
+    uint32_t channel_switches; //Frames sent on another channel or interface than the one before
+    uint32_t switches_avoided; //Frames sent ahead of older ones on another channel, see espnow.tx_group_max_wait_ms
+    uint32_t submitted;   //Calls queued from other tasks
+    uint32_t submit_full; //Calls from other tasks rejected with ESPNOW_QUEUE_FULL
+    uint32_t submit_failed; //Calls from other tasks that failed once run on the event loop
+    uint32_t paced;       //Frames held back because the link to their peer is degraded
+};
+
+//TX counters of a priority class
+struct mgos_espnow_prio_stats {
+    int queue_depth;      //Frames of this class waiting
+    uint32_t queued;      //Frames queued
+    uint32_t wait_max_us; //Longest time a frame waited to be handed to the driver
+    //Time frames waited to be handed to the driver, same buckets as tx_latency of struct mgos_espnow_stats
+    uint32_t wait[MGOS_ESPNOW_LAT_BUCKETS];
+};
+
+//Fragmentation counters
+struct mgos_espnow_frag_stats {
+    uint32_t tx_messages;  //Messages split into fragments
+    uint32_t rx_messages;  //Messages reassembled and delivered
+    uint32_t rx_timeouts;  //Partial messages dropped after espnow.frag_timeout_ms
+    uint32_t rx_dropped;   //Messages dropped because espnow.frag_rx_budget was exhausted or fragments were invalid
+    int rx_mem_used;       //Bytes of the messages being reassembled
+    int rx_mem_kept;       //Reassembly buffers kept for the next messages, idle ones are freed to stay within espnow.frag_rx_budget
+};
+
+//Reliable channel counters of a peer
+struct mgos_espnow_rel_stats {
+    bool enabled;         //Frames sent to the peer use the reliable channel
+    int in_flight;        //Frames sent and not acknowledged yet
+    int32_t srtt_us;      //Smoothed round trip time
+    int32_t rto_us;       //Current retransmit timeout
+    uint32_t acked;       //Frames acknowledged by the peer
+    uint32_t failed;      //Frames given up after espnow.rel_max_retries
+    uint32_t retransmits; //Frames sent again
+    uint32_t received;    //Reliable frames received from the peer
+    uint32_t duplicates;  //Received duplicates dropped before the callbacks
+    uint32_t sessions;    //Sessions started by the peer, each one resets duplicate tracking
+};
+
+//Small message coalescing counters (espnow.coalesce)
+struct mgos_espnow_coalesce_stats {
+    uint32_t messages;     //Messages that went through the coalescing buffers
+    uint32_t frames;       //Frames those messages were sent in
+    uint32_t frames_saved; //Frames not sent thanks to coalescing
+    float saved_per_sec;   //Frames saved per second, over the last second with traffic
+    uint32_t avg_delay_us; //Average time a message waited in a buffer
+    uint32_t dropped;      //Messages lost because their frame was not accepted by the TX queue
+    uint32_t rx_malformed; //Received coalesced frames with a bad length
+};
+
+//Group send counters
+struct mgos_espnow_group_stats {
+    uint32_t sends;              //Group sends accepted
+    uint32_t fanout_sends;       //Group sends done with a single driver call to all peers
+    uint32_t driver_calls_saved; //Driver calls not made thanks to those
+};
+
+//Virtual peer table counters
+struct mgos_espnow_peer_table_stats {
+    int peers;          //Peers loaded
+    int resident;       //Peers in the driver table
+    uint32_t hits;      //Frames sent to a peer already in the driver table
+    uint32_t misses;    //Frames that needed their peer installed first
+    uint32_t evictions; //Peers removed from the driver table to make room
+};
+
+//Binary peer store counters (espnow.store_filename)
+struct mgos_espnow_store_stats {
+    int peers;            //Peers loaded
+    int records;          //Records in the file, compacted once well above the number of peers
+    int file_size;        //Bytes in the file
+    int pending_bytes;    //Bytes waiting for the next commit
+    uint32_t commits;     //Appends written
+    uint32_t compactions; //Full rewrites
+};
+
+//Deferred RX ring counters (espnow.rx_defer)
+struct mgos_espnow_rx_stats {
+    int ring_slots;      //Slots in the ring, MGOS_ESPNOW_RX_RING_SLOTS
+    int ring_used;       //Slots holding frames not yet delivered
+    int ring_high_water; //Max slots used at the same time
+    uint32_t dropped;    //Frames lost because the ring was full
+    uint32_t deferred;   //Frames queued for the event loop
+};
+
+//Typed message counters (espnow.op_dispatch)
+struct mgos_espnow_op_stats {
+    uint32_t delivered; //Messages passed to an opcode handler
+    uint32_t unknown;   //Messages empty or without a handler for their opcode that no receive callback took either
+};
+
+//Request/response counters
+struct mgos_espnow_req_stats {
+    int slots;            //Requests that can be pending at the same time, MGOS_ESPNOW_REQ_SLOTS
+    int pending;          //Requests waiting for their response
+    uint32_t sent;        //Requests queued
+    uint32_t completed;   //Responses matched to a pending request
+    uint32_t timeouts;    //Requests given up without a response
+    uint32_t send_failed; //Requests whose frame was not sent
+    uint32_t unmatched;   //Responses received late or for an unknown request
+    uint32_t served;      //Requests received and passed to a handler
+    uint32_t no_handler;  //Requests received for an opcode without handler
+};
+
+//File transfer counters
+struct mgos_espnow_xfer_stats {
+    int slots;            //Transfers at the same time, both ways, MGOS_ESPNOW_XFER_SLOTS
+    int active;           //Transfers running
+    uint32_t sent;        //Chunks sent for the first time
+    uint32_t resent;      //Chunks sent again after a NACK or timeout
+    uint32_t received;    //Chunks received and written
+    uint32_t duplicates;  //Chunks received again
+    uint32_t completed;
+    uint32_t failed;
+    uint32_t resumed;     //Received files continued from an earlier transfer
+};
+
+//Frame capture ring usage
+struct mgos_espnow_capture_stats {
+    int slots;            //Records in the ring, MGOS_ESPNOW_CAPTURE_SLOTS
+    int snaplen;          //Payload bytes kept per frame, MGOS_ESPNOW_CAPTURE_SNAPLEN
+    bool enabled;
+    uint32_t captured;    //Frames recorded
+    uint32_t overwritten; //Frames recorded and no longer in the ring
+};
+
+//Occupancy of one of the static pools
+struct mgos_espnow_pool_stats {
+    int slots;          //Static ones and those of the heap chunks the pool grew
+    int used;
+    int high_water;
+    uint32_t exhausted; //Allocations refused because every slot was used
+};
+
+//Peers, callbacks and the tables built from them live in static pools sized by mos.yml cdefs.
+//Only when espnow.max_peers allows more than MGOS_ESPNOW_MAX_PEERS, the peers past it take heap chunks of
+//MGOS_ESPNOW_PEER_GROW and the peer index moves to the heap. Both stay allocated once grown, removing and
+//adding peers takes no more heap.
+struct mgos_espnow_mem_stats {
+    struct mgos_espnow_pool_stats peers;     //MGOS_ESPNOW_MAX_PEERS static
+    struct mgos_espnow_pool_stats callbacks; //MGOS_ESPNOW_CB_SLOTS
+    struct mgos_espnow_pool_stats cb_lists;  //Per peer callback lists, MGOS_ESPNOW_PEER_CB_SLOTS each
+    struct mgos_espnow_pool_stats tables;    //Peer index and dispatch tables, current and being replaced
+    struct mgos_espnow_pool_stats retired;   //Replaced heap objects a dispatch may still be using, MGOS_ESPNOW_RETIRE_SLOTS
+    int static_bytes;                        //Memory taken by all of the above
+    int heap_bytes;                          //Peer chunks and the peer index once they outgrow the static pools, 0 by default
+};
+
+//Payload compression counters
+struct mgos_espnow_compress_stats {
+    bool enabled;
+    int dict_len;          //Bytes of the static dictionary
+    uint32_t tx_compressed; //Frames and messages sent compressed
+    uint32_t tx_plain;      //Sent as they were because they did not get shorter
+    uint32_t tx_bytes_in;   //Bytes before and after compression, of those sent compressed
+    uint32_t tx_bytes_out;
+    uint32_t rx_decompressed;
+    uint32_t rx_errors;     //Corrupt or with an unknown dictionary, dropped
+};
+
+//Multi-hop relay counters
+struct mgos_espnow_mesh_stats {
+    uint32_t originated;     //Frames sent with mgos_espnow_mesh_send
+    uint32_t delivered;      //Frames from other nodes passed to the receive callbacks
+    uint32_t delivered_hops; //Hops those frames took, all together
+    uint32_t duplicates;     //Frames received again and dropped
+    uint32_t relayed;        //Frames forwarded for other nodes
+    uint32_t suppressed;     //Rebroadcasts dropped because neighbours already sent the frame
+    uint32_t relay_dropped;  //Frames not forwarded, no relay slot or TX queue full
+    uint32_t ttl_expired;    //Frames not forwarded because their TTL ran out
+    uint32_t flooded;        //Frames broadcast to every neighbour
+    uint32_t routed;         //Frames sent to the next hop of a learnt route
+    uint32_t resent;         //Routed frames sent again, their next hop was not heard forwarding them
+    uint32_t route_failures; //Routes dropped because their next hop did not ACK or forward
+    int routes;              //Routes known, up to MGOS_ESPNOW_MESH_ROUTES
+};
+
+//Link quality of a peer
+struct mgos_espnow_link_stats {
+    float tx_success;     //Share of frames the peer acknowledged, weighted towards the last 16 or so
+    int32_t rtt_us;       //Smoothed ping round trip, 0 until the first echo
+    int32_t rtt_var_us;
+    int rssi;             //Smoothed RSSI in dBm, 0 until reported with mgos_espnow_link_rssi
+    bool degraded;        //Frames to the peer are paced
+    uint32_t pings;       //Pings sent
+    uint32_t echoes;      //Echoes received
+    uint32_t pings_lost;  //Pings not answered before the next one
+};
+
+//Shared RX buffer pool counters
+struct mgos_espnow_rxbuf_stats {
+    int pool_slots;     //Buffers in the pool, MGOS_ESPNOW_RXBUF_SLOTS
+    int in_use;         //Buffers still referenced, 0 when idle unless a callback leaks one
+    int high_water;     //Max buffers referenced at the same time
+    uint32_t allocs;    //Frames copied to a buffer
+    uint32_t exhausted; //Frames not given to buffer callbacks because every buffer was referenced
+};
+
 struct espnow_recv_peer_cb {
     struct mgos_espnow_peer *peer;
     
@@ -83,6 +449,8 @@ struct espnow_recv_mac_cb {
     enum mac_cb_type type;
     
     espnow_recv_mac_cb_t cb;
+    //Set instead of cb for buffer callbacks
+    espnow_recv_buf_cb_t buf_cb;
     void *ud;
     
     SLIST_ENTRY(espnow_recv_mac_cb) next;
@@ -109,11 +477,11 @@ struct espnow_send_mac_cb {
     SLIST_ENTRY(espnow_send_mac_cb) next;
 };
 
-SLIST_HEAD(peer_list, mgos_espnow_peer) peer_list;
-SLIST_HEAD(espnow_recv_peer_cb_head, espnow_recv_peer_cb) espnow_recv_peer_cb_head;
-SLIST_HEAD(espnow_recv_mac_cb_head, espnow_recv_mac_cb) espnow_recv_mac_cb_head;
-SLIST_HEAD(espnow_send_peer_cb_head, espnow_send_peer_cb) espnow_send_peer_cb_head;
-SLIST_HEAD(espnow_send_mac_cb_head, espnow_send_mac_cb) espnow_send_mac_cb_head;
+extern SLIST_HEAD(peer_list, mgos_espnow_peer) peer_list;
+extern SLIST_HEAD(espnow_recv_peer_cb_head, espnow_recv_peer_cb) espnow_recv_peer_cb_head;
+extern SLIST_HEAD(espnow_recv_mac_cb_head, espnow_recv_mac_cb) espnow_recv_mac_cb_head;
+extern SLIST_HEAD(espnow_send_peer_cb_head, espnow_send_peer_cb) espnow_send_peer_cb_head;
+extern SLIST_HEAD(espnow_send_mac_cb_head, espnow_send_mac_cb) espnow_send_mac_cb_head;
 
 #ifdef __cplusplus
 extern "C"{
@@ -121,10 +489,58 @@ extern "C"{
 
     //Lib Init
     bool mgos_espnow_init();
-    //Send to a peer loaded. NULL to send to all loaded peers.
+    //Threading: the library runs on the mgos task. Sends, broadcasts, peer add/remove and callback
+    //register/remove can be called from other tasks too, they are copied to a queue of
+    //MGOS_ESPNOW_SUBMIT_SLOTS and run on the mgos task, ESPNOW_QUEUE_FULL is returned when it has no room.
+    //Their result only covers queueing: send failures reach the completion callback, other failures are
+    //logged. Handles are left 0 and peer names are limited to 31 characters. Every other call, like
+    //mgos_espnow_sendv, frames, large messages, groups and requests, must be made from the mgos task.
+    //Send to a peer loaded. NULL to send to all loaded peers, same as mgos_espnow_send_group(NULL, ...).
+    //Frames are queued, ESPNOW_QUEUE_FULL is returned when the queue has no room.
+    //With espnow.coalesce enabled, messages up to espnow.coalesce_max_msg bytes are buffered per destination
+    //and sent together in one frame when it is nearly full or after espnow.coalesce_ms.
     mgos_espnow_result_t mgos_espnow_send(const char *name, const uint8_t *data, int len);
     //Send a broadcast message
     mgos_espnow_result_t mgos_espnow_broadcast(const uint8_t *data, int len);
+    //Same as above with a completion callback for this message. handle may be NULL.
+    mgos_espnow_result_t mgos_espnow_send_msg(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t mgos_espnow_broadcast_msg(const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    //Same as above in a priority class, the ones without it send NORMAL frames. HIGH messages are never coalesced.
+    //The last MGOS_ESPNOW_TX_HIGH_SLOTS queue slots are kept for HIGH frames, and with espnow.tx_peer_rate set
+    //a peer cannot have more than espnow.tx_peer_burst other frames queued.
+    mgos_espnow_result_t mgos_espnow_send_prio(const char *name, const uint8_t *data, int len, mgos_espnow_prio_t prio);
+    mgos_espnow_result_t mgos_espnow_broadcast_prio(const uint8_t *data, int len, mgos_espnow_prio_t prio);
+    mgos_espnow_result_t mgos_espnow_send_msg_prio(const char *name, const uint8_t *data, int len, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t mgos_espnow_broadcast_msg_prio(const uint8_t *data, int len, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    //Send up to espnow.frag_max_len bytes split in MGOS_ESPNOW_FRAG_LEN fragments. The receiver delivers
+    //the whole message once to its recv callbacks. All fragments must fit in the TX queue.
+    //The callback reports success only if every fragment was sent.
+    mgos_espnow_result_t mgos_espnow_send_large(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    //Send the segments back to back as one message, without building the payload first.
+    //Plain payloads are gathered straight into the TX slot.
+    mgos_espnow_result_t mgos_espnow_sendv(const char *name, const struct mgos_espnow_seg *segs, int num_segs, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    //Take a TX slot to build a frame in place. Returns MGOS_ESPNOW_MAX_LEN writable bytes or NULL when the queue is full.
+    //The slot counts as used until it is passed to mgos_espnow_frame_send or mgos_espnow_frame_free.
+    uint8_t *mgos_espnow_frame_alloc();
+    //Send len bytes at data, anywhere inside an allocated slot so the caller can keep headroom in front.
+    //The slot is given back in every case, the frame is not copied unless reliable mode or coalescing need it.
+    mgos_espnow_result_t mgos_espnow_frame_send(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    void mgos_espnow_frame_free(uint8_t *data);
+    
+    
+    //Peer groups, kept in memory only. Peers are added by name and must be loaded. A member that is removed
+    //later is skipped when sending and is back in the group if a peer with the same name is added again.
+    mgos_espnow_result_t mgos_espnow_group_add(const char *group, const char *name);
+    //Remove a member, or the whole group if name is NULL. A group is removed with its last member.
+    void mgos_espnow_group_remove(const char *group, const char *name);
+    //Loaded members of a group, all loaded peers for NULL
+    int mgos_espnow_group_size(const char *group);
+    //Send to every loaded member of a group, all loaded peers for NULL. When the members are exactly the
+    //driver peer table (no broadcast peer, no reliable channel) the frame goes out with a single driver call,
+    //otherwise it is queued once per member. The callback gets the number of members sent and failed.
+    //Returns ESPNOW_OK if the message was queued for at least one member.
+    mgos_espnow_result_t mgos_espnow_send_group(const char *group, const uint8_t *data, int len, espnow_group_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    void mgos_espnow_get_group_stats(struct mgos_espnow_group_stats *stats);
     
     
     //Register for messages received by peers
@@ -142,6 +558,54 @@ extern "C"{
     //Remove receive callback.
     void mgos_espnow_remove_recv_mac_cb(espnow_recv_mac_cb_t cb, uint8_t *mac, enum mac_cb_type type);
     void mgos_espnow_remove_recv_peer_cb(espnow_recv_peer_cb_t cb, const char *name);
+    
+    
+    //Same matching as mgos_espnow_register_recv_mac_cb, the frame is passed in a shared buffer.
+    //The frame is copied once to a buffer from a pool of MGOS_ESPNOW_RXBUF_SLOTS. When all are retained
+    //buffer callbacks miss the frame, see mgos_espnow_get_rxbuf_stats.
+    mgos_espnow_result_t mgos_espnow_register_recv_buf_cb(const uint8_t *mac, enum mac_cb_type type, espnow_recv_buf_cb_t cb, void *ud);
+    void mgos_espnow_remove_recv_buf_cb(espnow_recv_buf_cb_t cb, uint8_t *mac, enum mac_cb_type type);
+    //Typed messages, with espnow.op_dispatch set a message whose first byte has a handler goes only to it.
+    //Messages with other opcodes still reach the receive callbacks. One handler per opcode, for a loaded peer
+    //or for everyone when name is NULL. The peer one is used first. Registering an opcode again replaces its handler.
+    mgos_espnow_result_t mgos_espnow_register_op_cb(const char *name, uint8_t op, espnow_op_cb_t cb, void *ud);
+    void mgos_espnow_remove_op_cb(const char *name, uint8_t op);
+    void mgos_espnow_get_op_stats(struct mgos_espnow_op_stats *stats);
+    //Send a request to a loaded peer, any number can be pending up to MGOS_ESPNOW_REQ_SLOTS. The callback
+    //gets the response or a timeout after timeout_ms. Payloads up to espnow.frag_max_len bytes, longer
+    //than a frame they are fragmented. id may be NULL.
+    mgos_espnow_result_t mgos_espnow_request(const char *name, uint8_t op, const uint8_t *data, int len, int timeout_ms, espnow_resp_cb_t cb, void *ud, uint16_t *id);
+    //Serve requests for an opcode, registering it again replaces the handler. Requests without
+    //a handler are answered with ESPNOW_REQ_NO_HANDLER.
+    mgos_espnow_result_t mgos_espnow_register_req_cb(uint8_t op, espnow_req_cb_t cb, void *ud);
+    void mgos_espnow_remove_req_cb(uint8_t op);
+    //Answer a request once, from its handler or later. status is ESPNOW_REQ_OK or ESPNOW_REQ_ERROR.
+    mgos_espnow_result_t mgos_espnow_respond(const struct mgos_espnow_req_info *req, mgos_espnow_req_status_t status, const uint8_t *data, int len);
+    void mgos_espnow_get_req_stats(struct mgos_espnow_req_stats *stats);
+    //Send a file to a loaded peer, which saves it as remote_name (the file name of path for NULL) in its
+    //espnow.xfer_dir. Up to espnow.xfer_window chunks are in flight, lost ones are sent again when the peer
+    //reports the gap. The callback gets the outcome once the peer checked the CRC32 of the whole file.
+    //A transfer that fails is resumed by sending the same name and size again. Both sides must have
+    //each other as peers.
+    mgos_espnow_result_t mgos_espnow_send_file(const char *name, const char *path, const char *remote_name, espnow_xfer_cb_t cb, void *ud);
+    //Called when a file from a peer is complete or failed
+    void mgos_espnow_register_xfer_cb(espnow_xfer_cb_t cb, void *ud);
+    void mgos_espnow_get_xfer_stats(struct mgos_espnow_xfer_stats *stats);
+    //Record frames received, handed to the driver and completed in a RAM ring of MGOS_ESPNOW_CAPTURE_SLOTS,
+    //overwriting the oldest. Recording costs the same small fixed time for every frame. Disabling keeps
+    //the frames recorded. Returns false if the ring could not be allocated.
+    bool mgos_espnow_capture_enable(bool enable);
+    //Write the frames in the ring to a pcap file that Wireshark opens as 802.11 with radiotap headers.
+    //Payloads are cut to MGOS_ESPNOW_CAPTURE_SNAPLEN bytes, completions appear as ACK frames with the
+    //radiotap TX failed flag when the peer did not ACK. Returns the frames written or -1.
+    int mgos_espnow_capture_save(const char *filename);
+    void mgos_espnow_get_capture_stats(struct mgos_espnow_capture_stats *stats);
+    //With espnow.compress set, frames and large messages to peers that can decode them are compressed.
+    //Receivers decompress before any callback runs, whatever their own espnow.compress.
+    void mgos_espnow_get_compress_stats(struct mgos_espnow_compress_stats *stats);
+    //Keep a buffer after the callback returns. Can be released from any task.
+    void mgos_espnow_rxbuf_retain(struct mgos_espnow_rxbuf *buf);
+    void mgos_espnow_rxbuf_release(struct mgos_espnow_rxbuf *buf);
 
 
     //Register a callback to be called after a message is sent to a peer
@@ -155,13 +619,73 @@ extern "C"{
 
     //Total registered peers loaded from file
     int mgos_espnow_total_peers();
+    //Up to espnow.max_peers peers. Only the ones used last are in the driver table, the least recently used
+    //is swapped out when a frame goes to another one. Encrypted frames are only received from peers in the table.
+    void mgos_espnow_get_peer_table_stats(struct mgos_espnow_peer_table_stats *stats);
+    //Pool usage. Callbacks never take heap memory, peers only past MGOS_ESPNOW_MAX_PEERS when espnow.max_peers is larger.
+    void mgos_espnow_get_mem_stats(struct mgos_espnow_mem_stats *stats);
 
 
-    //Add peer to memory. Optionally save it to json.
+    //Add peer to memory. Optionally save it to the peer store, or to json if espnow.store_filename is empty.
+    //A peer with the same name or MAC is replaced. Fails with ESPNOW_MAX_PEERS once espnow.max_peers peers are
+    //registered, MGOS_ESPNOW_MAX_PEERS by default, and with ESPNOW_NO_MEM when a peer past MGOS_ESPNOW_MAX_PEERS
+    //gets no heap memory.
     mgos_espnow_result_t mgos_espnow_add_peer(const char *name, const uint8_t *mac, bool softap, int channel, bool save);
     void mgos_espnow_remove_peer(const char *name, bool save);
+    //Saved changes are appended to the peer store espnow.store_commit_ms after the first one, write them now
+    void mgos_espnow_store_commit();
+    //Rewrite the peer store with the current peers
+    bool mgos_espnow_store_compact();
+    void mgos_espnow_get_store_stats(struct mgos_espnow_store_stats *stats);
+    //Peer list in the espnow.peers_filename JSON format. Import adds every peer of the file and returns how many.
+    bool mgos_espnow_export_json(const char *filename);
+    int mgos_espnow_import_json(const char *filename, bool save);
     struct mgos_espnow_peer *mgos_espnow_get_peer_by_name(const char *peer);
     struct mgos_espnow_peer *mgos_espnow_get_peer_by_mac(const uint8_t *mac);
+    //TX queue usage
+    void mgos_espnow_get_tx_stats(struct mgos_espnow_tx_stats *stats);
+    //Queueing of a priority class. Returns false if prio is not a valid class.
+    bool mgos_espnow_get_prio_stats(mgos_espnow_prio_t prio, struct mgos_espnow_prio_stats *stats);
+    //Traffic counters, also available with the ESPNow.Stats RPC when rpc-common is included.
+    //Counters are updated without locks and may be a frame apart from each other in a snapshot.
+    void mgos_espnow_get_stats(struct mgos_espnow_stats *stats);
+    bool mgos_espnow_get_peer_stats(const char *name, struct mgos_espnow_peer_stats *stats);
+    //Enable the reliable channel for a peer: sequence numbers, ACKs, retransmits and duplicate suppression.
+    //Completion callbacks then report the peer ACK instead of the link layer result. The peer must have
+    //this node as a peer too, ACKs are unicast. Payloads are limited to MGOS_ESPNOW_MAX_LEN - 4 bytes,
+    //longer ones are fragmented, and at most MGOS_ESPNOW_REL_WINDOW frames can be unacknowledged.
+    //The first frame starts a session with the peer, frames wait until the peer confirms it.
+    //The setting follows the peer when mgos_espnow_add_peer replaces it, it is lost when the peer is removed.
+    mgos_espnow_result_t mgos_espnow_set_reliable(const char *name, bool enable);
+    //Reliable channel counters. Returns false if the peer is unknown or never used the channel.
+    bool mgos_espnow_get_rel_stats(const char *name, struct mgos_espnow_rel_stats *stats);
+    //Link quality. The TX success of a peer is tracked from the completions of every frame sent to it,
+    //once it falls below espnow.link_degraded_pct its frames other than HIGH ones are paced
+    //espnow.link_pace_ms apart, and it can only have espnow.tx_peer_burst of them queued.
+    //Ping a loaded peer now to measure the round trip, every espnow.link_ping_ms with that set.
+    //The peer answers if it has this node as a peer.
+    mgos_espnow_result_t mgos_espnow_ping(const char *name);
+    //Returns false if the peer is unknown
+    bool mgos_espnow_get_link_stats(const char *name, struct mgos_espnow_link_stats *stats);
+    //The driver does not pass the RSSI of received frames, report it from a promiscuous mode handler.
+    //Callable from any task.
+    void mgos_espnow_link_rssi(const uint8_t *mac, int rssi);
+    //Send up to MGOS_ESPNOW_MESH_MAX_LEN bytes to a node beyond radio range, or to every node for NULL dst.
+    //Nodes with espnow.mesh set relay frames up to espnow.mesh_ttl hops, a node is addressed by its STA MAC.
+    //The frame is flooded until a route to dst is learnt from frames it sent. Receivers pass it to their
+    //receive callbacks once, with the origin as sender. Needs espnow.enable_broadcast on every node.
+    mgos_espnow_result_t mgos_espnow_mesh_send(const uint8_t *dst, const uint8_t *data, int len);
+    //Next hop towards a node and hops to it, false if no route is known
+    bool mgos_espnow_mesh_get_route(const uint8_t *dst, uint8_t *next_hop, int *hops);
+    void mgos_espnow_get_mesh_stats(struct mgos_espnow_mesh_stats *stats);
+    //Small message coalescing usage
+    void mgos_espnow_get_coalesce_stats(struct mgos_espnow_coalesce_stats *stats);
+    //Fragmentation and reassembly usage
+    void mgos_espnow_get_frag_stats(struct mgos_espnow_frag_stats *stats);
+    //Deferred RX ring usage
+    void mgos_espnow_get_rx_stats(struct mgos_espnow_rx_stats *stats);
+    //Shared RX buffer pool usage
+    void mgos_espnow_get_rxbuf_stats(struct mgos_espnow_rxbuf_stats *stats);
     //Parse colon separated mac address to target pointer. Return true on success.
     bool mgos_espnow_parse_colon_mac(const char *mac, uint8_t *tmac);
 
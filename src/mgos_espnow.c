@@ -25,8 +25,78 @@ SOFTWARE.
 #include "mgos.h"
 #include "frozen/frozen.h"
 #include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
 #include "esp_now.h"
 #include "esp_wifi.h"
+#ifdef ESP_PLATFORM
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#else
+#include <sched.h>
+#endif
+
+#ifndef MGOS_ESPNOW_RX_RING_SLOTS
+#define MGOS_ESPNOW_RX_RING_SLOTS 16
+#endif
+
+#ifndef MGOS_ESPNOW_TX_QUEUE_LEN
+#define MGOS_ESPNOW_TX_QUEUE_LEN 32
+#endif
+
+#ifndef MGOS_ESPNOW_TX_HIGH_SLOTS
+#define MGOS_ESPNOW_TX_HIGH_SLOTS 4
+#endif
+
+#if MGOS_ESPNOW_TX_HIGH_SLOTS >= MGOS_ESPNOW_TX_QUEUE_LEN
+#error "MGOS_ESPNOW_TX_HIGH_SLOTS must leave room for other frames in the TX queue"
+#endif
+
+#ifndef MGOS_ESPNOW_SUBMIT_SLOTS
+#define MGOS_ESPNOW_SUBMIT_SLOTS 16
+#endif
+
+#if (MGOS_ESPNOW_SUBMIT_SLOTS & (MGOS_ESPNOW_SUBMIT_SLOTS - 1)) != 0
+#error "MGOS_ESPNOW_SUBMIT_SLOTS must be a power of two"
+#endif
+
+#ifndef MGOS_ESPNOW_RXBUF_SLOTS
+#define MGOS_ESPNOW_RXBUF_SLOTS 8
+#endif
+
+#ifndef MGOS_ESPNOW_MAX_PEERS
+#define MGOS_ESPNOW_MAX_PEERS 32
+#endif
+
+#ifndef MGOS_ESPNOW_CB_SLOTS
+#define MGOS_ESPNOW_CB_SLOTS 32
+#endif
+
+#ifndef MGOS_ESPNOW_PEER_CB_SLOTS
+#define MGOS_ESPNOW_PEER_CB_SLOTS 4
+#endif
+
+#ifndef MGOS_ESPNOW_RETIRE_SLOTS
+#define MGOS_ESPNOW_RETIRE_SLOTS 16
+#endif
+
+#if MGOS_ESPNOW_MAX_PEERS > 2048 || MGOS_ESPNOW_CB_SLOTS > 4096
+#error "MGOS_ESPNOW_MAX_PEERS or MGOS_ESPNOW_CB_SLOTS too large for the static lookup tables"
+#endif
+
+//Heap chunk of peers added when the static ones are taken
+#ifndef MGOS_ESPNOW_PEER_GROW
+#define MGOS_ESPNOW_PEER_GROW 16
+#endif
+
+#if (MGOS_ESPNOW_RX_RING_SLOTS & (MGOS_ESPNOW_RX_RING_SLOTS - 1)) != 0
+#error "MGOS_ESPNOW_RX_RING_SLOTS must be a power of two"
+#endif
+
+struct peer_list peer_list;
+struct espnow_recv_peer_cb_head espnow_recv_peer_cb_head;
+struct espnow_recv_mac_cb_head espnow_recv_mac_cb_head;
+struct espnow_send_peer_cb_head espnow_send_peer_cb_head;
+struct espnow_send_mac_cb_head espnow_send_mac_cb_head;
 
 bool mgos_espnow_parse_colon_mac(const char * data, uint8_t *dest){
     int scanned = sscanf(data, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%*c", dest, dest+1, dest+2, dest+3, dest+4, dest+5);
@@ -34,13 +104,381 @@ bool mgos_espnow_parse_colon_mac(const char * data, uint8_t *dest){
     else return false;
 }
 
-int mgos_espnow_total_peers(){
-    int result = 0;
+//Objects that a running dispatch may still reference. Freed once no dispatch is in progress.
+//Peers, the peer index and the dispatch tables are only changed from the event loop, the WiFi task
+//reads them without locks. Changes publish a new snapshot and retire the old one, any moment with
+//no dispatch running ends the grace period of everything retired before it.
+//Pool blocks are chained by their pool, heap memory of the other layers takes an entry here.
+struct espnow_retired {
+    void *ptr;
+    SLIST_ENTRY(espnow_retired) next;
+};
+static SLIST_HEAD(espnow_retired_head, espnow_retired) espnow_retired_head;
+ESPNOW_POOL_DEFINE(espnow_retired_pool, sizeof(struct espnow_retired), MGOS_ESPNOW_RETIRE_SLOTS);
+static int espnow_dispatch_depth;
+//Dispatches running on this task
+static __thread int espnow_dispatch_nest;
+
+static void espnow_rebuild_recv_table();
+static void espnow_rebuild_send_table();
+//Set when a dispatch table could not be rebuilt, espnow_reclaim builds it once the spare one is free
+static bool espnow_recv_table_dirty, espnow_send_table_dirty;
+
+void espnow_dispatch_begin(){
+    espnow_dispatch_nest++;
+    __atomic_add_fetch(&espnow_dispatch_depth, 1, __ATOMIC_SEQ_CST);
+}
+
+void espnow_dispatch_end(){
+    __atomic_sub_fetch(&espnow_dispatch_depth, 1, __ATOMIC_SEQ_CST);
+    espnow_dispatch_nest--;
+}
+
+static void espnow_release(struct espnow_pool *pool, void *ptr){
+    if(pool != NULL) espnow_pool_free(pool, ptr);
+    else free(ptr);
+}
+
+//Only once no dispatch that started before the last retire can be running
+static void espnow_reclaim_all(){
+    espnow_pool_reclaim();
+    while(!SLIST_EMPTY(&espnow_retired_head)){
+        struct espnow_retired *r = SLIST_FIRST(&espnow_retired_head);
+        SLIST_REMOVE_HEAD(&espnow_retired_head, next);
+        free(r->ptr);
+        espnow_pool_free(&espnow_retired_pool, r);
+    }
+}
+
+void espnow_reclaim(){
+    if(__atomic_load_n(&espnow_dispatch_depth, __ATOMIC_SEQ_CST) != 0) return;
+    espnow_reclaim_all();
+    if(espnow_recv_table_dirty) espnow_rebuild_recv_table();
+    if(espnow_send_table_dirty) espnow_rebuild_send_table();
+}
+
+//Wait for the dispatches running on other tasks to end and free everything retired.
+//Returns false from inside a dispatch, which would be waiting for itself.
+static bool espnow_reclaim_wait(){
+    if(espnow_dispatch_nest > 0) return false;
+    while(__atomic_load_n(&espnow_dispatch_depth, __ATOMIC_SEQ_CST) != 0){
+        //Let the dispatching task run, it may have a lower priority than this one
+#ifdef ESP_PLATFORM
+        vTaskDelay(1);
+#else
+        sched_yield();
+#endif
+    }
+    espnow_reclaim_all();
+    return true;
+}
+
+//A block from a pool, retired blocks are waited for when there is no free one
+static void *espnow_alloc(struct espnow_pool *pool){
+    void *block = espnow_pool_alloc(pool);
+    if(block == NULL && espnow_reclaim_wait()) block = espnow_pool_alloc(pool);
+    if(block == NULL) pool->exhausted++;
+    return block;
+}
+
+static void espnow_retire_to(struct espnow_pool *pool, void *ptr){
+    if(ptr == NULL) return;
+    if(__atomic_load_n(&espnow_dispatch_depth, __ATOMIC_SEQ_CST) == 0){
+        espnow_release(pool, ptr);
+        return;
+    }
+    if(pool != NULL){
+        espnow_pool_retire(pool, ptr);
+        return;
+    }
+    struct espnow_retired *r = (struct espnow_retired *)espnow_alloc(&espnow_retired_pool);
+    if(r == NULL){
+        //Only from inside a dispatch, after MGOS_ESPNOW_RETIRE_SLOTS heap objects were replaced in it
+        LOG(LL_ERROR, ("No retired entry left, leaking %p", ptr));
+        return;
+    }
+    r->ptr = ptr;
+    SLIST_INSERT_HEAD(&espnow_retired_head, r, next);
+}
+
+void espnow_retire(void *ptr){
+    espnow_retire_to(NULL, ptr);
+}
+
+//Peers come from a static pool. Two more than MGOS_ESPNOW_MAX_PEERS, a peer replacing others
+//is allocated before they are freed. With a larger espnow.max_peers more peers take heap chunks.
+ESPNOW_POOL_DEFINE_GROW(espnow_peer_pool, sizeof(struct mgos_espnow_peer), MGOS_ESPNOW_MAX_PEERS + 2, MGOS_ESPNOW_PEER_GROW);
+
+//Callback entries share one pool, per peer callback lists another
+union espnow_cb_block {
+    struct espnow_recv_peer_cb recv_peer;
+    struct espnow_recv_mac_cb recv_mac;
+    struct espnow_send_peer_cb send_peer;
+    struct espnow_send_mac_cb send_mac;
+};
+ESPNOW_POOL_DEFINE(espnow_cb_pool, sizeof(union espnow_cb_block), MGOS_ESPNOW_CB_SLOTS);
+ESPNOW_POOL_DEFINE(espnow_cb_list_pool, (MGOS_ESPNOW_PEER_CB_SLOTS + 1) * sizeof(void *), MGOS_ESPNOW_CB_SLOTS + 2);
+
+//Peer index. Two open addressing tables (linear probing) over peer_list, keyed on MAC and name.
+//Both tables have a power of two capacity that keeps them at most half full. The index for
+//MGOS_ESPNOW_MAX_PEERS peers is in a static pool. More peers double the capacity and move the index
+//to the heap, it never shrinks back.
+//The WiFi task looks peers up while the event loop changes them. There is a spare copy of the index:
+//entries are added in place to both, a removal is a backward shift delete in the spare which is then
+//swapped in. The old index becomes the spare and the removed peer is deleted from it on the next
+//change, once no dispatch can be reading it. A removal from inside a dispatch while another one may
+//still read the spare leaves a tombstone in place instead, and the spare is rebuilt before its next use.
+#define ESPNOW_INDEX_CAP ESPNOW_POW2_CEIL(2 * MGOS_ESPNOW_MAX_PEERS)
+
+struct espnow_peer_index {
+    uint32_t cap;
+    int tombs;  //Removed peers left in place
+    bool stale; //Spare to rebuild from peer_list
+    struct mgos_espnow_peer **by_mac, **by_name;
+};
+static struct espnow_peer_index *espnow_peer_index, *espnow_index_spare;
+//Removed from the index but still in the spare. Only compared, the peer may be freed already.
+static struct mgos_espnow_peer *espnow_index_lag;
+static uint32_t espnow_index_lag_hash[2];
+//The spare was swapped out during a dispatch, which may still read it
+static bool espnow_index_spare_busy;
+static int espnow_peer_count;
+static struct mgos_espnow_peer espnow_index_tomb;
+ESPNOW_POOL_DEFINE(espnow_index_pool, sizeof(struct espnow_peer_index) + 2 * ESPNOW_INDEX_CAP * sizeof(void *), 2);
+
+uint32_t espnow_hash_bytes(const uint8_t *data, size_t len){
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++){
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t espnow_hash_str(const char *str){
+    uint32_t hash = 2166136261u;
+    while(*str){
+        hash ^= (uint8_t)*str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t espnow_peer_hash(const struct mgos_espnow_peer *peer, bool by_name){
+    return by_name ? espnow_hash_str(peer->name) : espnow_hash_bytes(peer->mac, 6);
+}
+
+static void espnow_index_put(struct espnow_peer_index *idx, struct mgos_espnow_peer *peer){
+    uint32_t mask = idx->cap - 1;
+    uint32_t i = espnow_peer_hash(peer, false) & mask;
+    while(idx->by_mac[i] != NULL) i = (i + 1) & mask;
+    __atomic_store_n(&idx->by_mac[i], peer, __ATOMIC_RELEASE);
+    i = espnow_peer_hash(peer, true) & mask;
+    while(idx->by_name[i] != NULL) i = (i + 1) & mask;
+    __atomic_store_n(&idx->by_name[i], peer, __ATOMIC_RELEASE);
+}
+
+//Backward shift deletion, keeps probe chains intact. Only on an index no lookup reads.
+static void espnow_index_del(struct mgos_espnow_peer **index, uint32_t cap, struct mgos_espnow_peer *peer, uint32_t hash, bool by_name){
+    uint32_t mask = cap - 1;
+    uint32_t i = hash & mask;
+    while(index[i] != peer){
+        if(index[i] == NULL) return;
+        i = (i + 1) & mask;
+    }
+    uint32_t j = i;
+    while(true){
+        j = (j + 1) & mask;
+        if(index[j] == NULL) break;
+        uint32_t home = espnow_peer_hash(index[j], by_name) & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            __atomic_store_n(&index[i], index[j], __ATOMIC_RELEASE);
+            i = j;
+        }
+    }
+    __atomic_store_n(&index[i], NULL, __ATOMIC_RELEASE);
+}
+
+//Lookups probe past a tombstone like past any other peer
+static void espnow_index_bury(struct mgos_espnow_peer **index, uint32_t cap, struct mgos_espnow_peer *peer, bool by_name){
+    uint32_t mask = cap - 1;
+    uint32_t i = espnow_peer_hash(peer, by_name) & mask;
+    while(index[i] != peer){
+        if(index[i] == NULL) return;
+        i = (i + 1) & mask;
+    }
+    __atomic_store_n(&index[i], &espnow_index_tomb, __ATOMIC_RELEASE);
+}
+
+//Index capacity for n peers
+static uint32_t espnow_index_cap(int n){
+    uint32_t cap = ESPNOW_INDEX_CAP;
+    while(cap < 2 * (uint32_t)n) cap *= 2;
+    return cap;
+}
+
+static struct espnow_peer_index *espnow_index_alloc(uint32_t cap){
+    struct espnow_peer_index *idx;
+    if(cap == ESPNOW_INDEX_CAP) idx = (struct espnow_peer_index *)espnow_alloc(&espnow_index_pool);
+    else idx = (struct espnow_peer_index *)malloc(sizeof(*idx) + 2 * cap * sizeof(void *));
+    if(idx == NULL) return NULL;
+    idx->cap = cap;
+    idx->tombs = 0;
+    idx->stale = true;
+    idx->by_mac = (struct mgos_espnow_peer **)(idx + 1);
+    idx->by_name = idx->by_mac + cap;
+    return idx;
+}
+
+static void espnow_index_retire(struct espnow_peer_index *idx){
+    if(idx != NULL) espnow_retire_to(idx->cap == ESPNOW_INDEX_CAP ? &espnow_index_pool : NULL, idx);
+}
+
+static void espnow_index_fill(struct espnow_peer_index *idx){
+    memset(idx->by_mac, 0, 2 * idx->cap * sizeof(void *));
     struct mgos_espnow_peer *peer;
     SLIST_FOREACH(peer, &peer_list, next){
-        result++;
+        espnow_index_put(idx, peer);
+    }
+    idx->tombs = 0;
+    idx->stale = false;
+}
+
+//Whether no lookup can be reading the spare. Waits for the dispatches of other tasks unless in one.
+static bool espnow_index_spare_idle(bool wait){
+    if(espnow_index_spare_busy && __atomic_load_n(&espnow_dispatch_depth, __ATOMIC_SEQ_CST) != 0 &&
+       (!wait || !espnow_reclaim_wait())) return false;
+    espnow_index_spare_busy = false;
+    return true;
+}
+
+//Catch the spare up with the index, deleting the peer it lags behind on
+static void espnow_index_spare_sync(struct espnow_peer_index *spare){
+    if(spare->stale){
+        espnow_index_fill(spare);
+    } else if(espnow_index_lag != NULL){
+        espnow_index_del(spare->by_mac, spare->cap, espnow_index_lag, espnow_index_lag_hash[0], false);
+        espnow_index_del(spare->by_name, spare->cap, espnow_index_lag, espnow_index_lag_hash[1], true);
+    }
+    espnow_index_lag = NULL;
+}
+
+//Swap in the spare, the old index becomes the spare
+static void espnow_index_swap(){
+    struct espnow_peer_index *old = espnow_peer_index;
+    __atomic_store_n(&espnow_peer_index, espnow_index_spare, __ATOMIC_SEQ_CST);
+    espnow_index_spare = old;
+    espnow_index_spare_busy = __atomic_load_n(&espnow_dispatch_depth, __ATOMIC_SEQ_CST) != 0;
+    if(old->tombs > 0) old->stale = true;
+}
+
+//Both copies at a new capacity, the index built over peer_list
+static bool espnow_index_grow(uint32_t cap){
+    struct espnow_peer_index *idx = espnow_index_alloc(cap), *spare = espnow_index_alloc(cap);
+    if(idx == NULL || spare == NULL){
+        if(idx != NULL) espnow_release(cap == ESPNOW_INDEX_CAP ? &espnow_index_pool : NULL, idx);
+        if(spare != NULL) espnow_release(cap == ESPNOW_INDEX_CAP ? &espnow_index_pool : NULL, spare);
+        return false;
+    }
+    espnow_index_fill(idx);
+    struct espnow_peer_index *old = espnow_peer_index, *old_spare = espnow_index_spare;
+    __atomic_store_n(&espnow_peer_index, idx, __ATOMIC_SEQ_CST);
+    espnow_index_spare = spare;
+    espnow_index_spare_busy = false;
+    espnow_index_lag = NULL;
+    espnow_index_retire(old);
+    espnow_index_retire(old_spare);
+    return true;
+}
+
+//Peers that can be added before mgos_espnow_add_peer gives ESPNOW_MAX_PEERS
+static bool espnow_peers_full(){
+    int max = mgos_sys_config_get_espnow_max_peers();
+    if(max == 0) max = MGOS_ESPNOW_MAX_PEERS;
+    return max > 0 && espnow_peer_count >= max;
+}
+
+//Insert in peer_list and in both indexes
+static bool espnow_peer_link(struct mgos_espnow_peer *peer){
+    if(espnow_peers_full()) return false;
+    struct espnow_peer_index *idx = espnow_peer_index;
+    uint32_t cap = espnow_index_cap(espnow_peer_count + 1);
+    if(idx != NULL && idx->cap > cap) cap = idx->cap;
+    if(idx != NULL && idx->cap == cap && 2 * (uint32_t)(espnow_peer_count + 1 + idx->tombs) > cap){
+        //Too many tombstones, swap in the spare without them or make room
+        if(espnow_index_spare_idle(true)){
+            espnow_index_spare_sync(espnow_index_spare);
+            espnow_index_swap();
+        } else {
+            cap *= 2;
+        }
+    }
+    if((idx == NULL || idx->cap < cap) && !espnow_index_grow(cap)){
+        LOG(LL_ERROR, ("Failed to allocate peer index"));
+        return false;
+    }
+    SLIST_INSERT_HEAD(&peer_list, peer, next);
+    peer->prev_next = &SLIST_FIRST(&peer_list);
+    if(SLIST_NEXT(peer, next) != NULL) SLIST_NEXT(peer, next)->prev_next = &SLIST_NEXT(peer, next);
+    espnow_index_put(espnow_peer_index, peer);
+    //The lagging peer may be in the same block, so it goes first
+    struct espnow_peer_index *spare = espnow_index_spare;
+    if(!spare->stale && espnow_index_lag != NULL){
+        if(espnow_index_spare_idle(false)) espnow_index_spare_sync(spare);
+        else spare->stale = true;
+    }
+    if(!spare->stale) espnow_index_put(spare, peer);
+    espnow_peer_count++;
+    return true;
+}
+
+static void espnow_peer_unlink(struct mgos_espnow_peer *peer){
+    *peer->prev_next = SLIST_NEXT(peer, next);
+    if(SLIST_NEXT(peer, next) != NULL) SLIST_NEXT(peer, next)->prev_next = peer->prev_next;
+    espnow_peer_count--;
+    struct espnow_peer_index *idx = espnow_peer_index, *spare = espnow_index_spare;
+    if(!espnow_index_spare_idle(true)){
+        espnow_index_bury(idx->by_mac, idx->cap, peer, false);
+        espnow_index_bury(idx->by_name, idx->cap, peer, true);
+        idx->tombs++;
+        spare->stale = true;
+        return;
+    }
+    espnow_index_spare_sync(spare);
+    uint32_t hash[2] = {espnow_peer_hash(peer, false), espnow_peer_hash(peer, true)};
+    espnow_index_del(spare->by_mac, spare->cap, peer, hash[0], false);
+    espnow_index_del(spare->by_name, spare->cap, peer, hash[1], true);
+    espnow_index_swap();
+    espnow_index_lag = peer;
+    memcpy(espnow_index_lag_hash, hash, sizeof(hash));
+}
+
+int mgos_espnow_total_peers(){
+    return espnow_peer_count;
+}
+
+//Virtual peer table. The library keeps every peer, the driver table only holds the ones used last.
+//Peers are installed when a frame to them is handed to the driver, evicting the least recently used.
+static struct mgos_espnow_peer *espnow_resident[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static int espnow_num_resident;
+static uint32_t espnow_lru_clock, espnow_lru_hits, espnow_lru_misses, espnow_lru_evictions;
+
+static void espnow_resident_add(struct mgos_espnow_peer *peer){
+    if(peer->resident || espnow_num_resident == ESP_NOW_MAX_TOTAL_PEER_NUM) return;
+    peer->resident = true;
+    peer->last_used = ++espnow_lru_clock;
+    espnow_resident[espnow_num_resident++] = peer;
+}
+
+static void espnow_resident_del(struct mgos_espnow_peer *peer){
+    if(!peer->resident) return;
+    peer->resident = false;
+    for(int i = 0; i < espnow_num_resident; i++){
+        if(espnow_resident[i] == peer){
+            espnow_resident[i] = espnow_resident[--espnow_num_resident];
+            break;
+        }
     }
-    return result;
 }
 
 static void mgos_espnow_add_broadcast_peer(){
@@ -55,177 +493,1515 @@ static void mgos_espnow_add_broadcast_peer(){
 }
 
 struct mgos_espnow_peer *mgos_espnow_get_peer_by_mac(const uint8_t *mac){
+    struct espnow_peer_index *idx = __atomic_load_n(&espnow_peer_index, __ATOMIC_SEQ_CST);
+    if(idx == NULL) return NULL;
+    uint32_t mask = idx->cap - 1;
+    uint32_t i = espnow_hash_bytes(mac, 6) & mask;
     struct mgos_espnow_peer *peer;
-    SLIST_FOREACH(peer, &peer_list, next){
-        if(memcmp(mac, peer->mac, 6) == 0){
+    while((peer = __atomic_load_n(&idx->by_mac[i], __ATOMIC_ACQUIRE)) != NULL){
+        if(peer != &espnow_index_tomb && memcmp(mac, peer->mac, 6) == 0){
+            return peer;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+struct mgos_espnow_peer *mgos_espnow_get_peer_by_name(const char *name){
+    struct espnow_peer_index *idx = __atomic_load_n(&espnow_peer_index, __ATOMIC_SEQ_CST);
+    if(idx == NULL || name == NULL) return NULL;
+    uint32_t mask = idx->cap - 1;
+    uint32_t i = espnow_hash_str(name) & mask;
+    struct mgos_espnow_peer *peer;
+    while((peer = __atomic_load_n(&idx->by_name[i], __ATOMIC_ACQUIRE)) != NULL){
+        if(peer != &espnow_index_tomb && strcmp(name, peer->name) == 0){
             return peer;
         }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+//Dispatch tables, rebuilt from the callback lists on every register/remove.
+//ALL, ANY_PEER and BCAST callbacks are flat arrays. MAC callbacks are bucketed by MAC hash,
+//bucket b spans mac[mac_start[b]] to mac[mac_start[b + 1]].
+struct espnow_recv_table {
+    struct espnow_recv_mac_cb **all, **any_peer, **bcast, **mac;
+    int num_all, num_any_peer, num_bcast;
+    uint32_t mac_mask;
+    uint16_t *mac_start;
+};
+
+struct espnow_send_table {
+    struct espnow_send_mac_cb **all, **any_peer, **bcast, **mac;
+    int num_all, num_any_peer, num_bcast;
+    uint32_t mac_mask;
+    uint16_t *mac_start;
+};
+
+static struct espnow_recv_table *espnow_recv_table;
+static struct espnow_send_table *espnow_send_table;
+
+//Room for every callback of the pool, in use and spare for each direction
+#define ESPNOW_MAC_BUCKETS_MAX ESPNOW_POW2_CEIL(MGOS_ESPNOW_CB_SLOTS)
+#define ESPNOW_TABLE_BYTES (sizeof(struct espnow_recv_table) + MGOS_ESPNOW_CB_SLOTS * sizeof(void *) + (ESPNOW_MAC_BUCKETS_MAX + 1) * sizeof(uint16_t))
+ESPNOW_POOL_DEFINE(espnow_table_pool, ESPNOW_TABLE_BYTES, 4);
+
+static uint32_t espnow_mac_buckets(int num_mac){
+    uint32_t buckets = 8;
+    while(buckets < (uint32_t)num_mac) buckets <<= 1;
+    return buckets;
+}
+
+static void espnow_rebuild_recv_table(){
+    struct espnow_recv_mac_cb *m_cb;
+    int num[4] = {0};
+    SLIST_FOREACH(m_cb, &espnow_recv_mac_cb_head, next){
+        num[m_cb->type]++;
+    }
+    uint32_t buckets = espnow_mac_buckets(num[MAC]);
+    struct espnow_recv_table *t = (struct espnow_recv_table *)espnow_alloc(&espnow_table_pool);
+    //Only when a dispatch on this task still uses the spare table
+    espnow_recv_table_dirty = t == NULL;
+    if(t == NULL) return;
+    t->all = (struct espnow_recv_mac_cb **)(t + 1);
+    t->any_peer = t->all + num[ALL];
+    t->bcast = t->any_peer + num[ANY_PEER];
+    t->mac = t->bcast + num[BCAST];
+    t->mac_start = (uint16_t *)(t->mac + num[MAC]);
+    t->mac_mask = buckets - 1;
+    SLIST_FOREACH(m_cb, &espnow_recv_mac_cb_head, next){
+        if(m_cb->type == MAC) t->mac_start[(espnow_hash_bytes(m_cb->mac, 6) & t->mac_mask) + 1]++;
+    }
+    for(uint32_t b = 0; b < buckets; b++) t->mac_start[b + 1] += t->mac_start[b];
+    SLIST_FOREACH(m_cb, &espnow_recv_mac_cb_head, next){
+        switch(m_cb->type){
+            case ALL: t->all[t->num_all++] = m_cb; break;
+            case ANY_PEER: t->any_peer[t->num_any_peer++] = m_cb; break;
+            case BCAST: t->bcast[t->num_bcast++] = m_cb; break;
+            case MAC: t->mac[t->mac_start[espnow_hash_bytes(m_cb->mac, 6) & t->mac_mask]++] = m_cb; break;
+        }
+    }
+    //Filling advanced each bucket start to its end, shift back
+    for(uint32_t b = buckets; b > 0; b--) t->mac_start[b] = t->mac_start[b - 1];
+    t->mac_start[0] = 0;
+    struct espnow_recv_table *old = espnow_recv_table;
+    __atomic_store_n(&espnow_recv_table, t, __ATOMIC_SEQ_CST);
+    espnow_retire_to(&espnow_table_pool, old);
+}
+
+static void espnow_rebuild_send_table(){
+    struct espnow_send_mac_cb *m_cb;
+    int num[4] = {0};
+    SLIST_FOREACH(m_cb, &espnow_send_mac_cb_head, next){
+        num[m_cb->type]++;
+    }
+    uint32_t buckets = espnow_mac_buckets(num[MAC]);
+    struct espnow_send_table *t = (struct espnow_send_table *)espnow_alloc(&espnow_table_pool);
+    espnow_send_table_dirty = t == NULL;
+    if(t == NULL) return;
+    t->all = (struct espnow_send_mac_cb **)(t + 1);
+    t->any_peer = t->all + num[ALL];
+    t->bcast = t->any_peer + num[ANY_PEER];
+    t->mac = t->bcast + num[BCAST];
+    t->mac_start = (uint16_t *)(t->mac + num[MAC]);
+    t->mac_mask = buckets - 1;
+    SLIST_FOREACH(m_cb, &espnow_send_mac_cb_head, next){
+        if(m_cb->type == MAC) t->mac_start[(espnow_hash_bytes(m_cb->mac, 6) & t->mac_mask) + 1]++;
+    }
+    for(uint32_t b = 0; b < buckets; b++) t->mac_start[b + 1] += t->mac_start[b];
+    SLIST_FOREACH(m_cb, &espnow_send_mac_cb_head, next){
+        switch(m_cb->type){
+            case ALL: t->all[t->num_all++] = m_cb; break;
+            case ANY_PEER: t->any_peer[t->num_any_peer++] = m_cb; break;
+            case BCAST: t->bcast[t->num_bcast++] = m_cb; break;
+            case MAC: t->mac[t->mac_start[espnow_hash_bytes(m_cb->mac, 6) & t->mac_mask]++] = m_cb; break;
+        }
+    }
+    for(uint32_t b = buckets; b > 0; b--) t->mac_start[b] = t->mac_start[b - 1];
+    t->mac_start[0] = 0;
+    struct espnow_send_table *old = espnow_send_table;
+    __atomic_store_n(&espnow_send_table, t, __ATOMIC_RELEASE);
+    espnow_retire_to(&espnow_table_pool, old);
+}
+
+//Per peer callback arrays hanging off struct mgos_espnow_peer, at most MGOS_ESPNOW_PEER_CB_SLOTS callbacks
+static bool espnow_rebuild_peer_recv_cbs(struct mgos_espnow_peer *peer){
+    struct espnow_recv_peer_cb *p_cb;
+    struct espnow_recv_peer_cb **cbs = NULL;
+    int num = 0;
+    SLIST_FOREACH(p_cb, &espnow_recv_peer_cb_head, next){
+        if(p_cb->peer == peer) num++;
+    }
+    if(num > 0){
+        if(num > MGOS_ESPNOW_PEER_CB_SLOTS) return false;
+        cbs = (struct espnow_recv_peer_cb **)espnow_alloc(&espnow_cb_list_pool);
+        if(cbs == NULL){
+            LOG(LL_ERROR, ("Failed to allocate peer rx callbacks"));
+            return false;
+        }
+        num = 0;
+        SLIST_FOREACH(p_cb, &espnow_recv_peer_cb_head, next){
+            if(p_cb->peer == peer) cbs[num++] = p_cb;
+        }
+    }
+    struct espnow_recv_peer_cb **old = peer->recv_cbs;
+    __atomic_store_n(&peer->recv_cbs, cbs, __ATOMIC_SEQ_CST);
+    espnow_retire_to(&espnow_cb_list_pool, old);
+    return true;
+}
+
+static bool espnow_rebuild_peer_send_cbs(struct mgos_espnow_peer *peer){
+    struct espnow_send_peer_cb *p_cb;
+    struct espnow_send_peer_cb **cbs = NULL;
+    int num = 0;
+    SLIST_FOREACH(p_cb, &espnow_send_peer_cb_head, next){
+        if(p_cb->peer == peer) num++;
+    }
+    if(num > 0){
+        if(num > MGOS_ESPNOW_PEER_CB_SLOTS) return false;
+        cbs = (struct espnow_send_peer_cb **)espnow_alloc(&espnow_cb_list_pool);
+        if(cbs == NULL){
+            LOG(LL_ERROR, ("Failed to allocate peer tx callbacks"));
+            return false;
+        }
+        num = 0;
+        SLIST_FOREACH(p_cb, &espnow_send_peer_cb_head, next){
+            if(p_cb->peer == peer) cbs[num++] = p_cb;
+        }
+    }
+    struct espnow_send_peer_cb **old = peer->send_cbs;
+    __atomic_store_n(&peer->send_cbs, cbs, __ATOMIC_SEQ_CST);
+    espnow_retire_to(&espnow_cb_list_pool, old);
+    return true;
+}
+
+static int espnow_cb_list_len(void **list){
+    int num = 0;
+    while(list != NULL && list[num] != NULL) num++;
+    return num;
+}
+
+//Stand ins for removed callbacks, when a list that still holds them could not be rebuilt
+static void espnow_recv_peer_nop(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    (void)peer;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+static void espnow_send_peer_nop(struct mgos_espnow_peer *peer, bool success, void *ud){
+    (void)peer;
+    (void)success;
+    (void)ud;
+}
+static void espnow_recv_mac_nop(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    (void)mac;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+static void espnow_send_mac_nop(const uint8_t *mac, bool success, void *ud){
+    (void)mac;
+    (void)success;
+    (void)ud;
+}
+static struct espnow_recv_peer_cb espnow_recv_peer_removed = {.cb = espnow_recv_peer_nop};
+static struct espnow_send_peer_cb espnow_send_peer_removed = {.cb = espnow_send_peer_nop};
+static struct espnow_recv_mac_cb espnow_recv_mac_removed = {.cb = espnow_recv_mac_nop};
+static struct espnow_send_mac_cb espnow_send_mac_removed = {.cb = espnow_send_mac_nop};
+
+//Replace a callback in place in a published list, readers see either the callback or its stand in
+static void espnow_cb_list_drop(void **list, int num, void *entry, void *removed){
+    for(int i = 0; list != NULL && i < num; i++){
+        if(list[i] == entry) __atomic_store_n(&list[i], removed, __ATOMIC_SEQ_CST);
+    }
+}
+
+//Callbacks of a dispatch table, its arrays are contiguous from all
+#define ESPNOW_TABLE_NUM_CBS(t) ((t)->num_all + (t)->num_any_peer + (t)->num_bcast + (t)->mac_start[(t)->mac_mask + 1])
+
+//Move the peer callbacks of a replaced peer to its replacement, or drop them when there is none.
+//Two peers replaced at once can bring more callbacks than fit, the extra ones are dropped.
+static void espnow_move_peer_cbs(struct mgos_espnow_peer *from, struct mgos_espnow_peer *to){
+    struct espnow_recv_peer_cb *r_cb, *r_tmp;
+    struct espnow_send_peer_cb *s_cb, *s_tmp;
+    int room = to != NULL ? MGOS_ESPNOW_PEER_CB_SLOTS - espnow_cb_list_len((void **)to->recv_cbs) : 0;
+    SLIST_FOREACH_SAFE(r_cb, &espnow_recv_peer_cb_head, next, r_tmp){
+        if(r_cb->peer != from) continue;
+        if(room-- > 0){
+            r_cb->peer = to;
+        } else {
+            SLIST_REMOVE(&espnow_recv_peer_cb_head, r_cb, espnow_recv_peer_cb, next);
+            espnow_retire_to(&espnow_cb_pool, r_cb);
+        }
+    }
+    room = to != NULL ? MGOS_ESPNOW_PEER_CB_SLOTS - espnow_cb_list_len((void **)to->send_cbs) : 0;
+    SLIST_FOREACH_SAFE(s_cb, &espnow_send_peer_cb_head, next, s_tmp){
+        if(s_cb->peer != from) continue;
+        if(room-- > 0){
+            s_cb->peer = to;
+        } else {
+            SLIST_REMOVE(&espnow_send_peer_cb_head, s_cb, espnow_send_peer_cb, next);
+            espnow_retire_to(&espnow_cb_pool, s_cb);
+        }
+    }
+    if(to != NULL){
+        espnow_rebuild_peer_recv_cbs(to);
+        espnow_rebuild_peer_send_cbs(to);
+        if(to->op_table == NULL){
+            __atomic_store_n(&to->op_table, from->op_table, __ATOMIC_SEQ_CST);
+            from->op_table = NULL;
+        }
+    }
+}
+
+static void espnow_free_peer(struct mgos_espnow_peer *peer){
+    espnow_resident_del(peer);
+    espnow_rel_free(peer);
+    espnow_retire_to(&espnow_cb_list_pool, peer->recv_cbs);
+    espnow_retire_to(&espnow_cb_list_pool, peer->send_cbs);
+    espnow_retire(peer->op_table);
+    espnow_retire_to(&espnow_peer_pool, peer);
+}
+
+//Calls from other tasks. Sends and peer or callback changes made outside the event loop are copied to a
+//bounded MPSC queue and run from the event loop, which stays the only writer of the library state.
+//Producers claim a slot with a CAS on head and publish it through the slot sequence, no lock is taken.
+#define ESPNOW_SUBMIT_NAME_LEN 32
+
+enum espnow_submit_op {
+    ESPNOW_SUBMIT_SEND,
+    ESPNOW_SUBMIT_BROADCAST,
+    ESPNOW_SUBMIT_ADD_PEER,
+    ESPNOW_SUBMIT_REMOVE_PEER,
+    ESPNOW_SUBMIT_RECV_PEER_CB,
+    ESPNOW_SUBMIT_RECV_MAC_CB,
+    ESPNOW_SUBMIT_RECV_BUF_CB,
+    ESPNOW_SUBMIT_SEND_PEER_CB,
+    ESPNOW_SUBMIT_SEND_MAC_CB,
+    ESPNOW_SUBMIT_REMOVE_RECV_PEER_CB,
+    ESPNOW_SUBMIT_REMOVE_RECV_MAC_CB,
+    ESPNOW_SUBMIT_REMOVE_RECV_BUF_CB,
+    ESPNOW_SUBMIT_REMOVE_SEND_PEER_CB,
+    ESPNOW_SUBMIT_REMOVE_SEND_MAC_CB
+};
+
+struct espnow_submit {
+    //Position the slot is free for, plus one once the call in it is published
+    uint32_t seq;
+    uint8_t op;
+    uint8_t prio;
+    bool flag; //Send to every peer, softap for ADD_PEER
+    bool save;
+    bool has_name, has_mac;
+    char name[ESPNOW_SUBMIT_NAME_LEN];
+    uint8_t mac[6];
+    int arg; //Payload length, callback type or channel
+    void (*cb)(void);
+    void *ud;
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+};
+
+static struct espnow_submit espnow_submit_ring[MGOS_ESPNOW_SUBMIT_SLOTS];
+static uint32_t espnow_submit_head, espnow_submit_tail;
+static bool espnow_submit_pending, espnow_submit_ready;
+static uint32_t espnow_submit_count, espnow_submit_full, espnow_submit_failed;
+static __thread bool espnow_loop_task;
+
+static void espnow_submit_drain(void *arg);
+
+//Calls made outside the event loop once the library is running go through the queue
+static bool espnow_submit_needed(){
+    return espnow_submit_ready && !espnow_loop_task;
+}
+
+static void espnow_submit_post(){
+    if(!__atomic_exchange_n(&espnow_submit_pending, true, __ATOMIC_SEQ_CST)){
+        if(!mgos_invoke_cb(espnow_submit_drain, NULL, false)){
+            //Event queue full, next call or TX completion will try again
+            __atomic_store_n(&espnow_submit_pending, false, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static void espnow_submit_kick(){
+    if(espnow_submit_tail != __atomic_load_n(&espnow_submit_head, __ATOMIC_ACQUIRE)) espnow_submit_post();
+}
+
+static bool espnow_submit_init(struct espnow_submit *req, uint8_t op, const char *name, const uint8_t *mac){
+    memset(req, 0, offsetof(struct espnow_submit, data));
+    req->op = op;
+    if(name != NULL){
+        size_t len = strlen(name);
+        if(len >= ESPNOW_SUBMIT_NAME_LEN) return false;
+        memcpy(req->name, name, len + 1);
+        req->has_name = true;
+    }
+    if(mac != NULL){
+        memcpy(req->mac, mac, 6);
+        req->has_mac = true;
+    }
+    return true;
+}
+
+static mgos_espnow_result_t espnow_submit(const struct espnow_submit *req, const uint8_t *data, int len){
+    if(len < 0 || len > MGOS_ESPNOW_MAX_LEN || (len > 0 && data == NULL)) return ESPNOW_PAYLOAD_LEN_ERR;
+    uint32_t pos = __atomic_load_n(&espnow_submit_head, __ATOMIC_RELAXED);
+    struct espnow_submit *slot;
+    while(true){
+        slot = &espnow_submit_ring[pos & (MGOS_ESPNOW_SUBMIT_SLOTS - 1)];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&espnow_submit_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if(diff < 0){
+            //Still holding the call from a turn ago
+            __atomic_add_fetch(&espnow_submit_full, 1, __ATOMIC_RELAXED);
+            return ESPNOW_QUEUE_FULL;
+        } else {
+            pos = __atomic_load_n(&espnow_submit_head, __ATOMIC_RELAXED);
+        }
+    }
+    size_t from = offsetof(struct espnow_submit, op);
+    memcpy((uint8_t *)slot + from, (const uint8_t *)req + from, offsetof(struct espnow_submit, data) - from);
+    if(len > 0) memcpy(slot->data, data, len);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&espnow_submit_count, 1, __ATOMIC_RELAXED);
+    espnow_submit_post();
+    return ESPNOW_OK;
+}
+
+//Returns false to keep the call queued until TX slots free up
+static bool espnow_submit_run(struct espnow_submit *s){
+    const char *name = s->has_name ? s->name : NULL;
+    uint8_t *mac = s->has_mac ? s->mac : NULL;
+    mgos_espnow_result_t res = ESPNOW_OK;
+    switch(s->op){
+        case ESPNOW_SUBMIT_SEND:
+        case ESPNOW_SUBMIT_BROADCAST:
+        if(s->op == ESPNOW_SUBMIT_BROADCAST){
+            res = mgos_espnow_broadcast_msg_prio(s->data, s->arg, (mgos_espnow_prio_t)s->prio, (espnow_msg_cb_t)s->cb, s->ud, NULL);
+        } else if(s->flag){
+            res = mgos_espnow_send_prio(NULL, s->data, s->arg, (mgos_espnow_prio_t)s->prio);
+        } else {
+            res = mgos_espnow_send_msg_prio(name, s->data, s->arg, (mgos_espnow_prio_t)s->prio, (espnow_msg_cb_t)s->cb, s->ud, NULL);
+        }
+        if(res == ESPNOW_QUEUE_FULL) return false;
+        if(res != ESPNOW_OK){
+            espnow_submit_failed++;
+            if(s->cb != NULL) ((espnow_msg_cb_t)s->cb)(0, s->mac, false, s->ud);
+        }
+        return true;
+        case ESPNOW_SUBMIT_ADD_PEER:
+        res = mgos_espnow_add_peer(name, mac, s->flag, s->arg, s->save);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_PEER:
+        mgos_espnow_remove_peer(name, s->save);
+        break;
+        case ESPNOW_SUBMIT_RECV_PEER_CB:
+        res = mgos_espnow_register_recv_peer_cb(name, (espnow_recv_peer_cb_t)s->cb, s->ud);
+        break;
+        case ESPNOW_SUBMIT_RECV_MAC_CB:
+        res = mgos_espnow_register_recv_mac_cb(mac, (enum mac_cb_type)s->arg, (espnow_recv_mac_cb_t)s->cb, s->ud);
+        break;
+        case ESPNOW_SUBMIT_RECV_BUF_CB:
+        res = mgos_espnow_register_recv_buf_cb(mac, (enum mac_cb_type)s->arg, (espnow_recv_buf_cb_t)s->cb, s->ud);
+        break;
+        case ESPNOW_SUBMIT_SEND_PEER_CB:
+        res = mgos_espnow_register_send_peer_cb(name, (espnow_send_peer_cb_t)s->cb, s->ud);
+        break;
+        case ESPNOW_SUBMIT_SEND_MAC_CB:
+        res = mgos_espnow_register_send_mac_cb(mac, (enum mac_cb_type)s->arg, (espnow_send_mac_cb_t)s->cb, s->ud);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_RECV_PEER_CB:
+        mgos_espnow_remove_recv_peer_cb((espnow_recv_peer_cb_t)s->cb, name);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_RECV_MAC_CB:
+        mgos_espnow_remove_recv_mac_cb((espnow_recv_mac_cb_t)s->cb, mac, (enum mac_cb_type)s->arg);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_RECV_BUF_CB:
+        mgos_espnow_remove_recv_buf_cb((espnow_recv_buf_cb_t)s->cb, mac, (enum mac_cb_type)s->arg);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_SEND_PEER_CB:
+        mgos_espnow_remove_send_peer_cb((espnow_send_peer_cb_t)s->cb, name);
+        break;
+        case ESPNOW_SUBMIT_REMOVE_SEND_MAC_CB:
+        mgos_espnow_remove_send_mac_cb((espnow_send_mac_cb_t)s->cb, mac, (enum mac_cb_type)s->arg);
+        break;
+    }
+    if(res != ESPNOW_OK){
+        espnow_submit_failed++;
+        LOG(LL_ERROR, ("Call %d from another task failed: %d", s->op, res));
+    }
+    return true;
+}
+
+static void espnow_submit_drain(void *arg){
+    __atomic_store_n(&espnow_submit_pending, false, __ATOMIC_SEQ_CST);
+    uint32_t pos = espnow_submit_tail;
+    while(true){
+        struct espnow_submit *s = &espnow_submit_ring[pos & (MGOS_ESPNOW_SUBMIT_SLOTS - 1)];
+        //Claimed slots are published in any order, stop at the first one not ready
+        if((int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1)) < 0) break;
+        if(!espnow_submit_run(s)) break;
+        __atomic_store_n(&s->seq, pos + MGOS_ESPNOW_SUBMIT_SLOTS, __ATOMIC_RELEASE);
+        pos++;
+    }
+    espnow_submit_tail = pos;
+    (void)arg;
+}
+
+static void espnow_submit_start(){
+    espnow_loop_task = true;
+    for(uint32_t i = 0; i < MGOS_ESPNOW_SUBMIT_SLOTS; i++) espnow_submit_ring[i].seq = i;
+    espnow_submit_ready = true;
+}
+
+//Mac callbacks from other tasks
+static mgos_espnow_result_t espnow_submit_mac_cb(uint8_t op, const uint8_t *mac, enum mac_cb_type type, void (*cb)(void), void *ud){
+    struct espnow_submit req;
+    espnow_submit_init(&req, op, NULL, type == MAC ? mac : NULL);
+    req.arg = type;
+    req.cb = cb;
+    req.ud = ud;
+    return espnow_submit(&req, NULL, 0);
+}
+
+//Peer callbacks and peer changes from other tasks
+static mgos_espnow_result_t espnow_submit_named(uint8_t op, const char *name, void (*cb)(void), void *ud){
+    struct espnow_submit req;
+    if(!espnow_submit_init(&req, op, name, NULL)) return ESPNOW_PEER_NOT_FOUND;
+    req.cb = cb;
+    req.ud = ud;
+    return espnow_submit(&req, NULL, 0);
+}
+
+//Sends from other tasks, the handle stays 0 as the frame only gets one once the event loop queues it
+static mgos_espnow_result_t espnow_submit_send(uint8_t op, const char *name, const uint8_t *data, int len, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct espnow_submit req;
+    if(handle != NULL) *handle = 0;
+    if(!espnow_submit_init(&req, op, name, NULL)) return ESPNOW_PEER_NOT_FOUND;
+    req.flag = op == ESPNOW_SUBMIT_SEND && name == NULL;
+    req.prio = prio;
+    req.arg = len;
+    req.cb = (void (*)(void))cb;
+    req.ud = ud;
+    return espnow_submit(&req, data, len);
+}
+
+static void espnow_submit_log(mgos_espnow_result_t res){
+    if(res != ESPNOW_OK) LOG(LL_ERROR, ("Failed to queue a call from another task: %d", res));
+}
+
+void mgos_espnow_remove_send_peer_cb(espnow_send_peer_cb_t cb, const char *name){
+    if(espnow_submit_needed()){
+        espnow_submit_log(espnow_submit_named(ESPNOW_SUBMIT_REMOVE_SEND_PEER_CB, name, (void (*)(void))cb, NULL));
+        return;
+    }
+    struct espnow_send_peer_cb *cb_entry;
+    SLIST_FOREACH(cb_entry, &espnow_send_peer_cb_head, next){
+        if(cb == cb_entry->cb && strcmp(name, cb_entry->peer->name) == 0){
+            SLIST_REMOVE(&espnow_send_peer_cb_head, cb_entry, espnow_send_peer_cb, next);
+            struct mgos_espnow_peer *peer = cb_entry->peer;
+            if(!espnow_rebuild_peer_send_cbs(peer)){
+                espnow_cb_list_drop((void **)peer->send_cbs, MGOS_ESPNOW_PEER_CB_SLOTS, cb_entry, &espnow_send_peer_removed);
+            }
+            espnow_retire_to(&espnow_cb_pool, cb_entry);
+            espnow_reclaim();
+            return;
+        }
+    }
+}
+
+static void espnow_remove_send_mac_entry(struct espnow_send_mac_cb *cb_entry){
+    SLIST_REMOVE(&espnow_send_mac_cb_head, cb_entry, espnow_send_mac_cb, next);
+    espnow_rebuild_send_table();
+    if(espnow_send_table_dirty && espnow_send_table != NULL){
+        espnow_cb_list_drop((void **)espnow_send_table->all, ESPNOW_TABLE_NUM_CBS(espnow_send_table), cb_entry, &espnow_send_mac_removed);
+    }
+    espnow_retire_to(&espnow_cb_pool, cb_entry);
+}
+
+void mgos_espnow_remove_send_mac_cb(espnow_send_mac_cb_t cb, uint8_t *mac, enum mac_cb_type type){
+    if(espnow_submit_needed()){
+        espnow_submit_log(espnow_submit_mac_cb(ESPNOW_SUBMIT_REMOVE_SEND_MAC_CB, mac, type, (void (*)(void))cb, NULL));
+        return;
+    }
+    struct espnow_send_mac_cb *cb_entry;
+    SLIST_FOREACH(cb_entry, &espnow_send_mac_cb_head, next){
+        if(cb == cb_entry->cb){
+            if(type == MAC){
+                if(cb_entry->type == MAC && memcmp(cb_entry->mac, mac, 6) == 0){
+                    espnow_remove_send_mac_entry(cb_entry);
+                    espnow_reclaim();
+                    return;
+                }
+            } else {
+                if(type == cb_entry->type){
+                    espnow_remove_send_mac_entry(cb_entry);
+                    espnow_reclaim();
+                    return;
+                }
+            }
+        }
+    }
+}
+
+static void espnow_remove_recv_mac_entry(struct espnow_recv_mac_cb *cb_entry){
+    SLIST_REMOVE(&espnow_recv_mac_cb_head, cb_entry, espnow_recv_mac_cb, next);
+    espnow_rebuild_recv_table();
+    if(espnow_recv_table_dirty && espnow_recv_table != NULL){
+        espnow_cb_list_drop((void **)espnow_recv_table->all, ESPNOW_TABLE_NUM_CBS(espnow_recv_table), cb_entry, &espnow_recv_mac_removed);
+    }
+    espnow_retire_to(&espnow_cb_pool, cb_entry);
+}
+
+static void espnow_remove_recv_mac_cb(espnow_recv_mac_cb_t cb, espnow_recv_buf_cb_t buf_cb, uint8_t *mac, enum mac_cb_type type){
+    struct espnow_recv_mac_cb *cb_entry;
+    SLIST_FOREACH(cb_entry, &espnow_recv_mac_cb_head, next){
+        if(cb == cb_entry->cb && buf_cb == cb_entry->buf_cb){
+            if(type == MAC){
+                if(cb_entry->type == MAC && memcmp(cb_entry->mac, mac, 6) == 0){
+                    espnow_remove_recv_mac_entry(cb_entry);
+                    espnow_reclaim();
+                    return;
+                }
+            } else {
+                if(type == cb_entry->type){
+                    espnow_remove_recv_mac_entry(cb_entry);
+                    espnow_reclaim();
+                    return;
+                }
+            }
+        }
+    }
+}
+void mgos_espnow_remove_recv_mac_cb(espnow_recv_mac_cb_t cb, uint8_t *mac, enum mac_cb_type type){
+    if(espnow_submit_needed()){
+        espnow_submit_log(espnow_submit_mac_cb(ESPNOW_SUBMIT_REMOVE_RECV_MAC_CB, mac, type, (void (*)(void))cb, NULL));
+        return;
+    }
+    espnow_remove_recv_mac_cb(cb, NULL, mac, type);
+}
+
+void mgos_espnow_remove_recv_buf_cb(espnow_recv_buf_cb_t cb, uint8_t *mac, enum mac_cb_type type){
+    if(espnow_submit_needed()){
+        espnow_submit_log(espnow_submit_mac_cb(ESPNOW_SUBMIT_REMOVE_RECV_BUF_CB, mac, type, (void (*)(void))cb, NULL));
+        return;
+    }
+    espnow_remove_recv_mac_cb(NULL, cb, mac, type);
+}
+
+void mgos_espnow_remove_recv_peer_cb(espnow_recv_peer_cb_t cb, const char *name){
+    if(espnow_submit_needed()){
+        espnow_submit_log(espnow_submit_named(ESPNOW_SUBMIT_REMOVE_RECV_PEER_CB, name, (void (*)(void))cb, NULL));
+        return;
+    }
+    struct espnow_recv_peer_cb *cb_entry;
+    SLIST_FOREACH(cb_entry, &espnow_recv_peer_cb_head, next){
+        if(cb == cb_entry->cb && strcmp(name, cb_entry->peer->name) == 0){
+            SLIST_REMOVE(&espnow_recv_peer_cb_head, cb_entry, espnow_recv_peer_cb, next);
+            struct mgos_espnow_peer *peer = cb_entry->peer;
+            if(!espnow_rebuild_peer_recv_cbs(peer)){
+                espnow_cb_list_drop((void **)peer->recv_cbs, MGOS_ESPNOW_PEER_CB_SLOTS, cb_entry, &espnow_recv_peer_removed);
+            }
+            espnow_retire_to(&espnow_cb_pool, cb_entry);
+            espnow_reclaim();
+            return;
+        }
+    }
+}
+
+//Counters. RX ones are only written by the WiFi task and TX ones by the event loop, callbacks run
+//from both so their counters are updated atomically.
+static struct mgos_espnow_stats espnow_stats;
+
+static void espnow_count_cb_time(int64_t start){
+    uint32_t us = (uint32_t)(mgos_uptime_micros() - start);
+    __atomic_fetch_add(&espnow_stats.cb_runs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&espnow_stats.cb_time_us, us, __ATOMIC_RELAXED);
+    uint32_t max = __atomic_load_n(&espnow_stats.cb_max_us, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&espnow_stats.cb_max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void espnow_count_tx(const uint8_t *mac, int len, bool success, int64_t queued_at){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(success){
+        espnow_stats.tx_frames++;
+        espnow_stats.tx_bytes += len;
+        if(peer != NULL){
+            peer->stats.tx_frames++;
+            peer->stats.tx_bytes += len;
+        }
+    } else {
+        espnow_stats.tx_failed++;
+        if(peer != NULL) peer->stats.tx_failed++;
+    }
+    if(peer != NULL) espnow_link_tx_done(peer, success);
+    //Bucket i counts frames completed in [2^i, 2^(i+1)) microseconds
+    uint32_t us = (uint32_t)(mgos_uptime_micros() - queued_at);
+    int bucket = us > 0 ? 31 - __builtin_clz(us) : 0;
+    if(bucket >= MGOS_ESPNOW_LAT_BUCKETS) bucket = MGOS_ESPNOW_LAT_BUCKETS - 1;
+    espnow_stats.tx_latency[bucket]++;
+}
+
+void mgos_espnow_get_stats(struct mgos_espnow_stats *stats){
+    *stats = espnow_stats;
+}
+
+bool mgos_espnow_get_peer_stats(const char *name, struct mgos_espnow_peer_stats *stats){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return false;
+    *stats = peer->stats;
+    return true;
+}
+
+//Shared RX buffers. Taken by the dispatch that first needs one, released by whoever drops the last reference.
+//Refs are atomic, buffers can be released from another task than the one dispatching.
+static struct mgos_espnow_rxbuf espnow_rxbufs[MGOS_ESPNOW_RXBUF_SLOTS];
+static int espnow_rxbuf_in_use, espnow_rxbuf_high_water;
+static uint32_t espnow_rxbuf_allocs, espnow_rxbuf_exhausted;
+
+static struct mgos_espnow_rxbuf *espnow_rxbuf_alloc(const uint8_t *mac, const uint8_t *data, int len){
+    for(int i = 0; i < MGOS_ESPNOW_RXBUF_SLOTS; i++){
+        struct mgos_espnow_rxbuf *buf = &espnow_rxbufs[i];
+        int free_refs = 0;
+        if(__atomic_compare_exchange_n(&buf->refs, &free_refs, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            memcpy(buf->mac, mac, 6);
+            buf->len = len;
+            memcpy(buf->data, data, len);
+            int used = __atomic_add_fetch(&espnow_rxbuf_in_use, 1, __ATOMIC_RELAXED);
+            if(used > espnow_rxbuf_high_water) espnow_rxbuf_high_water = used;
+            espnow_rxbuf_allocs++;
+            return buf;
+        }
+    }
+    espnow_rxbuf_exhausted++;
+    return NULL;
+}
+
+void mgos_espnow_rxbuf_retain(struct mgos_espnow_rxbuf *buf){
+    if(buf == NULL) return;
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+}
+
+void mgos_espnow_rxbuf_release(struct mgos_espnow_rxbuf *buf){
+    if(buf == NULL) return;
+    int refs = __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_RELEASE);
+    if(refs == 0){
+        __atomic_sub_fetch(&espnow_rxbuf_in_use, 1, __ATOMIC_RELAXED);
+    } else if(refs < 0){
+        LOG(LL_ERROR, ("RX buffer %p released more times than retained", buf));
+        __atomic_store_n(&buf->refs, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void mgos_espnow_get_rxbuf_stats(struct mgos_espnow_rxbuf_stats *stats){
+    stats->pool_slots = MGOS_ESPNOW_RXBUF_SLOTS;
+    stats->in_use = __atomic_load_n(&espnow_rxbuf_in_use, __ATOMIC_RELAXED);
+    stats->high_water = espnow_rxbuf_high_water;
+    stats->allocs = espnow_rxbuf_allocs;
+    stats->exhausted = espnow_rxbuf_exhausted;
+}
+
+//Buffer callbacks share one buffer per frame, taken when the first of them runs
+static void espnow_deliver_mac_cb(struct espnow_recv_mac_cb *m_cb, const uint8_t *mac_addr, const uint8_t *data, int data_len, struct mgos_espnow_rxbuf **buf, bool *buf_failed){
+    if(m_cb->buf_cb == NULL){
+        m_cb->cb(mac_addr, data, data_len, m_cb->ud);
+        return;
+    }
+    if(*buf == NULL && !*buf_failed){
+        *buf = espnow_rxbuf_alloc(mac_addr, data, data_len);
+        *buf_failed = *buf == NULL;
+    }
+    if(*buf != NULL) m_cb->buf_cb(*buf, m_cb->ud);
+}
+
+//Run the registered receive callbacks for a user message
+void espnow_deliver(const uint8_t *mac_addr, const uint8_t *data, int data_len){
+    struct espnow_recv_peer_cb *p_cb;
+    struct espnow_recv_mac_cb *m_cb;
+    struct mgos_espnow_rxbuf *buf = NULL;
+    bool buf_failed = false;
+    int64_t start = mgos_uptime_micros();
+    espnow_dispatch_begin();
+    struct mgos_espnow_peer *recv_peer = mgos_espnow_get_peer_by_mac(mac_addr);
+    struct espnow_recv_table *t = __atomic_load_n(&espnow_recv_table, __ATOMIC_SEQ_CST);
+    bool op_dispatch = mgos_sys_config_get_espnow_op_dispatch();
+    //Opcodes with a handler only go to it, the rest to the receive callbacks
+    if(op_dispatch && espnow_op_deliver(recv_peer, mac_addr, data, data_len)){
+        espnow_dispatch_end();
+        espnow_count_cb_time(start);
+        return;
+    }
+    int matched = 0;
+    //Peer Callbacks
+    if(recv_peer != NULL){
+        struct espnow_recv_peer_cb **cbs = __atomic_load_n(&recv_peer->recv_cbs, __ATOMIC_SEQ_CST);
+        for(int i = 0; cbs != NULL && (p_cb = cbs[i]) != NULL; i++){
+            p_cb->cb(recv_peer, data, data_len, p_cb->ud);
+            matched++;
+        }
+    }
+    //Mac Callbacks
+    if(t != NULL){
+        matched += t->num_all;
+        for(int i = 0; i < t->num_all; i++){
+            m_cb = t->all[i];
+            espnow_deliver_mac_cb(m_cb, mac_addr, data, data_len, &buf, &buf_failed);
+        }
+        if(recv_peer != NULL){
+            matched += t->num_any_peer;
+            for(int i = 0; i < t->num_any_peer; i++){
+                m_cb = t->any_peer[i];
+                espnow_deliver_mac_cb(m_cb, mac_addr, data, data_len, &buf, &buf_failed);
+            }
+        } else {
+            matched += t->num_bcast;
+            for(int i = 0; i < t->num_bcast; i++){
+                m_cb = t->bcast[i];
+                espnow_deliver_mac_cb(m_cb, mac_addr, data, data_len, &buf, &buf_failed);
+            }
+        }
+        uint32_t bucket = espnow_hash_bytes(mac_addr, 6) & t->mac_mask;
+        for(int i = t->mac_start[bucket]; i < t->mac_start[bucket + 1]; i++){
+            m_cb = t->mac[i];
+            if(memcmp(m_cb->mac, mac_addr, 6) == 0){
+                espnow_deliver_mac_cb(m_cb, mac_addr, data, data_len, &buf, &buf_failed);
+                matched++;
+            }
+        }
+    }
+    if(op_dispatch && matched == 0) espnow_op_count_unknown();
+    //Drop the dispatch reference, the buffer stays with the callbacks that retained it
+    mgos_espnow_rxbuf_release(buf);
+    espnow_dispatch_end();
+    espnow_count_cb_time(start);
+}
+
+//Demultiplex a received frame, library frames are handled by their layer and user payloads delivered
+void espnow_proto_rx(const uint8_t *mac_addr, const uint8_t *data, int data_len){
+    if(!espnow_is_proto(data, data_len)){
+        espnow_deliver(mac_addr, data, data_len);
+        return;
+    }
+    switch(data[1]){
+        case ESPNOW_PROTO_FRAG:
+        case ESPNOW_PROTO_FRAG_PROTO:
+        espnow_frag_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REL_DATA:
+        espnow_rel_rx_data(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REL_ACK:
+        espnow_rel_rx_ack(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REL_SYN:
+        espnow_rel_rx_syn(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REL_SYN_ACK:
+        espnow_rel_rx_syn_ack(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REL_FWD:
+        espnow_rel_rx_fwd(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_BATCH:
+        espnow_coalesce_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_REQ:
+        espnow_req_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_RESP:
+        espnow_resp_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_XFER:
+        espnow_xfer_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_LZ:
+        espnow_lz_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_CAPS:
+        espnow_lz_rx_caps(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_PING:
+        espnow_link_rx(mac_addr, data, data_len);
+        break;
+        case ESPNOW_PROTO_MESH:
+        espnow_mesh_rx(mac_addr, data, data_len);
+        break;
+        default:
+        //Unknown library frame, likely a user payload that happens to start with the magic byte
+        espnow_deliver(mac_addr, data, data_len);
+        break;
+    }
+}
+
+static void espnow_dispatch_rx(const uint8_t *mac_addr, const uint8_t *data, int data_len){
+    espnow_proto_rx(mac_addr, data, data_len);
+}
+
+//Deferred RX ring. Filled by the WiFi task, drained from the mgos event loop.
+//Head is only written by the producer and tail by the consumer, so no lock is needed.
+struct espnow_rx_slot {
+    uint8_t mac[6];
+    uint8_t len;
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+};
+
+static struct espnow_rx_slot espnow_rx_ring[MGOS_ESPNOW_RX_RING_SLOTS];
+static uint32_t espnow_rx_head, espnow_rx_tail;
+static bool espnow_rx_drain_pending;
+static uint32_t espnow_rx_high_water, espnow_rx_dropped, espnow_rx_deferred;
+
+static void espnow_rx_drain(void *arg){
+    int batch = mgos_sys_config_get_espnow_rx_batch();
+    if(batch <= 0) batch = MGOS_ESPNOW_RX_RING_SLOTS;
+    //Clear the pending flag before looking at head, frames queued after this point will post a new drain.
+    __atomic_store_n(&espnow_rx_drain_pending, false, __ATOMIC_SEQ_CST);
+    uint32_t tail = espnow_rx_tail;
+    uint32_t head = __atomic_load_n(&espnow_rx_head, __ATOMIC_ACQUIRE);
+    while(tail != head && batch-- > 0){
+        struct espnow_rx_slot *slot = &espnow_rx_ring[tail & (MGOS_ESPNOW_RX_RING_SLOTS - 1)];
+        espnow_dispatch_rx(slot->mac, slot->data, slot->len);
+        tail++;
+        __atomic_store_n(&espnow_rx_tail, tail, __ATOMIC_RELEASE);
+    }
+    espnow_reclaim();
+    //Batch exhausted with frames left, yield to other events and continue later
+    if(tail != __atomic_load_n(&espnow_rx_head, __ATOMIC_ACQUIRE) &&
+       !__atomic_exchange_n(&espnow_rx_drain_pending, true, __ATOMIC_SEQ_CST)){
+        if(!mgos_invoke_cb(espnow_rx_drain, NULL, false)){
+            __atomic_store_n(&espnow_rx_drain_pending, false, __ATOMIC_SEQ_CST);
+        }
+    }
+    (void)arg;
+}
+
+static void espnow_rx_defer(const uint8_t *mac_addr, const uint8_t *data, int data_len){
+    uint32_t head = espnow_rx_head;
+    uint32_t used = head - __atomic_load_n(&espnow_rx_tail, __ATOMIC_ACQUIRE);
+    if(used >= MGOS_ESPNOW_RX_RING_SLOTS || data_len < 0 || data_len > MGOS_ESPNOW_MAX_LEN){
+        espnow_rx_dropped++;
+        return;
+    }
+    struct espnow_rx_slot *slot = &espnow_rx_ring[head & (MGOS_ESPNOW_RX_RING_SLOTS - 1)];
+    memcpy(slot->mac, mac_addr, 6);
+    slot->len = (uint8_t)data_len;
+    memcpy(slot->data, data, data_len);
+    __atomic_store_n(&espnow_rx_head, head + 1, __ATOMIC_RELEASE);
+    espnow_rx_deferred++;
+    if(used + 1 > espnow_rx_high_water) espnow_rx_high_water = used + 1;
+    if(!__atomic_exchange_n(&espnow_rx_drain_pending, true, __ATOMIC_SEQ_CST)){
+        if(!mgos_invoke_cb(espnow_rx_drain, NULL, false)){
+            //Event queue full, next received frame will try again
+            __atomic_store_n(&espnow_rx_drain_pending, false, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+static void espnow_global_rx_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len){
+    espnow_capture(ESPNOW_CAPTURE_RX, mac_addr, data, data_len, ESPNOW_CAPTURE_OK);
+    //The peer found stays valid until the end, even if the event loop removes it meanwhile
+    espnow_dispatch_begin();
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac_addr);
+    espnow_stats.rx_frames++;
+    espnow_stats.rx_bytes += data_len;
+    if(peer != NULL){
+        peer->stats.rx_frames++;
+        peer->stats.rx_bytes += data_len;
+    }
+    //Library frames are always handled from the event loop, they share state with timers and the TX engine.
+    //While any are still queued, plain frames queue behind them so a peer's frames stay in order.
+    if(mgos_sys_config_get_espnow_rx_defer() || espnow_is_proto(data, data_len) ||
+       __atomic_load_n(&espnow_rx_head, __ATOMIC_RELAXED) != __atomic_load_n(&espnow_rx_tail, __ATOMIC_ACQUIRE)){
+        espnow_rx_defer(mac_addr, data, data_len);
+    } else {
+        espnow_dispatch_rx(mac_addr, data, data_len);
+    }
+    espnow_dispatch_end();
+}
+
+void mgos_espnow_get_rx_stats(struct mgos_espnow_rx_stats *stats){
+    uint32_t head = __atomic_load_n(&espnow_rx_head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&espnow_rx_tail, __ATOMIC_ACQUIRE);
+    stats->ring_slots = MGOS_ESPNOW_RX_RING_SLOTS;
+    stats->ring_used = (int)(head - tail);
+    stats->ring_high_water = (int)espnow_rx_high_water;
+    stats->dropped = espnow_rx_dropped;
+    stats->deferred = espnow_rx_deferred;
+}
+
+//TX engine. Frames wait in a bounded queue of static slots and at most espnow.tx_window of them
+//are handed to the driver at once. The WiFi task only records completions, the queue itself is
+//owned by the mgos event loop.
+//Each priority class has its own FIFO. HIGH is served first, NORMAL and BULK share the airtime left
+//with a deficit round robin, and frames to a peer over its rate limit wait without blocking the others.
+struct espnow_tx_frame {
+    uint8_t mac[6];
+    uint8_t off;
+    uint8_t len;
+    uint8_t prio;
+    bool rate_held;
+    //Channel and interface, frames in the same group go out without switching the radio
+    int group;
+    bool grouped;
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+    //Handed to the application to be filled in place
+    bool reserved;
+    int retries;
+    int64_t queued_at;
+    //Sent to every peer in the driver table with one call, completes once per peer
+    bool fanout;
+    int fanout_left;
+    mgos_espnow_handle_t handle;
+    espnow_msg_cb_t cb;
+    void *ud;
+    STAILQ_ENTRY(espnow_tx_frame) next;
+};
+STAILQ_HEAD(espnow_tx_queue, espnow_tx_frame);
+
+static struct espnow_tx_frame espnow_tx_frames[MGOS_ESPNOW_TX_QUEUE_LEN];
+static struct espnow_tx_queue espnow_tx_free, espnow_tx_pending[MGOS_ESPNOW_PRIO_CLASSES], espnow_tx_inflight;
+static int espnow_tx_depth, espnow_tx_high_water, espnow_tx_num_inflight, espnow_tx_num_reserved;
+static uint32_t espnow_tx_sent, espnow_tx_failed, espnow_tx_retries, espnow_tx_queue_full;
+static mgos_espnow_handle_t espnow_tx_last_handle;
+static mgos_timer_id espnow_tx_retry_timer = MGOS_INVALID_TIMER_ID;
+static bool espnow_tx_ready;
+
+//Airtime of a frame counted in payload bytes, the fixed part stands for preamble, headers and the ACK
+#define ESPNOW_TX_AIRTIME_OVERHEAD 50
+static mgos_espnow_prio_t espnow_tx_cur_prio = ESPNOW_PRIO_NORMAL;
+static int espnow_tx_deficit[MGOS_ESPNOW_PRIO_CLASSES];
+static int espnow_tx_drr_class = ESPNOW_PRIO_NORMAL;
+static bool espnow_tx_drr_visited;
+static struct mgos_espnow_prio_stats espnow_tx_prio_stats[MGOS_ESPNOW_PRIO_CLASSES];
+static uint32_t espnow_tx_rate_limited, espnow_tx_paced;
+//Group of the last frame handed to the driver, -1 for any, and since when the radio is on it
+static int espnow_tx_cur_group = -1;
+static int64_t espnow_tx_group_since;
+static uint32_t espnow_tx_channel_switches, espnow_tx_switches_avoided;
+static mgos_timer_id espnow_tx_rate_timer = MGOS_INVALID_TIMER_ID;
+
+//TX completions reported by the WiFi task, same single producer ring scheme as RX
+struct espnow_tx_done {
+    uint8_t mac[6];
+    bool success;
+};
+
+//A frame to all peers reports up to ESP_NOW_MAX_TOTAL_PEER_NUM completions
+#define ESPNOW_TX_DONE_SLOTS (MGOS_ESPNOW_TX_QUEUE_LEN + ESP_NOW_MAX_TOTAL_PEER_NUM)
+static struct espnow_tx_done espnow_tx_done_ring[ESPNOW_TX_DONE_SLOTS];
+static uint32_t espnow_tx_done_head, espnow_tx_done_tail;
+static bool espnow_tx_done_pending;
+
+static void espnow_tx_kick();
+static void espnow_submit_kick();
+
+static void espnow_tx_retry_timer_cb(void *arg){
+    espnow_tx_retry_timer = MGOS_INVALID_TIMER_ID;
+    espnow_tx_kick();
+    (void)arg;
+}
+
+static void espnow_tx_finish(struct espnow_tx_frame *frame, bool success){
+    if(success) espnow_tx_sent++;
+    else espnow_tx_failed++;
+    if(!frame->fanout) espnow_count_tx(frame->mac, frame->len, success, frame->queued_at);
+    //A NULL MAC tells the owner of a frame to all peers that none of the pending completions will come
+    if(frame->cb != NULL) frame->cb(frame->handle, frame->fanout ? NULL : frame->mac, success, frame->ud);
+    STAILQ_INSERT_TAIL(&espnow_tx_free, frame, next);
+}
+
+static void espnow_tx_fanout_done(struct espnow_tx_frame *frame, const uint8_t *mac, bool success){
+    if(success) espnow_tx_sent++;
+    else espnow_tx_failed++;
+    espnow_count_tx(mac, frame->len, success, frame->queued_at);
+    if(frame->cb != NULL) frame->cb(frame->handle, mac, success, frame->ud);
+    if(--frame->fanout_left > 0) return;
+    STAILQ_REMOVE(&espnow_tx_inflight, frame, espnow_tx_frame, next);
+    espnow_tx_num_inflight--;
+    STAILQ_INSERT_TAIL(&espnow_tx_free, frame, next);
+}
+
+static void espnow_tx_rate_timer_cb(void *arg){
+    espnow_tx_rate_timer = MGOS_INVALID_TIMER_ID;
+    espnow_tx_kick();
+    (void)arg;
+}
+
+static int espnow_tx_cost(const struct espnow_tx_frame *frame){
+    return frame->len + ESPNOW_TX_AIRTIME_OVERHEAD;
+}
+
+//Credit a class gets per round, at least one frame of any size
+static int espnow_tx_quantum(int cls){
+    int weight = cls == ESPNOW_PRIO_BULK ? mgos_sys_config_get_espnow_tx_weight_bulk() : mgos_sys_config_get_espnow_tx_weight_normal();
+    if(weight < 1) weight = 1;
+    return weight * (MGOS_ESPNOW_MAX_LEN + ESPNOW_TX_AIRTIME_OVERHEAD);
+}
+
+//Time between frames to a peer, from espnow.tx_peer_rate or espnow.link_pace_ms when its link is degraded.
+//0 for no limit.
+static int64_t espnow_tx_peer_interval(const struct mgos_espnow_peer *peer){
+    if(peer == NULL) return 0;
+    int rate = mgos_sys_config_get_espnow_tx_peer_rate();
+    int64_t interval = rate > 0 ? 1000000 / rate : 0;
+    if(peer->link.degraded){
+        int64_t pace = (int64_t)mgos_sys_config_get_espnow_link_pace_ms() * 1000;
+        if(pace > interval) interval = pace;
+    }
+    return interval;
+}
+
+//Token bucket of espnow.tx_peer_burst frames refilled once per interval, kept as the time it will be
+//full again. Degraded peers get no burst. Returns how long until the peer can send, 0 if it can now.
+static int64_t espnow_tx_rate_wait(const struct mgos_espnow_peer *peer, int64_t now){
+    int64_t interval = espnow_tx_peer_interval(peer);
+    if(interval <= 0) return 0;
+    int burst = peer->link.degraded ? 1 : mgos_sys_config_get_espnow_tx_peer_burst();
+    if(burst < 1) burst = 1;
+    int64_t wait = peer->tx_tat - (burst - 1) * interval - now;
+    return wait > 0 ? wait : 0;
+}
+
+static void espnow_tx_rate_take(struct mgos_espnow_peer *peer, int64_t now){
+    int64_t interval = espnow_tx_peer_interval(peer);
+    if(interval <= 0) return;
+    peer->tx_tat = (peer->tx_tat > now ? peer->tx_tat : now) + interval;
+}
+
+//-1 for frames that go out on whatever channel the radio is on
+static int espnow_tx_group(const uint8_t *mac){
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    if(mac == NULL) return -1;
+    if(memcmp(mac, bcast, 6) == 0) return mgos_sys_config_get_wifi_ap_channel() * 2 + 1;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL || peer->channel == 0) return -1;
+    return peer->channel * 2 + (peer->softap ? 1 : 0);
+}
+
+static bool espnow_tx_group_match(int group){
+    return group == -1 || espnow_tx_cur_group == -1 || group == espnow_tx_cur_group;
+}
+
+//Next frame of a class that can go now. Frames of a peer over its limit are skipped, the shortest wait is kept in wait.
+//Frames on the channel the radio is on go ahead of older ones for up to espnow.tx_group_max_wait_ms, then the radio
+//moves to the channel of the oldest frame. A frame waits at most that long for each other channel in use.
+static struct espnow_tx_frame *espnow_tx_class_first(int cls, int64_t now, int64_t *wait){
+    struct espnow_tx_frame *frame, *oldest = NULL;
+    bool held = false;
+    STAILQ_FOREACH(frame, &espnow_tx_pending[cls], next){
+        if(cls == ESPNOW_PRIO_HIGH) return frame;
+        //Frames to all peers stay behind every frame queued before them
+        if(frame->fanout){
+            if(oldest == NULL && !held) oldest = frame;
+            break;
+        }
+        struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(frame->mac);
+        int64_t w = espnow_tx_rate_wait(peer, now);
+        if(w > 0){
+            if(!frame->rate_held){
+                frame->rate_held = true;
+                if(peer->link.degraded) espnow_tx_paced++;
+                else espnow_tx_rate_limited++;
+            }
+            if(*wait == 0 || w < *wait) *wait = w;
+            held = true;
+            continue;
+        }
+        if(oldest == NULL) oldest = frame;
+        if(espnow_tx_group_match(frame->group)){
+            if(frame == oldest) return frame;
+            int max_wait = mgos_sys_config_get_espnow_tx_group_max_wait_ms();
+            if(max_wait <= 0 || now - espnow_tx_group_since >= (int64_t)max_wait * 1000) return oldest;
+            frame->grouped = true;
+            return frame;
+        }
+    }
+    return oldest;
+}
+
+//Strict priority for HIGH, deficit round robin on airtime between the other classes
+static struct espnow_tx_frame *espnow_tx_pick(int64_t now, int64_t *wait){
+    *wait = 0;
+    struct espnow_tx_frame *frame = espnow_tx_class_first(ESPNOW_PRIO_HIGH, now, wait);
+    if(frame != NULL) return frame;
+    for(int n = 0; n < 2 * (MGOS_ESPNOW_PRIO_CLASSES - 1); n++){
+        int cls = espnow_tx_drr_class;
+        frame = espnow_tx_class_first(cls, now, wait);
+        if(frame != NULL){
+            if(!espnow_tx_drr_visited){
+                espnow_tx_deficit[cls] += espnow_tx_quantum(cls);
+                espnow_tx_drr_visited = true;
+            }
+            if(espnow_tx_cost(frame) <= espnow_tx_deficit[cls]) return frame;
+        } else {
+            //Idle classes do not bank credit
+            espnow_tx_deficit[cls] = 0;
+        }
+        espnow_tx_drr_class = cls + 1 < MGOS_ESPNOW_PRIO_CLASSES ? cls + 1 : ESPNOW_PRIO_NORMAL;
+        espnow_tx_drr_visited = false;
+    }
+    return NULL;
+}
+
+static void espnow_tx_dequeue(struct espnow_tx_frame *frame, int64_t now){
+    STAILQ_REMOVE(&espnow_tx_pending[frame->prio], frame, espnow_tx_frame, next);
+    espnow_tx_depth--;
+    struct mgos_espnow_peer *peer = frame->fanout ? NULL : mgos_espnow_get_peer_by_mac(frame->mac);
+    if(peer != NULL && peer->tx_queued > 0) peer->tx_queued--;
+    if(frame->grouped) espnow_tx_switches_avoided++;
+    if(frame->group != -1 && frame->group != espnow_tx_cur_group){
+        if(espnow_tx_cur_group != -1) espnow_tx_channel_switches++;
+        espnow_tx_cur_group = frame->group;
+        espnow_tx_group_since = now;
+    }
+    struct mgos_espnow_prio_stats *ps = &espnow_tx_prio_stats[frame->prio];
+    ps->queue_depth--;
+    uint32_t us = (uint32_t)(now - frame->queued_at);
+    int bucket = us > 0 ? 31 - __builtin_clz(us) : 0;
+    if(bucket >= MGOS_ESPNOW_LAT_BUCKETS) bucket = MGOS_ESPNOW_LAT_BUCKETS - 1;
+    ps->wait[bucket]++;
+    if(us > ps->wait_max_us) ps->wait_max_us = us;
+    if(frame->prio == ESPNOW_PRIO_HIGH) return;
+    espnow_tx_deficit[frame->prio] -= espnow_tx_cost(frame);
+    espnow_tx_rate_take(peer, now);
+}
+
+//Hand pending frames to the driver until the window is full
+static void espnow_tx_kick(){
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    int window = mgos_sys_config_get_espnow_tx_window();
+    if(window <= 0) window = 1;
+    struct espnow_tx_frame *frame;
+    while(espnow_tx_num_inflight < window){
+        int64_t now = mgos_uptime_micros(), wait;
+        if((frame = espnow_tx_pick(now, &wait)) == NULL){
+            //Whatever is left waits for a peer rate limit, completions may not come before it is lifted
+            if(wait > 0 && espnow_tx_rate_timer == MGOS_INVALID_TIMER_ID){
+                espnow_tx_rate_timer = mgos_set_timer((int)((wait + 999) / 1000), 0, espnow_tx_rate_timer_cb, NULL);
+            }
+            return;
+        }
+        //Frames to all peers are in flight alone, every completion until they are done belongs to them
+        if(frame->fanout && espnow_tx_num_inflight > 0) return;
+        struct espnow_tx_frame *first = STAILQ_FIRST(&espnow_tx_inflight);
+        if(first != NULL && first->fanout) return;
+        esp_err_t err = frame->fanout ? ESP_OK : espnow_peer_use(frame->mac);
+        if(err == ESP_ERR_ESPNOW_FULL && espnow_tx_num_inflight > 0){
+            //Every resident peer has frames in flight, one can be evicted once they complete
+            return;
+        }
+        if(err == ESP_OK){
+            err = esp_now_send(frame->fanout ? NULL : frame->mac, frame->data + frame->off, frame->len);
+            espnow_capture(ESPNOW_CAPTURE_TX, frame->fanout ? bcast : frame->mac, frame->data + frame->off, frame->len,
+                err == ESP_OK ? ESPNOW_CAPTURE_OK : ESPNOW_CAPTURE_FAILED);
+        }
+        if(err == ESP_ERR_ESPNOW_NO_MEM && frame->retries < mgos_sys_config_get_espnow_tx_max_retries()){
+            //Driver queue full. Retry on the next completion, or after a while if none is expected.
+            frame->retries++;
+            espnow_tx_retries++;
+            if(espnow_tx_num_inflight == 0 && espnow_tx_retry_timer == MGOS_INVALID_TIMER_ID){
+                espnow_tx_retry_timer = mgos_set_timer(mgos_sys_config_get_espnow_tx_retry_ms(), 0, espnow_tx_retry_timer_cb, NULL);
+            }
+            return;
+        }
+        espnow_tx_dequeue(frame, now);
+        if(err != ESP_OK){
+            LOG(LL_ERROR, ("ESPNOW ERROR %d: %s", err, esp_err_to_name(err)));
+            espnow_tx_finish(frame, false);
+            continue;
+        }
+        if(frame->fanout){
+            esp_now_peer_num_t num;
+            if(esp_now_get_peer_num(&num) != ESP_OK || num.total_num <= 0){
+                espnow_tx_finish(frame, false);
+                continue;
+            }
+            frame->fanout_left = num.total_num;
+        }
+        STAILQ_INSERT_TAIL(&espnow_tx_inflight, frame, next);
+        espnow_tx_num_inflight++;
+    }
+}
+
+static void espnow_tx_done_drain(void *arg){
+    __atomic_store_n(&espnow_tx_done_pending, false, __ATOMIC_SEQ_CST);
+    uint32_t tail = espnow_tx_done_tail;
+    uint32_t head = __atomic_load_n(&espnow_tx_done_head, __ATOMIC_ACQUIRE);
+    while(tail != head){
+        struct espnow_tx_done *done = &espnow_tx_done_ring[tail % ESPNOW_TX_DONE_SLOTS];
+        //The driver completes frames in order, match the oldest one in flight for this MAC
+        struct espnow_tx_frame *frame = STAILQ_FIRST(&espnow_tx_inflight);
+        if(frame != NULL && frame->fanout){
+            espnow_tx_fanout_done(frame, done->mac, done->success);
+        } else {
+            STAILQ_FOREACH(frame, &espnow_tx_inflight, next){
+                if(memcmp(frame->mac, done->mac, 6) == 0) break;
+            }
+        }
+        if(frame != NULL && !frame->fanout){
+            STAILQ_REMOVE(&espnow_tx_inflight, frame, espnow_tx_frame, next);
+            espnow_tx_num_inflight--;
+            espnow_tx_finish(frame, done->success);
+        }
+        tail++;
+        __atomic_store_n(&espnow_tx_done_tail, tail, __ATOMIC_RELEASE);
     }
-    return NULL;
+    espnow_tx_kick();
+    espnow_submit_kick();
+    (void)arg;
 }
 
-struct mgos_espnow_peer *mgos_espnow_get_peer_by_name(const char *name){
-    struct mgos_espnow_peer *peer;
-    SLIST_FOREACH(peer, &peer_list, next){
-        if(strcmp(name, peer->name) == 0){
-            return peer;
+//Called from the WiFi task
+static void espnow_tx_done_push(const uint8_t *mac_addr, bool success){
+    uint32_t head = espnow_tx_done_head;
+    if(head - __atomic_load_n(&espnow_tx_done_tail, __ATOMIC_ACQUIRE) >= ESPNOW_TX_DONE_SLOTS){
+        //Can only happen for frames sent outside the TX engine
+        return;
+    }
+    struct espnow_tx_done *done = &espnow_tx_done_ring[head % ESPNOW_TX_DONE_SLOTS];
+    memcpy(done->mac, mac_addr, 6);
+    done->success = success;
+    __atomic_store_n(&espnow_tx_done_head, head + 1, __ATOMIC_RELEASE);
+    if(!__atomic_exchange_n(&espnow_tx_done_pending, true, __ATOMIC_SEQ_CST)){
+        if(!mgos_invoke_cb(espnow_tx_done_drain, NULL, false)){
+            __atomic_store_n(&espnow_tx_done_pending, false, __ATOMIC_SEQ_CST);
         }
     }
-    return NULL;
 }
 
-void mgos_espnow_remove_send_peer_cb(espnow_send_peer_cb_t cb, const char *name){
-    struct espnow_send_peer_cb *cb_entry;
-    SLIST_FOREACH(cb_entry, &espnow_send_peer_cb_head, next){
-        if(cb == cb_entry->cb && strcmp(name, cb_entry->peer->name) == 0){
-            SLIST_REMOVE(&espnow_send_peer_cb_head, cb_entry, espnow_send_peer_cb, next);
-            free(cb_entry);
-            return;
-        }
+static bool espnow_tx_mac_busy(const uint8_t *mac){
+    struct espnow_tx_frame *frame;
+    STAILQ_FOREACH(frame, &espnow_tx_inflight, next){
+        if(memcmp(frame->mac, mac, 6) == 0) return true;
     }
+    return false;
 }
 
-void mgos_espnow_remove_send_mac_cb(espnow_send_mac_cb_t cb, uint8_t *mac, enum mac_cb_type type){
-    struct espnow_send_mac_cb *cb_entry;
-    SLIST_FOREACH(cb_entry, &espnow_send_mac_cb_head, next){
-        if(cb == cb_entry->cb){
-            if(type == MAC){
-                if(cb_entry->type == MAC && memcmp(cb_entry->mac, mac, 6) == 0){
-                    SLIST_REMOVE(&espnow_send_mac_cb_head, cb_entry, espnow_send_mac_cb, next);
-                    free(cb_entry);
-                    return;
-                }
-            } else {
-                if(type == cb_entry->type){
-                    SLIST_REMOVE(&espnow_send_mac_cb_head, cb_entry, espnow_send_mac_cb, next);
-                    free(cb_entry);
-                    return;
-                }
-            }
-        }
-    }
+mgos_espnow_prio_t espnow_tx_set_prio(mgos_espnow_prio_t prio){
+    mgos_espnow_prio_t prev = espnow_tx_cur_prio;
+    if((unsigned)prio >= MGOS_ESPNOW_PRIO_CLASSES) prio = ESPNOW_PRIO_NORMAL;
+    espnow_tx_cur_prio = prio;
+    return prev;
 }
 
-void mgos_espnow_remove_recv_mac_cb(espnow_recv_mac_cb_t cb, uint8_t *mac, enum mac_cb_type type){
-    struct espnow_recv_mac_cb *cb_entry;
-    SLIST_FOREACH(cb_entry, &espnow_recv_mac_cb_head, next){
-        if(cb == cb_entry->cb){
-            if(type == MAC){
-                if(cb_entry->type == MAC && memcmp(cb_entry->mac, mac, 6) == 0){
-                    SLIST_REMOVE(&espnow_recv_mac_cb_head, cb_entry, espnow_recv_mac_cb, next);
-                    free(cb_entry);
-                    return;
-                }
-            } else {
-                if(type == cb_entry->type){
-                    SLIST_REMOVE(&espnow_recv_mac_cb_head, cb_entry, espnow_recv_mac_cb, next);
-                    free(cb_entry);
-                    return;
-                }
-            }
-        }
+mgos_espnow_prio_t espnow_tx_get_prio(){
+    return espnow_tx_cur_prio;
+}
+
+mgos_espnow_handle_t espnow_tx_next_handle(){
+    if(++espnow_tx_last_handle == 0) espnow_tx_last_handle = 1;
+    return espnow_tx_last_handle;
+}
+
+//Slots the class of the next frames can take
+int espnow_tx_free_slots(){
+    if(!espnow_tx_ready) return 0;
+    int slots = MGOS_ESPNOW_TX_QUEUE_LEN - espnow_tx_depth - espnow_tx_num_inflight - espnow_tx_num_reserved;
+    if(espnow_tx_cur_prio != ESPNOW_PRIO_HIGH) slots -= MGOS_ESPNOW_TX_HIGH_SLOTS;
+    if(espnow_tx_cur_prio == ESPNOW_PRIO_BULK){
+        //BULK only queues its weighted share, the rest stays open to NORMAL frames
+        int normal = espnow_tx_quantum(ESPNOW_PRIO_NORMAL), bulk = espnow_tx_quantum(ESPNOW_PRIO_BULK);
+        int share = ((MGOS_ESPNOW_TX_QUEUE_LEN - MGOS_ESPNOW_TX_HIGH_SLOTS) * bulk + normal + bulk - 1) / (normal + bulk);
+        if(share - espnow_tx_prio_stats[ESPNOW_PRIO_BULK].queue_depth < slots) slots = share - espnow_tx_prio_stats[ESPNOW_PRIO_BULK].queue_depth;
     }
+    return slots > 0 ? slots : 0;
 }
-void mgos_espnow_remove_recv_peer_cb(espnow_recv_peer_cb_t cb, const char *name){
-    struct espnow_recv_peer_cb *cb_entry;
-    SLIST_FOREACH(cb_entry, &espnow_recv_peer_cb_head, next){
-        if(cb == cb_entry->cb && strcmp(name, cb_entry->peer->name) == 0){
-            SLIST_REMOVE(&espnow_recv_peer_cb_head, cb_entry, espnow_recv_peer_cb, next);
-            free(cb_entry);
-            return;
-        }
+
+//Frames of the next class this peer can still queue, its rate limit would hold any more
+static int espnow_tx_peer_room(const struct mgos_espnow_peer *peer){
+    if(peer == NULL || espnow_tx_cur_prio == ESPNOW_PRIO_HIGH || espnow_tx_peer_interval(peer) <= 0) return MGOS_ESPNOW_TX_QUEUE_LEN;
+    int burst = mgos_sys_config_get_espnow_tx_peer_burst();
+    if(burst < 1) burst = 1;
+    return burst > peer->tx_queued ? burst - peer->tx_queued : 0;
+}
+
+static mgos_espnow_result_t espnow_tx_queue_full_drop(const uint8_t *mac){
+    espnow_tx_queue_full++;
+    espnow_stats.tx_dropped++;
+    struct mgos_espnow_peer *peer = mac != NULL ? mgos_espnow_get_peer_by_mac(mac) : NULL;
+    if(peer != NULL) peer->stats.tx_dropped++;
+    return ESPNOW_QUEUE_FULL;
+}
+
+//Queue a slot already holding len bytes at data + off. NULL MAC sends to every peer in the driver table.
+static void espnow_tx_commit(struct espnow_tx_frame *frame, const uint8_t *mac, int off, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(mac != NULL) memcpy(frame->mac, mac, 6);
+    else memset(frame->mac, 0, 6);
+    frame->off = (uint8_t)off;
+    frame->len = (uint8_t)len;
+    frame->prio = (uint8_t)espnow_tx_cur_prio;
+    frame->rate_held = false;
+    frame->group = espnow_tx_group(mac);
+    frame->grouped = false;
+    frame->retries = 0;
+    frame->fanout = mac == NULL;
+    frame->fanout_left = 0;
+    frame->queued_at = mgos_uptime_micros();
+    struct mgos_espnow_peer *peer = mac != NULL ? mgos_espnow_get_peer_by_mac(mac) : NULL;
+    if(peer != NULL) peer->tx_queued++;
+    frame->cb = cb;
+    frame->ud = ud;
+    frame->handle = espnow_tx_next_handle();
+    if(handle != NULL) *handle = frame->handle;
+    STAILQ_INSERT_TAIL(&espnow_tx_pending[frame->prio], frame, next);
+    espnow_tx_prio_stats[frame->prio].queued++;
+    espnow_tx_prio_stats[frame->prio].queue_depth++;
+    if(++espnow_tx_depth > espnow_tx_high_water) espnow_tx_high_water = espnow_tx_depth;
+    espnow_tx_kick();
+}
+
+//Copy the segments straight into a free slot
+static mgos_espnow_result_t espnow_tx_add(const uint8_t *mac, const struct mgos_espnow_seg *segs, int num_segs, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(!espnow_tx_ready) return ESPNOW_NOT_INIT;
+    int len = 0;
+    for(int i = 0; i < num_segs; i++){
+        if(segs[i].len < 0 || segs[i].len > MGOS_ESPNOW_MAX_LEN - len) return ESPNOW_PAYLOAD_LEN_ERR;
+        len += segs[i].len;
+    }
+    if(espnow_tx_free_slots() == 0 || (mac != NULL && espnow_tx_peer_room(mgos_espnow_get_peer_by_mac(mac)) == 0)){
+        return espnow_tx_queue_full_drop(mac);
+    }
+    struct espnow_tx_frame *frame = STAILQ_FIRST(&espnow_tx_free);
+    STAILQ_REMOVE_HEAD(&espnow_tx_free, next);
+    len = 0;
+    for(int i = 0; i < num_segs; i++){
+        memcpy(frame->data + len, segs[i].data, segs[i].len);
+        len += segs[i].len;
     }
+    espnow_tx_commit(frame, mac, 0, len, cb, ud, handle);
+    return ESPNOW_OK;
 }
 
-static void espnow_global_rx_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len){
-    if(mgos_sys_config_get_espnow_debug_level() != -1){
-        LOG(mgos_sys_config_get_espnow_debug_level(), 
-        ("RX - MAC %.2x:%.2x:%.2x:%.2x:%.2x:%.2x Data len %d - %.*s", 
-        mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5], 
-        data_len, data_len, data));
+mgos_espnow_result_t espnow_tx_enqueue(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct mgos_espnow_seg seg = {data, len};
+    return espnow_tx_add(mac, &seg, 1, cb, ud, handle);
+}
+
+//The callback runs once per peer with its MAC, or once with a NULL MAC if the driver rejected the frame
+mgos_espnow_result_t espnow_tx_enqueue_all(const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct mgos_espnow_seg seg = {data, len};
+    return espnow_tx_add(NULL, &seg, 1, cb, ud, handle);
+}
+
+//Slots handed to the application with mgos_espnow_frame_alloc
+static struct espnow_tx_frame *espnow_tx_reserved_slot(const uint8_t *data){
+    const uint8_t *base = (const uint8_t *)espnow_tx_frames;
+    if(data == NULL || data < base || data >= (const uint8_t *)(espnow_tx_frames + MGOS_ESPNOW_TX_QUEUE_LEN)) return NULL;
+    struct espnow_tx_frame *frame = &espnow_tx_frames[(data - base) / sizeof(struct espnow_tx_frame)];
+    if(!frame->reserved || data < frame->data || data >= frame->data + MGOS_ESPNOW_MAX_LEN) return NULL;
+    return frame;
+}
+
+uint8_t *mgos_espnow_frame_alloc(){
+    if(!espnow_tx_ready) return NULL;
+    if(espnow_tx_free_slots() == 0){
+        espnow_tx_queue_full_drop(NULL);
+        return NULL;
     }
-    struct espnow_recv_peer_cb *p_cb;
-    struct espnow_recv_mac_cb *m_cb;
-    struct mgos_espnow_peer *recv_peer = mgos_espnow_get_peer_by_mac(mac_addr);
-    //Peer Callbacks
-    if(recv_peer != NULL){
-        SLIST_FOREACH(p_cb, &espnow_recv_peer_cb_head, next){
-            if(p_cb->peer == recv_peer){
-                p_cb->cb(recv_peer, data, data_len, p_cb->ud);
-            }
-        }
+    struct espnow_tx_frame *frame = STAILQ_FIRST(&espnow_tx_free);
+    STAILQ_REMOVE_HEAD(&espnow_tx_free, next);
+    frame->reserved = true;
+    espnow_tx_num_reserved++;
+    return frame->data;
+}
+
+void mgos_espnow_frame_free(uint8_t *data){
+    struct espnow_tx_frame *frame = espnow_tx_reserved_slot(data);
+    if(frame == NULL) return;
+    frame->reserved = false;
+    espnow_tx_num_reserved--;
+    STAILQ_INSERT_TAIL(&espnow_tx_free, frame, next);
+}
+
+static void espnow_tx_init(){
+    STAILQ_INIT(&espnow_tx_free);
+    for(int i = 0; i < MGOS_ESPNOW_PRIO_CLASSES; i++){
+        STAILQ_INIT(&espnow_tx_pending[i]);
     }
-    //Mac Callbacks
-    SLIST_FOREACH(m_cb, &espnow_recv_mac_cb_head, next){
-        switch(m_cb->type){
-            case ALL:
-            m_cb->cb(mac_addr, data, data_len, m_cb->ud);
-            break;
-            case ANY_PEER:
-            if(recv_peer != NULL){
-                m_cb->cb(mac_addr, data, data_len, m_cb->ud);
-            }
-            break;
-            case BCAST:
-            if(recv_peer == NULL){
-                m_cb->cb(mac_addr, data, data_len, m_cb->ud);
-            }
-            break;
-            case MAC:
-            if(memcmp(m_cb->mac, mac_addr, 6) == 0){
-                m_cb->cb(mac_addr, data, data_len, m_cb->ud);
-            }
-            break;
-        }
+    STAILQ_INIT(&espnow_tx_inflight);
+    for(int i = 0; i < MGOS_ESPNOW_TX_QUEUE_LEN; i++){
+        STAILQ_INSERT_TAIL(&espnow_tx_free, &espnow_tx_frames[i], next);
     }
+    espnow_tx_ready = true;
+}
+
+void mgos_espnow_get_tx_stats(struct mgos_espnow_tx_stats *stats){
+    stats->queue_slots = MGOS_ESPNOW_TX_QUEUE_LEN;
+    stats->queue_depth = espnow_tx_depth;
+    stats->queue_high_water = espnow_tx_high_water;
+    stats->in_flight = espnow_tx_num_inflight;
+    stats->sent = espnow_tx_sent;
+    stats->failed = espnow_tx_failed;
+    stats->retries = espnow_tx_retries;
+    stats->queue_full = espnow_tx_queue_full;
+    stats->rate_limited = espnow_tx_rate_limited;
+    stats->paced = espnow_tx_paced;
+    stats->channel_switches = espnow_tx_channel_switches;
+    stats->switches_avoided = espnow_tx_switches_avoided;
+    stats->submitted = __atomic_load_n(&espnow_submit_count, __ATOMIC_RELAXED);
+    stats->submit_full = __atomic_load_n(&espnow_submit_full, __ATOMIC_RELAXED);
+    stats->submit_failed = espnow_submit_failed;
+}
+
+bool mgos_espnow_get_prio_stats(mgos_espnow_prio_t prio, struct mgos_espnow_prio_stats *stats){
+    if((unsigned)prio >= MGOS_ESPNOW_PRIO_CLASSES) return false;
+    *stats = espnow_tx_prio_stats[prio];
+    return true;
 }
 
 void espnow_global_tx_cb(const uint8_t *mac_addr, esp_now_send_status_t status){
     uint8_t bcast_addr[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-    if(mgos_sys_config_get_espnow_debug_level() != -1){
-        LOG(mgos_sys_config_get_espnow_debug_level(), 
-        ("TX - MAC %.2x:%.2x:%.2x:%.2x:%.2x:%.2x Result: %s", 
-        mac_addr[0], mac_addr[1], mac_addr[2], mac_addr[3], mac_addr[4], mac_addr[5], 
-        status == ESP_NOW_SEND_SUCCESS ? "Success": "Failure"));
-    }
+    espnow_capture(ESPNOW_CAPTURE_TX_DONE, mac_addr, NULL, 0, status == ESP_NOW_SEND_SUCCESS ? ESPNOW_CAPTURE_OK : ESPNOW_CAPTURE_FAILED);
     struct espnow_send_peer_cb *p_cb;
     struct espnow_send_mac_cb *m_cb;
+    bool success = status == ESP_NOW_SEND_SUCCESS;
+    int64_t start = mgos_uptime_micros();
+    espnow_dispatch_begin();
     struct mgos_espnow_peer *send_peer = mgos_espnow_get_peer_by_mac(mac_addr);
+    struct espnow_send_table *t = __atomic_load_n(&espnow_send_table, __ATOMIC_ACQUIRE);
     //Peer Callbacks
     if(send_peer != NULL){
-        SLIST_FOREACH(p_cb, &espnow_send_peer_cb_head, next){
-            p_cb->cb(send_peer, status == ESP_NOW_SEND_SUCCESS, p_cb->ud);
+        struct espnow_send_peer_cb **cbs = __atomic_load_n(&send_peer->send_cbs, __ATOMIC_ACQUIRE);
+        for(int i = 0; cbs != NULL && (p_cb = cbs[i]) != NULL; i++){
+            p_cb->cb(send_peer, success, p_cb->ud);
         }
     }
     //Mac Callbacks
-    SLIST_FOREACH(m_cb, &espnow_send_mac_cb_head, next){
-        switch(m_cb->type){
-            case ALL:
-            m_cb->cb(mac_addr, status == ESP_NOW_SEND_SUCCESS, m_cb->ud);
-            break;
-            case BCAST:
-            if(memcmp(bcast_addr, mac_addr, 6) == 0){
-                m_cb->cb(mac_addr, status == ESP_NOW_SEND_SUCCESS, m_cb->ud);
+    if(t != NULL){
+        for(int i = 0; i < t->num_all; i++){
+            m_cb = t->all[i];
+            m_cb->cb(mac_addr, success, m_cb->ud);
+        }
+        if(memcmp(bcast_addr, mac_addr, 6) == 0){
+            for(int i = 0; i < t->num_bcast; i++){
+                m_cb = t->bcast[i];
+                m_cb->cb(mac_addr, success, m_cb->ud);
             }
-            break;
-            case ANY_PEER:
-            if(send_peer != NULL){
-                m_cb->cb(mac_addr, status == ESP_NOW_SEND_SUCCESS, m_cb->ud);
+        }
+        if(send_peer != NULL){
+            for(int i = 0; i < t->num_any_peer; i++){
+                m_cb = t->any_peer[i];
+                m_cb->cb(mac_addr, success, m_cb->ud);
             }
-            break;
-            case MAC:
+        }
+        uint32_t bucket = espnow_hash_bytes(mac_addr, 6) & t->mac_mask;
+        for(int i = t->mac_start[bucket]; i < t->mac_start[bucket + 1]; i++){
+            m_cb = t->mac[i];
             if(memcmp(m_cb->mac, mac_addr, 6) == 0){
-                m_cb->cb(mac_addr, status == ESP_NOW_SEND_SUCCESS, m_cb->ud);
+                m_cb->cb(mac_addr, success, m_cb->ud);
             }
-            break;
         }
     }
+    espnow_dispatch_end();
+    espnow_count_cb_time(start);
+    espnow_tx_done_push(mac_addr, success);
 }
 
-mgos_espnow_result_t mgos_espnow_register_recv_mac_cb(const uint8_t *mac, enum mac_cb_type type, espnow_recv_mac_cb_t cb, void *ud){
-    struct espnow_recv_mac_cb *cb_entry = (struct espnow_recv_mac_cb *)calloc(1, sizeof(*cb_entry));
+static mgos_espnow_result_t espnow_register_recv_mac_cb(const uint8_t *mac, enum mac_cb_type type, espnow_recv_mac_cb_t cb, espnow_recv_buf_cb_t buf_cb, void *ud){
+    struct espnow_recv_mac_cb *cb_entry = (struct espnow_recv_mac_cb *)espnow_alloc(&espnow_cb_pool);
     if(cb_entry == NULL){
-        LOG(LL_ERROR, ("Failed to allocate rx cb struct"));
+        LOG(LL_ERROR, ("No free callback slot, MGOS_ESPNOW_CB_SLOTS is %d", MGOS_ESPNOW_CB_SLOTS));
         return ESPNOW_NO_MEM;
     }
     cb_entry->type = type;
@@ -233,16 +2009,30 @@ mgos_espnow_result_t mgos_espnow_register_recv_mac_cb(const uint8_t *mac, enum m
         memcpy(cb_entry->mac, mac, 6);
     }
     cb_entry->cb = cb;
+    cb_entry->buf_cb = buf_cb;
     cb_entry->ud = ud;
     
     SLIST_INSERT_HEAD(&espnow_recv_mac_cb_head, cb_entry, next);
+    espnow_rebuild_recv_table();
+    espnow_reclaim();
     return ESPNOW_OK;
 }
 
+mgos_espnow_result_t mgos_espnow_register_recv_mac_cb(const uint8_t *mac, enum mac_cb_type type, espnow_recv_mac_cb_t cb, void *ud){
+    if(espnow_submit_needed()) return espnow_submit_mac_cb(ESPNOW_SUBMIT_RECV_MAC_CB, mac, type, (void (*)(void))cb, ud);
+    return espnow_register_recv_mac_cb(mac, type, cb, NULL, ud);
+}
+
+mgos_espnow_result_t mgos_espnow_register_recv_buf_cb(const uint8_t *mac, enum mac_cb_type type, espnow_recv_buf_cb_t cb, void *ud){
+    if(espnow_submit_needed()) return espnow_submit_mac_cb(ESPNOW_SUBMIT_RECV_BUF_CB, mac, type, (void (*)(void))cb, ud);
+    return espnow_register_recv_mac_cb(mac, type, NULL, cb, ud);
+}
+
 mgos_espnow_result_t mgos_espnow_register_send_mac_cb(const uint8_t *mac, enum mac_cb_type type, espnow_send_mac_cb_t cb, void *ud){
-    struct espnow_send_mac_cb *cb_entry = (struct espnow_send_mac_cb *)calloc(1, sizeof(*cb_entry));
+    if(espnow_submit_needed()) return espnow_submit_mac_cb(ESPNOW_SUBMIT_SEND_MAC_CB, mac, type, (void (*)(void))cb, ud);
+    struct espnow_send_mac_cb *cb_entry = (struct espnow_send_mac_cb *)espnow_alloc(&espnow_cb_pool);
     if(cb_entry == NULL){
-        LOG(LL_ERROR, ("Failed to allocate tx cb struct"));
+        LOG(LL_ERROR, ("No free callback slot, MGOS_ESPNOW_CB_SLOTS is %d", MGOS_ESPNOW_CB_SLOTS));
         return ESPNOW_NO_MEM;
     }
     cb_entry->type = type;
@@ -253,72 +2043,237 @@ mgos_espnow_result_t mgos_espnow_register_send_mac_cb(const uint8_t *mac, enum m
     cb_entry->ud = ud;
     
     SLIST_INSERT_HEAD(&espnow_send_mac_cb_head, cb_entry, next);
+    espnow_rebuild_send_table();
+    espnow_reclaim();
     return ESPNOW_OK;
 }
 
 mgos_espnow_result_t mgos_espnow_register_recv_peer_cb(const char *name, espnow_recv_peer_cb_t cb, void *ud){
-    struct espnow_recv_peer_cb *cb_entry = (struct espnow_recv_peer_cb *)calloc(1, sizeof(*cb_entry));
-    if(cb_entry == NULL){
-        LOG(LL_ERROR, ("Failed to allocate rx cb struct"));
-        return ESPNOW_NO_MEM;
-    }
+    if(espnow_submit_needed()) return espnow_submit_named(ESPNOW_SUBMIT_RECV_PEER_CB, name, (void (*)(void))cb, ud);
     struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
     if(peer == NULL){
         return ESPNOW_PEER_NOT_FOUND;
     }
+    if(espnow_cb_list_len((void **)peer->recv_cbs) >= MGOS_ESPNOW_PEER_CB_SLOTS){
+        LOG(LL_ERROR, ("%s has MGOS_ESPNOW_PEER_CB_SLOTS rx callbacks already", name));
+        return ESPNOW_NO_MEM;
+    }
+    struct espnow_recv_peer_cb *cb_entry = (struct espnow_recv_peer_cb *)espnow_alloc(&espnow_cb_pool);
+    if(cb_entry == NULL){
+        LOG(LL_ERROR, ("No free callback slot, MGOS_ESPNOW_CB_SLOTS is %d", MGOS_ESPNOW_CB_SLOTS));
+        return ESPNOW_NO_MEM;
+    }
     cb_entry->peer = peer;
     cb_entry->cb = cb;
     cb_entry->ud = ud;
     
     SLIST_INSERT_HEAD(&espnow_recv_peer_cb_head, cb_entry, next);
+    if(!espnow_rebuild_peer_recv_cbs(peer)){
+        //Never published, no dispatch can hold it
+        SLIST_REMOVE(&espnow_recv_peer_cb_head, cb_entry, espnow_recv_peer_cb, next);
+        espnow_pool_free(&espnow_cb_pool, cb_entry);
+        return ESPNOW_NO_MEM;
+    }
+    espnow_reclaim();
     return ESPNOW_OK;
 }
 
 mgos_espnow_result_t mgos_espnow_register_send_peer_cb(const char *name, espnow_send_peer_cb_t cb, void *ud){
-    struct espnow_send_peer_cb *cb_entry = (struct espnow_send_peer_cb *)calloc(1, sizeof(*cb_entry));
-    if(cb_entry == NULL){
-        LOG(LL_ERROR, ("Failed to allocate tx cb struct"));
-        return ESPNOW_NO_MEM;
-    }
+    if(espnow_submit_needed()) return espnow_submit_named(ESPNOW_SUBMIT_SEND_PEER_CB, name, (void (*)(void))cb, ud);
     struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
     if(peer == NULL){
         return ESPNOW_PEER_NOT_FOUND;
     }
+    if(espnow_cb_list_len((void **)peer->send_cbs) >= MGOS_ESPNOW_PEER_CB_SLOTS){
+        LOG(LL_ERROR, ("%s has MGOS_ESPNOW_PEER_CB_SLOTS tx callbacks already", name));
+        return ESPNOW_NO_MEM;
+    }
+    struct espnow_send_peer_cb *cb_entry = (struct espnow_send_peer_cb *)espnow_alloc(&espnow_cb_pool);
+    if(cb_entry == NULL){
+        LOG(LL_ERROR, ("No free callback slot, MGOS_ESPNOW_CB_SLOTS is %d", MGOS_ESPNOW_CB_SLOTS));
+        return ESPNOW_NO_MEM;
+    }
     cb_entry->peer = peer;
     cb_entry->cb = cb;
     cb_entry->ud = ud;
     
     SLIST_INSERT_HEAD(&espnow_send_peer_cb_head, cb_entry, next);
+    if(!espnow_rebuild_peer_send_cbs(peer)){
+        //Never published, no dispatch can hold it
+        SLIST_REMOVE(&espnow_send_peer_cb_head, cb_entry, espnow_send_peer_cb, next);
+        espnow_pool_free(&espnow_cb_pool, cb_entry);
+        return ESPNOW_NO_MEM;
+    }
+    espnow_reclaim();
     return ESPNOW_OK;
 }
 
-mgos_espnow_result_t mgos_espnow_send(const char *name, const uint8_t *data, int len){
-    struct mgos_espnow_peer *peer;
-    char *error[50];
-    SLIST_FOREACH(peer, &peer_list, next){
-        if(strcmp(name, peer->name) == 0){
-            esp_err_t error = esp_now_send(peer->mac, data, len);
-            if(error != ESP_OK){
-                LOG(LL_ERROR, ("ESPNOW ERROR %d: %s", error, esp_err_to_name(error)));
-            }
-            return ESPNOW_OK;
-        }
+//Bytes a frame to this MAC can carry once the per peer layers add their headers
+int espnow_peer_room(const uint8_t *mac){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer != NULL && espnow_rel_enabled(peer)) return MGOS_ESPNOW_MAX_LEN - ESPNOW_REL_HDR_LEN;
+    return MGOS_ESPNOW_MAX_LEN;
+}
+
+//Frames that can be accepted right now by espnow_peer_send for this MAC
+int espnow_peer_free_slots(const uint8_t *mac){
+    int slots = espnow_tx_free_slots();
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(espnow_tx_peer_room(peer) < slots) slots = espnow_tx_peer_room(peer);
+    if(peer != NULL && espnow_rel_enabled(peer) && espnow_rel_free_slots(peer) < slots){
+        slots = espnow_rel_free_slots(peer);
     }
-    return ESPNOW_PEER_NOT_FOUND;
+    return slots;
 }
 
-mgos_espnow_result_t mgos_espnow_broadcast(const uint8_t *data, int len){
-    uint8_t bcast_addr[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
-    esp_now_send(bcast_addr, data, len);
+//Send a frame through the per peer layers (reliable channel) and the TX engine
+mgos_espnow_result_t espnow_peer_send(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    uint8_t packed[MGOS_ESPNOW_MAX_LEN];
+    int packed_len = espnow_lz_pack(mac, data, len, packed);
+    if(packed_len > 0){
+        data = packed;
+        len = packed_len;
+    }
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer != NULL && espnow_rel_enabled(peer)) return espnow_rel_send(peer, data, len, cb, ud, handle);
+    return espnow_tx_enqueue(mac, data, len, cb, ud, handle);
+}
+
+//User payloads starting with the magic byte, or too long for the peer layers, go out as fragments
+mgos_espnow_result_t espnow_tx_direct(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(len > MGOS_ESPNOW_MAX_LEN) return ESPNOW_PAYLOAD_LEN_ERR;
+    if((len > 0 && data[0] == ESPNOW_PROTO_MAGIC) || len > espnow_peer_room(mac)){
+        return espnow_frag_send(mac, data, len, cb, ud, handle);
+    }
+    return espnow_peer_send(mac, data, len, cb, ud, handle);
+}
+
+mgos_espnow_result_t espnow_tx_user(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(espnow_coalesce_accepts(mac, len)) return espnow_coalesce_add(mac, data, len, cb, ud, handle);
+    espnow_coalesce_flush_mac(mac);
+    return espnow_tx_direct(mac, data, len, cb, ud, handle);
+}
+
+//User payloads that need nothing from the per peer layers are copied once, straight into a TX slot
+static bool espnow_tx_plain(const uint8_t *mac, uint8_t first, int len){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer != NULL && espnow_rel_enabled(peer)) return false;
+    if(len > 0 && first == ESPNOW_PROTO_MAGIC) return false;
+    if(len >= mgos_sys_config_get_espnow_compress_min() && espnow_lz_wanted(mac)) return false;
+    return !espnow_coalesce_accepts(mac, len);
+}
+
+mgos_espnow_result_t mgos_espnow_sendv(const char *name, const struct mgos_espnow_seg *segs, int num_segs, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    int len = 0;
+    uint8_t first = 0;
+    for(int i = 0; i < num_segs; i++){
+        if(segs[i].len < 0 || segs[i].len > MGOS_ESPNOW_MAX_LEN - len) return ESPNOW_PAYLOAD_LEN_ERR;
+        if(len == 0 && segs[i].len > 0) first = ((const uint8_t *)segs[i].data)[0];
+        len += segs[i].len;
+    }
+    if(num_segs == 1) return espnow_tx_user(peer->mac, (const uint8_t *)segs[0].data, len, cb, ud, handle);
+    if(espnow_tx_plain(peer->mac, first, len)){
+        espnow_coalesce_flush_mac(peer->mac);
+        return espnow_tx_add(peer->mac, segs, num_segs, cb, ud, handle);
+    }
+    uint8_t buf[MGOS_ESPNOW_MAX_LEN];
+    len = 0;
+    for(int i = 0; i < num_segs; i++){
+        memcpy(buf + len, segs[i].data, segs[i].len);
+        len += segs[i].len;
+    }
+    return espnow_tx_user(peer->mac, buf, len, cb, ud, handle);
+}
+
+mgos_espnow_result_t mgos_espnow_frame_send(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct espnow_tx_frame *frame = espnow_tx_reserved_slot(data);
+    if(frame == NULL) return ESPNOW_SEND_FAILED;
+    int off = data - frame->data;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(len < 0 || len > MGOS_ESPNOW_MAX_LEN - off || peer == NULL){
+        mgos_espnow_frame_free(frame->data);
+        return peer == NULL ? ESPNOW_PEER_NOT_FOUND : ESPNOW_PAYLOAD_LEN_ERR;
+    }
+    if(!espnow_tx_plain(peer->mac, len > 0 ? data[0] : 0, len)){
+        //The per peer layers build their own frame
+        uint8_t buf[MGOS_ESPNOW_MAX_LEN];
+        memcpy(buf, data, len);
+        mgos_espnow_frame_free(frame->data);
+        return espnow_tx_user(peer->mac, buf, len, cb, ud, handle);
+    }
+    espnow_coalesce_flush_mac(peer->mac);
+    frame->reserved = false;
+    espnow_tx_num_reserved--;
+    espnow_tx_commit(frame, peer->mac, off, len, cb, ud, handle);
     return ESPNOW_OK;
 }
 
-static void mgos_espnow_dump_peers_json(){
-    LOG(LL_ERROR, ("Dumping current peer list to file"));
-    FILE *out_json = fopen(mgos_sys_config_get_espnow_peers_filename(), "w");
+mgos_espnow_result_t mgos_espnow_send_msg(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(espnow_submit_needed()) return mgos_espnow_send_msg_prio(name, data, len, ESPNOW_PRIO_NORMAL, cb, ud, handle);
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    return espnow_tx_user(peer->mac, data, len, cb, ud, handle);
+}
+
+mgos_espnow_result_t mgos_espnow_broadcast_msg(const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(espnow_submit_needed()) return mgos_espnow_broadcast_msg_prio(data, len, ESPNOW_PRIO_NORMAL, cb, ud, handle);
+    uint8_t bcast_addr[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    return espnow_tx_user(bcast_addr, data, len, cb, ud, handle);
+}
+
+mgos_espnow_result_t mgos_espnow_send_msg_prio(const char *name, const uint8_t *data, int len, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(espnow_submit_needed()) return espnow_submit_send(ESPNOW_SUBMIT_SEND, name, data, len, prio, cb, ud, handle);
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(prio);
+    mgos_espnow_result_t res = mgos_espnow_send_msg(name, data, len, cb, ud, handle);
+    espnow_tx_set_prio(prev);
+    return res;
+}
+
+mgos_espnow_result_t mgos_espnow_broadcast_msg_prio(const uint8_t *data, int len, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(espnow_submit_needed()) return espnow_submit_send(ESPNOW_SUBMIT_BROADCAST, NULL, data, len, prio, cb, ud, handle);
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(prio);
+    mgos_espnow_result_t res = mgos_espnow_broadcast_msg(data, len, cb, ud, handle);
+    espnow_tx_set_prio(prev);
+    return res;
+}
+
+mgos_espnow_result_t mgos_espnow_send_large(const char *name, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    if(len <= MGOS_ESPNOW_MAX_LEN) return espnow_tx_user(peer->mac, data, len, cb, ud, handle);
+    espnow_coalesce_flush_mac(peer->mac);
+    return espnow_frag_send(peer->mac, data, len, cb, ud, handle);
+}
+
+mgos_espnow_result_t mgos_espnow_send(const char *name, const uint8_t *data, int len){
+    if(espnow_submit_needed()) return mgos_espnow_send_prio(name, data, len, ESPNOW_PRIO_NORMAL);
+    if(name == NULL) return mgos_espnow_send_group(NULL, data, len, NULL, NULL, NULL);
+    return mgos_espnow_send_msg(name, data, len, NULL, NULL, NULL);
+}
+
+mgos_espnow_result_t mgos_espnow_broadcast(const uint8_t *data, int len){
+    return mgos_espnow_broadcast_msg(data, len, NULL, NULL, NULL);
+}
+
+mgos_espnow_result_t mgos_espnow_send_prio(const char *name, const uint8_t *data, int len, mgos_espnow_prio_t prio){
+    if(espnow_submit_needed()) return espnow_submit_send(ESPNOW_SUBMIT_SEND, name, data, len, prio, NULL, NULL, NULL);
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(prio);
+    mgos_espnow_result_t res = mgos_espnow_send(name, data, len);
+    espnow_tx_set_prio(prev);
+    return res;
+}
+
+mgos_espnow_result_t mgos_espnow_broadcast_prio(const uint8_t *data, int len, mgos_espnow_prio_t prio){
+    return mgos_espnow_broadcast_msg_prio(data, len, prio, NULL, NULL, NULL);
+}
+
+bool mgos_espnow_export_json(const char *filename){
+    FILE *out_json = fopen(filename, "w");
     if(out_json == NULL){
-        LOG(LL_ERROR, ("Failed to open file %s for writing!", mgos_sys_config_get_espnow_peers_filename()));
-        return;
+        LOG(LL_ERROR, ("Failed to open file %s for writing!", filename));
+        return false;
     }
     struct json_out file_output = JSON_OUT_FILE(out_json);
     int total_peers = mgos_espnow_total_peers();
@@ -335,13 +2290,28 @@ static void mgos_espnow_dump_peers_json(){
     }
     json_printf(&file_output, "]");
     fclose(out_json);
+    return true;
+}
+
+//Persist a change to the peer list, appended to the binary store or the whole JSON file rewritten
+static void espnow_save_peer(const struct mgos_espnow_peer *peer, const uint8_t *removed_mac){
+    if(espnow_store_enabled()){
+        if(peer != NULL) espnow_store_add(peer);
+        else espnow_store_remove(removed_mac);
+        return;
+    }
+    LOG(LL_ERROR, ("Dumping current peer list to file"));
+    mgos_espnow_export_json(mgos_sys_config_get_espnow_peers_filename());
 }
 
 static esp_err_t mgos_espnow_internal_add_peer(struct mgos_espnow_peer *peer){
+    static const uint8_t lmk[16] = {0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04};
     struct esp_now_peer_info newpeer;
     bool modify = false;
     if(esp_now_get_peer(peer->mac, &newpeer) == ESP_OK){
         modify = true;
+    } else {
+        memset(&newpeer, 0, sizeof(newpeer));
     }
     memcpy(newpeer.peer_addr, peer->mac, 6);
     newpeer.channel = peer->channel;
@@ -351,7 +2321,7 @@ static esp_err_t mgos_espnow_internal_add_peer(struct mgos_espnow_peer *peer){
         newpeer.ifidx = ESP_IF_WIFI_STA;
     }
     if(!mgos_sys_config_get_espnow_enable_broadcast()){
-        newpeer.lmk[16] = {0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04,0x01,0x02,0x03,0x04};
+        memcpy(newpeer.lmk, lmk, sizeof(lmk));
         newpeer.encrypt = true;
     }else{
         newpeer.encrypt = false;
@@ -361,85 +2331,269 @@ static esp_err_t mgos_espnow_internal_add_peer(struct mgos_espnow_peer *peer){
 }
 
 static void mgos_espnow_internal_remove_peer(struct mgos_espnow_peer *peer){
-    esp_now_del_peer(peer->mac);
+    if(peer->resident) esp_now_del_peer(peer->mac);
+    espnow_resident_del(peer);
+}
+
+//Remove the least recently used peer from the driver table. Peers with frames in flight stay.
+static bool espnow_evict_lru(){
+    struct mgos_espnow_peer *lru = NULL;
+    for(int i = 0; i < espnow_num_resident; i++){
+        struct mgos_espnow_peer *peer = espnow_resident[i];
+        if(espnow_tx_mac_busy(peer->mac)) continue;
+        if(lru == NULL || (int32_t)(peer->last_used - lru->last_used) < 0) lru = peer;
+    }
+    if(lru == NULL) return false;
+    esp_now_del_peer(lru->mac);
+    espnow_resident_del(lru);
+    espnow_lru_evictions++;
+    return true;
+}
+
+//Put a peer in the driver table, making room if evict is set
+static esp_err_t espnow_install_peer(struct mgos_espnow_peer *peer, bool evict){
+    if(peer->resident) return ESP_OK;
+    for(;;){
+        esp_err_t err = ESP_ERR_ESPNOW_FULL;
+        if(espnow_num_resident < ESP_NOW_MAX_TOTAL_PEER_NUM) err = mgos_espnow_internal_add_peer(peer);
+        if(err == ESP_OK){
+            espnow_resident_add(peer);
+            return ESP_OK;
+        }
+        if(err != ESP_ERR_ESPNOW_FULL || !evict || !espnow_evict_lru()) return err;
+    }
+}
+
+//Called by the TX engine right before a frame goes to the driver
+esp_err_t espnow_peer_use(const uint8_t *mac){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL) return ESP_OK;
+    if(peer->resident){
+        peer->last_used = ++espnow_lru_clock;
+        espnow_lru_hits++;
+        return ESP_OK;
+    }
+    espnow_lru_misses++;
+    return espnow_install_peer(peer, true);
+}
+
+void mgos_espnow_get_peer_table_stats(struct mgos_espnow_peer_table_stats *stats){
+    stats->peers = mgos_espnow_total_peers();
+    stats->resident = espnow_num_resident;
+    stats->hits = espnow_lru_hits;
+    stats->misses = espnow_lru_misses;
+    stats->evictions = espnow_lru_evictions;
+}
+
+static int espnow_pool_bytes(const struct espnow_pool *pool){
+    return pool->count * pool->size;
+}
+
+//Both copies of the index
+static int espnow_index_heap_bytes(){
+    struct espnow_peer_index *idx = espnow_peer_index;
+    if(idx == NULL || idx->cap == ESPNOW_INDEX_CAP) return 0;
+    return 2 * (sizeof(*idx) + 2 * idx->cap * sizeof(void *));
+}
+
+void mgos_espnow_get_mem_stats(struct mgos_espnow_mem_stats *stats){
+    struct mgos_espnow_pool_stats index;
+    espnow_pool_stats(&espnow_peer_pool, &stats->peers);
+    espnow_pool_stats(&espnow_cb_pool, &stats->callbacks);
+    espnow_pool_stats(&espnow_cb_list_pool, &stats->cb_lists);
+    espnow_pool_stats(&espnow_table_pool, &stats->tables);
+    espnow_pool_stats(&espnow_index_pool, &index);
+    stats->tables.slots += index.slots;
+    stats->tables.used += index.used;
+    stats->tables.high_water += index.high_water;
+    stats->tables.exhausted += index.exhausted;
+    espnow_pool_stats(&espnow_retired_pool, &stats->retired);
+    stats->static_bytes = espnow_pool_bytes(&espnow_peer_pool) + espnow_pool_bytes(&espnow_cb_pool) + espnow_pool_bytes(&espnow_cb_list_pool)
+        + espnow_pool_bytes(&espnow_table_pool) + espnow_pool_bytes(&espnow_index_pool) + espnow_pool_bytes(&espnow_retired_pool);
+    stats->heap_bytes = espnow_peer_pool.heap_bytes + espnow_index_heap_bytes();
 }
 
 mgos_espnow_result_t mgos_espnow_add_peer(const char *name, const uint8_t *mac, bool softap, int channel, bool save){
+    if(name != NULL && strlen(name) >= MGOS_ESPNOW_PEER_NAME_LEN) return ESPNOW_NAME_TOO_LONG;
+    if(espnow_submit_needed()){
+        struct espnow_submit req;
+        if(name == NULL || mac == NULL || !espnow_submit_init(&req, ESPNOW_SUBMIT_ADD_PEER, name, mac)) return ESPNOW_PEER_NOT_FOUND;
+        req.flag = softap;
+        req.arg = channel;
+        req.save = save;
+        return espnow_submit(&req, NULL, 0);
+    }
     struct mgos_espnow_peer *peer, *mnewpeer;
-    SLIST_FOREACH(peer, &peer_list, next){
-        if(strcmp(name, peer->name) == 0 || memcmp(peer->mac, mac, 6) == 0){
-            LOG(LL_ERROR, ("Adding new peer. Removing %s, MAC: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x", peer->name, peer->mac[0], peer->mac[1], peer->mac[2], peer->mac[3], peer->mac[4], peer->mac[5]));
-            SLIST_REMOVE(&peer_list, peer, mgos_espnow_peer, next);
-            free(peer->name);
-            free(peer);
-        }
-    }
-    mnewpeer = (struct mgos_espnow_peer *)calloc(1, sizeof(*mnewpeer));
-    mnewpeer->name = strdup(name);
-    memcpy(mnewpeer->mac, mac, 6);
-    mnewpeer->softap = softap;
-    if(channel == -1) mnewpeer->channel = mgos_sys_config_get_wifi_ap_channel();
-    else mnewpeer->channel = channel;
-    esp_err_t result = mgos_espnow_internal_add_peer(mnewpeer);
-    if(result != ESP_OK){
-        free(mnewpeer->name);
-        free(mnewpeer);
-        if(result == ESP_ERR_ESPNOW_FULL){
-            return ESPNOW_MAX_PEERS;
-        } else if(result == ESP_ERR_ESPNOW_NOT_INIT) {
-            return ESPNOW_NOT_INIT;
-        } else {
-            return ESPNOW_NO_MEM;
-        }
+    struct mgos_espnow_peer *existing[2] = {mgos_espnow_get_peer_by_name(name), mgos_espnow_get_peer_by_mac(mac)};
+    if(existing[1] == existing[0]) existing[1] = NULL;
+    if(existing[0] == NULL && existing[1] == NULL && espnow_peers_full()) return ESPNOW_MAX_PEERS;
+    for(int i = 0; i < 2; i++){
+        peer = existing[i];
+        if(peer == NULL) continue;
+        LOG(LL_ERROR, ("Adding new peer. Removing %s, MAC: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x", peer->name, peer->mac[0], peer->mac[1], peer->mac[2], peer->mac[3], peer->mac[4], peer->mac[5]));
+        espnow_peer_unlink(peer);
+        if(memcmp(peer->mac, mac, 6) != 0) mgos_espnow_internal_remove_peer(peer);
+        else espnow_resident_del(peer);
+    }
+    mgos_espnow_result_t res = ESPNOW_OK;
+    mnewpeer = (struct mgos_espnow_peer *)espnow_alloc(&espnow_peer_pool);
+    if(mnewpeer == NULL){
+        res = ESPNOW_NO_MEM;
     } else {
-        SLIST_INSERT_HEAD(&peer_list, mnewpeer, next);
-        if(save) mgos_espnow_dump_peers_json();
-        return ESPNOW_OK;
+        strcpy(mnewpeer->name, name);
+        memcpy(mnewpeer->mac, mac, 6);
+        mnewpeer->softap = softap;
+        if(channel == -1) mnewpeer->channel = mgos_sys_config_get_wifi_ap_channel();
+        else mnewpeer->channel = channel;
+        //A full driver table is fine, the peer is installed when something is sent to it
+        esp_err_t result = espnow_install_peer(mnewpeer, false);
+        if(result != ESP_OK && result != ESP_ERR_ESPNOW_FULL){
+            if(result == ESP_ERR_ESPNOW_NOT_INIT) {
+                res = ESPNOW_NOT_INIT;
+            } else {
+                res = ESPNOW_NO_MEM;
+            }
+        } else if(!espnow_peer_link(mnewpeer)){
+            mgos_espnow_internal_remove_peer(mnewpeer);
+            res = ESPNOW_NO_MEM;
+        }
+        if(res != ESPNOW_OK){
+            espnow_pool_free(&espnow_peer_pool, mnewpeer);
+            mnewpeer = NULL;
+        }
     }
+    //Callbacks and the reliable channel of a replaced peer follow the new one
+    bool reliable = false;
+    for(int i = 0; i < 2; i++){
+        if(existing[i] == NULL) continue;
+        if(espnow_rel_enabled(existing[i])) reliable = true;
+        espnow_move_peer_cbs(existing[i], mnewpeer);
+        espnow_free_peer(existing[i]);
+    }
+    if(mnewpeer != NULL && reliable) mgos_espnow_set_reliable(mnewpeer->name, true);
+    espnow_reclaim();
+    if(res == ESPNOW_OK && save) espnow_save_peer(mnewpeer, NULL);
+    return res;
 }
 
 void mgos_espnow_remove_peer(const char *name, bool save){
+    if(espnow_submit_needed()){
+        struct espnow_submit req;
+        if(!espnow_submit_init(&req, ESPNOW_SUBMIT_REMOVE_PEER, name, NULL)){
+            espnow_submit_log(ESPNOW_PEER_NOT_FOUND);
+            return;
+        }
+        req.save = save;
+        espnow_submit_log(espnow_submit(&req, NULL, 0));
+        return;
+    }
     struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
     if(peer == NULL) return;
-    SLIST_REMOVE(&peer_list, peer, mgos_espnow_peer, next);
+    espnow_peer_unlink(peer);
     mgos_espnow_internal_remove_peer(peer);
-    free(peer->name);
-    free(peer);
+    espnow_move_peer_cbs(peer, NULL);
+    if(save) espnow_save_peer(NULL, peer->mac);
+    espnow_free_peer(peer);
+    espnow_reclaim();
 }
 
-static void mgos_espnow_load_peers_file(){
+//Peers loaded at boot, before they are added to the driver and before any callback is registered.
+//Replaces peers with the same name or MAC like mgos_espnow_add_peer.
+bool espnow_peer_load(const char *name, const uint8_t *mac, bool softap, int channel){
+    espnow_peer_unload(mac);
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer != NULL) espnow_peer_unload(peer->mac);
+    if(strlen(name) >= MGOS_ESPNOW_PEER_NAME_LEN) return false;
+    peer = (struct mgos_espnow_peer *)espnow_alloc(&espnow_peer_pool);
+    if(peer == NULL) return false;
+    strcpy(peer->name, name);
+    memcpy(peer->mac, mac, 6);
+    peer->softap = softap;
+    if(channel == -1) peer->channel = mgos_sys_config_get_wifi_ap_channel();
+    else peer->channel = channel;
+    if(!espnow_peer_link(peer)){
+        espnow_pool_free(&espnow_peer_pool, peer);
+        return false;
+    }
+    return true;
+}
+
+void espnow_peer_unload(const uint8_t *mac){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL) return;
+    espnow_peer_unlink(peer);
+    espnow_free_peer(peer);
+}
+
+typedef void (*espnow_json_peer_fn)(const char *name, const uint8_t *mac, bool softap, int channel, void *arg);
+
+//Call fn for every valid entry of a JSON peer list, returns the number of entries
+static int espnow_json_each(const char *filename, espnow_json_peer_fn fn, void *arg){
     char *peers_json;
-    int peers_json_len, channel = -1;
-    struct json_token item;
-    char *name = NULL, *mac = NULL;
-    char scanned_softap = 0;
-    peers_json = json_fread(mgos_sys_config_get_espnow_peers_filename());
-    if(peers_json == NULL) return;
+    int peers_json_len, channel, count = 0;
+    struct json_token item, name_tok, mac_tok;
+    //Strings are copied out of the file buffer, nothing is allocated per entry
+    char name[MGOS_ESPNOW_PEER_NAME_LEN], mac[18];
+    uint8_t parsed_mac[6];
+    int scanned_softap;
+    peers_json = json_fread(filename);
+    if(peers_json == NULL) return 0;
     peers_json_len = strlen(peers_json);
     for(int i = 0; json_scanf_array_elem(peers_json, peers_json_len, "", i, &item) > 0; i++) {
-        name = NULL;
-        mac = NULL;
+        memset(&name_tok, 0, sizeof(name_tok));
+        memset(&mac_tok, 0, sizeof(mac_tok));
         scanned_softap = 1;
-        if(json_scanf(item.ptr, item.len, "{ name: %Q, mac: %Q }", &name, &mac) == 2){
-            struct mgos_espnow_peer *peer = (struct mgos_espnow_peer*) calloc(1, sizeof(*peer));
-            if(mgos_espnow_parse_colon_mac(mac, peer->mac)){
-                LOG(LL_ERROR, ("New Peer Name: %s  MAC: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x", name, peer->mac[0], peer->mac[1], peer->mac[2], peer->mac[3], peer->mac[4], peer->mac[5]));
-                peer->name = name;
-                json_scanf(item.ptr, item.len, "{ softap: %B }", &scanned_softap);
-                peer->softap = (bool)scanned_softap;
-                channel = -1;
-                json_scanf(item.ptr, item.len, "{ channel: %d }", &channel);
-                if(channel == -1) peer->channel = mgos_sys_config_get_wifi_ap_channel();
-                else peer->channel = channel;
-                SLIST_INSERT_HEAD(&peer_list, peer, next);
-                mgos_espnow_internal_add_peer(peer);
+        channel = -1;
+        json_scanf(item.ptr, item.len, "{ name: %T, mac: %T, softap: %B, channel: %d }", &name_tok, &mac_tok, &scanned_softap, &channel);
+        if(name_tok.type == JSON_TYPE_STRING && mac_tok.type == JSON_TYPE_STRING){
+            if(name_tok.len >= (int)sizeof(name)){
+                LOG(LL_ERROR, ("PEER#%d: NAME LONGER THAN %d", i, MGOS_ESPNOW_PEER_NAME_LEN - 1));
+                continue;
+            }
+            snprintf(name, sizeof(name), "%.*s", name_tok.len, name_tok.ptr);
+            snprintf(mac, sizeof(mac), "%.*s", mac_tok.len, mac_tok.ptr);
+            if(mgos_espnow_parse_colon_mac(mac, parsed_mac)){
+                LOG(LL_ERROR, ("New Peer Name: %s  MAC: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x", name, parsed_mac[0], parsed_mac[1], parsed_mac[2], parsed_mac[3], parsed_mac[4], parsed_mac[5]));
+                fn(name, parsed_mac, scanned_softap != 0, channel, arg);
+                count++;
             } else {
                 LOG(LL_ERROR, ("PEER#%d: %s HAS INVALID MAC %s", i, name, mac));
-                free(peer);
             }
-            free(mac);
         }
     }
+    free(peers_json);
+    return count;
+}
+
+static void espnow_json_load_cb(const char *name, const uint8_t *mac, bool softap, int channel, void *arg){
+    espnow_peer_load(name, mac, softap, channel);
+    (void)arg;
+}
+
+static void espnow_json_import_cb(const char *name, const uint8_t *mac, bool softap, int channel, void *arg){
+    mgos_espnow_add_peer(name, mac, softap, channel, false);
+    (void)arg;
+}
+
+int mgos_espnow_import_json(const char *filename, bool save){
+    int count = espnow_json_each(filename, espnow_json_import_cb, NULL);
+    if(count > 0 && save){
+        if(espnow_store_enabled()) mgos_espnow_store_compact();
+        else mgos_espnow_export_json(mgos_sys_config_get_espnow_peers_filename());
+    }
+    return count;
+}
+
+static void mgos_espnow_load_peers_file(){
+    //The JSON list is only read when there is no binary store yet, and then migrated to it
+    if(!espnow_store_enabled() || !espnow_store_load()){
+        espnow_json_each(mgos_sys_config_get_espnow_peers_filename(), espnow_json_load_cb, NULL);
+        if(espnow_store_enabled()) mgos_espnow_store_compact();
+    }
+    struct mgos_espnow_peer *peer;
+    SLIST_FOREACH(peer, &peer_list, next){
+        espnow_install_peer(peer, false);
+    }
 }
 
 bool mgos_espnow_init(){
@@ -453,7 +2607,9 @@ bool mgos_espnow_init(){
     SLIST_INIT(&espnow_recv_mac_cb_head);
     SLIST_INIT(&espnow_send_peer_cb_head);
     SLIST_INIT(&espnow_send_mac_cb_head);
+    espnow_submit_start();
     esp_now_init();
+    espnow_tx_init();
     if(mgos_sys_config_get_espnow_enable_broadcast()){
         mgos_espnow_add_broadcast_peer();
     }
@@ -462,8 +2618,13 @@ bool mgos_espnow_init(){
         esp_now_set_pmk(pmk);
     }
     mgos_espnow_load_peers_file();
+    espnow_capture_init();
+    espnow_link_init();
     esp_now_register_recv_cb(espnow_global_rx_cb);
     esp_now_register_send_cb(espnow_global_tx_cb);
+#if MGOS_HAVE_RPC_COMMON
+    espnow_rpc_init();
+#endif
     uint8_t mac[6];
     esp_wifi_get_mac(ESP_IF_WIFI_AP, mac);
     LOG(LL_ERROR, ("AP MAC Address: %.2x:%.2x:%.2x:%.2x:%.2x:%.2x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]));
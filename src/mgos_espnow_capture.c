@@ -0,0 +1,273 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Frame capture. Frames seen by the driver callbacks and handed to the driver are recorded in a RAM ring
+//as fixed size binary records, the oldest ones are overwritten. Recording takes a slot with one atomic
+//add and copies at most MGOS_ESPNOW_CAPTURE_SNAPLEN bytes, so it costs the same for every frame and can
+//run on the WiFi task. Readers check the sequence number of a record before and after copying it and skip
+//it if a writer got there meanwhile. The ring is saved as a pcap file of 802.11 vendor action frames with
+//a radiotap header, the way ESP-NOW frames look on the air, and logged from the event loop for
+//espnow.debug_level instead of printing on the WiFi task.
+
+#include <sys/time.h>
+
+#include "mgos.h"
+#include "esp_wifi.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_CAPTURE_SLOTS
+#define MGOS_ESPNOW_CAPTURE_SLOTS 64
+#endif
+
+#ifndef MGOS_ESPNOW_CAPTURE_SNAPLEN
+#define MGOS_ESPNOW_CAPTURE_SNAPLEN 32
+#endif
+
+#if (MGOS_ESPNOW_CAPTURE_SLOTS & (MGOS_ESPNOW_CAPTURE_SLOTS - 1)) != 0
+#error "MGOS_ESPNOW_CAPTURE_SLOTS must be a power of two"
+#endif
+
+#define ESPNOW_CAPTURE_LOG_MS 100
+
+struct espnow_capture_rec {
+    uint32_t seq;       //Index + 1 once written, 0 while a writer fills it
+    uint8_t dir;        //enum espnow_capture_dir
+    uint8_t status;     //ESPNOW_CAPTURE_OK or ESPNOW_CAPTURE_FAILED
+    uint8_t len;        //Frame length
+    uint8_t caplen;     //Bytes kept
+    int64_t time;       //Uptime, us
+    uint8_t mac[6];
+    uint8_t data[MGOS_ESPNOW_CAPTURE_SNAPLEN];
+};
+
+static struct espnow_capture_rec *espnow_capture_ring;
+static bool espnow_capture_on;
+static uint32_t espnow_capture_head;
+static uint32_t espnow_capture_logged;
+static mgos_timer_id espnow_capture_log_timer = MGOS_INVALID_TIMER_ID;
+
+void espnow_capture(uint8_t dir, const uint8_t *mac, const uint8_t *data, int len, uint8_t status){
+    struct espnow_capture_rec *ring = __atomic_load_n(&espnow_capture_ring, __ATOMIC_ACQUIRE);
+    if(ring == NULL || !__atomic_load_n(&espnow_capture_on, __ATOMIC_RELAXED)) return;
+    uint32_t idx = __atomic_fetch_add(&espnow_capture_head, 1, __ATOMIC_RELAXED);
+    struct espnow_capture_rec *rec = &ring[idx & (MGOS_ESPNOW_CAPTURE_SLOTS - 1)];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->dir = dir;
+    rec->status = status;
+    rec->len = len;
+    rec->caplen = len < MGOS_ESPNOW_CAPTURE_SNAPLEN ? len : MGOS_ESPNOW_CAPTURE_SNAPLEN;
+    rec->time = mgos_uptime_micros();
+    memcpy(rec->mac, mac, 6);
+    if(rec->caplen > 0) memcpy(rec->data, data, rec->caplen);
+    __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+//Copy the record for index idx, false if it was overwritten or is being written
+static bool espnow_capture_read(uint32_t idx, struct espnow_capture_rec *out){
+    const struct espnow_capture_rec *rec = &espnow_capture_ring[idx & (MGOS_ESPNOW_CAPTURE_SLOTS - 1)];
+    if(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != idx + 1) return false;
+    memcpy(out, rec, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == idx + 1;
+}
+
+static uint32_t espnow_capture_first(uint32_t head){
+    return head > MGOS_ESPNOW_CAPTURE_SLOTS ? head - MGOS_ESPNOW_CAPTURE_SLOTS : 0;
+}
+
+static void espnow_capture_log_cb(void *arg){
+    uint32_t head = __atomic_load_n(&espnow_capture_head, __ATOMIC_ACQUIRE);
+    uint32_t idx = espnow_capture_logged, first = espnow_capture_first(head);
+    int level = mgos_sys_config_get_espnow_debug_level();
+    if(idx < first){
+        LOG(level, ("%u frames not logged", (unsigned)(first - idx)));
+        idx = first;
+    }
+    static const char *dirs[] = {"RX", "TX", "TX done"};
+    struct espnow_capture_rec rec;
+    for(; idx != head; idx++){
+        if(!espnow_capture_read(idx, &rec)) continue;
+        if(rec.dir == ESPNOW_CAPTURE_TX_DONE){
+            LOG(level, ("%s - MAC %.2x:%.2x:%.2x:%.2x:%.2x:%.2x Result: %s", dirs[rec.dir],
+                rec.mac[0], rec.mac[1], rec.mac[2], rec.mac[3], rec.mac[4], rec.mac[5],
+                rec.status == ESPNOW_CAPTURE_OK ? "Success" : "Failure"));
+        } else {
+            LOG(level, ("%s - MAC %.2x:%.2x:%.2x:%.2x:%.2x:%.2x Data len %d%s - %.*s", dirs[rec.dir],
+                rec.mac[0], rec.mac[1], rec.mac[2], rec.mac[3], rec.mac[4], rec.mac[5], rec.len,
+                rec.status == ESPNOW_CAPTURE_OK ? "" : " rejected", rec.caplen, rec.data));
+        }
+    }
+    espnow_capture_logged = idx;
+    (void)arg;
+}
+
+bool mgos_espnow_capture_enable(bool enable){
+    if(enable && espnow_capture_ring == NULL){
+        struct espnow_capture_rec *ring = (struct espnow_capture_rec *)calloc(MGOS_ESPNOW_CAPTURE_SLOTS, sizeof(*ring));
+        if(ring == NULL){
+            LOG(LL_ERROR, ("Failed to allocate capture ring"));
+            return false;
+        }
+        __atomic_store_n(&espnow_capture_ring, ring, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&espnow_capture_on, enable, __ATOMIC_RELAXED);
+    return true;
+}
+
+void espnow_capture_init(){
+    if(mgos_sys_config_get_espnow_debug_level() != -1){
+        if(!mgos_espnow_capture_enable(true)) return;
+        espnow_capture_log_timer = mgos_set_timer(ESPNOW_CAPTURE_LOG_MS, MGOS_TIMER_REPEAT, espnow_capture_log_cb, NULL);
+    } else if(mgos_sys_config_get_espnow_capture()){
+        mgos_espnow_capture_enable(true);
+    }
+}
+
+//pcap file, LINKTYPE_IEEE802_11_RADIOTAP
+struct espnow_pcap_hdr {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t network;
+};
+
+struct espnow_pcap_rec_hdr {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+//Radiotap header with only the RX flags or TX flags field, TX flags bit 0 reports a failed transmission
+#define ESPNOW_RADIOTAP_LEN 10
+#define ESPNOW_RADIOTAP_RX_FLAGS (1 << 14)
+#define ESPNOW_RADIOTAP_TX_FLAGS (1 << 15)
+//802.11 header, category, OUI and random value of the action frame, vendor element header
+#define ESPNOW_WLAN_HDR_LEN 24
+#define ESPNOW_ACTION_HDR_LEN 8
+#define ESPNOW_VENDOR_IE_HDR_LEN 7
+#define ESPNOW_WLAN_ACK_LEN 10
+
+static int espnow_capture_frame(const struct espnow_capture_rec *rec, const uint8_t *self, uint8_t *out, int *orig_len){
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    static const uint8_t oui[3] = {0x18, 0xfe, 0x34};
+    uint16_t present = rec->dir == ESPNOW_CAPTURE_RX ? ESPNOW_RADIOTAP_RX_FLAGS : ESPNOW_RADIOTAP_TX_FLAGS;
+    uint8_t *p = out;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = ESPNOW_RADIOTAP_LEN;
+    *p++ = 0;
+    *p++ = present & 0xff;
+    *p++ = present >> 8;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = rec->status == ESPNOW_CAPTURE_OK ? 0 : 1;
+    *p++ = 0;
+    if(rec->dir == ESPNOW_CAPTURE_TX_DONE){
+        //The peer ACK of a frame, marked failed when it never came
+        *p++ = 0xd4;
+        *p++ = 0;
+        *p++ = 0;
+        *p++ = 0;
+        memcpy(p, self, 6);
+        p += 6;
+        *orig_len = p - out;
+        return p - out;
+    }
+    *p++ = 0xd0; //Management, action
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 0;
+    memcpy(p, rec->dir == ESPNOW_CAPTURE_RX ? self : rec->mac, 6);
+    memcpy(p + 6, rec->dir == ESPNOW_CAPTURE_RX ? rec->mac : self, 6);
+    memcpy(p + 12, bcast, 6);
+    p += 18;
+    *p++ = 0;
+    *p++ = 0;
+    *p++ = 127; //Vendor specific action
+    memcpy(p, oui, 3);
+    p += 3;
+    memset(p, 0, 4);
+    p += 4;
+    *p++ = 221; //Vendor specific element
+    *p++ = 5 + rec->len;
+    memcpy(p, oui, 3);
+    p += 3;
+    *p++ = 4; //ESP-NOW
+    *p++ = 1; //Version
+    memcpy(p, rec->data, rec->caplen);
+    p += rec->caplen;
+    *orig_len = (p - out) + rec->len - rec->caplen;
+    return p - out;
+}
+
+int mgos_espnow_capture_save(const char *filename){
+    FILE *f = fopen(filename, "wb");
+    if(f == NULL){
+        LOG(LL_ERROR, ("Failed to open %s", filename));
+        return -1;
+    }
+    uint8_t self[6] = {0};
+    esp_wifi_get_mac(mgos_sys_config_get_wifi_sta_enable() ? ESP_IF_WIFI_STA : ESP_IF_WIFI_AP, self);
+    //Records keep the uptime, shifted to the wall clock so captures of several nodes line up
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    int64_t offset = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - mgos_uptime_micros();
+    struct espnow_pcap_hdr hdr = {0xa1b2c3d4, 2, 4, 0, 0, 65535, 127};
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    uint32_t head = __atomic_load_n(&espnow_capture_head, __ATOMIC_ACQUIRE);
+    int num = 0;
+    struct espnow_capture_rec rec;
+    uint8_t frame[ESPNOW_RADIOTAP_LEN + ESPNOW_WLAN_HDR_LEN + ESPNOW_ACTION_HDR_LEN + ESPNOW_VENDOR_IE_HDR_LEN + MGOS_ESPNOW_CAPTURE_SNAPLEN];
+    if(espnow_capture_ring == NULL) head = 0;
+    for(uint32_t idx = espnow_capture_first(head); ok && idx != head; idx++){
+        if(!espnow_capture_read(idx, &rec)) continue;
+        int orig_len;
+        int len = espnow_capture_frame(&rec, self, frame, &orig_len);
+        int64_t t = rec.time + offset;
+        struct espnow_pcap_rec_hdr rh = {(uint32_t)(t / 1000000), (uint32_t)(t % 1000000), (uint32_t)len, (uint32_t)orig_len};
+        ok = fwrite(&rh, sizeof(rh), 1, f) == 1 && fwrite(frame, 1, len, f) == (size_t)len;
+        num++;
+    }
+    if(fclose(f) != 0) ok = false;
+    if(!ok){
+        LOG(LL_ERROR, ("Failed to write %s", filename));
+        return -1;
+    }
+    return num;
+}
+
+void mgos_espnow_get_capture_stats(struct mgos_espnow_capture_stats *stats){
+    uint32_t head = __atomic_load_n(&espnow_capture_head, __ATOMIC_RELAXED);
+    stats->slots = MGOS_ESPNOW_CAPTURE_SLOTS;
+    stats->snaplen = MGOS_ESPNOW_CAPTURE_SNAPLEN;
+    stats->enabled = espnow_capture_on;
+    stats->captured = head;
+    stats->overwritten = espnow_capture_first(head);
+}
@@ -0,0 +1,229 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_COALESCE_SLOTS
+#define MGOS_ESPNOW_COALESCE_SLOTS 4
+#endif
+
+//Completion callbacks tracked per batch, a batch is sent early when they run out
+#define ESPNOW_COALESCE_MAX_CBS 16
+//Flush once the remaining room can't hold a length byte and a few payload bytes
+#define ESPNOW_COALESCE_MIN_ROOM 9
+
+struct espnow_coalesce_cb {
+    mgos_espnow_handle_t handle;
+    espnow_msg_cb_t cb;
+    void *ud;
+};
+
+//Completions of the messages in a flushed batch
+struct espnow_coalesce_done {
+    int num_cbs;
+    struct espnow_coalesce_cb cbs[ESPNOW_COALESCE_MAX_CBS];
+};
+
+//Messages waiting for one destination
+struct espnow_coalesce_buf {
+    bool used;
+    uint8_t mac[6];
+    int len;
+    int num_msgs;
+    int num_cbs;
+    int64_t first_at;
+    int64_t delay_sum;
+    mgos_timer_id timer;
+    struct espnow_coalesce_cb cbs[ESPNOW_COALESCE_MAX_CBS];
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+};
+
+static struct espnow_coalesce_buf espnow_coalesce_bufs[MGOS_ESPNOW_COALESCE_SLOTS];
+//Batches waiting for the driver, more than one per buffer when frames queue up
+ESPNOW_POOL_DEFINE_GROW(espnow_coalesce_done_pool, sizeof(struct espnow_coalesce_done), MGOS_ESPNOW_COALESCE_SLOTS, 4);
+static struct mgos_espnow_coalesce_stats espnow_coalesce_stats;
+static int64_t espnow_coalesce_window_start;
+static uint32_t espnow_coalesce_window_saved;
+static uint64_t espnow_coalesce_delay_sum;
+
+static void espnow_coalesce_done_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    struct espnow_coalesce_done *done = (struct espnow_coalesce_done *)ud;
+    for(int i = 0; i < done->num_cbs; i++){
+        done->cbs[i].cb(done->cbs[i].handle, mac, success, done->cbs[i].ud);
+    }
+    espnow_pool_free(&espnow_coalesce_done_pool, done);
+    (void)handle;
+}
+
+static void espnow_coalesce_count_saved(int saved){
+    int64_t now = mgos_uptime_micros();
+    espnow_coalesce_stats.frames_saved += saved;
+    espnow_coalesce_window_saved += saved;
+    if(now - espnow_coalesce_window_start >= 1000000){
+        espnow_coalesce_stats.saved_per_sec = espnow_coalesce_window_saved * 1e6f / (float)(now - espnow_coalesce_window_start);
+        espnow_coalesce_window_saved = 0;
+        espnow_coalesce_window_start = now;
+    }
+}
+
+static void espnow_coalesce_flush(struct espnow_coalesce_buf *buf){
+    if(!buf->used) return;
+    if(buf->timer != MGOS_INVALID_TIMER_ID){
+        mgos_clear_timer(buf->timer);
+        buf->timer = MGOS_INVALID_TIMER_ID;
+    }
+    int64_t now = mgos_uptime_micros();
+    espnow_coalesce_delay_sum += (uint64_t)(now * buf->num_msgs - buf->delay_sum);
+    espnow_coalesce_stats.messages += buf->num_msgs;
+    espnow_coalesce_stats.frames++;
+    struct espnow_coalesce_done *done = NULL;
+    if(buf->num_cbs > 0){
+        done = (struct espnow_coalesce_done *)espnow_pool_alloc(&espnow_coalesce_done_pool);
+        if(done != NULL){
+            done->num_cbs = buf->num_cbs;
+            memcpy(done->cbs, buf->cbs, buf->num_cbs * sizeof(done->cbs[0]));
+        }
+    }
+    mgos_espnow_result_t res;
+    if(buf->num_msgs == 1){
+        //Nothing to share the frame with, send it as a plain message
+        res = espnow_tx_direct(buf->mac, buf->frame + ESPNOW_PROTO_HDR_LEN + 1, buf->len - ESPNOW_PROTO_HDR_LEN - 1,
+            done ? espnow_coalesce_done_cb : NULL, done, NULL);
+    } else {
+        res = espnow_peer_send(buf->mac, buf->frame, buf->len, done ? espnow_coalesce_done_cb : NULL, done, NULL);
+        if(res == ESPNOW_OK) espnow_coalesce_count_saved(buf->num_msgs - 1);
+    }
+    if(res != ESPNOW_OK){
+        espnow_pool_free(&espnow_coalesce_done_pool, done);
+        done = NULL;
+    }
+    if(done == NULL){
+        //Either the frame was not accepted or the completions could not be tracked
+        for(int i = 0; i < buf->num_cbs; i++){
+            buf->cbs[i].cb(buf->cbs[i].handle, buf->mac, res == ESPNOW_OK, buf->cbs[i].ud);
+        }
+    }
+    if(res != ESPNOW_OK){
+        LOG(LL_ERROR, ("Dropping %d coalesced messages: %d", buf->num_msgs, res));
+        espnow_coalesce_stats.dropped += buf->num_msgs;
+    }
+    buf->used = false;
+}
+
+static void espnow_coalesce_timer_cb(void *arg){
+    struct espnow_coalesce_buf *buf = (struct espnow_coalesce_buf *)arg;
+    buf->timer = MGOS_INVALID_TIMER_ID;
+    espnow_coalesce_flush(buf);
+}
+
+static struct espnow_coalesce_buf *espnow_coalesce_find(const uint8_t *mac){
+    for(int i = 0; i < MGOS_ESPNOW_COALESCE_SLOTS; i++){
+        if(espnow_coalesce_bufs[i].used && memcmp(espnow_coalesce_bufs[i].mac, mac, 6) == 0){
+            return &espnow_coalesce_bufs[i];
+        }
+    }
+    return NULL;
+}
+
+//Send out what is buffered for a MAC, so a message sent directly doesn't overtake it
+void espnow_coalesce_flush_mac(const uint8_t *mac){
+    struct espnow_coalesce_buf *buf = espnow_coalesce_find(mac);
+    if(buf != NULL) espnow_coalesce_flush(buf);
+}
+
+bool espnow_coalesce_accepts(const uint8_t *mac, int len){
+    if(!mgos_sys_config_get_espnow_coalesce()) return false;
+    //Only NORMAL messages wait for others, the flush is queued NORMAL
+    if(espnow_tx_get_prio() != ESPNOW_PRIO_NORMAL) return false;
+    return len > 0 && len <= mgos_sys_config_get_espnow_coalesce_max_msg() && len + 1 <= espnow_peer_room(mac) - ESPNOW_PROTO_HDR_LEN;
+}
+
+mgos_espnow_result_t espnow_coalesce_add(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    int room = espnow_peer_room(mac);
+    struct espnow_coalesce_buf *buf = espnow_coalesce_find(mac);
+    if(buf != NULL && (buf->len + 1 + len > room || (cb != NULL && buf->num_cbs == ESPNOW_COALESCE_MAX_CBS))){
+        espnow_coalesce_flush(buf);
+        buf = NULL;
+    }
+    if(buf == NULL){
+        struct espnow_coalesce_buf *oldest = NULL;
+        for(int i = 0; i < MGOS_ESPNOW_COALESCE_SLOTS; i++){
+            struct espnow_coalesce_buf *b = &espnow_coalesce_bufs[i];
+            if(!b->used){
+                buf = b;
+                break;
+            }
+            if(oldest == NULL || b->first_at < oldest->first_at) oldest = b;
+        }
+        if(buf == NULL){
+            espnow_coalesce_flush(oldest);
+            buf = oldest;
+        }
+        buf->used = true;
+        memcpy(buf->mac, mac, 6);
+        buf->frame[0] = ESPNOW_PROTO_MAGIC;
+        buf->frame[1] = ESPNOW_PROTO_BATCH;
+        buf->len = ESPNOW_PROTO_HDR_LEN;
+        buf->num_msgs = 0;
+        buf->num_cbs = 0;
+        buf->delay_sum = 0;
+        buf->first_at = mgos_uptime_micros();
+        buf->timer = mgos_set_timer(mgos_sys_config_get_espnow_coalesce_ms(), 0, espnow_coalesce_timer_cb, buf);
+    }
+    mgos_espnow_handle_t h = espnow_tx_next_handle();
+    if(handle != NULL) *handle = h;
+    if(cb != NULL){
+        buf->cbs[buf->num_cbs].handle = h;
+        buf->cbs[buf->num_cbs].cb = cb;
+        buf->cbs[buf->num_cbs].ud = ud;
+        buf->num_cbs++;
+    }
+    buf->frame[buf->len++] = (uint8_t)len;
+    memcpy(buf->frame + buf->len, data, len);
+    buf->len += len;
+    buf->num_msgs++;
+    buf->delay_sum += mgos_uptime_micros();
+    if(room - buf->len < ESPNOW_COALESCE_MIN_ROOM) espnow_coalesce_flush(buf);
+    return ESPNOW_OK;
+}
+
+void espnow_coalesce_rx(const uint8_t *mac, const uint8_t *data, int len){
+    int off = ESPNOW_PROTO_HDR_LEN;
+    while(off < len){
+        int msg_len = data[off++];
+        if(off + msg_len > len){
+            espnow_coalesce_stats.rx_malformed++;
+            return;
+        }
+        espnow_deliver(mac, data + off, msg_len);
+        off += msg_len;
+    }
+}
+
+void mgos_espnow_get_coalesce_stats(struct mgos_espnow_coalesce_stats *stats){
+    *stats = espnow_coalesce_stats;
+    stats->avg_delay_us = espnow_coalesce_stats.messages ? (uint32_t)(espnow_coalesce_delay_sum / espnow_coalesce_stats.messages) : 0;
+}
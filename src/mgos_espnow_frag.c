@@ -0,0 +1,306 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_FRAG_SLOTS
+#define MGOS_ESPNOW_FRAG_SLOTS 4
+#endif
+
+#define ESPNOW_FRAG_HDR_LEN 5
+
+//Completion of a fragmented message, reported once every fragment is done
+struct espnow_frag_tx {
+    int remaining;
+    bool success;
+    mgos_espnow_handle_t handle;
+    espnow_msg_cb_t cb;
+    void *ud;
+};
+
+//Reassembly of one message, at most one per source MAC. The buffer stays with the slot for the
+//next message, and can't be taken while the message in it is being delivered.
+struct espnow_frag_rx {
+    bool used;
+    bool delivering;
+    uint8_t mac[6];
+    uint8_t msg_id;
+    uint8_t count;
+    uint8_t received;
+    uint8_t seen[32];
+    int len;
+    int size;
+    uint8_t *buf;
+    int cap;
+    int64_t started;
+};
+
+ESPNOW_POOL_DEFINE_GROW(espnow_frag_tx_pool, sizeof(struct espnow_frag_tx), 4, 4);
+static struct espnow_frag_rx espnow_frag_rx_slots[MGOS_ESPNOW_FRAG_SLOTS];
+static uint8_t espnow_frag_msg_id;
+static int espnow_frag_mem_used, espnow_frag_mem_kept;
+//Compressed messages, grown to the longest one sent
+static uint8_t *espnow_frag_packed;
+static int espnow_frag_packed_cap;
+static mgos_timer_id espnow_frag_timer = MGOS_INVALID_TIMER_ID;
+static struct mgos_espnow_frag_stats espnow_frag_stats;
+
+static void espnow_frag_tx_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    struct espnow_frag_tx *tx = (struct espnow_frag_tx *)ud;
+    if(!success) tx->success = false;
+    if(--tx->remaining > 0) return;
+    if(tx->cb != NULL) tx->cb(tx->handle, mac, tx->success, tx->ud);
+    espnow_pool_free(&espnow_frag_tx_pool, tx);
+    (void)handle;
+}
+
+static mgos_espnow_result_t espnow_frag_send_type(uint8_t type, const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    int max_len = mgos_sys_config_get_espnow_frag_max_len();
+    if(max_len < MGOS_ESPNOW_MAX_LEN) max_len = MGOS_ESPNOW_MAX_LEN;
+    if(len <= 0 || len > max_len || len > 255 * MGOS_ESPNOW_FRAG_LEN) return ESPNOW_PAYLOAD_LEN_ERR;
+    int count = (len + MGOS_ESPNOW_FRAG_LEN - 1) / MGOS_ESPNOW_FRAG_LEN;
+    if(count > espnow_peer_free_slots(mac)) return ESPNOW_QUEUE_FULL;
+    struct espnow_frag_tx *tx = (struct espnow_frag_tx *)espnow_pool_alloc(&espnow_frag_tx_pool);
+    if(tx == NULL) return ESPNOW_NO_MEM;
+    tx->remaining = count;
+    tx->success = true;
+    tx->handle = espnow_tx_next_handle();
+    tx->cb = cb;
+    tx->ud = ud;
+    if(handle != NULL) *handle = tx->handle;
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+    frame[0] = ESPNOW_PROTO_MAGIC;
+    frame[1] = type;
+    frame[2] = ++espnow_frag_msg_id;
+    frame[4] = (uint8_t)count;
+    for(int i = 0; i < count; i++){
+        int chunk = len - i * MGOS_ESPNOW_FRAG_LEN;
+        if(chunk > MGOS_ESPNOW_FRAG_LEN) chunk = MGOS_ESPNOW_FRAG_LEN;
+        frame[3] = (uint8_t)i;
+        memcpy(frame + ESPNOW_FRAG_HDR_LEN, data + i * MGOS_ESPNOW_FRAG_LEN, chunk);
+        mgos_espnow_result_t res = espnow_peer_send(mac, frame, ESPNOW_FRAG_HDR_LEN + chunk, espnow_frag_tx_cb, tx, NULL);
+        if(res != ESPNOW_OK){
+            //Slots were checked above, only the fragments already queued will report
+            tx->success = false;
+            tx->remaining -= count - i;
+            if(i == 0){
+                espnow_pool_free(&espnow_frag_tx_pool, tx);
+                return res;
+            }
+            break;
+        }
+    }
+    espnow_frag_stats.tx_messages++;
+    return ESPNOW_OK;
+}
+
+//Messages to peers that decode compressed frames are compressed as a whole, often into a single frame
+mgos_espnow_result_t espnow_frag_send(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    //Payloads starting with the magic byte must come out of the frag layer, not the protocol demux
+    if(len < mgos_sys_config_get_espnow_compress_min() || espnow_is_proto(data, len) || !espnow_lz_wanted(mac)){
+        return espnow_frag_send_type(ESPNOW_PROTO_FRAG, mac, data, len, cb, ud, handle);
+    }
+    //Sending copies the frames into TX slots, the buffer is free again once it returns
+    if(espnow_frag_packed_cap < len){
+        uint8_t *packed = (uint8_t *)malloc(len);
+        if(packed == NULL) return ESPNOW_NO_MEM;
+        free(espnow_frag_packed);
+        espnow_frag_packed = packed;
+        espnow_frag_packed_cap = len;
+    }
+    uint8_t *packed = espnow_frag_packed;
+    int packed_len = espnow_lz_pack_msg(data, len, packed, len - 1);
+    if(packed_len <= 0) return espnow_frag_send_type(ESPNOW_PROTO_FRAG, mac, data, len, cb, ud, handle);
+    if(packed_len <= espnow_peer_room(mac)) return espnow_peer_send(mac, packed, packed_len, cb, ud, handle);
+    return espnow_frag_send_type(ESPNOW_PROTO_FRAG_PROTO, mac, packed, packed_len, cb, ud, handle);
+}
+
+//The reassembled message is a library frame, handed back to the protocol demux instead of the callbacks
+mgos_espnow_result_t espnow_frag_send_proto(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    return espnow_frag_send_type(ESPNOW_PROTO_FRAG_PROTO, mac, data, len, cb, ud, handle);
+}
+
+static void espnow_frag_deliver(uint8_t type, const uint8_t *mac, const uint8_t *data, int len){
+    if(type == ESPNOW_PROTO_FRAG_PROTO){
+        if(espnow_is_proto(data, len)) espnow_proto_rx(mac, data, len);
+        else espnow_frag_stats.rx_dropped++;
+        return;
+    }
+    espnow_deliver(mac, data, len);
+}
+
+static void espnow_frag_release(struct espnow_frag_rx *slot){
+    espnow_frag_mem_used -= slot->size;
+    uint8_t *buf = slot->buf;
+    int cap = slot->cap;
+    memset(slot, 0, sizeof(*slot));
+    slot->buf = buf;
+    slot->cap = cap;
+}
+
+static void espnow_frag_free_buf(struct espnow_frag_rx *slot){
+    free(slot->buf);
+    espnow_frag_mem_kept -= slot->cap;
+    slot->buf = NULL;
+    slot->cap = 0;
+}
+
+//A buffer of size bytes for the slot. Buffers of idle slots are given back when keeping them all
+//would go over espnow.frag_rx_budget.
+static bool espnow_frag_reserve(struct espnow_frag_rx *slot, int size){
+    if(slot->cap >= size) return true;
+    int budget = mgos_sys_config_get_espnow_frag_rx_budget();
+    for(int i = 0; i < MGOS_ESPNOW_FRAG_SLOTS && espnow_frag_mem_kept - slot->cap + size > budget; i++){
+        struct espnow_frag_rx *s = &espnow_frag_rx_slots[i];
+        if(s != slot && !s->used && !s->delivering) espnow_frag_free_buf(s);
+    }
+    espnow_frag_free_buf(slot);
+    slot->buf = (uint8_t *)malloc(size);
+    if(slot->buf == NULL) return false;
+    slot->cap = size;
+    espnow_frag_mem_kept += size;
+    return true;
+}
+
+static void espnow_frag_timer_cb(void *arg){
+    int64_t now = mgos_uptime_micros();
+    int64_t timeout = (int64_t)mgos_sys_config_get_espnow_frag_timeout_ms() * 1000;
+    bool active = false;
+    for(int i = 0; i < MGOS_ESPNOW_FRAG_SLOTS; i++){
+        struct espnow_frag_rx *slot = &espnow_frag_rx_slots[i];
+        if(!slot->used) continue;
+        if(now - slot->started >= timeout){
+            espnow_frag_stats.rx_timeouts++;
+            espnow_frag_release(slot);
+        } else {
+            active = true;
+        }
+    }
+    if(!active){
+        mgos_clear_timer(espnow_frag_timer);
+        espnow_frag_timer = MGOS_INVALID_TIMER_ID;
+    }
+    (void)arg;
+}
+
+static struct espnow_frag_rx *espnow_frag_get_slot(const uint8_t *mac, uint8_t msg_id){
+    struct espnow_frag_rx *slot = NULL, *free_slot = NULL, *oldest = NULL;
+    for(int i = 0; i < MGOS_ESPNOW_FRAG_SLOTS; i++){
+        struct espnow_frag_rx *s = &espnow_frag_rx_slots[i];
+        if(s->delivering) continue;
+        if(!s->used){
+            //Prefer a slot with a buffer already big enough
+            if(free_slot == NULL || free_slot->cap < s->cap) free_slot = s;
+        } else if(memcmp(s->mac, mac, 6) == 0){
+            slot = s;
+        } else if(oldest == NULL || s->started < oldest->started){
+            oldest = s;
+        }
+    }
+    if(slot != NULL){
+        if(slot->msg_id == msg_id) return slot;
+        //Sender moved on to a new message, the old one is lost
+        espnow_frag_stats.rx_dropped++;
+        espnow_frag_release(slot);
+        return slot;
+    }
+    if(free_slot != NULL) return free_slot;
+    espnow_frag_stats.rx_dropped++;
+    if(oldest != NULL) espnow_frag_release(oldest);
+    return oldest;
+}
+
+void espnow_frag_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len <= ESPNOW_FRAG_HDR_LEN){
+        espnow_frag_stats.rx_dropped++;
+        return;
+    }
+    uint8_t msg_id = data[2], index = data[3], count = data[4];
+    int chunk = len - ESPNOW_FRAG_HDR_LEN;
+    if(count == 0 || index >= count || chunk > MGOS_ESPNOW_FRAG_LEN || (index < count - 1 && chunk != MGOS_ESPNOW_FRAG_LEN)){
+        espnow_frag_stats.rx_dropped++;
+        return;
+    }
+    if(count == 1){
+        espnow_frag_stats.rx_messages++;
+        espnow_frag_deliver(data[1], mac, data + ESPNOW_FRAG_HDR_LEN, chunk);
+        return;
+    }
+    struct espnow_frag_rx *slot = espnow_frag_get_slot(mac, msg_id);
+    if(slot == NULL){
+        //Every slot is delivering a message that holds this one
+        espnow_frag_stats.rx_dropped++;
+        return;
+    }
+    if(!slot->used){
+        int size = count * MGOS_ESPNOW_FRAG_LEN;
+        if(espnow_frag_mem_used + size > mgos_sys_config_get_espnow_frag_rx_budget() || !espnow_frag_reserve(slot, size)){
+            espnow_frag_stats.rx_dropped++;
+            return;
+        }
+        slot->used = true;
+        memcpy(slot->mac, mac, 6);
+        slot->msg_id = msg_id;
+        slot->count = count;
+        slot->size = size;
+        slot->started = mgos_uptime_micros();
+        espnow_frag_mem_used += size;
+        if(espnow_frag_timer == MGOS_INVALID_TIMER_ID){
+            int interval = mgos_sys_config_get_espnow_frag_timeout_ms() / 2;
+            espnow_frag_timer = mgos_set_timer(interval > 10 ? interval : 10, MGOS_TIMER_REPEAT, espnow_frag_timer_cb, NULL);
+        }
+    } else if(slot->count != count){
+        espnow_frag_stats.rx_dropped++;
+        espnow_frag_release(slot);
+        return;
+    }
+    if(slot->seen[index / 8] & (1 << (index % 8))) return;
+    if(index * MGOS_ESPNOW_FRAG_LEN + chunk > slot->size){
+        espnow_frag_stats.rx_dropped++;
+        espnow_frag_release(slot);
+        return;
+    }
+    slot->seen[index / 8] |= 1 << (index % 8);
+    slot->received++;
+    memcpy(slot->buf + index * MGOS_ESPNOW_FRAG_LEN, data + ESPNOW_FRAG_HDR_LEN, chunk);
+    if(index == count - 1) slot->len = index * MGOS_ESPNOW_FRAG_LEN + chunk;
+    if(slot->received < slot->count) return;
+    espnow_frag_stats.rx_messages++;
+    //Released first, a library frame inside may take another slot
+    uint8_t from[6];
+    memcpy(from, slot->mac, 6);
+    int msg_len = slot->len;
+    espnow_frag_release(slot);
+    slot->delivering = true;
+    espnow_frag_deliver(data[1], from, slot->buf, msg_len);
+    slot->delivering = false;
+}
+
+void mgos_espnow_get_frag_stats(struct mgos_espnow_frag_stats *stats){
+    *stats = espnow_frag_stats;
+    stats->rx_mem_used = espnow_frag_mem_used;
+    stats->rx_mem_kept = espnow_frag_mem_kept;
+}
@@ -0,0 +1,251 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+//Named peer groups. Members are kept by peer name and looked up on every send,
+//so peers replaced or removed after joining don't leave dangling pointers.
+struct espnow_group {
+    char *name;
+    char **members;
+    int num_members;
+    SLIST_ENTRY(espnow_group) next;
+};
+
+static SLIST_HEAD(espnow_group_head, espnow_group) espnow_groups = SLIST_HEAD_INITIALIZER(espnow_groups);
+
+//Results of one group send, reported together once every member completed
+struct espnow_group_tx {
+    mgos_espnow_handle_t handle;
+    int pending;
+    int sent;
+    int failed;
+    bool queuing;
+    espnow_group_cb_t cb;
+    void *ud;
+};
+ESPNOW_POOL_DEFINE_GROW(espnow_group_tx_pool, sizeof(struct espnow_group_tx), 4, 4);
+
+static struct mgos_espnow_group_stats espnow_group_stats;
+
+static struct espnow_group *espnow_group_find(const char *name){
+    struct espnow_group *group;
+    SLIST_FOREACH(group, &espnow_groups, next){
+        if(strcmp(group->name, name) == 0) return group;
+    }
+    return NULL;
+}
+
+static int espnow_group_member_idx(const struct espnow_group *group, const char *name){
+    for(int i = 0; i < group->num_members; i++){
+        if(strcmp(group->members[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+static void espnow_group_free(struct espnow_group *group){
+    for(int i = 0; i < group->num_members; i++){
+        free(group->members[i]);
+    }
+    free(group->members);
+    free(group->name);
+    free(group);
+}
+
+mgos_espnow_result_t mgos_espnow_group_add(const char *group_name, const char *name){
+    if(group_name == NULL || name == NULL || mgos_espnow_get_peer_by_name(name) == NULL) return ESPNOW_PEER_NOT_FOUND;
+    struct espnow_group *group = espnow_group_find(group_name);
+    if(group != NULL && espnow_group_member_idx(group, name) >= 0) return ESPNOW_OK;
+    bool created = false;
+    if(group == NULL){
+        group = (struct espnow_group *)calloc(1, sizeof(*group));
+        if(group == NULL) return ESPNOW_NO_MEM;
+        group->name = strdup(group_name);
+        if(group->name == NULL){
+            free(group);
+            return ESPNOW_NO_MEM;
+        }
+        created = true;
+    }
+    char **members = (char **)realloc(group->members, (group->num_members + 1) * sizeof(*members));
+    char *member = strdup(name);
+    if(members != NULL) group->members = members;
+    if(members == NULL || member == NULL){
+        free(member);
+        if(created) espnow_group_free(group);
+        return ESPNOW_NO_MEM;
+    }
+    group->members[group->num_members++] = member;
+    if(created) SLIST_INSERT_HEAD(&espnow_groups, group, next);
+    return ESPNOW_OK;
+}
+
+void mgos_espnow_group_remove(const char *group_name, const char *name){
+    if(group_name == NULL) return;
+    struct espnow_group *group = espnow_group_find(group_name);
+    if(group == NULL) return;
+    if(name != NULL){
+        int idx = espnow_group_member_idx(group, name);
+        if(idx < 0) return;
+        free(group->members[idx]);
+        group->members[idx] = group->members[--group->num_members];
+        if(group->num_members > 0) return;
+    }
+    SLIST_REMOVE(&espnow_groups, group, espnow_group, next);
+    espnow_group_free(group);
+}
+
+int mgos_espnow_group_size(const char *group_name){
+    if(group_name == NULL) return mgos_espnow_total_peers();
+    struct espnow_group *group = espnow_group_find(group_name);
+    if(group == NULL) return 0;
+    int num = 0;
+    for(int i = 0; i < group->num_members; i++){
+        if(mgos_espnow_get_peer_by_name(group->members[i]) != NULL) num++;
+    }
+    return num;
+}
+
+//Whether the driver peer table holds num peers, all of them resident. The broadcast entry isn't a peer.
+static bool espnow_group_table_is(int num){
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    struct mgos_espnow_peer_table_stats table;
+    esp_now_peer_num_t driver_peers;
+    mgos_espnow_get_peer_table_stats(&table);
+    if(table.resident != num || esp_now_get_peer_num(&driver_peers) != ESP_OK) return false;
+    return driver_peers.total_num - (esp_now_is_peer_exist(bcast) ? 1 : 0) == num;
+}
+
+static void espnow_group_tx_check(struct espnow_group_tx *tx){
+    if(tx->queuing || tx->pending > 0) return;
+    if(tx->cb != NULL) tx->cb(tx->handle, tx->sent, tx->failed, tx->ud);
+    espnow_pool_free(&espnow_group_tx_pool, tx);
+}
+
+static void espnow_group_member_done(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    struct espnow_group_tx *tx = (struct espnow_group_tx *)ud;
+    if(mac == NULL){
+        //The frame to all peers was rejected, no member will report
+        tx->failed += tx->pending;
+        tx->pending = 0;
+    } else {
+        if(success) tx->sent++;
+        else tx->failed++;
+        tx->pending--;
+    }
+    espnow_group_tx_check(tx);
+    (void)handle;
+}
+
+//Member after prev, *i is the next member name to look up. Every peer is a member of the NULL group.
+static struct mgos_espnow_peer *espnow_group_next(const struct espnow_group *group, struct mgos_espnow_peer *prev, int *i){
+    if(group == NULL) return prev == NULL ? SLIST_FIRST(&peer_list) : SLIST_NEXT(prev, next);
+    while(*i < group->num_members){
+        struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(group->members[(*i)++]);
+        if(peer != NULL) return peer;
+    }
+    return NULL;
+}
+
+#define ESPNOW_GROUP_FOREACH(peer, group, i) \
+    for(i = 0, peer = espnow_group_next(group, NULL, &i); peer != NULL; peer = espnow_group_next(group, peer, &i))
+
+mgos_espnow_result_t mgos_espnow_send_group(const char *group_name, const uint8_t *data, int len, espnow_group_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    if(len < 0 || len > MGOS_ESPNOW_MAX_LEN) return ESPNOW_PAYLOAD_LEN_ERR;
+    struct espnow_group *group = NULL;
+    if(group_name != NULL){
+        group = espnow_group_find(group_name);
+        if(group == NULL) return ESPNOW_PEER_NOT_FOUND;
+    }
+    //Members are walked again for each pass, sending doesn't add or remove peers
+    struct mgos_espnow_peer *peer;
+    int i, num = 0;
+    //One driver call reaches everyone when the members are exactly the driver peer table
+    //and the frame needs nothing per peer (sequence numbers, fragmentation)
+    bool fanout = len == 0 || data[0] != ESPNOW_PROTO_MAGIC;
+    ESPNOW_GROUP_FOREACH(peer, group, i){
+        if(espnow_rel_enabled(peer) || !peer->resident) fanout = false;
+        num++;
+    }
+    if(num == 0) return ESPNOW_PEER_NOT_FOUND;
+    if(fanout) fanout = espnow_group_table_is(num);
+    if(fanout){
+        //Members were just used, keep them in the table ahead of the peers sent to less recently
+        ESPNOW_GROUP_FOREACH(peer, group, i){
+            espnow_peer_use(peer->mac);
+        }
+    }
+    struct espnow_group_tx *tx = (struct espnow_group_tx *)espnow_pool_alloc(&espnow_group_tx_pool);
+    if(tx == NULL){
+        espnow_group_tx_pool.exhausted++;
+        return ESPNOW_NO_MEM;
+    }
+    tx->handle = espnow_tx_next_handle();
+    tx->cb = cb;
+    tx->ud = ud;
+    tx->queuing = true;
+    mgos_espnow_result_t res = ESPNOW_OK;
+    int accepted = 0;
+    if(fanout){
+        ESPNOW_GROUP_FOREACH(peer, group, i){
+            espnow_coalesce_flush_mac(peer->mac);
+        }
+        tx->pending = num;
+        res = espnow_tx_enqueue_all(data, len, espnow_group_member_done, tx, NULL);
+        if(res == ESPNOW_OK){
+            accepted = num;
+            espnow_group_stats.fanout_sends++;
+            espnow_group_stats.driver_calls_saved += num - 1;
+        } else {
+            tx->pending = 0;
+        }
+    } else {
+        ESPNOW_GROUP_FOREACH(peer, group, i){
+            tx->pending++;
+            mgos_espnow_result_t r = espnow_tx_user(peer->mac, data, len, espnow_group_member_done, tx, NULL);
+            if(r != ESPNOW_OK){
+                tx->pending--;
+                tx->failed++;
+                res = r;
+            } else {
+                accepted++;
+            }
+        }
+    }
+    if(accepted == 0){
+        espnow_pool_free(&espnow_group_tx_pool, tx);
+        return res;
+    }
+    espnow_group_stats.sends++;
+    if(handle != NULL) *handle = tx->handle;
+    tx->queuing = false;
+    espnow_group_tx_check(tx);
+    return ESPNOW_OK;
+}
+
+void mgos_espnow_get_group_stats(struct mgos_espnow_group_stats *stats){
+    *stats = espnow_group_stats;
+}
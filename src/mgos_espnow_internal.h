@@ -0,0 +1,216 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CS_ESPNOW_INTERNAL_H
+#define CS_ESPNOW_INTERNAL_H
+
+#include "mgos_espnow.h"
+
+//Library frames start with the magic byte followed by the frame type.
+//Everything else received is a plain user payload.
+#define ESPNOW_PROTO_MAGIC 0xE5
+#define ESPNOW_PROTO_HDR_LEN 2
+
+enum espnow_proto_type {
+    ESPNOW_PROTO_FRAG = 1,     //[magic][type][msg id][index][count][data]
+    ESPNOW_PROTO_REL_DATA = 2, //[magic][type][seq lo][seq hi][inner frame]
+    ESPNOW_PROTO_REL_ACK = 3,  //[magic][type][next expected seq, 2 bytes][received after it, 32 bit mask]
+    ESPNOW_PROTO_BATCH = 4,    //[magic][type]([len][message])...
+    ESPNOW_PROTO_FRAG_PROTO = 5, //Same as FRAG, the message is a library frame
+    ESPNOW_PROTO_REQ = 6,      //[magic][type][id lo][id hi][op][payload]
+    ESPNOW_PROTO_RESP = 7,     //[magic][type][id lo][id hi][status][payload]
+    ESPNOW_PROTO_XFER = 8,     //[magic][type][op][transfer id]..., see mgos_espnow_xfer.c
+    ESPNOW_PROTO_LZ = 9,       //[magic][type][dictionary id][len lo][len hi][compressed frame]
+    ESPNOW_PROTO_CAPS = 10,    //[magic][type][flags][dictionary id]
+    ESPNOW_PROTO_PING = 11,    //[magic][type][echo][seq][sender time, 4 bytes]
+    ESPNOW_PROTO_MESH = 12,    //[magic][type][flags][ttl][hops][seq, 2 bytes][origin][destination][next hop], see mgos_espnow_mesh.c
+    ESPNOW_PROTO_REL_SYN = 13, //[magic][type][epoch][first seq, 2 bytes]
+    ESPNOW_PROTO_REL_SYN_ACK = 14, //[magic][type][epoch]
+    ESPNOW_PROTO_REL_FWD = 15, //[magic][type][seq, 2 bytes], frames before seq were given up
+};
+
+//What a peer told us it can decode, mgos_espnow_peer.lz
+enum espnow_lz_state {
+    ESPNOW_LZ_UNKNOWN = 0,
+    ESPNOW_LZ_ASKED,
+    ESPNOW_LZ_YES,
+    ESPNOW_LZ_NO
+};
+
+#define ESPNOW_REL_HDR_LEN 4
+
+//Capture record kinds and results
+enum espnow_capture_dir {
+    ESPNOW_CAPTURE_RX,
+    ESPNOW_CAPTURE_TX,     //Handed to the driver, failed if it refused the frame
+    ESPNOW_CAPTURE_TX_DONE //Driver completion, failed if the peer did not ACK
+};
+#define ESPNOW_CAPTURE_OK 0
+#define ESPNOW_CAPTURE_FAILED 1
+
+//Fixed block pool over static memory, see mgos_espnow_pool.c
+struct espnow_pool_chunk;
+struct espnow_pool {
+    uint8_t *mem;
+    int size;
+    int count;
+    uint16_t *retired_links; //Per block, chains retired blocks without writing to them
+    int fresh;               //Blocks never handed out start here
+    int used;
+    int high_water;
+    uint32_t exhausted;
+    void *free_list;
+    int retired_head;        //Block index + 1, 0 for none
+    struct espnow_pool *retired_next_pool;
+    int grow;                //Blocks of each heap chunk added once the static ones run out, 0 for none
+    int total;               //Static and heap blocks
+    struct espnow_pool_chunk *chunks;
+    int heap_bytes;
+};
+#define ESPNOW_POOL_WORDS(size) (((size) + 7) / 8)
+//Pool of n blocks of at least size bytes, 8 byte aligned
+#define ESPNOW_POOL_DEFINE(var, size, n) ESPNOW_POOL_DEFINE_GROW(var, size, n, 0)
+//Pool that goes on in heap chunks of grow blocks after the n static ones. Chunks are kept for good.
+#define ESPNOW_POOL_DEFINE_GROW(var, size, n, grow) \
+    static uint64_t var##_mem[(n) * ESPNOW_POOL_WORDS(size)]; \
+    static uint16_t var##_links[n]; \
+    static struct espnow_pool var = {(uint8_t *)var##_mem, ESPNOW_POOL_WORDS(size) * 8, (n), var##_links, 0, 0, 0, 0, NULL, 0, NULL, \
+        (grow), (n), NULL, 0}
+
+//Smallest power of two not below n, for table sizes known at build time
+#define ESPNOW_POW2_CEIL(n) ((n) <= 8 ? 8 : (n) <= 16 ? 16 : (n) <= 32 ? 32 : (n) <= 64 ? 64 : (n) <= 128 ? 128 : \
+    (n) <= 256 ? 256 : (n) <= 512 ? 512 : (n) <= 1024 ? 1024 : (n) <= 2048 ? 2048 : 4096)
+
+static inline bool espnow_is_proto(const uint8_t *data, int len){
+    return len >= ESPNOW_PROTO_HDR_LEN && data[0] == ESPNOW_PROTO_MAGIC;
+}
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //mgos_espnow.c
+    //Around reads of peers or callbacks made outside the event loop, they are not freed meanwhile
+    void espnow_dispatch_begin();
+    void espnow_dispatch_end();
+    uint32_t espnow_hash_bytes(const uint8_t *data, size_t len);
+    //Free now, or once no dispatch can still be using it
+    void espnow_retire(void *ptr);
+    void espnow_reclaim();
+    void espnow_deliver(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_proto_rx(const uint8_t *mac, const uint8_t *data, int len);
+    mgos_espnow_result_t espnow_peer_send(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    int espnow_peer_room(const uint8_t *mac);
+    //Put a peer in the driver table if it isn't, and mark it as used last
+    esp_err_t espnow_peer_use(const uint8_t *mac);
+    int espnow_peer_free_slots(const uint8_t *mac);
+    mgos_espnow_result_t espnow_tx_user(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t espnow_tx_direct(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t espnow_tx_enqueue(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t espnow_tx_enqueue_all(const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_handle_t espnow_tx_next_handle();
+    //Class of the frames queued from now on, returns the previous one
+    mgos_espnow_prio_t espnow_tx_set_prio(mgos_espnow_prio_t prio);
+    mgos_espnow_prio_t espnow_tx_get_prio();
+    int espnow_tx_free_slots();
+    bool espnow_peer_load(const char *name, const uint8_t *mac, bool softap, int channel);
+    void espnow_peer_unload(const uint8_t *mac);
+
+    //mgos_espnow_frag.c
+    mgos_espnow_result_t espnow_frag_send(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    mgos_espnow_result_t espnow_frag_send_proto(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    void espnow_frag_rx(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_rel.c
+    bool espnow_rel_enabled(const struct mgos_espnow_peer *peer);
+    int espnow_rel_free_slots(const struct mgos_espnow_peer *peer);
+    mgos_espnow_result_t espnow_rel_send(struct mgos_espnow_peer *peer, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    void espnow_rel_rx_data(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_rel_rx_ack(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_rel_rx_syn(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_rel_rx_syn_ack(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_rel_rx_fwd(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_rel_free(struct mgos_espnow_peer *peer);
+
+    //mgos_espnow_coalesce.c
+    bool espnow_coalesce_accepts(const uint8_t *mac, int len);
+    mgos_espnow_result_t espnow_coalesce_add(const uint8_t *mac, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle);
+    void espnow_coalesce_flush_mac(const uint8_t *mac);
+    void espnow_coalesce_rx(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_op.c
+    bool espnow_op_deliver(struct mgos_espnow_peer *peer, const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_op_count_unknown();
+
+    //mgos_espnow_req.c
+    void espnow_req_rx(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_resp_rx(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_xfer.c
+    void espnow_xfer_rx(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_lz.c
+    int espnow_lz_compress(const uint8_t *in, int len, uint8_t *out, int out_len);
+    int espnow_lz_decompress(const uint8_t *in, int len, uint8_t *out, int out_len);
+    bool espnow_lz_wanted(const uint8_t *mac);
+    int espnow_lz_pack(const uint8_t *mac, const uint8_t *data, int len, uint8_t *out);
+    int espnow_lz_pack_msg(const uint8_t *data, int len, uint8_t *out, int out_len);
+    void espnow_lz_rx(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_lz_rx_caps(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_link.c
+    void espnow_link_tx_done(struct mgos_espnow_peer *peer, bool success);
+    void espnow_link_rx(const uint8_t *mac, const uint8_t *data, int len);
+    void espnow_link_init();
+
+    //mgos_espnow_mesh.c
+    void espnow_mesh_rx(const uint8_t *mac, const uint8_t *data, int len);
+
+    //mgos_espnow_capture.c
+    //Record a frame, callable from any task
+    void espnow_capture(uint8_t dir, const uint8_t *mac, const uint8_t *data, int len, uint8_t status);
+    void espnow_capture_init();
+
+    //mgos_espnow_pool.c
+    void *espnow_pool_alloc(struct espnow_pool *pool);
+    void espnow_pool_free(struct espnow_pool *pool, void *block);
+    //Keep a block a dispatch may still read until espnow_pool_reclaim
+    void espnow_pool_retire(struct espnow_pool *pool, void *block);
+    void espnow_pool_reclaim();
+    void espnow_pool_stats(const struct espnow_pool *pool, struct mgos_espnow_pool_stats *stats);
+
+    //mgos_espnow_rpc.c
+    void espnow_rpc_init();
+
+    //mgos_espnow_store.c
+    bool espnow_store_enabled();
+    bool espnow_store_load();
+    void espnow_store_add(const struct mgos_espnow_peer *peer);
+    void espnow_store_remove(const uint8_t *mac);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,183 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Link quality per peer. TX success is smoothed from the completion of every frame sent to the peer,
+//round trips are measured with pings answered by the library on the other side, and RSSI comes from
+//the application. Peers whose TX success falls too low are paced by the TX engine so retries on a
+//bad link do not take the airtime of the good ones.
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#define ESPNOW_LINK_PING_LEN 8
+#define ESPNOW_LINK_ECHO 0x01
+//Fixed point 1 of tx_fail, and the weight of a new sample
+#define ESPNOW_LINK_ONE 65536
+#define ESPNOW_LINK_WEIGHT 16
+//Points above espnow.link_degraded_pct a peer must get back to before it is no longer paced
+#define ESPNOW_LINK_HYSTERESIS 10
+//Shortest time between two pings of the periodic round
+#define ESPNOW_LINK_MIN_TICK_MS 10
+
+static mgos_timer_id espnow_link_timer = MGOS_INVALID_TIMER_ID;
+static int espnow_link_next;
+
+static uint32_t espnow_link_now(){
+    return (uint32_t)mgos_uptime_micros();
+}
+
+void espnow_link_tx_done(struct mgos_espnow_peer *peer, bool success){
+    struct mgos_espnow_link *link = &peer->link;
+    int32_t sample = success ? 0 : ESPNOW_LINK_ONE;
+    link->tx_fail += (sample - link->tx_fail) / ESPNOW_LINK_WEIGHT;
+    int pct = mgos_sys_config_get_espnow_link_degraded_pct();
+    int ok_pct = 100 - (int)((int64_t)link->tx_fail * 100 / ESPNOW_LINK_ONE);
+    if(pct <= 0){
+        link->degraded = false;
+    } else if(!link->degraded && ok_pct < pct){
+        link->degraded = true;
+        LOG(LL_INFO, ("Link to %s degraded, %d%% of frames acknowledged", peer->name, ok_pct));
+    } else if(link->degraded && ok_pct >= pct + ESPNOW_LINK_HYSTERESIS){
+        link->degraded = false;
+        LOG(LL_INFO, ("Link to %s recovered, %d%% of frames acknowledged", peer->name, ok_pct));
+    }
+}
+
+static void espnow_link_rtt_sample(struct mgos_espnow_link *link, int32_t rtt){
+    if(link->srtt_us == 0){
+        link->srtt_us = rtt > 0 ? rtt : 1;
+        link->rttvar_us = rtt / 2;
+    } else {
+        int32_t err = rtt - link->srtt_us;
+        link->srtt_us += err / 8;
+        link->rttvar_us += ((err < 0 ? -err : err) - link->rttvar_us) / 4;
+    }
+}
+
+static mgos_espnow_result_t espnow_link_send(const uint8_t *mac, uint8_t flags, uint8_t seq, uint32_t sent_at){
+    uint8_t frame[ESPNOW_LINK_PING_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_PING, flags, seq,
+        sent_at & 0xff, (sent_at >> 8) & 0xff, (sent_at >> 16) & 0xff, sent_at >> 24};
+    //Straight to the TX engine, neither queued behind bulk data nor retransmitted by the reliable channel
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(ESPNOW_PRIO_HIGH);
+    mgos_espnow_result_t res = espnow_tx_enqueue(mac, frame, sizeof(frame), NULL, NULL, NULL);
+    espnow_tx_set_prio(prev);
+    return res;
+}
+
+static mgos_espnow_result_t espnow_link_ping(struct mgos_espnow_peer *peer){
+    struct mgos_espnow_link *link = &peer->link;
+    uint32_t now = espnow_link_now();
+    mgos_espnow_result_t res = espnow_link_send(peer->mac, 0, (uint8_t)(link->ping_seq + 1), now);
+    if(res != ESPNOW_OK) return res;
+    if(link->ping_pending) link->pings_lost++;
+    link->ping_seq++;
+    link->ping_pending = true;
+    link->ping_sent_at = now;
+    link->pings++;
+    return ESPNOW_OK;
+}
+
+void espnow_link_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_LINK_PING_LEN) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    //Echoes are unicast, only peers get one
+    if(peer == NULL) return;
+    uint32_t sent_at = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+    if(!(data[2] & ESPNOW_LINK_ECHO)){
+        espnow_link_send(mac, ESPNOW_LINK_ECHO, data[3], sent_at);
+        return;
+    }
+    struct mgos_espnow_link *link = &peer->link;
+    //Late echoes of a ping already counted lost are ignored
+    if(!link->ping_pending || data[3] != link->ping_seq || sent_at != link->ping_sent_at) return;
+    link->ping_pending = false;
+    link->echoes++;
+    espnow_link_rtt_sample(link, (int32_t)(espnow_link_now() - sent_at));
+}
+
+//One peer per tick, every peer is pinged once per espnow.link_ping_ms
+static void espnow_link_timer_cb(void *arg){
+    espnow_link_timer = MGOS_INVALID_TIMER_ID;
+    int period = mgos_sys_config_get_espnow_link_ping_ms();
+    if(period <= 0) return;
+    int num = mgos_espnow_total_peers();
+    if(num > 0){
+        if(espnow_link_next >= num) espnow_link_next = 0;
+        int i = 0;
+        struct mgos_espnow_peer *peer;
+        SLIST_FOREACH(peer, &peer_list, next){
+            if(i++ == espnow_link_next) break;
+        }
+        if(peer != NULL) espnow_link_ping(peer);
+        espnow_link_next++;
+    }
+    int tick = period / (num > 0 ? num : 1);
+    if(tick < ESPNOW_LINK_MIN_TICK_MS) tick = ESPNOW_LINK_MIN_TICK_MS;
+    espnow_link_timer = mgos_set_timer(tick, 0, espnow_link_timer_cb, NULL);
+    (void)arg;
+}
+
+void espnow_link_init(){
+    if(mgos_sys_config_get_espnow_link_ping_ms() > 0 && espnow_link_timer == MGOS_INVALID_TIMER_ID){
+        espnow_link_timer = mgos_set_timer(mgos_sys_config_get_espnow_link_ping_ms(), 0, espnow_link_timer_cb, NULL);
+    }
+}
+
+mgos_espnow_result_t mgos_espnow_ping(const char *name){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    return espnow_link_ping(peer);
+}
+
+bool mgos_espnow_get_link_stats(const char *name, struct mgos_espnow_link_stats *stats){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return false;
+    const struct mgos_espnow_link *link = &peer->link;
+    stats->tx_success = 1.0f - (float)link->tx_fail / ESPNOW_LINK_ONE;
+    stats->rtt_us = link->srtt_us;
+    stats->rtt_var_us = link->rttvar_us;
+    int32_t rssi = __atomic_load_n(&link->rssi_x16, __ATOMIC_RELAXED);
+    stats->rssi = rssi / 16;
+    stats->degraded = link->degraded;
+    stats->pings = link->pings;
+    stats->echoes = link->echoes;
+    stats->pings_lost = link->pings_lost;
+    return true;
+}
+
+void mgos_espnow_link_rssi(const uint8_t *mac, int rssi){
+    if(rssi >= 0) return;
+    //The peer found stays valid until the end, even if the event loop removes it meanwhile
+    espnow_dispatch_begin();
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer != NULL){
+        //Concurrent reports can overwrite each other, one sample lost either way
+        int32_t cur = __atomic_load_n(&peer->link.rssi_x16, __ATOMIC_RELAXED);
+        int32_t sample = rssi * 16;
+        cur = cur == 0 ? sample : cur + (sample - cur) / 8;
+        __atomic_store_n(&peer->link.rssi_x16, cur, __ATOMIC_RELAXED);
+    }
+    espnow_dispatch_end();
+}
@@ -0,0 +1,328 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Payload compression. LZF style codec whose window starts with a static dictionary of
+//common JSON telemetry and RPC text, so even a single short frame finds matches.
+//Peers tell each other they can decode with a CAPS frame, only peers that said so get
+//compressed frames. Frames that don't shrink are sent as they are.
+//
+//Compressed stream, offsets count back from the current output position into dictionary + output:
+//  [000LLLLL] literal run of L + 1 bytes follows
+//  [LLLooooo][oooooooo] match of L + 2 bytes, L 1..6, offset o + 1
+//  [111ooooo][LLLLLLLL][oooooooo] match of L + 9 bytes
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+//[magic][type][dictionary id][len lo][len hi][stream]
+#define ESPNOW_LZ_HDR_LEN 5
+//[magic][type][flags][dictionary id]
+#define ESPNOW_LZ_CAPS_LEN 4
+#define ESPNOW_LZ_CAPS_DECODE 0x01
+#define ESPNOW_LZ_CAPS_REPLY 0x80
+//Bumped whenever the dictionary changes, peers with another one are sent plain frames
+#define ESPNOW_LZ_DICT_ID 1
+//A peer that doesn't answer is asked again after this, doubling up to 64 times as long
+#define ESPNOW_LZ_ASK_MS 1000
+#define ESPNOW_LZ_ASK_MAX_SHIFT 6
+
+#define ESPNOW_LZ_HLOG 9
+#define ESPNOW_LZ_HSIZE (1 << ESPNOW_LZ_HLOG)
+#define ESPNOW_LZ_MAX_LIT 32
+#define ESPNOW_LZ_MAX_OFF 8192
+#define ESPNOW_LZ_MAX_REF (264)
+//Positions are kept in 16 bits, longer messages are sent plain
+#define ESPNOW_LZ_MAX_IN (65535 - (int)sizeof(espnow_lz_dict))
+
+//Most used text last, the hash table keeps the latest position of each 3 byte sequence
+static const uint8_t espnow_lz_dict[] =
+    "\"error\":{\"code\":-1,\"message\":\"\"},\"result\":null,\"src\":\"\",\"dst\":\"\",\"tag\":\"\","
+    "\"method\":\"Sys.GetInfo\",\"args\":{\"id\":0,\"name\":\"\",\"type\":\"\",\"state\":\"on\","
+    "\"status\":\"ok\",\"enabled\":false,\"valid\":true,\"mode\":\"auto\",\"version\":\"1.0\","
+    "\"count\":0,\"uptime\":0,\"time\":0,\"ts\":1700000000,\"seq\":0,\"mac\":\"00:00:00:00:00:00\","
+    "\"rssi\":-60,\"channel\":1,\"battery\":100,\"voltage\":3.30,\"current\":0.00,\"power\":0.0,"
+    "\"pressure\":1013.25,\"lux\":0,\"co2\":400,\"pm25\":0,\"motion\":false,\"door\":\"closed\","
+    "\"humidity\":50.0,\"temperature\":20.00,\"temp\":20.0,\"value\":0,\"data\":[0,0,0],";
+
+static uint16_t espnow_lz_dict_htab[ESPNOW_LZ_HSIZE];
+static uint16_t espnow_lz_htab[ESPNOW_LZ_HSIZE];
+static bool espnow_lz_ready;
+static struct mgos_espnow_compress_stats espnow_lz_stats;
+
+#define ESPNOW_LZ_DICT_LEN ((int)sizeof(espnow_lz_dict) - 1)
+
+static inline unsigned espnow_lz_hash(uint8_t a, uint8_t b, uint8_t c){
+    uint32_t v = ((uint32_t)a << 16) | ((uint32_t)b << 8) | c;
+    return (v * 2654435761u) >> (32 - ESPNOW_LZ_HLOG);
+}
+
+//Byte at a position of dictionary + input
+static inline uint8_t espnow_lz_at(const uint8_t *in, int pos){
+    return pos < ESPNOW_LZ_DICT_LEN ? espnow_lz_dict[pos] : in[pos - ESPNOW_LZ_DICT_LEN];
+}
+
+//Positions are stored + 1, 0 is an empty entry
+static void espnow_lz_prepare(){
+    if(espnow_lz_ready) return;
+    for(int i = 0; i + 2 < ESPNOW_LZ_DICT_LEN; i++){
+        espnow_lz_dict_htab[espnow_lz_hash(espnow_lz_dict[i], espnow_lz_dict[i + 1], espnow_lz_dict[i + 2])] = i + 1;
+    }
+    espnow_lz_ready = true;
+}
+
+//Returns the compressed length, or 0 if it would not fit in out_len
+int espnow_lz_compress(const uint8_t *in, int len, uint8_t *out, int out_len){
+    if(len <= 0 || len > ESPNOW_LZ_MAX_IN || out_len < 2) return 0;
+    espnow_lz_prepare();
+    memcpy(espnow_lz_htab, espnow_lz_dict_htab, sizeof(espnow_lz_htab));
+    int op = 1; //out[0] holds the length of the first literal run
+    int lit = 0;
+    int ip = 0;
+    while(ip < len){
+        if(ip + 2 < len){
+            unsigned h = espnow_lz_hash(in[ip], in[ip + 1], in[ip + 2]);
+            int pos = ESPNOW_LZ_DICT_LEN + ip;
+            int ref = (int)espnow_lz_htab[h] - 1;
+            espnow_lz_htab[h] = pos + 1;
+            int off = pos - ref - 1;
+            if(ref >= 0 && off < ESPNOW_LZ_MAX_OFF && espnow_lz_at(in, ref) == in[ip]
+                && espnow_lz_at(in, ref + 1) == in[ip + 1] && espnow_lz_at(in, ref + 2) == in[ip + 2]){
+                int max = len - ip;
+                if(max > ESPNOW_LZ_MAX_REF) max = ESPNOW_LZ_MAX_REF;
+                int mlen = 3;
+                while(mlen < max && espnow_lz_at(in, ref + mlen) == in[ip + mlen]) mlen++;
+                //Close the literal run, or drop its unused length byte
+                if(lit > 0) out[op - lit - 1] = lit - 1;
+                else op--;
+                if(op + 4 > out_len) return 0;
+                int l = mlen - 2;
+                if(l < 7){
+                    out[op++] = (l << 5) | (off >> 8);
+                }else{
+                    out[op++] = (7 << 5) | (off >> 8);
+                    out[op++] = l - 7;
+                }
+                out[op++] = off & 0xff;
+                out[op++] = 0;
+                lit = 0;
+                //Index the matched bytes too, frames are short and every match counts
+                for(int i = ip + 1; i < ip + mlen && i + 2 < len; i++){
+                    espnow_lz_htab[espnow_lz_hash(in[i], in[i + 1], in[i + 2])] = ESPNOW_LZ_DICT_LEN + i + 1;
+                }
+                ip += mlen;
+                continue;
+            }
+        }
+        if(op >= out_len) return 0;
+        out[op++] = in[ip++];
+        if(++lit == ESPNOW_LZ_MAX_LIT){
+            out[op - lit - 1] = lit - 1;
+            lit = 0;
+            if(op >= out_len) return 0;
+            out[op++] = 0;
+        }
+    }
+    if(lit > 0) out[op - lit - 1] = lit - 1;
+    else op--;
+    return op;
+}
+
+//Returns the decompressed length, or -1 on a corrupt stream or if it does not fit in out_len
+int espnow_lz_decompress(const uint8_t *in, int len, uint8_t *out, int out_len){
+    int ip = 0, op = 0;
+    while(ip < len){
+        int c = in[ip++];
+        if(c < ESPNOW_LZ_MAX_LIT){
+            int n = c + 1;
+            if(ip + n > len || op + n > out_len) return -1;
+            memcpy(out + op, in + ip, n);
+            ip += n;
+            op += n;
+            continue;
+        }
+        int l = c >> 5;
+        if(l == 7){
+            if(ip >= len) return -1;
+            l += in[ip++];
+        }
+        if(ip >= len) return -1;
+        int ref = ESPNOW_LZ_DICT_LEN + op - (((c & 0x1f) << 8) | in[ip++]) - 1;
+        l += 2;
+        if(ref < 0 || op + l > out_len) return -1;
+        //Byte by byte, a match can overlap its own output
+        for(int i = 0; i < l; i++, ref++){
+            out[op++] = ref < ESPNOW_LZ_DICT_LEN ? espnow_lz_dict[ref] : out[ref - ESPNOW_LZ_DICT_LEN];
+        }
+    }
+    return op;
+}
+
+static void espnow_lz_send_caps(const uint8_t *mac, bool reply){
+    uint8_t caps[ESPNOW_LZ_CAPS_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_CAPS, ESPNOW_LZ_CAPS_DECODE, ESPNOW_LZ_DICT_ID};
+    if(reply) caps[2] |= ESPNOW_LZ_CAPS_REPLY;
+    espnow_peer_send(mac, caps, sizeof(caps), NULL, NULL, NULL);
+}
+
+//What the peer can decode, from its CAPS frame or a frame it compressed with our dictionary
+static void espnow_lz_learn(struct mgos_espnow_peer *peer, bool decode){
+    peer->lz = decode ? ESPNOW_LZ_YES : ESPNOW_LZ_NO;
+    peer->lz_tries = 0;
+}
+
+//Whether frames to this peer go through the compressor. Asks the peer what it can decode the first time,
+//and again while the CAPS frame or its answer get lost, frames are sent plain meanwhile.
+bool espnow_lz_wanted(const uint8_t *mac){
+    if(!mgos_sys_config_get_espnow_compress()) return false;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL) return false;
+    uint32_t now = (uint32_t)(mgos_uptime_micros() / 1000);
+    if(peer->lz == ESPNOW_LZ_ASKED){
+        int shift = peer->lz_tries - 1 < ESPNOW_LZ_ASK_MAX_SHIFT ? peer->lz_tries - 1 : ESPNOW_LZ_ASK_MAX_SHIFT;
+        if(now - peer->lz_asked_at >= ((uint32_t)ESPNOW_LZ_ASK_MS << shift)) peer->lz = ESPNOW_LZ_UNKNOWN;
+    }
+    if(peer->lz == ESPNOW_LZ_UNKNOWN && espnow_peer_free_slots(mac) > 1){
+        peer->lz = ESPNOW_LZ_ASKED;
+        peer->lz_asked_at = now;
+        if(peer->lz_tries < 255) peer->lz_tries++;
+        espnow_lz_send_caps(mac, true);
+    }
+    return peer->lz == ESPNOW_LZ_YES;
+}
+
+//Compresses a frame for the peer into out, at most MGOS_ESPNOW_MAX_LEN bytes.
+//Returns the compressed frame length, or 0 to send the frame as it is.
+int espnow_lz_pack(const uint8_t *mac, const uint8_t *data, int len, uint8_t *out){
+    int min = mgos_sys_config_get_espnow_compress_min();
+    if(len < min || len < ESPNOW_LZ_HDR_LEN + 2) return 0;
+    if(espnow_is_proto(data, len)){
+        //Fragments of compressed messages were compressed as a whole, acks, caps and pings are tiny
+        switch(data[1]){
+            case ESPNOW_PROTO_FRAG:
+            case ESPNOW_PROTO_FRAG_PROTO:
+            case ESPNOW_PROTO_REL_ACK:
+            case ESPNOW_PROTO_REL_SYN:
+            case ESPNOW_PROTO_REL_SYN_ACK:
+            case ESPNOW_PROTO_REL_FWD:
+            case ESPNOW_PROTO_LZ:
+            case ESPNOW_PROTO_CAPS:
+            case ESPNOW_PROTO_PING:
+            return 0;
+        }
+    }
+    if(!espnow_lz_wanted(mac)) return 0;
+    return espnow_lz_pack_msg(data, len, out, len - 1);
+}
+
+//Compresses a message of any length into out, a frame of at most out_len bytes.
+//Returns the frame length, or 0 if it does not get shorter.
+int espnow_lz_pack_msg(const uint8_t *data, int len, uint8_t *out, int out_len){
+    if(out_len <= ESPNOW_LZ_HDR_LEN) return 0;
+    int n = espnow_lz_compress(data, len, out + ESPNOW_LZ_HDR_LEN, out_len - ESPNOW_LZ_HDR_LEN);
+    if(n <= 0){
+        espnow_lz_stats.tx_plain++;
+        return 0;
+    }
+    out[0] = ESPNOW_PROTO_MAGIC;
+    out[1] = ESPNOW_PROTO_LZ;
+    out[2] = ESPNOW_LZ_DICT_ID;
+    out[3] = len & 0xff;
+    out[4] = len >> 8;
+    espnow_lz_stats.tx_compressed++;
+    espnow_lz_stats.tx_bytes_in += len;
+    espnow_lz_stats.tx_bytes_out += ESPNOW_LZ_HDR_LEN + n;
+    return ESPNOW_LZ_HDR_LEN + n;
+}
+
+//Decompressed messages longer than a frame, grown to the longest one. A message delivered from it
+//may bring in another one, that one takes the heap.
+static uint8_t *espnow_lz_rx_buf;
+static int espnow_lz_rx_cap;
+static bool espnow_lz_rx_busy;
+
+static uint8_t *espnow_lz_rx_get(int size){
+    if(espnow_lz_rx_busy) return (uint8_t *)malloc(size);
+    if(espnow_lz_rx_cap < size){
+        uint8_t *buf = (uint8_t *)malloc(size);
+        if(buf == NULL) return NULL;
+        free(espnow_lz_rx_buf);
+        espnow_lz_rx_buf = buf;
+        espnow_lz_rx_cap = size;
+    }
+    espnow_lz_rx_busy = true;
+    return espnow_lz_rx_buf;
+}
+
+static void espnow_lz_rx_put(uint8_t *buf){
+    if(buf == espnow_lz_rx_buf) espnow_lz_rx_busy = false;
+    else free(buf);
+}
+
+void espnow_lz_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_LZ_HDR_LEN || data[2] != ESPNOW_LZ_DICT_ID){
+        espnow_lz_stats.rx_errors++;
+        return;
+    }
+    int size = data[3] | (data[4] << 8);
+    int max = mgos_sys_config_get_espnow_frag_max_len();
+    if(max < MGOS_ESPNOW_MAX_LEN) max = MGOS_ESPNOW_MAX_LEN;
+    if(size <= 0 || size > max){
+        espnow_lz_stats.rx_errors++;
+        return;
+    }
+    uint8_t stack[MGOS_ESPNOW_MAX_LEN];
+    uint8_t *buf = size <= (int)sizeof(stack) ? stack : espnow_lz_rx_get(size);
+    if(buf == NULL){
+        espnow_lz_stats.rx_errors++;
+        return;
+    }
+    int n = espnow_lz_decompress(data + ESPNOW_LZ_HDR_LEN, len - ESPNOW_LZ_HDR_LEN, buf, size);
+    //Compressed frames never nest
+    if(n != size || (espnow_is_proto(buf, n) && buf[1] == ESPNOW_PROTO_LZ)){
+        espnow_lz_stats.rx_errors++;
+    }else{
+        espnow_lz_stats.rx_decompressed++;
+        //Only a peer that compresses with our dictionary can send this, so it can decode too.
+        //A CAPS frame that said otherwise wins, a frame that failed to decode says nothing.
+        struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+        if(peer != NULL && peer->lz != ESPNOW_LZ_NO) espnow_lz_learn(peer, true);
+        espnow_proto_rx(mac, buf, n);
+    }
+    if(buf != stack) espnow_lz_rx_put(buf);
+}
+
+void espnow_lz_rx_caps(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_LZ_CAPS_LEN) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL) return;
+    //Decoding with another dictionary is as good as not decoding
+    espnow_lz_learn(peer, (data[2] & ESPNOW_LZ_CAPS_DECODE) && data[3] == ESPNOW_LZ_DICT_ID);
+    if(data[2] & ESPNOW_LZ_CAPS_REPLY) espnow_lz_send_caps(mac, false);
+}
+
+void mgos_espnow_get_compress_stats(struct mgos_espnow_compress_stats *stats){
+    *stats = espnow_lz_stats;
+    stats->enabled = mgos_sys_config_get_espnow_compress();
+    stats->dict_len = ESPNOW_LZ_DICT_LEN;
+}
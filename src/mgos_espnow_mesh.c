@@ -0,0 +1,386 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Multi-hop relay. Mesh frames carry their origin, a sequence number and a TTL and are broadcast.
+//Nodes with espnow.mesh set rebroadcast the ones they have not seen yet after a random jitter,
+//dropping the rebroadcast if they hear the frame from enough neighbours meanwhile.
+//Every mesh frame received teaches the route back to its origin: the neighbour it came from.
+//Frames to a node with a known route are sent to that next hop only, as a unicast when it is a loaded
+//peer, and each hop forwards it the same way or floods it when it knows no route. Routed broadcasts
+//are acknowledged by hearing the next hop forward them, they are resent a few times before the route
+//is dropped and the frame flooded.
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "esp_wifi.h"
+
+#ifndef MGOS_ESPNOW_MESH_SEEN_SLOTS
+#define MGOS_ESPNOW_MESH_SEEN_SLOTS 64
+#endif
+
+#ifndef MGOS_ESPNOW_MESH_ROUTES
+#define MGOS_ESPNOW_MESH_ROUTES 16
+#endif
+
+#ifndef MGOS_ESPNOW_MESH_RELAY_SLOTS
+#define MGOS_ESPNOW_MESH_RELAY_SLOTS 8
+#endif
+
+#define ESPNOW_MESH_WAYS 4
+#define ESPNOW_MESH_SETS (MGOS_ESPNOW_MESH_SEEN_SLOTS / ESPNOW_MESH_WAYS)
+
+#if MGOS_ESPNOW_MESH_SEEN_SLOTS < ESPNOW_MESH_WAYS || (ESPNOW_MESH_SETS & (ESPNOW_MESH_SETS - 1)) != 0
+#error "MGOS_ESPNOW_MESH_SEEN_SLOTS must be a power of two of at least 4"
+#endif
+
+//[magic][type][flags][ttl][hops][seq lo][seq hi][origin][destination][next hop][payload]
+#define ESPNOW_MESH_HDR_LEN (MGOS_ESPNOW_MAX_LEN - MGOS_ESPNOW_MESH_MAX_LEN)
+#define ESPNOW_MESH_ROUTED 0x01 //Only the next hop forwards it
+#define ESPNOW_MESH_OFF_ORIGIN 7
+#define ESPNOW_MESH_OFF_DST 13
+#define ESPNOW_MESH_OFF_NEXT 19
+//A pending rebroadcast is dropped once the frame was heard this many more times
+#define ESPNOW_MESH_SUPPRESS 2
+//A routed broadcast is sent again when its next hop is not heard passing it on in time,
+//after that many retries the route is dropped and the frame flooded
+#define ESPNOW_MESH_ACK_MS 40
+#define ESPNOW_MESH_RETRIES 2
+
+static const uint8_t espnow_mesh_bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+//Seen origin/sequence pairs, kept as 32 bit fingerprints. Each set replaces its oldest entry.
+static uint32_t espnow_mesh_seen[ESPNOW_MESH_SETS][ESPNOW_MESH_WAYS];
+static uint8_t espnow_mesh_seen_next[ESPNOW_MESH_SETS];
+
+struct espnow_mesh_route {
+    uint8_t dst[6];
+    uint8_t next_hop[6];
+    uint8_t hops;
+    int64_t updated;
+    int64_t used; //Last learnt or sent through, the table replaces the one left alone longest
+};
+static struct espnow_mesh_route espnow_mesh_routes[MGOS_ESPNOW_MESH_ROUTES];
+
+//Rebroadcast waiting for its jitter, or a routed frame waiting for its next hop to forward it
+struct espnow_mesh_relay {
+    bool used;
+    bool own;
+    bool acking;
+    uint32_t key;
+    int heard;
+    int tries;
+    uint8_t next_hop[6];
+    mgos_timer_id timer;
+    int len;
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+};
+static struct espnow_mesh_relay espnow_mesh_relays[MGOS_ESPNOW_MESH_RELAY_SLOTS];
+
+static uint16_t espnow_mesh_seq;
+static struct mgos_espnow_mesh_stats espnow_mesh_stats;
+
+static bool espnow_mesh_is_me(const uint8_t *mac){
+    uint8_t own[6];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, own);
+    if(memcmp(mac, own, 6) == 0) return true;
+    esp_wifi_get_mac(ESP_IF_WIFI_AP, own);
+    return memcmp(mac, own, 6) == 0;
+}
+
+static uint32_t espnow_mesh_key(const uint8_t *frame){
+    uint8_t id[8];
+    memcpy(id, frame + ESPNOW_MESH_OFF_ORIGIN, 6);
+    id[6] = frame[5];
+    id[7] = frame[6];
+    uint32_t key = espnow_hash_bytes(id, sizeof(id));
+    return key != 0 ? key : 1;
+}
+
+//Records the key, returns true if it was already there
+static bool espnow_mesh_seen_check(uint32_t key){
+    uint32_t *set = espnow_mesh_seen[key & (ESPNOW_MESH_SETS - 1)];
+    for(int i = 0; i < ESPNOW_MESH_WAYS; i++){
+        if(set[i] == key) return true;
+    }
+    uint8_t *next = &espnow_mesh_seen_next[key & (ESPNOW_MESH_SETS - 1)];
+    set[*next] = key;
+    *next = (*next + 1) % ESPNOW_MESH_WAYS;
+    return false;
+}
+
+static struct espnow_mesh_route *espnow_mesh_route_find(const uint8_t *dst){
+    int64_t max_age = (int64_t)mgos_sys_config_get_espnow_mesh_route_ms() * 1000;
+    int64_t now = mgos_uptime_micros();
+    for(int i = 0; i < MGOS_ESPNOW_MESH_ROUTES; i++){
+        struct espnow_mesh_route *r = &espnow_mesh_routes[i];
+        if(r->hops == 0 || memcmp(r->dst, dst, 6) != 0) continue;
+        if(now - r->updated > max_age){
+            r->hops = 0;
+            return NULL;
+        }
+        return r;
+    }
+    return NULL;
+}
+
+//The neighbour a frame came from leads back to its origin in hops
+static void espnow_mesh_route_learn(const uint8_t *dst, const uint8_t *next_hop, int hops){
+    struct espnow_mesh_route *r = espnow_mesh_route_find(dst);
+    if(r != NULL && hops > r->hops && memcmp(r->next_hop, next_hop, 6) != 0) return;
+    if(r == NULL){
+        //Free entry, or the one used longest ago
+        r = &espnow_mesh_routes[0];
+        for(int i = 0; i < MGOS_ESPNOW_MESH_ROUTES && r->hops != 0; i++){
+            struct espnow_mesh_route *e = &espnow_mesh_routes[i];
+            if(e->hops == 0 || e->used < r->used) r = e;
+        }
+        memcpy(r->dst, dst, 6);
+    }
+    memcpy(r->next_hop, next_hop, 6);
+    r->hops = (uint8_t)(hops < 255 ? hops : 255);
+    r->updated = r->used = mgos_uptime_micros();
+}
+
+//The next hop is gone, flood until another route is learnt
+static void espnow_mesh_route_drop(const uint8_t *next_hop){
+    for(int i = 0; i < MGOS_ESPNOW_MESH_ROUTES; i++){
+        struct espnow_mesh_route *r = &espnow_mesh_routes[i];
+        if(r->hops != 0 && memcmp(r->next_hop, next_hop, 6) == 0){
+            r->hops = 0;
+            espnow_mesh_stats.route_failures++;
+        }
+    }
+}
+
+static void espnow_mesh_unicast_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    if(!success && mac != NULL) espnow_mesh_route_drop(mac);
+    (void)handle;
+    (void)ud;
+}
+
+//Send a frame as is, or to the next hop towards its destination when one is known
+static mgos_espnow_result_t espnow_mesh_transmit(uint8_t *frame, int len){
+    struct espnow_mesh_route *r = NULL;
+    if(memcmp(frame + ESPNOW_MESH_OFF_DST, espnow_mesh_bcast, 6) != 0) r = espnow_mesh_route_find(frame + ESPNOW_MESH_OFF_DST);
+    if(r == NULL){
+        frame[2] &= ~ESPNOW_MESH_ROUTED;
+        memset(frame + ESPNOW_MESH_OFF_NEXT, 0xff, 6);
+        espnow_mesh_stats.flooded++;
+        return espnow_tx_enqueue(espnow_mesh_bcast, frame, len, NULL, NULL, NULL);
+    }
+    r->used = mgos_uptime_micros();
+    frame[2] |= ESPNOW_MESH_ROUTED;
+    memcpy(frame + ESPNOW_MESH_OFF_NEXT, r->next_hop, 6);
+    espnow_mesh_stats.routed++;
+    //Unicasts are acknowledged, but only reach peers in the driver table
+    if(mgos_espnow_get_peer_by_mac(r->next_hop) != NULL){
+        return espnow_tx_enqueue(r->next_hop, frame, len, espnow_mesh_unicast_cb, NULL, NULL);
+    }
+    return espnow_tx_enqueue(espnow_mesh_bcast, frame, len, NULL, NULL, NULL);
+}
+
+//Routed broadcasts get no acknowledgement, but the next hop forwarding them is heard.
+//The last hop does not forward and unicasts are acknowledged by the driver.
+static bool espnow_mesh_needs_ack(const uint8_t *frame){
+    if((frame[2] & ESPNOW_MESH_ROUTED) == 0) return false;
+    if(memcmp(frame + ESPNOW_MESH_OFF_NEXT, frame + ESPNOW_MESH_OFF_DST, 6) == 0) return false;
+    return mgos_espnow_get_peer_by_mac(frame + ESPNOW_MESH_OFF_NEXT) == NULL;
+}
+
+static void espnow_mesh_relay_cb(void *arg){
+    struct espnow_mesh_relay *relay = (struct espnow_mesh_relay *)arg;
+    relay->timer = MGOS_INVALID_TIMER_ID;
+    if(relay->acking){
+        if(++relay->tries > ESPNOW_MESH_RETRIES) espnow_mesh_route_drop(relay->next_hop);
+        espnow_mesh_stats.resent++;
+    }
+    mgos_espnow_result_t res = espnow_mesh_transmit(relay->frame, relay->len);
+    if(!relay->acking && !relay->own){
+        if(res == ESPNOW_OK) espnow_mesh_stats.relayed++;
+        else espnow_mesh_stats.relay_dropped++;
+    }
+    relay->acking = false;
+    if(res == ESPNOW_OK && espnow_mesh_needs_ack(relay->frame)){
+        memcpy(relay->next_hop, relay->frame + ESPNOW_MESH_OFF_NEXT, 6);
+        relay->timer = mgos_set_timer(ESPNOW_MESH_ACK_MS, 0, espnow_mesh_relay_cb, relay);
+        if(relay->timer != MGOS_INVALID_TIMER_ID){
+            relay->acking = true;
+            return;
+        }
+    }
+    relay->used = false;
+}
+
+static struct espnow_mesh_relay *espnow_mesh_relay_find(uint32_t key){
+    for(int i = 0; i < MGOS_ESPNOW_MESH_RELAY_SLOTS; i++){
+        if(espnow_mesh_relays[i].used && espnow_mesh_relays[i].key == key) return &espnow_mesh_relays[i];
+    }
+    return NULL;
+}
+
+static struct espnow_mesh_relay *espnow_mesh_relay_alloc(const uint8_t *data, int len, bool own){
+    struct espnow_mesh_relay *relay = NULL;
+    for(int i = 0; i < MGOS_ESPNOW_MESH_RELAY_SLOTS && relay == NULL; i++){
+        if(!espnow_mesh_relays[i].used) relay = &espnow_mesh_relays[i];
+    }
+    if(relay == NULL) return NULL;
+    relay->used = true;
+    relay->own = own;
+    relay->acking = false;
+    relay->key = espnow_mesh_key(data);
+    relay->heard = 0;
+    relay->tries = 0;
+    relay->timer = MGOS_INVALID_TIMER_ID;
+    relay->len = len;
+    memcpy(relay->frame, data, len);
+    return relay;
+}
+
+static void espnow_mesh_relay(const uint8_t *data, int len, bool jitter){
+    struct espnow_mesh_relay *relay = espnow_mesh_relay_alloc(data, len, false);
+    if(relay == NULL){
+        espnow_mesh_stats.relay_dropped++;
+        return;
+    }
+    relay->frame[3]--;
+    relay->frame[4]++;
+    int max = mgos_sys_config_get_espnow_mesh_jitter_ms();
+    int delay = jitter && max > 0 ? (int)mgos_rand_range(0, max) : 0;
+    if(delay <= 0){
+        espnow_mesh_relay_cb(relay);
+        return;
+    }
+    relay->timer = mgos_set_timer(delay, 0, espnow_mesh_relay_cb, relay);
+    if(relay->timer == MGOS_INVALID_TIMER_ID) espnow_mesh_relay_cb(relay);
+}
+
+//A neighbour sent a frame we hold for rebroadcast, enough of them make ours useless
+static void espnow_mesh_heard(uint32_t key){
+    for(int i = 0; i < MGOS_ESPNOW_MESH_RELAY_SLOTS; i++){
+        struct espnow_mesh_relay *relay = &espnow_mesh_relays[i];
+        if(!relay->used || relay->acking || relay->key != key || relay->timer == MGOS_INVALID_TIMER_ID) continue;
+        if(++relay->heard >= ESPNOW_MESH_SUPPRESS){
+            mgos_clear_timer(relay->timer);
+            relay->timer = MGOS_INVALID_TIMER_ID;
+            relay->used = false;
+            espnow_mesh_stats.suppressed++;
+        }
+        return;
+    }
+}
+
+//The next hop of a routed frame we sent forwarding it
+static void espnow_mesh_acked(uint32_t key, const uint8_t *mac){
+    struct espnow_mesh_relay *relay = espnow_mesh_relay_find(key);
+    if(relay == NULL || !relay->acking || memcmp(relay->next_hop, mac, 6) != 0) return;
+    mgos_clear_timer(relay->timer);
+    relay->timer = MGOS_INVALID_TIMER_ID;
+    relay->acking = false;
+    relay->used = false;
+}
+
+void espnow_mesh_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_MESH_HDR_LEN) return;
+    const uint8_t *origin = data + ESPNOW_MESH_OFF_ORIGIN, *dst = data + ESPNOW_MESH_OFF_DST;
+    uint32_t key = espnow_mesh_key(data);
+    espnow_mesh_acked(key, mac);
+    //Our own frames coming back
+    if(espnow_mesh_is_me(origin)) return;
+    espnow_mesh_route_learn(origin, mac, data[4] + 1);
+    bool for_me = espnow_mesh_is_me(dst), bcast = memcmp(dst, espnow_mesh_bcast, 6) == 0;
+    bool routed = (data[2] & ESPNOW_MESH_ROUTED) != 0;
+    bool next_me = espnow_mesh_is_me(data + ESPNOW_MESH_OFF_NEXT);
+    //Routed frames are only for their next hop, and their destination if it hears them first
+    if(routed && !for_me && !next_me) return;
+    if(espnow_mesh_seen_check(key)){
+        espnow_mesh_stats.duplicates++;
+        espnow_mesh_heard(key);
+        //Our forward was lost on its way back to the sender, which resends until it hears it
+        if(routed && next_me && !for_me && data[3] > 1 && mgos_sys_config_get_espnow_mesh() &&
+            espnow_mesh_relay_find(key) == NULL) espnow_mesh_relay(data, len, false);
+        return;
+    }
+    if(for_me || bcast){
+        espnow_mesh_stats.delivered++;
+        espnow_mesh_stats.delivered_hops += data[4] + 1;
+        espnow_deliver(origin, data + ESPNOW_MESH_HDR_LEN, len - ESPNOW_MESH_HDR_LEN);
+    }
+    if(for_me || !mgos_sys_config_get_espnow_mesh()) return;
+    if(data[3] <= 1){
+        espnow_mesh_stats.ttl_expired++;
+        return;
+    }
+    //Floods race each other and get a jitter, a routed frame has a single forwarder
+    espnow_mesh_relay(data, len, !routed);
+}
+
+mgos_espnow_result_t mgos_espnow_mesh_send(const uint8_t *dst, const uint8_t *data, int len){
+    if(len < 0 || len > MGOS_ESPNOW_MESH_MAX_LEN) return ESPNOW_PAYLOAD_LEN_ERR;
+    int ttl = mgos_sys_config_get_espnow_mesh_ttl();
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+    uint16_t seq = ++espnow_mesh_seq;
+    frame[0] = ESPNOW_PROTO_MAGIC;
+    frame[1] = ESPNOW_PROTO_MESH;
+    frame[2] = 0;
+    frame[3] = (uint8_t)(ttl < 1 ? 1 : ttl > 255 ? 255 : ttl);
+    frame[4] = 0;
+    frame[5] = seq & 0xff;
+    frame[6] = seq >> 8;
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, frame + ESPNOW_MESH_OFF_ORIGIN);
+    memcpy(frame + ESPNOW_MESH_OFF_DST, dst != NULL ? dst : espnow_mesh_bcast, 6);
+    memcpy(frame + ESPNOW_MESH_HDR_LEN, data, len);
+    espnow_mesh_seen_check(espnow_mesh_key(frame));
+    len += ESPNOW_MESH_HDR_LEN;
+    mgos_espnow_result_t res = espnow_mesh_transmit(frame, len);
+    if(res != ESPNOW_OK) return res;
+    espnow_mesh_stats.originated++;
+    //Keep it around to resend if the next hop is not heard forwarding it
+    struct espnow_mesh_relay *relay = espnow_mesh_needs_ack(frame) ? espnow_mesh_relay_alloc(frame, len, true) : NULL;
+    if(relay != NULL){
+        memcpy(relay->next_hop, frame + ESPNOW_MESH_OFF_NEXT, 6);
+        relay->timer = mgos_set_timer(ESPNOW_MESH_ACK_MS, 0, espnow_mesh_relay_cb, relay);
+        if(relay->timer != MGOS_INVALID_TIMER_ID) relay->acking = true;
+        else relay->used = false;
+    }
+    return res;
+}
+
+bool mgos_espnow_mesh_get_route(const uint8_t *dst, uint8_t *next_hop, int *hops){
+    struct espnow_mesh_route *r = espnow_mesh_route_find(dst);
+    if(r == NULL) return false;
+    if(next_hop != NULL) memcpy(next_hop, r->next_hop, 6);
+    if(hops != NULL) *hops = r->hops;
+    return true;
+}
+
+void mgos_espnow_get_mesh_stats(struct mgos_espnow_mesh_stats *stats){
+    *stats = espnow_mesh_stats;
+    stats->routes = 0;
+    int64_t max_age = (int64_t)mgos_sys_config_get_espnow_mesh_route_ms() * 1000;
+    int64_t now = mgos_uptime_micros();
+    for(int i = 0; i < MGOS_ESPNOW_MESH_ROUTES; i++){
+        if(espnow_mesh_routes[i].hops != 0 && now - espnow_mesh_routes[i].updated <= max_age) stats->routes++;
+    }
+}
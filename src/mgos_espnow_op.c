@@ -0,0 +1,121 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Typed messages. With espnow.op_dispatch the first byte of a user payload is an opcode and the message
+//only goes to the handler registered for it, on the sending peer first and then globally. Messages
+//whose opcode has no handler go to the receive callbacks as usual.
+//Tables are rebuilt on register/remove and swapped, the old one is retired like the dispatch tables.
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+struct espnow_op_handler {
+    espnow_op_cb_t cb;
+    void *ud;
+};
+
+struct espnow_op_table {
+    int num;
+    //Index in handlers plus one, 0 when the opcode has no handler
+    uint16_t slot[256];
+    struct espnow_op_handler handlers[];
+};
+
+static struct espnow_op_table *espnow_op_global;
+static struct mgos_espnow_op_stats espnow_op_stats;
+
+//Copy of a table with op set to cb, or removed if cb is NULL
+static mgos_espnow_result_t espnow_op_set(struct espnow_op_table **table, uint8_t op, espnow_op_cb_t cb, void *ud){
+    struct espnow_op_table *old = *table;
+    bool had = old != NULL && old->slot[op] != 0;
+    if(cb == NULL && !had) return ESPNOW_OK;
+    int num = (old != NULL ? old->num : 0) + (cb != NULL && !had ? 1 : 0) - (cb == NULL ? 1 : 0);
+    struct espnow_op_table *t = NULL;
+    if(num > 0){
+        t = (struct espnow_op_table *)calloc(1, sizeof(*t) + num * sizeof(t->handlers[0]));
+        if(t == NULL){
+            LOG(LL_ERROR, ("Failed to allocate opcode table"));
+            return ESPNOW_NO_MEM;
+        }
+        for(int i = 0; i < 256; i++){
+            if(i == op){
+                if(cb == NULL) continue;
+                t->handlers[t->num].cb = cb;
+                t->handlers[t->num].ud = ud;
+            } else if(old != NULL && old->slot[i] != 0){
+                t->handlers[t->num] = old->handlers[old->slot[i] - 1];
+            } else {
+                continue;
+            }
+            t->slot[i] = ++t->num;
+        }
+    }
+    __atomic_store_n(table, t, __ATOMIC_SEQ_CST);
+    espnow_retire(old);
+    espnow_reclaim();
+    return ESPNOW_OK;
+}
+
+mgos_espnow_result_t mgos_espnow_register_op_cb(const char *name, uint8_t op, espnow_op_cb_t cb, void *ud){
+    if(cb == NULL) return ESPNOW_SEND_FAILED;
+    if(name == NULL) return espnow_op_set(&espnow_op_global, op, cb, ud);
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    return espnow_op_set(&peer->op_table, op, cb, ud);
+}
+
+void mgos_espnow_remove_op_cb(const char *name, uint8_t op){
+    if(name == NULL){
+        espnow_op_set(&espnow_op_global, op, NULL, NULL);
+        return;
+    }
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer != NULL) espnow_op_set(&peer->op_table, op, NULL, NULL);
+}
+
+//Returns false if the opcode has no handler, the message is left to the receive callbacks
+bool espnow_op_deliver(struct mgos_espnow_peer *peer, const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 1) return false;
+    const struct espnow_op_handler *h = NULL;
+    const struct espnow_op_table *t = peer != NULL ? __atomic_load_n(&peer->op_table, __ATOMIC_SEQ_CST) : NULL;
+    if(t != NULL && t->slot[data[0]] != 0){
+        h = &t->handlers[t->slot[data[0]] - 1];
+    } else if((t = __atomic_load_n(&espnow_op_global, __ATOMIC_SEQ_CST)) != NULL && t->slot[data[0]] != 0){
+        h = &t->handlers[t->slot[data[0]] - 1];
+    }
+    if(h == NULL) return false;
+    espnow_op_stats.delivered++;
+    h->cb(mac, data[0], data + 1, len - 1, h->ud);
+    return true;
+}
+
+//A message neither an opcode handler nor a receive callback took
+void espnow_op_count_unknown(){
+    espnow_op_stats.unknown++;
+}
+
+void mgos_espnow_get_op_stats(struct mgos_espnow_op_stats *stats){
+    *stats = espnow_op_stats;
+}
@@ -0,0 +1,140 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Fixed block pools over static memory. Blocks come from a free list, or the never used tail of the
+//pool, so a pool needs no setup. Only used from the event loop.
+//A free block holds the free list link, so blocks that readers may still see are chained through a
+//separate array instead until they can be freed.
+//Pools defined with a grow step take heap chunks once the static blocks run out. Blocks are numbered
+//across the static memory and the chunks, chunks are never freed so readers can't lose a block.
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+//Retired blocks are chained by index + 1 in 16 bits
+#define ESPNOW_POOL_MAX_BLOCKS 65535
+
+struct espnow_pool_chunk {
+    struct espnow_pool_chunk *next; //Older chunk, lower blocks
+    int base;                       //Number of the first block
+    int count;
+    uint16_t *retired_links;
+    uint8_t *mem;
+};
+
+//Block i and its retired link
+static uint8_t *espnow_pool_block(const struct espnow_pool *pool, int i, uint16_t **link){
+    if(i < pool->count){
+        *link = &pool->retired_links[i];
+        return pool->mem + (size_t)i * pool->size;
+    }
+    struct espnow_pool_chunk *chunk = pool->chunks;
+    while(i < chunk->base) chunk = chunk->next;
+    *link = &chunk->retired_links[i - chunk->base];
+    return chunk->mem + (size_t)(i - chunk->base) * pool->size;
+}
+
+static int espnow_pool_index(const struct espnow_pool *pool, const void *block){
+    const uint8_t *p = (const uint8_t *)block;
+    if(p >= pool->mem && p < pool->mem + (size_t)pool->count * pool->size) return (p - pool->mem) / pool->size;
+    struct espnow_pool_chunk *chunk = pool->chunks;
+    while(p < chunk->mem || p >= chunk->mem + (size_t)chunk->count * pool->size) chunk = chunk->next;
+    return chunk->base + (p - chunk->mem) / pool->size;
+}
+
+static bool espnow_pool_grow(struct espnow_pool *pool){
+    if(pool->grow <= 0 || pool->total + pool->grow > ESPNOW_POOL_MAX_BLOCKS) return false;
+    size_t head = ESPNOW_POOL_WORDS(sizeof(struct espnow_pool_chunk) + pool->grow * sizeof(uint16_t)) * 8;
+    size_t bytes = head + (size_t)pool->grow * pool->size;
+    struct espnow_pool_chunk *chunk = (struct espnow_pool_chunk *)malloc(bytes);
+    if(chunk == NULL) return false;
+    chunk->base = pool->total;
+    chunk->count = pool->grow;
+    chunk->retired_links = (uint16_t *)(chunk + 1);
+    chunk->mem = (uint8_t *)chunk + head;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->total += pool->grow;
+    pool->heap_bytes += bytes;
+    return true;
+}
+
+void *espnow_pool_alloc(struct espnow_pool *pool){
+    void *block = pool->free_list;
+    uint16_t *link;
+    if(block != NULL){
+        pool->free_list = *(void **)block;
+    } else if(pool->fresh < pool->total || espnow_pool_grow(pool)){
+        block = espnow_pool_block(pool, pool->fresh++, &link);
+    } else {
+        return NULL;
+    }
+    memset(block, 0, pool->size);
+    if(++pool->used > pool->high_water) pool->high_water = pool->used;
+    return block;
+}
+
+void espnow_pool_free(struct espnow_pool *pool, void *block){
+    if(block == NULL) return;
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->used--;
+}
+
+//Pools with retired blocks
+static struct espnow_pool *espnow_pool_retired_pools;
+
+void espnow_pool_retire(struct espnow_pool *pool, void *block){
+    if(block == NULL) return;
+    int i = espnow_pool_index(pool, block);
+    uint16_t *link;
+    espnow_pool_block(pool, i, &link);
+    *link = pool->retired_head;
+    if(pool->retired_head == 0){
+        pool->retired_next_pool = espnow_pool_retired_pools;
+        espnow_pool_retired_pools = pool;
+    }
+    pool->retired_head = i + 1;
+}
+
+void espnow_pool_reclaim(){
+    while(espnow_pool_retired_pools != NULL){
+        struct espnow_pool *pool = espnow_pool_retired_pools;
+        espnow_pool_retired_pools = pool->retired_next_pool;
+        while(pool->retired_head != 0){
+            uint16_t *link;
+            void *block = espnow_pool_block(pool, pool->retired_head - 1, &link);
+            pool->retired_head = *link;
+            espnow_pool_free(pool, block);
+        }
+    }
+}
+
+void espnow_pool_stats(const struct espnow_pool *pool, struct mgos_espnow_pool_stats *stats){
+    stats->slots = pool->total;
+    stats->used = pool->used;
+    stats->high_water = pool->high_water;
+    stats->exhausted = pool->exhausted;
+}
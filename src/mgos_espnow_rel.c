@@ -0,0 +1,470 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_REL_WINDOW
+#define MGOS_ESPNOW_REL_WINDOW 8
+#endif
+
+//Receive window tracked for duplicates, one bit per sequence number after rx_next
+#define ESPNOW_REL_RX_WINDOW 32
+#define ESPNOW_REL_MIN_RTO_US 20000
+#define ESPNOW_REL_MAX_RTO_US 2000000
+#define ESPNOW_REL_TICK_MS 10
+
+//Frame kept until acknowledged
+struct espnow_rel_slot {
+    bool used;
+    bool retransmitted;
+    bool fast_retransmitted;
+    uint16_t seq;
+    uint8_t len;
+    //Retransmits keep the class of the first send
+    mgos_espnow_prio_t prio;
+    int tries;
+    int64_t sent_at;
+    mgos_espnow_handle_t handle;
+    espnow_msg_cb_t cb;
+    void *ud;
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+};
+
+//A session starts with a SYN carrying its epoch and first sequence number, the receiver resets its
+//duplicate tracking on it and answers with a SYN_ACK. Frames wait in their slots until then, so a
+//restarted sender never has its new frames taken for duplicates of the old ones.
+struct espnow_rel {
+    struct mgos_espnow_peer *peer;
+    //Sender side, slots is NULL unless enabled with mgos_espnow_set_reliable
+    struct espnow_rel_slot *slots;
+    int used;
+    uint16_t next_seq;
+    int32_t srtt, rttvar, rto;
+    bool synced;
+    uint8_t epoch;
+    uint16_t syn_seq;
+    int syn_tries;
+    int64_t syn_sent_at;
+    //Frames given up, the receiver is told to move past them until an ACK shows it did
+    bool fwd;
+    uint16_t fwd_seq;
+    int fwd_tries;
+    int64_t fwd_sent_at;
+    //Receiver side
+    bool rx_init;
+    uint16_t rx_next;
+    uint32_t rx_mask;
+    struct mgos_espnow_rel_stats stats;
+    SLIST_ENTRY(espnow_rel) next;
+};
+
+//Peer states and send windows are kept in pools that reuse freed blocks, growing onto the heap
+ESPNOW_POOL_DEFINE_GROW(espnow_rel_pool, sizeof(struct espnow_rel), 4, 4);
+ESPNOW_POOL_DEFINE_GROW(espnow_rel_window_pool, MGOS_ESPNOW_REL_WINDOW * sizeof(struct espnow_rel_slot), 1, 1);
+
+static SLIST_HEAD(espnow_rel_head, espnow_rel) espnow_rel_head = SLIST_HEAD_INITIALIZER(espnow_rel_head);
+static mgos_timer_id espnow_rel_timer = MGOS_INVALID_TIMER_ID;
+static uint8_t espnow_rel_epoch;
+
+static void espnow_rel_timer_cb(void *arg);
+
+static struct espnow_rel *espnow_rel_get(struct mgos_espnow_peer *peer){
+    if(peer->rel != NULL) return peer->rel;
+    struct espnow_rel *rel = (struct espnow_rel *)espnow_pool_alloc(&espnow_rel_pool);
+    if(rel == NULL) return NULL;
+    rel->peer = peer;
+    SLIST_INSERT_HEAD(&espnow_rel_head, rel, next);
+    peer->rel = rel;
+    return rel;
+}
+
+bool espnow_rel_enabled(const struct mgos_espnow_peer *peer){
+    return peer->rel != NULL && peer->rel->slots != NULL;
+}
+
+//Oldest sequence number not acknowledged or given up yet
+static uint16_t espnow_rel_floor(const struct espnow_rel *rel){
+    uint16_t floor = rel->next_seq;
+    for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+        const struct espnow_rel_slot *slot = &rel->slots[i];
+        if(slot->used && (int16_t)(slot->seq - floor) < 0) floor = slot->seq;
+    }
+    return floor;
+}
+
+//Frames in flight also stay within the receive window of the oldest one, the receiver drops frames beyond it
+int espnow_rel_free_slots(const struct mgos_espnow_peer *peer){
+    const struct espnow_rel *rel = peer->rel;
+    int free_slots = MGOS_ESPNOW_REL_WINDOW - rel->used;
+    int span = ESPNOW_REL_RX_WINDOW - (uint16_t)(rel->next_seq - espnow_rel_floor(rel));
+    return span < free_slots ? span : free_slots;
+}
+
+static void espnow_rel_transmit(struct espnow_rel *rel, struct espnow_rel_slot *slot){
+    //The TX engine may be full, the retransmit timer will try again
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(slot->prio);
+    mgos_espnow_result_t res = espnow_tx_enqueue(rel->peer->mac, slot->frame, slot->len, NULL, NULL, NULL);
+    espnow_tx_set_prio(prev);
+    if(res != ESPNOW_OK) return;
+    slot->sent_at = mgos_uptime_micros();
+    slot->tries++;
+}
+
+static void espnow_rel_complete(struct espnow_rel *rel, struct espnow_rel_slot *slot, bool success){
+    slot->used = false;
+    rel->used--;
+    if(success) rel->stats.acked++;
+    else rel->stats.failed++;
+    if(slot->cb != NULL) slot->cb(slot->handle, rel->peer->mac, success, slot->ud);
+}
+
+static void espnow_rel_start_timer(){
+    if(espnow_rel_timer == MGOS_INVALID_TIMER_ID){
+        espnow_rel_timer = mgos_set_timer(ESPNOW_REL_TICK_MS, MGOS_TIMER_REPEAT, espnow_rel_timer_cb, NULL);
+    }
+}
+
+//Control frames hold back the sender's window, never queue them behind bulk data
+static void espnow_rel_send_ctrl(struct espnow_rel *rel, const uint8_t *frame, int len){
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(ESPNOW_PRIO_HIGH);
+    espnow_tx_enqueue(rel->peer->mac, frame, len, NULL, NULL, NULL);
+    espnow_tx_set_prio(prev);
+}
+
+static void espnow_rel_send_syn(struct espnow_rel *rel){
+    uint8_t syn[5] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_SYN, rel->epoch, rel->syn_seq & 0xff, rel->syn_seq >> 8};
+    espnow_rel_send_ctrl(rel, syn, sizeof(syn));
+    rel->syn_sent_at = mgos_uptime_micros();
+    rel->syn_tries++;
+}
+
+static void espnow_rel_send_fwd(struct espnow_rel *rel){
+    rel->fwd_seq = espnow_rel_floor(rel);
+    uint8_t fwd[4] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_FWD, rel->fwd_seq & 0xff, rel->fwd_seq >> 8};
+    espnow_rel_send_ctrl(rel, fwd, sizeof(fwd));
+    rel->fwd_sent_at = mgos_uptime_micros();
+    rel->fwd_tries++;
+}
+
+//New session from the next sequence number, with an epoch no SYN_ACK of an older one can match
+static void espnow_rel_start_session(struct espnow_rel *rel){
+    rel->synced = false;
+    rel->epoch = ++espnow_rel_epoch;
+    rel->syn_seq = rel->next_seq;
+    rel->syn_tries = 0;
+    espnow_rel_send_syn(rel);
+}
+
+mgos_espnow_result_t espnow_rel_send(struct mgos_espnow_peer *peer, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud, mgos_espnow_handle_t *handle){
+    struct espnow_rel *rel = peer->rel;
+    if(len < 0 || len > MGOS_ESPNOW_MAX_LEN - ESPNOW_REL_HDR_LEN) return ESPNOW_PAYLOAD_LEN_ERR;
+    if(espnow_rel_free_slots(peer) <= 0 || espnow_tx_free_slots() == 0) return ESPNOW_QUEUE_FULL;
+    struct espnow_rel_slot *slot = NULL;
+    for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+        if(!rel->slots[i].used){
+            slot = &rel->slots[i];
+            break;
+        }
+    }
+    if(slot == NULL) return ESPNOW_QUEUE_FULL;
+    if(!rel->synced && rel->syn_tries == 0) espnow_rel_start_session(rel);
+    memset(slot, 0, offsetof(struct espnow_rel_slot, frame));
+    slot->used = true;
+    slot->seq = rel->next_seq++;
+    slot->prio = espnow_tx_get_prio();
+    slot->frame[0] = ESPNOW_PROTO_MAGIC;
+    slot->frame[1] = ESPNOW_PROTO_REL_DATA;
+    slot->frame[2] = slot->seq & 0xff;
+    slot->frame[3] = slot->seq >> 8;
+    memcpy(slot->frame + ESPNOW_REL_HDR_LEN, data, len);
+    slot->len = (uint8_t)(ESPNOW_REL_HDR_LEN + len);
+    slot->handle = espnow_tx_next_handle();
+    slot->cb = cb;
+    slot->ud = ud;
+    if(handle != NULL) *handle = slot->handle;
+    rel->used++;
+    //Until the SYN_ACK frames only take their slot, they go out in order once it arrives
+    if(rel->synced) espnow_rel_transmit(rel, slot);
+    espnow_rel_start_timer();
+    return ESPNOW_OK;
+}
+
+static void espnow_rel_send_ack(struct espnow_rel *rel){
+    uint8_t ack[8] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_ACK, rel->rx_next & 0xff, rel->rx_next >> 8,
+        rel->rx_mask & 0xff, (rel->rx_mask >> 8) & 0xff, (rel->rx_mask >> 16) & 0xff, rel->rx_mask >> 24};
+    espnow_rel_send_ctrl(rel, ack, sizeof(ack));
+}
+
+void espnow_rel_rx_fwd(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 4) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    struct espnow_rel *rel = peer != NULL ? peer->rel : NULL;
+    if(rel == NULL || !rel->rx_init) return;
+    uint16_t seq = data[2] | (data[3] << 8);
+    int16_t d = (int16_t)(seq - rel->rx_next);
+    if(d > 0){
+        //Frames before seq will not come, keep what was received after it
+        bool next_received = d <= ESPNOW_REL_RX_WINDOW && (rel->rx_mask & (1u << (d - 1)));
+        rel->rx_mask = d < ESPNOW_REL_RX_WINDOW ? rel->rx_mask >> d : 0;
+        rel->rx_next = seq;
+        if(next_received){
+            rel->rx_next++;
+            while(rel->rx_mask & 1){
+                rel->rx_mask >>= 1;
+                rel->rx_next++;
+            }
+            rel->rx_mask >>= 1;
+        }
+    }
+    espnow_rel_send_ack(rel);
+}
+
+void espnow_rel_rx_syn(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 5) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    struct espnow_rel *rel = peer != NULL ? espnow_rel_get(peer) : NULL;
+    if(rel == NULL) return;
+    //The sender restarted or started over, nothing of its old session can come after this
+    rel->rx_init = true;
+    rel->rx_next = data[3] | (data[4] << 8);
+    rel->rx_mask = 0;
+    rel->stats.sessions++;
+    uint8_t syn_ack[3] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_SYN_ACK, data[2]};
+    espnow_rel_send_ctrl(rel, syn_ack, sizeof(syn_ack));
+}
+
+void espnow_rel_rx_syn_ack(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 3) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL || !espnow_rel_enabled(peer)) return;
+    struct espnow_rel *rel = peer->rel;
+    if(rel->synced || rel->syn_tries == 0 || data[2] != rel->epoch) return;
+    rel->synced = true;
+    rel->syn_tries = 0;
+    //Frames queued meanwhile, in sequence order
+    for(uint16_t seq = rel->syn_seq; seq != rel->next_seq; seq++){
+        for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+            struct espnow_rel_slot *slot = &rel->slots[i];
+            if(slot->used && slot->seq == seq && slot->tries == 0) espnow_rel_transmit(rel, slot);
+        }
+    }
+}
+
+void espnow_rel_rx_data(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_REL_HDR_LEN) return;
+    uint16_t seq = data[2] | (data[3] << 8);
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    struct espnow_rel *rel = peer != NULL ? espnow_rel_get(peer) : NULL;
+    if(rel == NULL){
+        //No state to track duplicates against, and nowhere to send the ACK
+        espnow_proto_rx(mac, data + ESPNOW_REL_HDR_LEN, len - ESPNOW_REL_HDR_LEN);
+        return;
+    }
+    int16_t d = (int16_t)(seq - rel->rx_next);
+    if(!rel->rx_init){
+        //This node restarted during the sender's session
+        rel->rx_init = true;
+        rel->rx_next = seq;
+        rel->rx_mask = 0;
+        d = 0;
+    }
+    bool duplicate = false;
+    if(d < 0 || d > ESPNOW_REL_RX_WINDOW){
+        //Already delivered, or too far ahead to remember. The ACK tells the sender where we are.
+        duplicate = true;
+    } else if(d == 0){
+        //Slide the window past every sequence number now received in order
+        rel->rx_next++;
+        while(rel->rx_mask & 1){
+            rel->rx_mask >>= 1;
+            rel->rx_next++;
+        }
+        rel->rx_mask >>= 1;
+    } else if(rel->rx_mask & (1u << (d - 1))){
+        duplicate = true;
+    } else {
+        rel->rx_mask |= 1u << (d - 1);
+    }
+    espnow_rel_send_ack(rel);
+    if(duplicate){
+        rel->stats.duplicates++;
+        return;
+    }
+    rel->stats.received++;
+    espnow_proto_rx(mac, data + ESPNOW_REL_HDR_LEN, len - ESPNOW_REL_HDR_LEN);
+}
+
+static void espnow_rel_rtt_sample(struct espnow_rel *rel, int32_t rtt){
+    if(rel->srtt == 0){
+        rel->srtt = rtt;
+        rel->rttvar = rtt / 2;
+    } else {
+        int32_t err = rtt - rel->srtt;
+        rel->srtt += err / 8;
+        rel->rttvar += ((err < 0 ? -err : err) - rel->rttvar) / 4;
+    }
+    rel->rto = rel->srtt + 4 * rel->rttvar;
+    if(rel->rto < ESPNOW_REL_MIN_RTO_US) rel->rto = ESPNOW_REL_MIN_RTO_US;
+    if(rel->rto > ESPNOW_REL_MAX_RTO_US) rel->rto = ESPNOW_REL_MAX_RTO_US;
+}
+
+void espnow_rel_rx_ack(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 8) return;
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_mac(mac);
+    if(peer == NULL || !espnow_rel_enabled(peer) || !peer->rel->synced) return;
+    struct espnow_rel *rel = peer->rel;
+    uint16_t cum = data[2] | (data[3] << 8);
+    uint32_t mask = data[4] | (data[5] << 8) | (data[6] << 16) | ((uint32_t)data[7] << 24);
+    if(rel->fwd && (int16_t)(cum - rel->fwd_seq) >= 0) rel->fwd = false;
+    int64_t now = mgos_uptime_micros();
+    int16_t highest = -1;
+    for(int i = 0; i < ESPNOW_REL_RX_WINDOW; i++){
+        if(mask & (1u << i)) highest = i + 1;
+    }
+    for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+        struct espnow_rel_slot *slot = &rel->slots[i];
+        if(!slot->used) continue;
+        int16_t d = (int16_t)(slot->seq - cum);
+        if(d < 0 || (d > 0 && d <= ESPNOW_REL_RX_WINDOW && (mask & (1u << (d - 1))))){
+            //Karn: only frames sent once give a valid RTT sample
+            if(!slot->retransmitted && slot->tries > 0) espnow_rel_rtt_sample(rel, (int32_t)(now - slot->sent_at));
+            espnow_rel_complete(rel, slot, true);
+        } else if(d < highest && !slot->fast_retransmitted && slot->tries > 0){
+            //A later frame made it, this one is a hole. Resend it now instead of waiting for the RTO.
+            slot->fast_retransmitted = true;
+            slot->retransmitted = true;
+            rel->stats.retransmits++;
+            espnow_rel_transmit(rel, slot);
+        }
+    }
+}
+
+static void espnow_rel_fail_all(struct espnow_rel *rel){
+    for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+        if(rel->slots[i].used) espnow_rel_complete(rel, &rel->slots[i], false);
+    }
+}
+
+static void espnow_rel_timer_cb(void *arg){
+    int64_t now = mgos_uptime_micros();
+    int max_tries = mgos_sys_config_get_espnow_rel_max_retries() + 1;
+    bool pending = false;
+    struct espnow_rel *rel;
+    SLIST_FOREACH(rel, &espnow_rel_head, next){
+        if(rel->slots == NULL || (rel->used == 0 && !rel->fwd)) continue;
+        pending = true;
+        if(!rel->synced){
+            int64_t rto = (int64_t)rel->rto << (rel->syn_tries - 1 < 4 ? rel->syn_tries - 1 : 4);
+            if(now - rel->syn_sent_at < rto) continue;
+            if(rel->syn_tries < max_tries){
+                rel->stats.retransmits++;
+                espnow_rel_send_syn(rel);
+                continue;
+            }
+            //The peer never answered, its frames fail and the next send starts over
+            rel->syn_tries = 0;
+            espnow_rel_fail_all(rel);
+            continue;
+        }
+        bool given_up = false;
+        for(int i = 0; i < MGOS_ESPNOW_REL_WINDOW; i++){
+            struct espnow_rel_slot *slot = &rel->slots[i];
+            if(!slot->used) continue;
+            //Exponential backoff on top of the RTT based timeout
+            int64_t rto = (int64_t)rel->rto << (slot->tries > 1 ? (slot->tries - 1 < 4 ? slot->tries - 1 : 4) : 0);
+            if(slot->tries > 0 && now - slot->sent_at < rto) continue;
+            if(slot->tries >= max_tries){
+                espnow_rel_complete(rel, slot, false);
+                given_up = true;
+                continue;
+            }
+            if(slot->tries > 0){
+                slot->retransmitted = true;
+                rel->stats.retransmits++;
+            }
+            espnow_rel_transmit(rel, slot);
+        }
+        if(given_up){
+            rel->fwd = true;
+            rel->fwd_tries = 0;
+            espnow_rel_send_fwd(rel);
+        } else if(rel->fwd && now - rel->fwd_sent_at >= rel->rto){
+            if(rel->fwd_tries < max_tries) espnow_rel_send_fwd(rel);
+            else rel->fwd = false;
+        }
+    }
+    if(!pending){
+        mgos_clear_timer(espnow_rel_timer);
+        espnow_rel_timer = MGOS_INVALID_TIMER_ID;
+    }
+    (void)arg;
+}
+
+mgos_espnow_result_t mgos_espnow_set_reliable(const char *name, bool enable){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    if(enable == espnow_rel_enabled(peer)) return ESPNOW_OK;
+    if(!enable){
+        struct espnow_rel *rel = peer->rel;
+        espnow_rel_fail_all(rel);
+        espnow_pool_free(&espnow_rel_window_pool, rel->slots);
+        rel->slots = NULL;
+        return ESPNOW_OK;
+    }
+    struct espnow_rel *rel = espnow_rel_get(peer);
+    if(rel == NULL) return ESPNOW_NO_MEM;
+    rel->slots = (struct espnow_rel_slot *)espnow_pool_alloc(&espnow_rel_window_pool);
+    if(rel->slots == NULL) return ESPNOW_NO_MEM;
+    rel->used = 0;
+    //The session starts with the first frame sent
+    rel->synced = false;
+    rel->syn_tries = 0;
+    rel->srtt = 0;
+    rel->rttvar = 0;
+    rel->rto = mgos_sys_config_get_espnow_rel_rto_ms() * 1000;
+    return ESPNOW_OK;
+}
+
+bool mgos_espnow_get_rel_stats(const char *name, struct mgos_espnow_rel_stats *stats){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL || peer->rel == NULL) return false;
+    *stats = peer->rel->stats;
+    stats->enabled = espnow_rel_enabled(peer);
+    stats->in_flight = peer->rel->used;
+    stats->srtt_us = peer->rel->srtt;
+    stats->rto_us = peer->rel->rto;
+    return true;
+}
+
+void espnow_rel_free(struct mgos_espnow_peer *peer){
+    struct espnow_rel *rel = peer->rel;
+    if(rel == NULL) return;
+    if(rel->slots != NULL) espnow_rel_fail_all(rel);
+    SLIST_REMOVE(&espnow_rel_head, rel, espnow_rel, next);
+    peer->rel = NULL;
+    espnow_pool_free(&espnow_rel_window_pool, rel->slots);
+    espnow_pool_free(&espnow_rel_pool, rel);
+}
@@ -0,0 +1,279 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Request/response on top of the peer layers. Every request carries a 16 bit correlation ID so any number
+//can be pending to the same peer. Responses are matched through a small hash table on MAC and ID, and
+//timeouts are retired by a timer wheel driven by one mgos timer that only runs while requests are pending.
+
+#include "mgos.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_REQ_SLOTS
+#define MGOS_ESPNOW_REQ_SLOTS 16
+#endif
+
+#define ESPNOW_REQ_HDR_LEN 5
+//Hash buckets and wheel slots, powers of two
+#define ESPNOW_REQ_BUCKETS 16
+#define ESPNOW_REQ_WHEEL_SLOTS 64
+#define ESPNOW_REQ_TICK_MS 10
+
+struct espnow_req {
+    uint8_t mac[6];
+    uint16_t id;
+    uint32_t expires; //Wheel tick
+    espnow_resp_cb_t cb;
+    void *ud;
+    LIST_ENTRY(espnow_req) hash_entry; //Also links the free list
+    LIST_ENTRY(espnow_req) wheel_entry;
+};
+
+struct espnow_req_handler {
+    uint8_t op;
+    espnow_req_cb_t cb;
+    void *ud;
+    SLIST_ENTRY(espnow_req_handler) next;
+};
+
+LIST_HEAD(espnow_req_list, espnow_req);
+
+static struct espnow_req espnow_req_slots[MGOS_ESPNOW_REQ_SLOTS];
+static struct espnow_req_list espnow_req_free;
+static struct espnow_req_list espnow_req_hash[ESPNOW_REQ_BUCKETS];
+static struct espnow_req_list espnow_req_wheel[ESPNOW_REQ_WHEEL_SLOTS];
+static bool espnow_req_ready;
+static int espnow_req_pending;
+static uint16_t espnow_req_next_id;
+static int64_t espnow_req_base;
+static uint32_t espnow_req_tick;
+static mgos_timer_id espnow_req_timer = MGOS_INVALID_TIMER_ID;
+static SLIST_HEAD(espnow_req_handlers, espnow_req_handler) espnow_req_handlers = SLIST_HEAD_INITIALIZER(espnow_req_handlers);
+static struct mgos_espnow_req_stats espnow_req_stats;
+//Frames to fragment, grown to the longest one sent
+static uint8_t *espnow_req_large;
+static int espnow_req_large_cap;
+
+static struct espnow_req_list *espnow_req_bucket(const uint8_t *mac, uint16_t id){
+    return &espnow_req_hash[(mac[4] ^ mac[5] ^ id ^ (id >> 8)) & (ESPNOW_REQ_BUCKETS - 1)];
+}
+
+static struct espnow_req *espnow_req_find(const uint8_t *mac, uint16_t id){
+    struct espnow_req *req;
+    LIST_FOREACH(req, espnow_req_bucket(mac, id), hash_entry){
+        if(req->id == id && memcmp(req->mac, mac, 6) == 0) return req;
+    }
+    return NULL;
+}
+
+static uint32_t espnow_req_now_tick(){
+    return (uint32_t)((mgos_uptime_micros() - espnow_req_base) / (ESPNOW_REQ_TICK_MS * 1000));
+}
+
+//Unlink and free the slot before the callback, it may send a new request
+static void espnow_req_complete(struct espnow_req *req, mgos_espnow_req_status_t status, const uint8_t *data, int len){
+    uint8_t mac[6];
+    memcpy(mac, req->mac, 6);
+    uint16_t id = req->id;
+    espnow_resp_cb_t cb = req->cb;
+    void *ud = req->ud;
+    LIST_REMOVE(req, hash_entry);
+    LIST_REMOVE(req, wheel_entry);
+    LIST_INSERT_HEAD(&espnow_req_free, req, hash_entry);
+    espnow_req_pending--;
+    if(cb != NULL) cb(id, mac, status, data, len, ud);
+}
+
+static void espnow_req_timer_cb(void *arg){
+    uint32_t now = espnow_req_now_tick();
+    uint32_t steps = now - espnow_req_tick;
+    if(steps > ESPNOW_REQ_WHEEL_SLOTS) steps = ESPNOW_REQ_WHEEL_SLOTS;
+    struct espnow_req *expired[MGOS_ESPNOW_REQ_SLOTS];
+    int num = 0;
+    for(uint32_t i = 1; i <= steps; i++){
+        struct espnow_req *req;
+        //Slots hold requests for later turns of the wheel too
+        LIST_FOREACH(req, &espnow_req_wheel[(espnow_req_tick + i) & (ESPNOW_REQ_WHEEL_SLOTS - 1)], wheel_entry){
+            if((int32_t)(req->expires - now) <= 0) expired[num++] = req;
+        }
+    }
+    espnow_req_tick = now;
+    for(int i = 0; i < num; i++){
+        espnow_req_stats.timeouts++;
+        espnow_req_complete(expired[i], ESPNOW_REQ_TIMEOUT, NULL, 0);
+    }
+    if(espnow_req_pending == 0){
+        mgos_clear_timer(espnow_req_timer);
+        espnow_req_timer = MGOS_INVALID_TIMER_ID;
+    }
+    (void)arg;
+}
+
+static void espnow_req_tx_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    if(success) return;
+    struct espnow_req *req = espnow_req_find(mac, (uint16_t)(uintptr_t)ud);
+    if(req == NULL) return;
+    espnow_req_stats.send_failed++;
+    espnow_req_complete(req, ESPNOW_REQ_SEND_FAILED, NULL, 0);
+    (void)handle;
+}
+
+//Frames longer than the peer layers can carry are fragmented and handed back to the demux on the other side
+static mgos_espnow_result_t espnow_req_tx(const uint8_t *mac, uint8_t type, uint16_t id, uint8_t arg, const uint8_t *data, int len, espnow_msg_cb_t cb, void *ud){
+    int max_len = mgos_sys_config_get_espnow_frag_max_len();
+    if(max_len < MGOS_ESPNOW_MAX_LEN) max_len = MGOS_ESPNOW_MAX_LEN;
+    if(len < 0 || (len > 0 && data == NULL) || ESPNOW_REQ_HDR_LEN + len > max_len) return ESPNOW_PAYLOAD_LEN_ERR;
+    int total = ESPNOW_REQ_HDR_LEN + len;
+    bool fits = total <= espnow_peer_room(mac);
+    uint8_t small[MGOS_ESPNOW_MAX_LEN];
+    if(!fits && espnow_req_large_cap < total){
+        uint8_t *large = (uint8_t *)malloc(total);
+        if(large == NULL) return ESPNOW_NO_MEM;
+        free(espnow_req_large);
+        espnow_req_large = large;
+        espnow_req_large_cap = total;
+    }
+    uint8_t *frame = fits ? small : espnow_req_large;
+    frame[0] = ESPNOW_PROTO_MAGIC;
+    frame[1] = type;
+    frame[2] = id & 0xff;
+    frame[3] = id >> 8;
+    frame[4] = arg;
+    if(len > 0) memcpy(frame + ESPNOW_REQ_HDR_LEN, data, len);
+    //Fragments are copied into TX slots, the buffer is free again once this returns
+    if(fits) return espnow_peer_send(mac, frame, total, cb, ud, NULL);
+    return espnow_frag_send_proto(mac, frame, total, cb, ud, NULL);
+}
+
+mgos_espnow_result_t mgos_espnow_request(const char *name, uint8_t op, const uint8_t *data, int len, int timeout_ms, espnow_resp_cb_t cb, void *ud, uint16_t *id){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    if(!espnow_req_ready){
+        for(int i = 0; i < MGOS_ESPNOW_REQ_SLOTS; i++) LIST_INSERT_HEAD(&espnow_req_free, &espnow_req_slots[i], hash_entry);
+        espnow_req_ready = true;
+    }
+    struct espnow_req *req = LIST_FIRST(&espnow_req_free);
+    if(req == NULL) return ESPNOW_QUEUE_FULL;
+    uint16_t rid = ++espnow_req_next_id;
+    while(espnow_req_find(peer->mac, rid) != NULL) rid = ++espnow_req_next_id;
+    if(espnow_req_timer == MGOS_INVALID_TIMER_ID){
+        espnow_req_base = mgos_uptime_micros();
+        espnow_req_tick = 0;
+        espnow_req_timer = mgos_set_timer(ESPNOW_REQ_TICK_MS, MGOS_TIMER_REPEAT, espnow_req_timer_cb, NULL);
+    }
+    if(timeout_ms <= 0) timeout_ms = mgos_sys_config_get_espnow_req_timeout_ms();
+    LIST_REMOVE(req, hash_entry);
+    memcpy(req->mac, peer->mac, 6);
+    req->id = rid;
+    req->expires = espnow_req_now_tick() + (timeout_ms + ESPNOW_REQ_TICK_MS - 1) / ESPNOW_REQ_TICK_MS;
+    if((int32_t)(req->expires - espnow_req_tick) <= 0) req->expires = espnow_req_tick + 1;
+    req->cb = cb;
+    req->ud = ud;
+    LIST_INSERT_HEAD(espnow_req_bucket(req->mac, rid), req, hash_entry);
+    LIST_INSERT_HEAD(&espnow_req_wheel[req->expires & (ESPNOW_REQ_WHEEL_SLOTS - 1)], req, wheel_entry);
+    espnow_req_pending++;
+    //Tracked before sending so a failure reported right away still finds it
+    mgos_espnow_result_t res = espnow_req_tx(peer->mac, ESPNOW_PROTO_REQ, rid, op, data, len, espnow_req_tx_cb, (void *)(uintptr_t)rid);
+    if(res != ESPNOW_OK){
+        req = espnow_req_find(peer->mac, rid);
+        if(req != NULL){
+            req->cb = NULL;
+            espnow_req_complete(req, ESPNOW_REQ_SEND_FAILED, NULL, 0);
+        }
+        return res;
+    }
+    espnow_req_stats.sent++;
+    if(id != NULL) *id = rid;
+    return ESPNOW_OK;
+}
+
+mgos_espnow_result_t mgos_espnow_respond(const struct mgos_espnow_req_info *req, mgos_espnow_req_status_t status, const uint8_t *data, int len){
+    return espnow_req_tx(req->mac, ESPNOW_PROTO_RESP, req->id, (uint8_t)status, data, len, NULL, NULL);
+}
+
+static struct espnow_req_handler *espnow_req_get_handler(uint8_t op){
+    struct espnow_req_handler *h;
+    SLIST_FOREACH(h, &espnow_req_handlers, next){
+        if(h->op == op) return h;
+    }
+    return NULL;
+}
+
+mgos_espnow_result_t mgos_espnow_register_req_cb(uint8_t op, espnow_req_cb_t cb, void *ud){
+    struct espnow_req_handler *h = espnow_req_get_handler(op);
+    if(h == NULL){
+        h = (struct espnow_req_handler *)calloc(1, sizeof(*h));
+        if(h == NULL){
+            LOG(LL_ERROR, ("Failed to allocate request handler"));
+            return ESPNOW_NO_MEM;
+        }
+        h->op = op;
+        SLIST_INSERT_HEAD(&espnow_req_handlers, h, next);
+    }
+    h->cb = cb;
+    h->ud = ud;
+    return ESPNOW_OK;
+}
+
+void mgos_espnow_remove_req_cb(uint8_t op){
+    struct espnow_req_handler *h = espnow_req_get_handler(op);
+    if(h == NULL) return;
+    SLIST_REMOVE(&espnow_req_handlers, h, espnow_req_handler, next);
+    free(h);
+}
+
+void espnow_req_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_REQ_HDR_LEN) return;
+    struct mgos_espnow_req_info req;
+    memcpy(req.mac, mac, 6);
+    req.id = data[2] | (data[3] << 8);
+    req.op = data[4];
+    struct espnow_req_handler *h = espnow_req_get_handler(req.op);
+    if(h == NULL || h->cb == NULL){
+        espnow_req_stats.no_handler++;
+        mgos_espnow_respond(&req, ESPNOW_REQ_NO_HANDLER, NULL, 0);
+        return;
+    }
+    espnow_req_stats.served++;
+    h->cb(&req, data + ESPNOW_REQ_HDR_LEN, len - ESPNOW_REQ_HDR_LEN, h->ud);
+}
+
+void espnow_resp_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_REQ_HDR_LEN) return;
+    struct espnow_req *req = espnow_req_find(mac, data[2] | (data[3] << 8));
+    if(req == NULL){
+        espnow_req_stats.unmatched++;
+        return;
+    }
+    mgos_espnow_req_status_t status = (mgos_espnow_req_status_t)data[4];
+    if(status != ESPNOW_REQ_OK && status != ESPNOW_REQ_NO_HANDLER) status = ESPNOW_REQ_ERROR;
+    espnow_req_stats.completed++;
+    espnow_req_complete(req, status, data + ESPNOW_REQ_HDR_LEN, len - ESPNOW_REQ_HDR_LEN);
+}
+
+void mgos_espnow_get_req_stats(struct mgos_espnow_req_stats *stats){
+    *stats = espnow_req_stats;
+    stats->slots = MGOS_ESPNOW_REQ_SLOTS;
+    stats->pending = espnow_req_pending;
+}
@@ -0,0 +1,387 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdarg.h>
+
+#include "mgos.h"
+#include "frozen/frozen.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#if MGOS_HAVE_RPC_COMMON
+
+#include "mgos_rpc.h"
+
+static int espnow_rpc_latency(struct json_out *out, va_list *ap){
+    const struct mgos_espnow_stats *stats = va_arg(*ap, const struct mgos_espnow_stats *);
+    int len = json_printf(out, "[");
+    for(int i = 0; i < MGOS_ESPNOW_LAT_BUCKETS; i++){
+        len += json_printf(out, "%s%u", i > 0 ? ", " : "", stats->tx_latency[i]);
+    }
+    return len + json_printf(out, "]");
+}
+
+static int espnow_rpc_pool(struct json_out *out, va_list *ap){
+    const struct mgos_espnow_pool_stats *ps = va_arg(*ap, const struct mgos_espnow_pool_stats *);
+    return json_printf(out, "{slots: %d, used: %d, high_water: %d, exhausted: %u}", ps->slots, ps->used, ps->high_water, ps->exhausted);
+}
+
+static int espnow_rpc_classes(struct json_out *out, va_list *ap){
+    static const char *names[MGOS_ESPNOW_PRIO_CLASSES] = {"high", "normal", "bulk"};
+    int len = json_printf(out, "{");
+    for(int i = 0; i < MGOS_ESPNOW_PRIO_CLASSES; i++){
+        struct mgos_espnow_prio_stats ps;
+        mgos_espnow_get_prio_stats((mgos_espnow_prio_t)i, &ps);
+        len += json_printf(out, "%s%Q: {depth: %d, queued: %u, wait_max_us: %u}", i > 0 ? ", " : "", names[i],
+            ps.queue_depth, ps.queued, ps.wait_max_us);
+    }
+    (void)ap;
+    return len + json_printf(out, "}");
+}
+
+static int espnow_rpc_peer(struct json_out *out, const struct mgos_espnow_peer *peer){
+    const struct mgos_espnow_peer_stats *st = &peer->stats;
+    struct mgos_espnow_link_stats link;
+    mgos_espnow_get_link_stats(peer->name, &link);
+    char mac[18];
+    snprintf(mac, sizeof(mac), "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x", peer->mac[0], peer->mac[1], peer->mac[2], peer->mac[3], peer->mac[4], peer->mac[5]);
+    return json_printf(out, "{name: %Q, mac: %Q, resident: %B, rx_frames: %u, rx_bytes: %u, tx_frames: %u, tx_bytes: %u, tx_failed: %u, tx_dropped: %u, "
+        "link: {tx_success_pct: %d, rtt_us: %d, rtt_var_us: %d, rssi: %d, degraded: %B, pings: %u, echoes: %u, pings_lost: %u}}",
+        peer->name, mac, peer->resident, st->rx_frames, st->rx_bytes, st->tx_frames, st->tx_bytes, st->tx_failed, st->tx_dropped,
+        (int)(link.tx_success * 100.0f + 0.5f), link.rtt_us, link.rtt_var_us, link.rssi, link.degraded, link.pings, link.echoes, link.pings_lost);
+}
+
+//Every peer, or only the one named
+static int espnow_rpc_peers(struct json_out *out, va_list *ap){
+    const char *name = va_arg(*ap, const char *);
+    int len = json_printf(out, "[");
+    if(name != NULL){
+        len += espnow_rpc_peer(out, mgos_espnow_get_peer_by_name(name));
+    } else {
+        struct mgos_espnow_peer *peer;
+        SLIST_FOREACH(peer, &peer_list, next){
+            if(peer != SLIST_FIRST(&peer_list)) len += json_printf(out, ", ");
+            len += espnow_rpc_peer(out, peer);
+        }
+    }
+    return len + json_printf(out, "]");
+}
+
+static void espnow_rpc_stats(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args){
+    char *name = NULL;
+    json_scanf(args.p, args.len, "{peer: %Q}", &name);
+    if(name != NULL && mgos_espnow_get_peer_by_name(name) == NULL){
+        mg_rpc_send_errorf(ri, 404, "peer %s not found", name);
+        free(name);
+        return;
+    }
+    struct mgos_espnow_stats st;
+    struct mgos_espnow_tx_stats tx;
+    struct mgos_espnow_rx_stats rx;
+    struct mgos_espnow_rxbuf_stats rxbuf;
+    struct mgos_espnow_op_stats ops;
+    struct mgos_espnow_req_stats req;
+    struct mgos_espnow_xfer_stats xfer;
+    struct mgos_espnow_compress_stats lz;
+    struct mgos_espnow_mem_stats mem;
+    struct mgos_espnow_mesh_stats mesh;
+    mgos_espnow_get_stats(&st);
+    mgos_espnow_get_tx_stats(&tx);
+    mgos_espnow_get_rx_stats(&rx);
+    mgos_espnow_get_rxbuf_stats(&rxbuf);
+    mgos_espnow_get_op_stats(&ops);
+    mgos_espnow_get_req_stats(&req);
+    mgos_espnow_get_xfer_stats(&xfer);
+    mgos_espnow_get_compress_stats(&lz);
+    mgos_espnow_get_mem_stats(&mem);
+    mgos_espnow_get_mesh_stats(&mesh);
+    mg_rpc_send_responsef(ri, "{rx_frames: %u, rx_bytes: %u, tx_frames: %u, tx_bytes: %u, tx_failed: %u, tx_dropped: %u, "
+        "cb_runs: %u, cb_time_us: %u, cb_max_us: %u, tx_latency_us_log2: %M, "
+        "tx_queue: {depth: %d, high_water: %d, in_flight: %d, retries: %u, rate_limited: %u, paced: %u, "
+        "channel_switches: %u, switches_avoided: %u, submitted: %u, submit_full: %u, submit_failed: %u, classes: %M}, "
+        "rx_ring: {used: %d, high_water: %d, dropped: %u}, "
+        "rx_bufs: {in_use: %d, high_water: %d, exhausted: %u}, "
+        "ops: {delivered: %u, unknown: %u}, "
+        "requests: {pending: %d, sent: %u, completed: %u, timeouts: %u, send_failed: %u, served: %u}, "
+        "files: {active: %d, sent: %u, resent: %u, received: %u, duplicates: %u, completed: %u, failed: %u, resumed: %u}, "
+        "compress: {enabled: %B, compressed: %u, plain: %u, bytes_in: %u, bytes_out: %u, decompressed: %u, errors: %u}, "
+        "pools: {bytes: %d, heap_bytes: %d, peers: %M, callbacks: %M, cb_lists: %M, tables: %M, retired: %M}, "
+        "mesh: {originated: %u, delivered: %u, delivered_hops: %u, duplicates: %u, relayed: %u, suppressed: %u, relay_dropped: %u, "
+        "ttl_expired: %u, flooded: %u, routed: %u, resent: %u, route_failures: %u, routes: %d}, peers: %M}",
+        st.rx_frames, st.rx_bytes, st.tx_frames, st.tx_bytes, st.tx_failed, st.tx_dropped,
+        st.cb_runs, st.cb_time_us, st.cb_max_us, espnow_rpc_latency, &st,
+        tx.queue_depth, tx.queue_high_water, tx.in_flight, tx.retries, tx.rate_limited, tx.paced,
+        tx.channel_switches, tx.switches_avoided, tx.submitted, tx.submit_full, tx.submit_failed, espnow_rpc_classes,
+        rx.ring_used, rx.ring_high_water, rx.dropped,
+        rxbuf.in_use, rxbuf.high_water, rxbuf.exhausted,
+        ops.delivered, ops.unknown,
+        req.pending, req.sent, req.completed, req.timeouts, req.send_failed, req.served,
+        xfer.active, xfer.sent, xfer.resent, xfer.received, xfer.duplicates, xfer.completed, xfer.failed, xfer.resumed,
+        lz.enabled, lz.tx_compressed, lz.tx_plain, lz.tx_bytes_in, lz.tx_bytes_out, lz.rx_decompressed, lz.rx_errors,
+        mem.static_bytes, mem.heap_bytes, espnow_rpc_pool, &mem.peers, espnow_rpc_pool, &mem.callbacks, espnow_rpc_pool, &mem.cb_lists,
+        espnow_rpc_pool, &mem.tables, espnow_rpc_pool, &mem.retired,
+        mesh.originated, mesh.delivered, mesh.delivered_hops, mesh.duplicates, mesh.relayed, mesh.suppressed, mesh.relay_dropped,
+        mesh.ttl_expired, mesh.flooded, mesh.routed, mesh.resent, mesh.route_failures, mesh.routes,
+        espnow_rpc_peers, name);
+    free(name);
+    (void)cb_arg;
+    (void)fi;
+}
+
+//RPC bridge. ESPNow.Call sends {method, args} to a peer as a MGOS_ESPNOW_REQ_OP_RPC request. With
+//espnow.rpc_bridge the peer runs it through an RPC channel of its own and answers with the response frame.
+#define ESPNOW_RPC_BRIDGE_CALLS 4
+
+struct espnow_rpc_bridge_call {
+    bool used;
+    int id;
+    struct mgos_espnow_req_info req;
+};
+
+static struct espnow_rpc_bridge_call espnow_rpc_bridge_calls[ESPNOW_RPC_BRIDGE_CALLS];
+static int espnow_rpc_bridge_id;
+static bool espnow_rpc_bridge_open;
+
+static void espnow_rpc_call_cb(uint16_t id, const uint8_t *mac, mgos_espnow_req_status_t status, const uint8_t *data, int len, void *ud){
+    struct mg_rpc_request_info *ri = (struct mg_rpc_request_info *)ud;
+    if(status == ESPNOW_REQ_OK){
+        struct json_token result = JSON_INVALID_TOKEN;
+        int code = 0;
+        char *msg = NULL;
+        json_scanf((const char *)data, len, "{result: %T, error: {code: %d, message: %Q}}", &result, &code, &msg);
+        if(result.ptr != NULL && result.type == JSON_TYPE_STRING){
+            mg_rpc_send_responsef(ri, "%.*Q", result.len, result.ptr);
+        } else if(result.ptr != NULL){
+            mg_rpc_send_responsef(ri, "%.*s", result.len, result.ptr);
+        } else if(code != 0 || msg != NULL){
+            mg_rpc_send_errorf(ri, code, "%s", msg != NULL ? msg : "");
+        } else {
+            mg_rpc_send_responsef(ri, NULL);
+        }
+        free(msg);
+    } else if(status == ESPNOW_REQ_ERROR){
+        mg_rpc_send_errorf(ri, 500, "%.*s", len, (const char *)data);
+    } else if(status == ESPNOW_REQ_NO_HANDLER){
+        mg_rpc_send_errorf(ri, 501, "RPC bridge not enabled on the peer");
+    } else if(status == ESPNOW_REQ_TIMEOUT){
+        mg_rpc_send_errorf(ri, 504, "timeout");
+    } else {
+        mg_rpc_send_errorf(ri, 503, "request not sent");
+    }
+    (void)id;
+    (void)mac;
+}
+
+static void espnow_rpc_call(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args){
+    char *peer = NULL, *method = NULL;
+    struct json_token params = JSON_INVALID_TOKEN;
+    int timeout_ms = 0;
+    json_scanf(args.p, args.len, "{peer: %Q, method: %Q, args: %T, timeout_ms: %d}", &peer, &method, &params, &timeout_ms);
+    if(peer == NULL || method == NULL){
+        mg_rpc_send_errorf(ri, 400, "peer and method are required");
+    } else {
+        char *call = json_asprintf("{method: %Q, args: %.*s}", method, params.ptr != NULL ? params.len : 2, params.ptr != NULL ? params.ptr : "{}");
+        mgos_espnow_result_t res = call != NULL ? mgos_espnow_request(peer, MGOS_ESPNOW_REQ_OP_RPC, (const uint8_t *)call, strlen(call),
+            timeout_ms, espnow_rpc_call_cb, ri, NULL) : ESPNOW_NO_MEM;
+        if(res == ESPNOW_PEER_NOT_FOUND){
+            mg_rpc_send_errorf(ri, 404, "peer %s not found", peer);
+        } else if(res != ESPNOW_OK){
+            mg_rpc_send_errorf(ri, 503, "request not sent (%d)", res);
+        }
+        free(call);
+    }
+    free(peer);
+    free(method);
+    (void)cb_arg;
+    (void)fi;
+}
+
+//Start or stop recording, and save the ring as a pcap file to get with FS.Get
+static void espnow_rpc_capture(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args){
+    struct json_token enable = JSON_INVALID_TOKEN;
+    char *file = NULL;
+    json_scanf(args.p, args.len, "{enable: %T, file: %Q}", &enable, &file);
+    if(enable.type == JSON_TYPE_TRUE || enable.type == JSON_TYPE_FALSE){
+        if(!mgos_espnow_capture_enable(enable.type == JSON_TYPE_TRUE)){
+            mg_rpc_send_errorf(ri, 500, "no memory for the capture ring");
+            free(file);
+            return;
+        }
+    }
+    int saved = 0;
+    if(file != NULL && (saved = mgos_espnow_capture_save(file)) < 0){
+        mg_rpc_send_errorf(ri, 500, "failed to write %s", file);
+        free(file);
+        return;
+    }
+    struct mgos_espnow_capture_stats st;
+    mgos_espnow_get_capture_stats(&st);
+    mg_rpc_send_responsef(ri, "{enabled: %B, captured: %u, overwritten: %u, saved: %d}", st.enabled, st.captured, st.overwritten, saved);
+    free(file);
+    (void)cb_arg;
+    (void)fi;
+}
+
+static void espnow_rpc_send_file_cb(const struct mgos_espnow_xfer_info *info, mgos_espnow_xfer_status_t status, void *ud){
+    struct mg_rpc_request_info *ri = (struct mg_rpc_request_info *)ud;
+    if(status == ESPNOW_XFER_OK){
+        mg_rpc_send_responsef(ri, "{size: %u}", info->size);
+    } else {
+        mg_rpc_send_errorf(ri, 500, "transfer failed (%d) after %u of %u bytes", status, info->done, info->size);
+    }
+}
+
+//Answered when the peer has the whole file, pass a long enough RPC timeout for large ones
+static void espnow_rpc_send_file(struct mg_rpc_request_info *ri, void *cb_arg, struct mg_rpc_frame_info *fi, struct mg_str args){
+    char *peer = NULL, *path = NULL, *name = NULL;
+    json_scanf(args.p, args.len, "{peer: %Q, path: %Q, name: %Q}", &peer, &path, &name);
+    if(peer == NULL || path == NULL){
+        mg_rpc_send_errorf(ri, 400, "peer and path are required");
+    } else {
+        mgos_espnow_result_t res = mgos_espnow_send_file(peer, path, name, espnow_rpc_send_file_cb, ri);
+        if(res == ESPNOW_PEER_NOT_FOUND){
+            mg_rpc_send_errorf(ri, 404, "peer %s not found", peer);
+        } else if(res != ESPNOW_OK){
+            mg_rpc_send_errorf(ri, 503, "transfer not started (%d)", res);
+        }
+    }
+    free(peer);
+    free(path);
+    free(name);
+    (void)cb_arg;
+    (void)fi;
+}
+
+static void espnow_rpc_bridge_serve(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    struct mg_rpc_channel *ch = (struct mg_rpc_channel *)ud;
+    char *method = NULL;
+    struct json_token params = JSON_INVALID_TOKEN;
+    json_scanf((const char *)data, len, "{method: %Q, args: %T}", &method, &params);
+    if(method == NULL){
+        static const char err[] = "bad call";
+        mgos_espnow_respond(req, ESPNOW_REQ_ERROR, (const uint8_t *)err, sizeof(err) - 1);
+        return;
+    }
+    //The oldest call is forgotten when all are taken, its caller times out
+    if(++espnow_rpc_bridge_id <= 0) espnow_rpc_bridge_id = 1;
+    struct espnow_rpc_bridge_call *call = &espnow_rpc_bridge_calls[espnow_rpc_bridge_id % ESPNOW_RPC_BRIDGE_CALLS];
+    call->used = true;
+    call->id = espnow_rpc_bridge_id;
+    call->req = *req;
+    char *frame = json_asprintf("{id: %d, src: %Q, method: %Q, args: %.*s}", call->id, "espnow", method,
+        params.ptr != NULL ? params.len : 2, params.ptr != NULL ? params.ptr : "{}");
+    if(frame != NULL){
+        struct mg_str f = mg_mk_str(frame);
+        ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+    }
+    free(frame);
+    free(method);
+}
+
+static void espnow_rpc_bridge_sent(void *arg){
+    struct mg_rpc_channel *ch = (struct mg_rpc_channel *)arg;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *)1);
+}
+
+static bool espnow_rpc_bridge_send_frame(struct mg_rpc_channel *ch, const struct mg_str f){
+    int id = 0;
+    json_scanf(f.p, f.len, "{id: %d}", &id);
+    for(int i = 0; i < ESPNOW_RPC_BRIDGE_CALLS; i++){
+        struct espnow_rpc_bridge_call *call = &espnow_rpc_bridge_calls[i];
+        if(!call->used || call->id != id) continue;
+        call->used = false;
+        if(mgos_espnow_respond(&call->req, ESPNOW_REQ_OK, (const uint8_t *)f.p, f.len) == ESPNOW_PAYLOAD_LEN_ERR){
+            static const char err[] = "response too long";
+            mgos_espnow_respond(&call->req, ESPNOW_REQ_ERROR, (const uint8_t *)err, sizeof(err) - 1);
+        }
+        break;
+    }
+    //The RPC core marks the channel busy after this returns, report the frame sent afterwards
+    mgos_invoke_cb(espnow_rpc_bridge_sent, ch, false);
+    return true;
+}
+
+static void espnow_rpc_bridge_connect(struct mg_rpc_channel *ch){
+    if(espnow_rpc_bridge_open) return;
+    espnow_rpc_bridge_open = true;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+}
+
+static void espnow_rpc_bridge_close(struct mg_rpc_channel *ch){
+    (void)ch;
+}
+
+static void espnow_rpc_bridge_destroy(struct mg_rpc_channel *ch){
+    (void)ch;
+}
+
+static const char *espnow_rpc_bridge_get_type(struct mg_rpc_channel *ch){
+    (void)ch;
+    return "ESPNOW";
+}
+
+static bool espnow_rpc_bridge_is_persistent(struct mg_rpc_channel *ch){
+    (void)ch;
+    return true;
+}
+
+static bool espnow_rpc_bridge_is_broadcast_enabled(struct mg_rpc_channel *ch){
+    (void)ch;
+    return false;
+}
+
+static char *espnow_rpc_bridge_get_info(struct mg_rpc_channel *ch){
+    (void)ch;
+    return strdup("espnow");
+}
+
+static void espnow_rpc_bridge_init(){
+    struct mg_rpc_channel *ch = (struct mg_rpc_channel *)calloc(1, sizeof(*ch));
+    if(ch == NULL){
+        LOG(LL_ERROR, ("Failed to allocate RPC bridge channel"));
+        return;
+    }
+    ch->ch_connect = espnow_rpc_bridge_connect;
+    ch->send_frame = espnow_rpc_bridge_send_frame;
+    ch->ch_close = espnow_rpc_bridge_close;
+    ch->ch_destroy = espnow_rpc_bridge_destroy;
+    ch->get_type = espnow_rpc_bridge_get_type;
+    ch->is_persistent = espnow_rpc_bridge_is_persistent;
+    ch->is_broadcast_enabled = espnow_rpc_bridge_is_broadcast_enabled;
+    ch->get_info = espnow_rpc_bridge_get_info;
+    mg_rpc_add_channel(mgos_rpc_get_global(), mg_mk_str("espnow"), ch);
+    ch->ch_connect(ch);
+    mgos_espnow_register_req_cb(MGOS_ESPNOW_REQ_OP_RPC, espnow_rpc_bridge_serve, ch);
+}
+
+void espnow_rpc_init(){
+    if(mgos_rpc_get_global() == NULL) return;
+    mg_rpc_add_handler(mgos_rpc_get_global(), "ESPNow.Stats", "{peer: %Q}", espnow_rpc_stats, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "ESPNow.Call", "{peer: %Q, method: %Q, args: %T, timeout_ms: %d}", espnow_rpc_call, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "ESPNow.Capture", "{enable: %B, file: %Q}", espnow_rpc_capture, NULL);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "ESPNow.SendFile", "{peer: %Q, path: %Q, name: %Q}", espnow_rpc_send_file, NULL);
+    if(mgos_sys_config_get_espnow_rpc_bridge()) espnow_rpc_bridge_init();
+}
+
+#endif
@@ -0,0 +1,262 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <stdio.h>
+
+#include "mgos.h"
+#include "common/cs_crc32.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+//Binary peer store. The file starts with a header, followed by records appended as peers are added and
+//removed. Replaying the records in order rebuilds the peer list. Once the log holds many more records
+//than there are peers it is compacted, rewritten with one record per peer.
+//
+//Record: [op][mac, 6][softap][channel][name len][name][crc32 of the previous bytes, 4, little endian]
+static const uint8_t espnow_store_magic[5] = {'E', 'S', 'P', 'N', 1};
+
+enum espnow_store_op {
+    ESPNOW_STORE_ADD = 1,
+    ESPNOW_STORE_REMOVE = 2,
+};
+
+#define ESPNOW_STORE_REC_FIXED 10
+#define ESPNOW_STORE_REC_MAX (ESPNOW_STORE_REC_FIXED + 255 + 4)
+//Appends are written at once when this much is waiting
+#define ESPNOW_STORE_PENDING_MAX 1024
+//Compact when the log holds more than twice the live peers plus this
+#define ESPNOW_STORE_COMPACT_SLACK 32
+
+//Room for one more record once the appends are due
+static uint8_t espnow_store_pending[ESPNOW_STORE_PENDING_MAX + ESPNOW_STORE_REC_MAX];
+static int espnow_store_pending_len, espnow_store_pending_records;
+static bool espnow_store_broken;
+static mgos_timer_id espnow_store_timer = MGOS_INVALID_TIMER_ID;
+static struct mgos_espnow_store_stats espnow_store_stats;
+
+bool espnow_store_enabled(){
+    const char *filename = mgos_sys_config_get_espnow_store_filename();
+    return filename != NULL && filename[0] != '\0';
+}
+
+static int espnow_store_encode(uint8_t *rec, uint8_t op, const uint8_t *mac, bool softap, int channel, const char *name){
+    size_t name_len = name != NULL ? strlen(name) : 0;
+    if(name_len > 255) name_len = 255;
+    rec[0] = op;
+    memcpy(rec + 1, mac, 6);
+    rec[7] = softap;
+    rec[8] = (uint8_t)channel;
+    rec[9] = (uint8_t)name_len;
+    if(name_len > 0) memcpy(rec + ESPNOW_STORE_REC_FIXED, name, name_len);
+    int len = ESPNOW_STORE_REC_FIXED + name_len;
+    uint32_t crc = cs_crc32(0, rec, len);
+    for(int i = 0; i < 4; i++){
+        rec[len++] = (uint8_t)(crc >> (8 * i));
+    }
+    return len;
+}
+
+static bool espnow_store_write_header(FILE *f){
+    return fwrite(espnow_store_magic, 1, sizeof(espnow_store_magic), f) == sizeof(espnow_store_magic);
+}
+
+bool mgos_espnow_store_compact(){
+    if(!espnow_store_enabled()) return false;
+    const char *filename = mgos_sys_config_get_espnow_store_filename();
+    char tmp_name[strlen(filename) + 5];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+    FILE *f = fopen(tmp_name, "wb");
+    if(f == NULL){
+        LOG(LL_ERROR, ("Failed to open file %s for writing!", tmp_name));
+        return false;
+    }
+    uint8_t rec[ESPNOW_STORE_REC_MAX];
+    bool ok = espnow_store_write_header(f);
+    int size = sizeof(espnow_store_magic), records = 0;
+    struct mgos_espnow_peer *peer;
+    SLIST_FOREACH(peer, &peer_list, next){
+        if(!ok) break;
+        int len = espnow_store_encode(rec, ESPNOW_STORE_ADD, peer->mac, peer->softap, peer->channel, peer->name);
+        ok = fwrite(rec, 1, len, f) == (size_t)len;
+        size += len;
+        records++;
+    }
+    if(fclose(f) != 0) ok = false;
+    //Renaming over an existing file is not supported by every filesystem. If power is lost in between,
+    //the loader picks up the temporary file.
+    if(ok){
+        remove(filename);
+        ok = rename(tmp_name, filename) == 0;
+    }
+    if(!ok){
+        LOG(LL_ERROR, ("Failed to compact peer store %s", filename));
+        remove(tmp_name);
+        return false;
+    }
+    //The snapshot includes everything still waiting to be appended
+    espnow_store_pending_len = 0;
+    espnow_store_pending_records = 0;
+    espnow_store_broken = false;
+    espnow_store_stats.records = records;
+    espnow_store_stats.file_size = size;
+    espnow_store_stats.pending_bytes = 0;
+    espnow_store_stats.compactions++;
+    return true;
+}
+
+static bool espnow_store_compact_due(){
+    int records = espnow_store_stats.records + espnow_store_pending_records;
+    return espnow_store_broken || espnow_store_stats.file_size == 0 ||
+        records > 2 * mgos_espnow_total_peers() + ESPNOW_STORE_COMPACT_SLACK;
+}
+
+void mgos_espnow_store_commit(){
+    if(espnow_store_timer != MGOS_INVALID_TIMER_ID){
+        mgos_clear_timer(espnow_store_timer);
+        espnow_store_timer = MGOS_INVALID_TIMER_ID;
+    }
+    if(espnow_store_pending_len == 0 || !espnow_store_enabled()) return;
+    if(espnow_store_compact_due()){
+        mgos_espnow_store_compact();
+        return;
+    }
+    FILE *f = fopen(mgos_sys_config_get_espnow_store_filename(), "ab");
+    bool ok = f != NULL && fwrite(espnow_store_pending, 1, espnow_store_pending_len, f) == (size_t)espnow_store_pending_len;
+    if(f != NULL && fclose(f) != 0) ok = false;
+    if(!ok){
+        //A partial record at the end would hide anything appended after it, rewrite the file instead
+        LOG(LL_ERROR, ("Failed to append to peer store, compacting"));
+        espnow_store_broken = true;
+        mgos_espnow_store_compact();
+        return;
+    }
+    espnow_store_stats.records += espnow_store_pending_records;
+    espnow_store_stats.file_size += espnow_store_pending_len;
+    espnow_store_stats.commits++;
+    espnow_store_pending_len = 0;
+    espnow_store_pending_records = 0;
+    espnow_store_stats.pending_bytes = 0;
+}
+
+static void espnow_store_timer_cb(void *arg){
+    espnow_store_timer = MGOS_INVALID_TIMER_ID;
+    mgos_espnow_store_commit();
+    (void)arg;
+}
+
+static void espnow_store_put(uint8_t op, const uint8_t *mac, bool softap, int channel, const char *name){
+    if((int)sizeof(espnow_store_pending) - espnow_store_pending_len < ESPNOW_STORE_REC_MAX){
+        //Commits keep failing, try to write the whole list instead. If that fails too the next commit does.
+        espnow_store_broken = true;
+        if(!mgos_espnow_store_compact()){
+            espnow_store_pending_len = 0;
+            espnow_store_pending_records = 0;
+            espnow_store_stats.pending_bytes = 0;
+        }
+        return;
+    }
+    espnow_store_pending_len += espnow_store_encode(espnow_store_pending + espnow_store_pending_len, op, mac, softap, channel, name);
+    espnow_store_pending_records++;
+    espnow_store_stats.pending_bytes = espnow_store_pending_len;
+    int commit_ms = mgos_sys_config_get_espnow_store_commit_ms();
+    if(commit_ms <= 0 || espnow_store_pending_len >= ESPNOW_STORE_PENDING_MAX){
+        mgos_espnow_store_commit();
+    } else if(espnow_store_timer == MGOS_INVALID_TIMER_ID){
+        espnow_store_timer = mgos_set_timer(commit_ms, 0, espnow_store_timer_cb, NULL);
+    }
+}
+
+void espnow_store_add(const struct mgos_espnow_peer *peer){
+    espnow_store_put(ESPNOW_STORE_ADD, peer->mac, peer->softap, peer->channel, peer->name);
+}
+
+void espnow_store_remove(const uint8_t *mac){
+    espnow_store_put(ESPNOW_STORE_REMOVE, mac, false, 0, NULL);
+}
+
+//Replay the store into the peer list. Returns false if there is no valid store.
+bool espnow_store_load(){
+    const char *filename = mgos_sys_config_get_espnow_store_filename();
+    FILE *f = fopen(filename, "rb");
+    if(f == NULL){
+        char tmp_name[strlen(filename) + 5];
+        snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename);
+        if(rename(tmp_name, filename) != 0) return false;
+        LOG(LL_ERROR, ("Recovered peer store from %s", tmp_name));
+        f = fopen(filename, "rb");
+        if(f == NULL) return false;
+    }
+    uint8_t rec[ESPNOW_STORE_REC_MAX];
+    if(fread(rec, 1, sizeof(espnow_store_magic), f) != sizeof(espnow_store_magic) ||
+       memcmp(rec, espnow_store_magic, sizeof(espnow_store_magic)) != 0){
+        LOG(LL_ERROR, ("Invalid peer store %s", filename));
+        fclose(f);
+        return false;
+    }
+    int size = sizeof(espnow_store_magic), records = 0;
+    char name[256];
+    for(;;){
+        size_t got = fread(rec, 1, ESPNOW_STORE_REC_FIXED, f);
+        if(got != ESPNOW_STORE_REC_FIXED){
+            if(got > 0) espnow_store_broken = true;
+            break;
+        }
+        int len = ESPNOW_STORE_REC_FIXED + rec[9] + 4;
+        if(fread(rec + ESPNOW_STORE_REC_FIXED, 1, len - ESPNOW_STORE_REC_FIXED, f) != (size_t)(len - ESPNOW_STORE_REC_FIXED)){
+            espnow_store_broken = true;
+            break;
+        }
+        uint32_t crc = cs_crc32(0, rec, len - 4);
+        uint32_t stored = rec[len - 4] | (rec[len - 3] << 8) | (rec[len - 2] << 16) | ((uint32_t)rec[len - 1] << 24);
+        if(crc != stored || (rec[0] != ESPNOW_STORE_ADD && rec[0] != ESPNOW_STORE_REMOVE)){
+            espnow_store_broken = true;
+            break;
+        }
+        if(rec[0] == ESPNOW_STORE_ADD){
+            memcpy(name, rec + ESPNOW_STORE_REC_FIXED, rec[9]);
+            name[rec[9]] = '\0';
+            espnow_peer_load(name, rec + 1, rec[7] != 0, rec[8]);
+        } else {
+            espnow_peer_unload(rec + 1);
+        }
+        size += len;
+        records++;
+    }
+    fclose(f);
+    espnow_store_stats.records = records;
+    espnow_store_stats.file_size = size;
+    if(espnow_store_broken){
+        //Usually a record cut short by a reset, drop it and whatever follows
+        LOG(LL_ERROR, ("Peer store %s damaged after %d records, compacting", filename, records));
+        mgos_espnow_store_compact();
+    } else if(espnow_store_compact_due()){
+        mgos_espnow_store_compact();
+    }
+    return true;
+}
+
+void mgos_espnow_get_store_stats(struct mgos_espnow_store_stats *stats){
+    *stats = espnow_store_stats;
+    stats->peers = mgos_espnow_total_peers();
+}
@@ -0,0 +1,694 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Bulk file transfer. The sender keeps a window of chunks in flight and reads each one from the file when
+//it is sent or resent, nothing is buffered. The receiver writes chunks where they belong as they arrive
+//and tracks the window with a bitmap. Its ACKs carry the first missing chunk and the bitmap after it, so
+//gaps below the highest chunk received work as a selective NACK. Both sides run a CRC32 over the file
+//in order and the receiver keeps its progress in a state file next to the partial one, an interrupted
+//transfer of the same name and size resumes where it stopped.
+
+#include "mgos.h"
+#include "common/cs_crc32.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+
+#ifndef MGOS_ESPNOW_XFER_SLOTS
+#define MGOS_ESPNOW_XFER_SLOTS 2
+#endif
+
+enum espnow_xfer_op {
+    ESPNOW_XFER_OP_OFFER = 1, //[magic][type][op][id][size, 4][chunk len][name]
+    ESPNOW_XFER_OP_DATA = 2,  //[magic][type][op][id][index, 4][data]
+    ESPNOW_XFER_OP_ACK = 3,   //[magic][type][op][id][status][first missing chunk, 4][received from it on, 8]
+    ESPNOW_XFER_OP_END = 4,   //[magic][type][op][id][crc32, 4]
+};
+
+#define ESPNOW_XFER_OFFER_HDR_LEN 9
+#define ESPNOW_XFER_DATA_HDR_LEN 8
+#define ESPNOW_XFER_ACK_LEN 17
+#define ESPNOW_XFER_END_LEN 8
+//Chunks tracked by the bitmaps, the window can not be larger
+#define ESPNOW_XFER_MAX_WINDOW 64
+#define ESPNOW_XFER_NAME_LEN 48
+#define ESPNOW_XFER_PATH_LEN 256
+#define ESPNOW_XFER_TICK_MS 20
+//Chunks received between writes of the receiver state file
+#define ESPNOW_XFER_SAVE_EVERY 64
+//Bytes read back per tick to bring the CRC up to chunks that were not added when they were handled
+#define ESPNOW_XFER_CRC_STEP 4096
+#define ESPNOW_XFER_STATE_MAGIC 0x53465845
+
+struct espnow_xfer {
+    bool used;
+    bool sender;
+    bool accepted;        //Sender: the peer answered the offer
+    uint8_t status;       //ESPNOW_XFER_RUNNING, receivers keep the final one a while to answer retransmits
+    uint8_t mac[6];
+    uint8_t id;
+    uint8_t chunk;        //Data bytes per DATA frame, the last one can be shorter
+    uint32_t size;
+    uint32_t count;       //Chunks in the file
+    uint32_t base;        //First chunk not acknowledged (sender) or not received (receiver)
+    uint32_t next;        //Sender: first chunk never sent
+    uint64_t mask;        //Chunks done from base on, bit i for chunk base + i
+    uint32_t crc;
+    uint32_t crc_pos;     //Bytes of the file in crc
+    uint32_t last_rx;     //ms of the last frame from the peer
+    uint32_t last_tx;     //ms of the last OFFER or END (sender) or ACK (receiver)
+    int unacked;          //Receiver: chunks received since the last ACK
+    uint32_t saved;       //Receiver: base written to the state file
+    uint32_t sent_at[ESPNOW_XFER_MAX_WINDOW]; //ms a chunk was last sent, by index modulo the bitmap size
+    uint32_t sent_seq[ESPNOW_XFER_MAX_WINDOW]; //Order a chunk was last sent in, same index
+    uint32_t tx_seq;      //Sender: DATA frames sent
+    uint32_t acked_seq;   //Sender: latest sent chunk acknowledged, older ones still missing are lost
+    FILE *fp;
+    char *path;
+    char name[ESPNOW_XFER_NAME_LEN];
+    espnow_xfer_cb_t cb;
+    void *ud;
+};
+
+//Receiver state file, [magic][size][chunk][base] in host order
+struct espnow_xfer_state {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t chunk;
+    uint32_t base;
+};
+
+static struct espnow_xfer espnow_xfers[MGOS_ESPNOW_XFER_SLOTS];
+static mgos_timer_id espnow_xfer_timer = MGOS_INVALID_TIMER_ID;
+static uint8_t espnow_xfer_next_id;
+static bool espnow_xfer_pumping;
+static espnow_xfer_cb_t espnow_xfer_recv_cb;
+static void *espnow_xfer_recv_ud;
+static struct mgos_espnow_xfer_stats espnow_xfer_stats;
+
+static uint32_t espnow_xfer_now(){
+    return (uint32_t)(mgos_uptime_micros() / 1000);
+}
+
+static int espnow_xfer_window(){
+    int window = mgos_sys_config_get_espnow_xfer_window();
+    if(window < 1) return 1;
+    return window > ESPNOW_XFER_MAX_WINDOW ? ESPNOW_XFER_MAX_WINDOW : window;
+}
+
+static uint32_t espnow_xfer_get32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void espnow_xfer_put32(uint8_t *p, uint32_t v){
+    for(int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static struct espnow_xfer *espnow_xfer_find(const uint8_t *mac, uint8_t id, bool sender){
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        struct espnow_xfer *x = &espnow_xfers[i];
+        if(x->used && x->sender == sender && x->id == id && memcmp(x->mac, mac, 6) == 0) return x;
+    }
+    return NULL;
+}
+
+static struct espnow_xfer *espnow_xfer_alloc(){
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        struct espnow_xfer *x = &espnow_xfers[i];
+        if(!x->used){
+            memset(x, 0, sizeof(*x));
+            x->used = true;
+            x->status = ESPNOW_XFER_RUNNING;
+            x->last_rx = espnow_xfer_now();
+            return x;
+        }
+    }
+    return NULL;
+}
+
+static void espnow_xfer_free(struct espnow_xfer *x){
+    if(x->fp != NULL) fclose(x->fp);
+    free(x->path);
+    x->fp = NULL;
+    x->path = NULL;
+    x->used = false;
+}
+
+static void espnow_xfer_info(const struct espnow_xfer *x, struct mgos_espnow_xfer_info *info){
+    memcpy(info->mac, x->mac, 6);
+    info->id = x->id;
+    info->sender = x->sender;
+    info->name = x->name;
+    info->path = x->path;
+    info->size = x->size;
+    uint64_t done = (uint64_t)x->base * x->chunk;
+    info->done = done < x->size ? (uint32_t)done : x->size;
+}
+
+//Mark a chunk done and move base past the ones done in a row
+static void espnow_xfer_mark(struct espnow_xfer *x, uint32_t index){
+    x->mask |= (uint64_t)1 << (index - x->base);
+    while(x->mask & 1){
+        x->mask >>= 1;
+        x->base++;
+    }
+}
+
+static uint32_t espnow_xfer_chunk_len(const struct espnow_xfer *x, uint32_t index){
+    uint32_t off = index * x->chunk;
+    return x->size - off < x->chunk ? x->size - off : x->chunk;
+}
+
+//Add the file from crc_pos up to upto to the CRC, reading back at most max bytes
+static bool espnow_xfer_crc_catch_up(struct espnow_xfer *x, uint32_t upto, uint32_t max){
+    uint8_t buf[256];
+    if(upto > x->size) upto = x->size;
+    while(x->crc_pos < upto && max > 0){
+        uint32_t n = upto - x->crc_pos;
+        if(n > sizeof(buf)) n = sizeof(buf);
+        if(fseek(x->fp, x->crc_pos, SEEK_SET) != 0 || fread(buf, 1, n, x->fp) != n) return false;
+        x->crc = cs_crc32(x->crc, buf, n);
+        x->crc_pos += n;
+        max = max > n ? max - n : 0;
+    }
+    return true;
+}
+
+static void espnow_xfer_start_timer();
+
+static void espnow_xfer_send_ack(struct espnow_xfer *x){
+    uint8_t frame[ESPNOW_XFER_ACK_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_XFER, ESPNOW_XFER_OP_ACK, x->id, x->status};
+    espnow_xfer_put32(frame + 5, x->base);
+    for(int i = 0; i < 8; i++) frame[9 + i] = (uint8_t)(x->mask >> (8 * i));
+    espnow_peer_send(x->mac, frame, sizeof(frame), NULL, NULL, NULL);
+    x->last_tx = espnow_xfer_now();
+    x->unacked = 0;
+}
+
+//Answer without a slot, for offers that are turned down
+static void espnow_xfer_send_status(const uint8_t *mac, uint8_t id, mgos_espnow_xfer_status_t status){
+    uint8_t frame[ESPNOW_XFER_ACK_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_XFER, ESPNOW_XFER_OP_ACK, id, (uint8_t)status};
+    espnow_peer_send(mac, frame, sizeof(frame), NULL, NULL, NULL);
+}
+
+static void espnow_xfer_send_offer(struct espnow_xfer *x){
+    uint8_t frame[ESPNOW_XFER_OFFER_HDR_LEN + ESPNOW_XFER_NAME_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_XFER, ESPNOW_XFER_OP_OFFER, x->id};
+    espnow_xfer_put32(frame + 4, x->size);
+    frame[8] = x->chunk;
+    int name_len = strlen(x->name);
+    memcpy(frame + ESPNOW_XFER_OFFER_HDR_LEN, x->name, name_len);
+    espnow_peer_send(x->mac, frame, ESPNOW_XFER_OFFER_HDR_LEN + name_len, NULL, NULL, NULL);
+    x->last_tx = espnow_xfer_now();
+}
+
+static void espnow_xfer_send_end(struct espnow_xfer *x){
+    uint8_t frame[ESPNOW_XFER_END_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_XFER, ESPNOW_XFER_OP_END, x->id};
+    espnow_xfer_put32(frame + 4, x->crc);
+    espnow_peer_send(x->mac, frame, sizeof(frame), NULL, NULL, NULL);
+    x->last_tx = espnow_xfer_now();
+}
+
+static void espnow_xfer_finish(struct espnow_xfer *x, mgos_espnow_xfer_status_t status){
+    struct mgos_espnow_xfer_info info;
+    espnow_xfer_info(x, &info);
+    espnow_xfer_cb_t cb = x->cb;
+    void *ud = x->ud;
+    if(status == ESPNOW_XFER_OK){
+        espnow_xfer_stats.completed++;
+    } else {
+        espnow_xfer_stats.failed++;
+        LOG(LL_ERROR, ("Transfer of %s %s %.2x:%.2x:%.2x:%.2x:%.2x:%.2x failed: %d", x->name, x->sender ? "to" : "from",
+            x->mac[0], x->mac[1], x->mac[2], x->mac[3], x->mac[4], x->mac[5], status));
+    }
+    x->status = status;
+    if(x->sender){
+        //The slot is free again by the time the callback runs, it may start the next transfer
+        char *path = x->path;
+        x->path = NULL;
+        espnow_xfer_free(x);
+        info.path = path;
+        if(cb != NULL) cb(&info, status, ud);
+        free(path);
+        return;
+    }
+    if(cb != NULL) cb(&info, status, ud);
+}
+
+static void espnow_xfer_tx_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud);
+
+//Send or resend a chunk, the data is read from the file every time
+static bool espnow_xfer_send_chunk(struct espnow_xfer *x, uint32_t index){
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_XFER, ESPNOW_XFER_OP_DATA, x->id};
+    uint32_t off = index * x->chunk, len = espnow_xfer_chunk_len(x, index);
+    espnow_xfer_put32(frame + 4, index);
+    if(fseek(x->fp, off, SEEK_SET) != 0 || fread(frame + ESPNOW_XFER_DATA_HDR_LEN, 1, len, x->fp) != len){
+        espnow_xfer_finish(x, ESPNOW_XFER_IO_ERROR);
+        return false;
+    }
+    mgos_espnow_prio_t prev = espnow_tx_set_prio(ESPNOW_PRIO_BULK);
+    mgos_espnow_result_t res = espnow_peer_send(x->mac, frame, ESPNOW_XFER_DATA_HDR_LEN + len, espnow_xfer_tx_cb, NULL, NULL);
+    espnow_tx_set_prio(prev);
+    if(res != ESPNOW_OK) return false;
+    //Chunks sent in order for the first time go straight into the CRC
+    if(off == x->crc_pos){
+        x->crc = cs_crc32(x->crc, frame + ESPNOW_XFER_DATA_HDR_LEN, len);
+        x->crc_pos += len;
+    }
+    if(index < x->next){
+        espnow_xfer_stats.resent++;
+    } else {
+        espnow_xfer_stats.sent++;
+    }
+    x->sent_at[index % ESPNOW_XFER_MAX_WINDOW] = espnow_xfer_now();
+    x->sent_seq[index % ESPNOW_XFER_MAX_WINDOW] = ++x->tx_seq;
+    return true;
+}
+
+//Resend chunks of the window not acknowledged. On an ACK those the peer reported as gaps are lost once
+//a chunk sent after them arrived, on the timer those sent at least rto ms ago.
+static void espnow_xfer_resend(struct espnow_xfer *x, uint32_t rto, bool gaps){
+    uint32_t now = espnow_xfer_now();
+    uint32_t end = x->next - x->base;
+    if(gaps){
+        if(x->mask == 0) return;
+        end = 64 - __builtin_clzll(x->mask) - 1;
+    }
+    for(uint32_t i = 0; i < end && x->used; i++){
+        uint32_t slot = (x->base + i) % ESPNOW_XFER_MAX_WINDOW;
+        if(x->mask & ((uint64_t)1 << i)) continue;
+        if(gaps ? (int32_t)(x->sent_seq[slot] - x->acked_seq) >= 0 : now - x->sent_at[slot] < rto) continue;
+        if(espnow_peer_free_slots(x->mac) <= 0 || !espnow_xfer_send_chunk(x, x->base + i)) return;
+    }
+}
+
+//Note the latest sent of the chunks an ACK covers for the first time
+static void espnow_xfer_acked(struct espnow_xfer *x, uint32_t index){
+    uint32_t seq = x->sent_seq[index % ESPNOW_XFER_MAX_WINDOW];
+    if((int32_t)(seq - x->acked_seq) > 0) x->acked_seq = seq;
+}
+
+//Fill the window with new chunks while the TX queue has room for them
+static void espnow_xfer_pump(struct espnow_xfer *x){
+    if(espnow_xfer_pumping || !x->used || !x->sender || !x->accepted) return;
+    espnow_xfer_pumping = true;
+    uint32_t window = espnow_xfer_window();
+    while(x->used && x->next < x->count && x->next - x->base < window && espnow_peer_free_slots(x->mac) > 0){
+        if(!espnow_xfer_send_chunk(x, x->next)) break;
+        x->next++;
+    }
+    espnow_xfer_pumping = false;
+}
+
+static void espnow_xfer_tx_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        if(espnow_xfers[i].used && espnow_xfers[i].sender) espnow_xfer_pump(&espnow_xfers[i]);
+    }
+    (void)handle;
+    (void)mac;
+    (void)success;
+    (void)ud;
+}
+
+static void espnow_xfer_part_path(const struct espnow_xfer *x, char *buf, int len, const char *suffix){
+    snprintf(buf, len, "%s%s", x->path, suffix);
+}
+
+static void espnow_xfer_save_state(struct espnow_xfer *x){
+    char state_path[ESPNOW_XFER_PATH_LEN];
+    struct espnow_xfer_state st = {ESPNOW_XFER_STATE_MAGIC, x->size, x->chunk, x->base};
+    //Chunks below base must be in the partial file before the state says so
+    if(fflush(x->fp) != 0) return;
+    espnow_xfer_part_path(x, state_path, sizeof(state_path), ".xfs");
+    FILE *f = fopen(state_path, "wb");
+    if(f == NULL) return;
+    if(fwrite(&st, sizeof(st), 1, f) == 1) x->saved = x->base;
+    fclose(f);
+}
+
+//Final state of a received file, the slot stays until the sender has had time to see it
+static void espnow_xfer_recv_done(struct espnow_xfer *x, mgos_espnow_xfer_status_t status){
+    char part_path[ESPNOW_XFER_PATH_LEN], state_path[ESPNOW_XFER_PATH_LEN];
+    espnow_xfer_part_path(x, part_path, sizeof(part_path), ".part");
+    espnow_xfer_part_path(x, state_path, sizeof(state_path), ".xfs");
+    if(status == ESPNOW_XFER_TIMEOUT){
+        //Kept to resume when the sender tries again
+        espnow_xfer_save_state(x);
+    }
+    fclose(x->fp);
+    x->fp = NULL;
+    if(status == ESPNOW_XFER_OK){
+        remove(x->path);
+        if(rename(part_path, x->path) != 0) status = ESPNOW_XFER_IO_ERROR;
+    }
+    if(status != ESPNOW_XFER_TIMEOUT){
+        if(status != ESPNOW_XFER_OK) remove(part_path);
+        remove(state_path);
+    }
+    espnow_xfer_finish(x, status);
+    if(status == ESPNOW_XFER_TIMEOUT){
+        espnow_xfer_free(x);
+    } else {
+        espnow_xfer_send_ack(x);
+    }
+}
+
+static bool espnow_xfer_name_ok(const char *name){
+    return name[0] != '\0' && name[0] != '.' && strchr(name, '/') == NULL && strlen(name) < ESPNOW_XFER_NAME_LEN;
+}
+
+//Open the partial file, resuming it when the state file matches the offer
+static bool espnow_xfer_recv_open(struct espnow_xfer *x){
+    char part_path[ESPNOW_XFER_PATH_LEN], state_path[ESPNOW_XFER_PATH_LEN];
+    espnow_xfer_part_path(x, part_path, sizeof(part_path), ".part");
+    espnow_xfer_part_path(x, state_path, sizeof(state_path), ".xfs");
+    struct espnow_xfer_state st = {0};
+    FILE *f = fopen(state_path, "rb");
+    if(f != NULL){
+        if(fread(&st, sizeof(st), 1, f) != 1) st.magic = 0;
+        fclose(f);
+    }
+    if(st.magic == ESPNOW_XFER_STATE_MAGIC && st.size == x->size && st.chunk == x->chunk && st.base <= x->count){
+        x->fp = fopen(part_path, "r+b");
+        if(x->fp != NULL){
+            //The CRC of the chunks kept is read back over the next ticks
+            x->base = x->saved = st.base;
+            espnow_xfer_stats.resumed++;
+            return true;
+        }
+    }
+    x->fp = fopen(part_path, "w+b");
+    return x->fp != NULL;
+}
+
+static void espnow_xfer_rx_offer(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_XFER_OFFER_HDR_LEN + 1) return;
+    uint8_t id = data[3];
+    struct espnow_xfer *x = espnow_xfer_find(mac, id, false);
+    if(x != NULL){
+        x->last_rx = espnow_xfer_now();
+        espnow_xfer_send_ack(x);
+        return;
+    }
+    char name[ESPNOW_XFER_NAME_LEN];
+    int name_len = len - ESPNOW_XFER_OFFER_HDR_LEN;
+    if(name_len >= ESPNOW_XFER_NAME_LEN || data[8] == 0 || !mgos_sys_config_get_espnow_xfer_accept()){
+        espnow_xfer_send_status(mac, id, ESPNOW_XFER_REJECTED);
+        return;
+    }
+    memcpy(name, data + ESPNOW_XFER_OFFER_HDR_LEN, name_len);
+    name[name_len] = '\0';
+    if(!espnow_xfer_name_ok(name)){
+        espnow_xfer_send_status(mac, id, ESPNOW_XFER_REJECTED);
+        return;
+    }
+    //A new offer from the same peer replaces one it gave up on
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        struct espnow_xfer *old = &espnow_xfers[i];
+        if(old->used && !old->sender && memcmp(old->mac, mac, 6) == 0){
+            if(old->status == ESPNOW_XFER_RUNNING){
+                espnow_xfer_recv_done(old, ESPNOW_XFER_TIMEOUT);
+            } else {
+                espnow_xfer_free(old);
+            }
+        }
+    }
+    x = espnow_xfer_alloc();
+    if(x == NULL) return; //Busy, the sender tries again
+    memcpy(x->mac, mac, 6);
+    x->id = id;
+    x->size = espnow_xfer_get32(data + 4);
+    x->chunk = data[8];
+    x->count = (uint32_t)(((uint64_t)x->size + x->chunk - 1) / x->chunk);
+    memcpy(x->name, name, name_len + 1);
+    x->cb = espnow_xfer_recv_cb;
+    x->ud = espnow_xfer_recv_ud;
+    const char *dir = mgos_sys_config_get_espnow_xfer_dir();
+    if(dir == NULL) dir = "";
+    //Room for the suffixes of the partial and state files
+    int path_len = strlen(dir) + name_len + 2;
+    x->path = path_len + 5 <= ESPNOW_XFER_PATH_LEN ? (char *)malloc(path_len) : NULL;
+    if(x->path != NULL) snprintf(x->path, path_len, "%s%s%s", dir, dir[0] != '\0' ? "/" : "", name);
+    if(x->path == NULL || !espnow_xfer_recv_open(x)){
+        LOG(LL_ERROR, ("Failed to create %s", x->path != NULL ? x->path : name));
+        espnow_xfer_free(x);
+        espnow_xfer_send_status(mac, id, ESPNOW_XFER_REJECTED);
+        return;
+    }
+    espnow_xfer_start_timer();
+    espnow_xfer_send_ack(x);
+}
+
+static void espnow_xfer_rx_data(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_XFER_DATA_HDR_LEN) return;
+    struct espnow_xfer *x = espnow_xfer_find(mac, data[3], false);
+    if(x == NULL) return;
+    uint32_t now = espnow_xfer_now();
+    x->last_rx = now;
+    if(x->status != ESPNOW_XFER_RUNNING){
+        espnow_xfer_send_ack(x);
+        return;
+    }
+    uint32_t index = espnow_xfer_get32(data + 4);
+    if(index < x->base || (index - x->base < ESPNOW_XFER_MAX_WINDOW && (x->mask & ((uint64_t)1 << (index - x->base))))){
+        //Our ACK got lost, repeat it soon
+        espnow_xfer_stats.duplicates++;
+        if(now - x->last_tx >= ESPNOW_XFER_TICK_MS) espnow_xfer_send_ack(x);
+        return;
+    }
+    uint32_t chunk_len = len - ESPNOW_XFER_DATA_HDR_LEN;
+    if(index >= x->count || index - x->base >= ESPNOW_XFER_MAX_WINDOW || chunk_len != espnow_xfer_chunk_len(x, index)) return;
+    uint32_t off = index * x->chunk;
+    if(fseek(x->fp, off, SEEK_SET) != 0 || fwrite(data + ESPNOW_XFER_DATA_HDR_LEN, 1, chunk_len, x->fp) != chunk_len){
+        espnow_xfer_recv_done(x, ESPNOW_XFER_IO_ERROR);
+        return;
+    }
+    if(off == x->crc_pos){
+        x->crc = cs_crc32(x->crc, data + ESPNOW_XFER_DATA_HDR_LEN, chunk_len);
+        x->crc_pos += chunk_len;
+    }
+    espnow_xfer_stats.received++;
+    bool gap = index != x->base;
+    espnow_xfer_mark(x, index);
+    x->unacked++;
+    //Out of order chunks NACK the gap right away, at most once a tick
+    if((gap && now - x->last_tx >= ESPNOW_XFER_TICK_MS) || x->unacked >= (espnow_xfer_window() + 1) / 2 || x->base == x->count){
+        espnow_xfer_send_ack(x);
+    }
+    if(x->base - x->saved >= ESPNOW_XFER_SAVE_EVERY) espnow_xfer_save_state(x);
+}
+
+static void espnow_xfer_rx_end(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_XFER_END_LEN) return;
+    struct espnow_xfer *x = espnow_xfer_find(mac, data[3], false);
+    if(x == NULL) return;
+    x->last_rx = espnow_xfer_now();
+    if(x->status != ESPNOW_XFER_RUNNING || x->base != x->count){
+        espnow_xfer_send_ack(x);
+        return;
+    }
+    if(!espnow_xfer_crc_catch_up(x, x->size, x->size)){
+        espnow_xfer_recv_done(x, ESPNOW_XFER_IO_ERROR);
+        return;
+    }
+    espnow_xfer_recv_done(x, x->crc == espnow_xfer_get32(data + 4) ? ESPNOW_XFER_OK : ESPNOW_XFER_CRC_ERROR);
+}
+
+static void espnow_xfer_rx_ack(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < ESPNOW_XFER_ACK_LEN) return;
+    struct espnow_xfer *x = espnow_xfer_find(mac, data[3], true);
+    if(x == NULL) return;
+    x->last_rx = espnow_xfer_now();
+    if(data[4] != ESPNOW_XFER_RUNNING){
+        espnow_xfer_finish(x, data[4] <= ESPNOW_XFER_TIMEOUT ? (mgos_espnow_xfer_status_t)data[4] : ESPNOW_XFER_REJECTED);
+        return;
+    }
+    uint32_t base = espnow_xfer_get32(data + 5);
+    uint64_t mask = 0;
+    for(int i = 0; i < 8; i++) mask |= (uint64_t)data[9 + i] << (8 * i);
+    if(!x->accepted){
+        //The first ACK answers the offer, base is where a resumed transfer goes on
+        if(base > x->count) return;
+        x->accepted = true;
+        x->base = x->next = base;
+        x->mask = 0;
+    } else {
+        if(base < x->base || base > x->next) return;
+        for(uint32_t i = x->base; i < base; i++){
+            if(!(x->mask & ((uint64_t)1 << (i - x->base)))) espnow_xfer_acked(x, i);
+        }
+        uint32_t shift = base - x->base;
+        x->mask = shift >= 64 ? 0 : x->mask >> shift;
+        x->base = base;
+    }
+    //Only chunks sent so far can be acknowledged
+    uint32_t sent = x->next - x->base;
+    if(sent < 64) mask &= ((uint64_t)1 << sent) - 1;
+    mask &= ~(uint64_t)1 & ~x->mask;
+    for(uint32_t i = 1; i < sent && i < 64; i++){
+        if(mask & ((uint64_t)1 << i)) espnow_xfer_acked(x, x->base + i);
+    }
+    x->mask |= mask;
+    if(x->base == x->count){
+        if(x->crc_pos == x->size) espnow_xfer_send_end(x);
+        return;
+    }
+    espnow_xfer_resend(x, 0, true);
+    espnow_xfer_pump(x);
+}
+
+static void espnow_xfer_tick(struct espnow_xfer *x, uint32_t now){
+    int rto = mgos_sys_config_get_espnow_xfer_rto_ms();
+    if(now - x->last_rx >= (uint32_t)mgos_sys_config_get_espnow_xfer_timeout_ms()){
+        if(x->status != ESPNOW_XFER_RUNNING){
+            espnow_xfer_free(x);
+        } else if(x->sender){
+            espnow_xfer_finish(x, ESPNOW_XFER_TIMEOUT);
+        } else {
+            espnow_xfer_recv_done(x, ESPNOW_XFER_TIMEOUT);
+        }
+        return;
+    }
+    if(x->status != ESPNOW_XFER_RUNNING) return;
+    if(!x->sender){
+        if(!espnow_xfer_crc_catch_up(x, x->base * x->chunk, ESPNOW_XFER_CRC_STEP)){
+            espnow_xfer_recv_done(x, ESPNOW_XFER_IO_ERROR);
+            return;
+        }
+        if(x->unacked > 0) espnow_xfer_send_ack(x);
+        return;
+    }
+    if(!x->accepted){
+        if(now - x->last_tx >= (uint32_t)rto) espnow_xfer_send_offer(x);
+        return;
+    }
+    //Chunks skipped on resume or sent while the CRC was behind are read back
+    if(!espnow_xfer_crc_catch_up(x, x->next * x->chunk, ESPNOW_XFER_CRC_STEP)){
+        espnow_xfer_finish(x, ESPNOW_XFER_IO_ERROR);
+        return;
+    }
+    if(x->base == x->count){
+        if(x->crc_pos == x->size && now - x->last_tx >= (uint32_t)rto) espnow_xfer_send_end(x);
+        return;
+    }
+    espnow_xfer_resend(x, rto, false);
+    espnow_xfer_pump(x);
+}
+
+static void espnow_xfer_timer_cb(void *arg){
+    uint32_t now = espnow_xfer_now();
+    bool active = false;
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        if(espnow_xfers[i].used) espnow_xfer_tick(&espnow_xfers[i], now);
+        active |= espnow_xfers[i].used;
+    }
+    if(!active){
+        mgos_clear_timer(espnow_xfer_timer);
+        espnow_xfer_timer = MGOS_INVALID_TIMER_ID;
+    }
+    (void)arg;
+}
+
+static void espnow_xfer_start_timer(){
+    if(espnow_xfer_timer != MGOS_INVALID_TIMER_ID) return;
+    espnow_xfer_timer = mgos_set_timer(ESPNOW_XFER_TICK_MS, MGOS_TIMER_REPEAT, espnow_xfer_timer_cb, NULL);
+}
+
+mgos_espnow_result_t mgos_espnow_send_file(const char *name, const char *path, const char *remote_name, espnow_xfer_cb_t cb, void *ud){
+    struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+    if(peer == NULL) return ESPNOW_PEER_NOT_FOUND;
+    if(remote_name == NULL){
+        remote_name = strrchr(path, '/');
+        remote_name = remote_name != NULL ? remote_name + 1 : path;
+    }
+    if(!espnow_xfer_name_ok(remote_name)) return ESPNOW_PAYLOAD_LEN_ERR;
+    int room = espnow_peer_room(peer->mac) - ESPNOW_XFER_DATA_HDR_LEN;
+    if(room > 255) room = 255;
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL){
+        LOG(LL_ERROR, ("Failed to open %s", path));
+        return ESPNOW_SEND_FAILED;
+    }
+    long size = -1;
+    if(fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+    struct espnow_xfer *x = size >= 0 ? espnow_xfer_alloc() : NULL;
+    char *path_copy = x != NULL ? strdup(path) : NULL;
+    if(path_copy == NULL){
+        fclose(fp);
+        if(x != NULL) espnow_xfer_free(x);
+        return size < 0 ? ESPNOW_SEND_FAILED : x == NULL ? ESPNOW_QUEUE_FULL : ESPNOW_NO_MEM;
+    }
+    x->sender = true;
+    memcpy(x->mac, peer->mac, 6);
+    x->id = ++espnow_xfer_next_id;
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        //IDs only need to differ between transfers to the same peer
+        struct espnow_xfer *other = &espnow_xfers[i];
+        if(other != x && other->used && other->sender && other->id == x->id && memcmp(other->mac, x->mac, 6) == 0){
+            x->id = ++espnow_xfer_next_id;
+            i = -1;
+        }
+    }
+    x->size = (uint32_t)size;
+    x->chunk = (uint8_t)room;
+    x->count = (uint32_t)(((uint64_t)x->size + x->chunk - 1) / x->chunk);
+    x->fp = fp;
+    x->path = path_copy;
+    strcpy(x->name, remote_name);
+    x->cb = cb;
+    x->ud = ud;
+    espnow_xfer_send_offer(x);
+    espnow_xfer_start_timer();
+    return ESPNOW_OK;
+}
+
+void mgos_espnow_register_xfer_cb(espnow_xfer_cb_t cb, void *ud){
+    espnow_xfer_recv_cb = cb;
+    espnow_xfer_recv_ud = ud;
+}
+
+void espnow_xfer_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(len < 4) return;
+    switch(data[2]){
+        case ESPNOW_XFER_OP_OFFER:
+        espnow_xfer_rx_offer(mac, data, len);
+        break;
+        case ESPNOW_XFER_OP_DATA:
+        espnow_xfer_rx_data(mac, data, len);
+        break;
+        case ESPNOW_XFER_OP_ACK:
+        espnow_xfer_rx_ack(mac, data, len);
+        break;
+        case ESPNOW_XFER_OP_END:
+        espnow_xfer_rx_end(mac, data, len);
+        break;
+    }
+}
+
+void mgos_espnow_get_xfer_stats(struct mgos_espnow_xfer_stats *stats){
+    *stats = espnow_xfer_stats;
+    stats->slots = MGOS_ESPNOW_XFER_SLOTS;
+    stats->active = 0;
+    for(int i = 0; i < MGOS_ESPNOW_XFER_SLOTS; i++){
+        if(espnow_xfers[i].used && espnow_xfers[i].status == ESPNOW_XFER_RUNNING) stats->active++;
+    }
+}
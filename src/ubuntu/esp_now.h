@@ -0,0 +1,95 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//ESP-NOW driver API for the ubuntu platform, implemented by a virtual radio (esp_now_sim.c)
+
+#ifndef CS_ESPNOW_UBUNTU_ESP_NOW_H
+#define CS_ESPNOW_UBUNTU_ESP_NOW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_wifi.h"
+
+#define ESP_ERR_ESPNOW_BASE (0x3000 + 0x66)
+#define ESP_ERR_ESPNOW_NOT_INIT (ESP_ERR_ESPNOW_BASE + 1)
+#define ESP_ERR_ESPNOW_ARG (ESP_ERR_ESPNOW_BASE + 2)
+#define ESP_ERR_ESPNOW_NO_MEM (ESP_ERR_ESPNOW_BASE + 3)
+#define ESP_ERR_ESPNOW_FULL (ESP_ERR_ESPNOW_BASE + 4)
+#define ESP_ERR_ESPNOW_NOT_FOUND (ESP_ERR_ESPNOW_BASE + 5)
+#define ESP_ERR_ESPNOW_INTERNAL (ESP_ERR_ESPNOW_BASE + 6)
+#define ESP_ERR_ESPNOW_EXIST (ESP_ERR_ESPNOW_BASE + 7)
+#define ESP_ERR_ESPNOW_IF (ESP_ERR_ESPNOW_BASE + 8)
+
+#define ESP_NOW_ETH_ALEN 6
+#define ESP_NOW_KEY_LEN 16
+#define ESP_NOW_MAX_TOTAL_PEER_NUM 20
+#define ESP_NOW_MAX_ENCRYPT_PEER_NUM 6
+#define ESP_NOW_MAX_DATA_LEN 250
+
+typedef enum {
+    ESP_NOW_SEND_SUCCESS = 0,
+    ESP_NOW_SEND_FAIL,
+} esp_now_send_status_t;
+
+typedef struct esp_now_peer_info {
+    uint8_t peer_addr[ESP_NOW_ETH_ALEN];
+    uint8_t lmk[ESP_NOW_KEY_LEN];
+    uint8_t channel;
+    wifi_interface_t ifidx;
+    bool encrypt;
+    void *priv;
+} esp_now_peer_info_t;
+
+typedef struct esp_now_peer_num {
+    int total_num;
+    int encrypt_num;
+} esp_now_peer_num_t;
+
+typedef void (*esp_now_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data, int data_len);
+typedef void (*esp_now_send_cb_t)(const uint8_t *mac_addr, esp_now_send_status_t status);
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    esp_err_t esp_now_init(void);
+    esp_err_t esp_now_deinit(void);
+    esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+    esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb);
+    esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len);
+    esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer);
+    esp_err_t esp_now_del_peer(const uint8_t *peer_addr);
+    esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer);
+    esp_err_t esp_now_get_peer(const uint8_t *peer_addr, esp_now_peer_info_t *peer);
+    bool esp_now_is_peer_exist(const uint8_t *peer_addr);
+    esp_err_t esp_now_get_peer_num(esp_now_peer_num_t *num);
+    esp_err_t esp_now_set_pmk(const uint8_t *pmk);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,296 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Virtual radio for running the library on the ubuntu platform. Every node is a process on the same host,
+//node i listens on UDP port espnow.sim.port + i and a frame is a datagram [source MAC][destination MAC][payload]
+//sent to all the other nodes, which keep the ones addressed to them or to the broadcast MAC.
+//Frames go out one after another, each taking espnow.sim.latency_ms of airtime plus espnow.sim.switch_ms when
+//its peer is on another channel or interface than the previous frame. They are lost with espnow.sim.loss_pct probability.
+//Only the nodes in range by espnow.sim.topology get a frame. Unicast frames report success when not lost and
+//in range, whether or not a node with that MAC is running.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mgos.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+
+//Frames sent and not completed yet, more are refused with ESP_ERR_ESPNOW_NO_MEM like the real driver queue
+#define ESPNOW_SIM_QUEUE_LEN 8
+#define ESPNOW_SIM_HDR_LEN 12
+
+struct espnow_sim_frame {
+    bool used;
+    uint8_t dst[6];
+    int len;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+};
+
+static const uint8_t espnow_sim_bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+static bool espnow_sim_ready;
+static int espnow_sim_sock = -1;
+static esp_now_recv_cb_t espnow_sim_recv_cb;
+static esp_now_send_cb_t espnow_sim_send_cb;
+static esp_now_peer_info_t espnow_sim_peers[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static int espnow_sim_num_peers;
+static struct espnow_sim_frame espnow_sim_frames[ESPNOW_SIM_QUEUE_LEN];
+//Radio airtime, when the last queued frame ends and where it is tuned
+static int64_t espnow_sim_busy_until;
+static int espnow_sim_channel;
+static wifi_interface_t espnow_sim_ifidx;
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6]){
+    int node = mgos_sys_config_get_espnow_sim_node();
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    mac[2] = 0x00;
+    mac[3] = ifx == ESP_IF_WIFI_AP ? 0x01 : 0x00;
+    mac[4] = (uint8_t)(node >> 8);
+    mac[5] = (uint8_t)node;
+    return ESP_OK;
+}
+
+const char *esp_err_to_name(esp_err_t code){
+    switch(code){
+        case ESP_OK: return "ESP_OK";
+        case ESP_ERR_ESPNOW_NOT_INIT: return "ESP_ERR_ESPNOW_NOT_INIT";
+        case ESP_ERR_ESPNOW_ARG: return "ESP_ERR_ESPNOW_ARG";
+        case ESP_ERR_ESPNOW_NO_MEM: return "ESP_ERR_ESPNOW_NO_MEM";
+        case ESP_ERR_ESPNOW_FULL: return "ESP_ERR_ESPNOW_FULL";
+        case ESP_ERR_ESPNOW_NOT_FOUND: return "ESP_ERR_ESPNOW_NOT_FOUND";
+        case ESP_ERR_ESPNOW_INTERNAL: return "ESP_ERR_ESPNOW_INTERNAL";
+        case ESP_ERR_ESPNOW_EXIST: return "ESP_ERR_ESPNOW_EXIST";
+        case ESP_ERR_ESPNOW_IF: return "ESP_ERR_ESPNOW_IF";
+        default: return "ESP_FAIL";
+    }
+}
+
+//Node of a virtual radio MAC, -1 for any other MAC
+static int espnow_sim_node_of(const uint8_t *mac){
+    if(mac[0] != 0x02 || mac[1] != 0x00 || mac[2] != 0x00 || mac[3] > 0x01) return -1;
+    return (mac[4] << 8) | mac[5];
+}
+
+static bool espnow_sim_in_range(int a, int b){
+    const char *topology = mgos_sys_config_get_espnow_sim_topology();
+    if(topology != NULL && strcmp(topology, "line") == 0) return a - b == 1 || b - a == 1;
+    if(topology != NULL && strcmp(topology, "grid") == 0){
+        int cols = mgos_sys_config_get_espnow_sim_grid_cols();
+        if(cols < 1) cols = 1;
+        int drow = a / cols - b / cols, dcol = a % cols - b % cols;
+        return (drow == 0 && (dcol == 1 || dcol == -1)) || (dcol == 0 && (drow == 1 || drow == -1));
+    }
+    return true;
+}
+
+static bool espnow_sim_is_me(const uint8_t *mac){
+    uint8_t own[6];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, own);
+    if(memcmp(mac, own, 6) == 0) return true;
+    esp_wifi_get_mac(ESP_IF_WIFI_AP, own);
+    return memcmp(mac, own, 6) == 0;
+}
+
+static void espnow_sim_ev(struct mg_connection *nc, int ev, void *ev_data, void *user_data){
+    if(ev != MG_EV_RECV) return;
+    struct mbuf *io = &nc->recv_mbuf;
+    const uint8_t *frame = (const uint8_t *)io->buf;
+    if(io->len > ESPNOW_SIM_HDR_LEN && io->len <= ESPNOW_SIM_HDR_LEN + ESP_NOW_MAX_DATA_LEN &&
+       !espnow_sim_is_me(frame) && (espnow_sim_is_me(frame + 6) || memcmp(frame + 6, espnow_sim_bcast, 6) == 0) &&
+       espnow_sim_recv_cb != NULL){
+        espnow_sim_recv_cb(frame, frame + ESPNOW_SIM_HDR_LEN, (int)io->len - ESPNOW_SIM_HDR_LEN);
+    }
+    mbuf_remove(io, io->len);
+    //Datagrams arrive on a connection created per sender, the listener itself stays
+    if(nc->listener != NULL) nc->flags |= MG_F_SEND_AND_CLOSE;
+    (void)ev_data;
+    (void)user_data;
+}
+
+static void espnow_sim_transmit(const struct espnow_sim_frame *frame){
+    uint8_t buf[ESPNOW_SIM_HDR_LEN + ESP_NOW_MAX_DATA_LEN];
+    esp_wifi_get_mac(ESP_IF_WIFI_STA, buf);
+    memcpy(buf + 6, frame->dst, 6);
+    memcpy(buf + ESPNOW_SIM_HDR_LEN, frame->data, frame->len);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int node = mgos_sys_config_get_espnow_sim_node();
+    for(int i = 0; i < mgos_sys_config_get_espnow_sim_nodes(); i++){
+        if(i == node || !espnow_sim_in_range(node, i)) continue;
+        addr.sin_port = htons(mgos_sys_config_get_espnow_sim_port() + i);
+        sendto(espnow_sim_sock, buf, ESPNOW_SIM_HDR_LEN + frame->len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+}
+
+static void espnow_sim_complete(void *arg){
+    struct espnow_sim_frame *frame = (struct espnow_sim_frame *)arg;
+    bool lost = mgos_rand_range(0, 100) < mgos_sys_config_get_espnow_sim_loss_pct();
+    int dst = espnow_sim_node_of(frame->dst);
+    if(dst >= 0 && !espnow_sim_in_range(mgos_sys_config_get_espnow_sim_node(), dst)) lost = true;
+    if(!lost) espnow_sim_transmit(frame);
+    frame->used = false;
+    if(espnow_sim_send_cb != NULL) espnow_sim_send_cb(frame->dst, lost ? ESP_NOW_SEND_FAIL : ESP_NOW_SEND_SUCCESS);
+}
+
+static int espnow_sim_find(const uint8_t *mac){
+    for(int i = 0; i < espnow_sim_num_peers; i++){
+        if(memcmp(espnow_sim_peers[i].peer_addr, mac, 6) == 0) return i;
+    }
+    return -1;
+}
+
+static esp_err_t espnow_sim_queue(const uint8_t *dst, const uint8_t *data, size_t len){
+    for(int i = 0; i < ESPNOW_SIM_QUEUE_LEN; i++){
+        struct espnow_sim_frame *frame = &espnow_sim_frames[i];
+        if(frame->used) continue;
+        frame->used = true;
+        memcpy(frame->dst, dst, 6);
+        memcpy(frame->data, data, len);
+        frame->len = (int)len;
+        int64_t now = mgos_uptime_micros();
+        int64_t start = espnow_sim_busy_until > now ? espnow_sim_busy_until : now;
+        int idx = espnow_sim_find(dst);
+        //Channel 0 is whatever the radio is on
+        if(idx >= 0 && espnow_sim_peers[idx].channel != 0 &&
+           (espnow_sim_peers[idx].channel != espnow_sim_channel || espnow_sim_peers[idx].ifidx != espnow_sim_ifidx)){
+            espnow_sim_channel = espnow_sim_peers[idx].channel;
+            espnow_sim_ifidx = espnow_sim_peers[idx].ifidx;
+            start += mgos_sys_config_get_espnow_sim_switch_ms() * 1000;
+        }
+        espnow_sim_busy_until = start + mgos_sys_config_get_espnow_sim_latency_ms() * 1000;
+        mgos_set_timer((int)((espnow_sim_busy_until - now + 999) / 1000), 0, espnow_sim_complete, frame);
+        return ESP_OK;
+    }
+    return ESP_ERR_ESPNOW_NO_MEM;
+}
+
+esp_err_t esp_now_init(void){
+    if(espnow_sim_ready) return ESP_OK;
+    espnow_sim_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(espnow_sim_sock < 0) return ESP_ERR_ESPNOW_INTERNAL;
+    fcntl(espnow_sim_sock, F_SETFL, fcntl(espnow_sim_sock, F_GETFL, 0) | O_NONBLOCK);
+    char addr[32];
+    snprintf(addr, sizeof(addr), "udp://127.0.0.1:%d", mgos_sys_config_get_espnow_sim_port() + mgos_sys_config_get_espnow_sim_node());
+    if(mg_bind(mgos_get_mgr(), addr, espnow_sim_ev, NULL) == NULL){
+        LOG(LL_ERROR, ("Virtual radio failed to listen on %s", addr));
+        close(espnow_sim_sock);
+        espnow_sim_sock = -1;
+        return ESP_ERR_ESPNOW_INTERNAL;
+    }
+    LOG(LL_INFO, ("Virtual radio node %d of %d on %s", mgos_sys_config_get_espnow_sim_node(), mgos_sys_config_get_espnow_sim_nodes(), addr));
+    espnow_sim_ready = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void){
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb){
+    espnow_sim_recv_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb){
+    espnow_sim_send_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len){
+    if(!espnow_sim_ready) return ESP_ERR_ESPNOW_NOT_INIT;
+    if(data == NULL || len == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_ERR_ESPNOW_ARG;
+    if(peer_addr != NULL){
+        if(espnow_sim_find(peer_addr) < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+        return espnow_sim_queue(peer_addr, data, len);
+    }
+    //NULL sends to every peer in the table, one completion each
+    int free_slots = 0;
+    for(int i = 0; i < ESPNOW_SIM_QUEUE_LEN; i++){
+        if(!espnow_sim_frames[i].used) free_slots++;
+    }
+    if(free_slots < espnow_sim_num_peers) return ESP_ERR_ESPNOW_NO_MEM;
+    for(int i = 0; i < espnow_sim_num_peers; i++){
+        espnow_sim_queue(espnow_sim_peers[i].peer_addr, data, len);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer){
+    if(!espnow_sim_ready) return ESP_ERR_ESPNOW_NOT_INIT;
+    if(peer == NULL) return ESP_ERR_ESPNOW_ARG;
+    if(espnow_sim_find(peer->peer_addr) >= 0) return ESP_ERR_ESPNOW_EXIST;
+    esp_now_peer_num_t num;
+    esp_now_get_peer_num(&num);
+    if(num.total_num == ESP_NOW_MAX_TOTAL_PEER_NUM || (peer->encrypt && num.encrypt_num == ESP_NOW_MAX_ENCRYPT_PEER_NUM)){
+        return ESP_ERR_ESPNOW_FULL;
+    }
+    espnow_sim_peers[espnow_sim_num_peers++] = *peer;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr){
+    int idx = espnow_sim_find(peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    espnow_sim_peers[idx] = espnow_sim_peers[--espnow_sim_num_peers];
+    return ESP_OK;
+}
+
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer){
+    int idx = espnow_sim_find(peer->peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    espnow_sim_peers[idx] = *peer;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_get_peer(const uint8_t *peer_addr, esp_now_peer_info_t *peer){
+    int idx = espnow_sim_find(peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    *peer = espnow_sim_peers[idx];
+    return ESP_OK;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr){
+    return espnow_sim_find(peer_addr) >= 0;
+}
+
+esp_err_t esp_now_get_peer_num(esp_now_peer_num_t *num){
+    num->total_num = espnow_sim_num_peers;
+    num->encrypt_num = 0;
+    for(int i = 0; i < espnow_sim_num_peers; i++){
+        if(espnow_sim_peers[i].encrypt) num->encrypt_num++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_now_set_pmk(const uint8_t *pmk){
+    (void)pmk;
+    return ESP_OK;
+}
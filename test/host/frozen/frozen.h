@@ -0,0 +1,92 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Subset of frozen, the JSON library of Mongoose OS, that the library uses
+
+#ifndef CS_ESPNOW_HOST_FROZEN_H
+#define CS_ESPNOW_HOST_FROZEN_H
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    enum json_token_type {
+        JSON_TYPE_INVALID = 0,
+        JSON_TYPE_STRING,
+        JSON_TYPE_NUMBER,
+        JSON_TYPE_TRUE,
+        JSON_TYPE_FALSE,
+        JSON_TYPE_NULL,
+        JSON_TYPE_OBJECT_START,
+        JSON_TYPE_OBJECT_END,
+        JSON_TYPE_ARRAY_START,
+        JSON_TYPE_ARRAY_END
+    };
+
+    struct json_token {
+        const char *ptr;
+        int len;
+        enum json_token_type type;
+    };
+#define JSON_INVALID_TOKEN {0, 0, JSON_TYPE_INVALID}
+
+    struct json_out {
+        int (*printer)(struct json_out *out, const char *str, size_t len);
+        union {
+            struct {
+                char *buf;
+                size_t size;
+                size_t len;
+            } buf;
+            void *data;
+            FILE *fp;
+        } u;
+    };
+    int json_printer_buf(struct json_out *out, const char *str, size_t len);
+    int json_printer_file(struct json_out *out, const char *str, size_t len);
+#define JSON_OUT_BUF(buf, len) {json_printer_buf, {{buf, len, 0}}}
+#define JSON_OUT_FILE(fp) {json_printer_file, {{(char *)fp, 0, 0}}}
+
+    //%Q quoted string or null, %B bool, %M callback with a va_list *, the usual printf conversions,
+    //and bare keys quoted like frozen does
+    int json_printf(struct json_out *out, const char *fmt, ...);
+    int json_vprintf(struct json_out *out, const char *fmt, va_list ap);
+    char *json_asprintf(const char *fmt, ...);
+    //Whole file, NUL terminated, to be freed by the caller
+    char *json_fread(const char *path);
+    //Top level keys only: %T token, %Q malloc'ed string, %B int, %d int
+    int json_scanf(const char *str, int len, const char *fmt, ...);
+    //Element of the top level array, path must be ""
+    int json_scanf_array_elem(const char *s, int len, const char *path, int index, struct json_token *token);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
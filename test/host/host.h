@@ -0,0 +1,114 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Control of the host build from tests and benchmarks: the mgos event loop, the mock radio
+//(host_radio.c) and heap call counting.
+
+#ifndef CS_ESPNOW_HOST_H
+#define CS_ESPNOW_HOST_H
+
+#include "mgos.h"
+#include "esp_now.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    //Event loop. The clock is virtual and only moves with host_advance_ms unless host_real_time is set.
+    //Both run mgos_invoke_cb callbacks and due timers on the calling thread, which is the mgos task.
+    void host_advance_ms(int ms);
+    //Run queued mgos_invoke_cb callbacks, returns how many
+    int host_run_invokes(void);
+    //Follow the monotonic clock and wait on the UDP listeners of mg_bind, for the virtual radio
+    void host_real_time(void);
+    void host_run_ms(int ms);
+    int host_timers_pending(void);
+
+    //Mock radio. esp_now_send queues frames, they complete after host_radio_latency_ms (0 for the next
+    //event loop pass) with ESP_NOW_SEND_FAIL for lost ones. Frames not lost come back to this node as
+    //received from the peer they were sent to when loopback is set, the peer then plays the other end.
+#define HOST_RADIO_QUEUE_LEN 64
+    struct host_radio_frame {
+        uint8_t mac[6];
+        int len;
+        uint8_t data[ESP_NOW_MAX_DATA_LEN];
+        int64_t sent_at;
+        bool lost;
+    };
+    extern int host_radio_capacity;     //Driver peer table size, ESP_NOW_MAX_TOTAL_PEER_NUM
+    extern int host_radio_queue_len;    //Frames the driver takes before ESP_ERR_ESPNOW_NO_MEM
+    extern int host_radio_latency_ms;
+    extern int host_radio_loss_pct;
+    extern bool host_radio_loopback;
+    extern bool host_radio_manual;      //Completions only from host_radio_complete
+    //Called for every frame accepted, may mark it lost or change it
+    extern void (*host_radio_hook)(struct host_radio_frame *frame, void *ud);
+    extern void *host_radio_hook_ud;
+    //Return non-zero from it to refuse the frame with that error
+    extern esp_err_t (*host_radio_send_hook)(const uint8_t *mac, const uint8_t *data, size_t len);
+    struct host_radio_stats {
+        uint32_t sends;       //esp_now_send calls
+        uint32_t refused;     //Refused, queue full or hook
+        uint32_t frames;      //Frames accepted, one per peer for a NULL destination
+        uint32_t lost;
+        uint32_t fanout_calls; //esp_now_send calls with a NULL destination
+        uint32_t adds;
+        uint32_t dels;
+    };
+    extern struct host_radio_stats host_radio_stats;
+    //Frames waiting for their completion
+    int host_radio_pending(void);
+    //Complete the oldest pending frame, returns false if none
+    bool host_radio_complete(bool success);
+    //Pass a frame to the registered receive callback, as the WiFi task would
+    void host_radio_rx(const uint8_t *mac, const uint8_t *data, int len);
+    //Pass a send status to the registered send callback, as the WiFi task would
+    void host_radio_tx_status(const uint8_t *mac, bool success);
+    //Driver peer table
+    int host_radio_peers(void);
+    bool host_radio_has_peer(const uint8_t *mac);
+
+    //Heap calls (malloc, calloc, realloc, strdup, free) made while counting, for tests linked with
+    //a HEAP library, see espnow_add_library in CMakeLists.txt
+    void host_heap_count(bool enable);
+    uint32_t host_heap_calls(void);
+
+    //MAC and name of the i-th peer used by tests and benchmarks
+    static inline void host_peer_mac(int i, uint8_t mac[6]){
+        mac[0] = 0x30;
+        mac[1] = 0xae;
+        mac[2] = 0xa4;
+        mac[3] = (uint8_t)(i >> 16);
+        mac[4] = (uint8_t)(i >> 8);
+        mac[5] = (uint8_t)i;
+    }
+    static inline void host_peer_name(int i, char *name, size_t len){
+        snprintf(name, len, "peer%d", i);
+    }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
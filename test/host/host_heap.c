@@ -0,0 +1,73 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Heap call counting, linked with -Wl,--wrap for malloc, calloc, realloc, strdup and free
+
+#include "host.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+void __real_free(void *ptr);
+
+static bool host_heap_counting;
+static uint32_t host_heap_count_calls;
+
+void host_heap_count(bool enable){
+    __atomic_store_n(&host_heap_counting, enable, __ATOMIC_SEQ_CST);
+}
+
+uint32_t host_heap_calls(void){
+    return __atomic_load_n(&host_heap_count_calls, __ATOMIC_SEQ_CST);
+}
+
+static void host_heap_call(void){
+    if(__atomic_load_n(&host_heap_counting, __ATOMIC_RELAXED)) __atomic_add_fetch(&host_heap_count_calls, 1, __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size){
+    host_heap_call();
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size){
+    host_heap_call();
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size){
+    host_heap_call();
+    return __real_realloc(ptr, size);
+}
+
+char *__wrap_strdup(const char *s){
+    host_heap_call();
+    return __real_strdup(s);
+}
+
+void __wrap_free(void *ptr){
+    if(ptr != NULL) host_heap_call();
+    __real_free(ptr);
+}
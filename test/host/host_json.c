@@ -0,0 +1,326 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//The frozen calls of frozen/frozen.h and cs_crc32, enough for the peer list files
+
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "mgos.h"
+#include "frozen/frozen.h"
+#include "common/cs_crc32.h"
+
+int json_printer_buf(struct json_out *out, const char *str, size_t len){
+    size_t avail = out->u.buf.size > out->u.buf.len ? out->u.buf.size - out->u.buf.len : 0;
+    size_t n = len < avail ? len : avail;
+    if(n > 0) memcpy(out->u.buf.buf + out->u.buf.len, str, n);
+    out->u.buf.len += n;
+    if(out->u.buf.size > 0){
+        size_t end = out->u.buf.len < out->u.buf.size ? out->u.buf.len : out->u.buf.size - 1;
+        out->u.buf.buf[end] = '\0';
+    }
+    return (int)len;
+}
+
+int json_printer_file(struct json_out *out, const char *str, size_t len){
+    return (int)fwrite(str, 1, len, out->u.fp);
+}
+
+static int json_put(struct json_out *out, const char *str, size_t len){
+    return out->printer(out, str, len);
+}
+
+static int json_put_quoted(struct json_out *out, const char *str){
+    if(str == NULL) return json_put(out, "null", 4);
+    int n = json_put(out, "\"", 1);
+    for(; *str != '\0'; str++){
+        char esc[8];
+        if(*str == '"' || *str == '\\'){
+            esc[0] = '\\';
+            esc[1] = *str;
+            n += json_put(out, esc, 2);
+        } else if((unsigned char)*str < 0x20){
+            n += json_put(out, esc, snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*str));
+        } else {
+            n += json_put(out, str, 1);
+        }
+    }
+    return n + json_put(out, "\"", 1);
+}
+
+int json_vprintf(struct json_out *out, const char *fmt, va_list ap){
+    int n = 0;
+    char prev = '\0';
+    va_list args;
+    va_copy(args, ap);
+    while(*fmt != '\0'){
+        if(*fmt == '%'){
+            const char *spec = fmt++;
+            bool star = false;
+            char conv[16];
+            char tmp[64];
+            while(*fmt == '-' || *fmt == '0' || *fmt == '.' || *fmt == '*' || isdigit((unsigned char)*fmt)){
+                if(*fmt == '*') star = true;
+                fmt++;
+            }
+            int longs = 0;
+            while(*fmt == 'l' || *fmt == 'z'){
+                longs += *fmt == 'l' ? 1 : 2;
+                fmt++;
+            }
+            char c = *fmt++;
+            snprintf(conv, sizeof(conv), "%.*s", (int)(fmt - spec), spec);
+            if(c == 'Q'){
+                n += json_put_quoted(out, va_arg(args, const char *));
+            } else if(c == 'B'){
+                n += va_arg(args, int) ? json_put(out, "true", 4) : json_put(out, "false", 5);
+            } else if(c == 'M'){
+                int (*fn)(struct json_out *, va_list *) = va_arg(args, int (*)(struct json_out *, va_list *));
+                n += fn(out, &args);
+            } else if(c == 's'){
+                int prec = star ? va_arg(args, int) : -1;
+                const char *s = va_arg(args, const char *);
+                n += json_put(out, s, prec >= 0 ? strnlen(s, prec) : strlen(s));
+            } else if(c == 'f' || c == 'g' || c == 'e'){
+                n += json_put(out, tmp, snprintf(tmp, sizeof(tmp), conv, va_arg(args, double)));
+            } else if(c == '%'){
+                n += json_put(out, "%", 1);
+            } else if(longs >= 2){
+                n += json_put(out, tmp, snprintf(tmp, sizeof(tmp), conv, va_arg(args, long long)));
+            } else if(longs == 1){
+                n += json_put(out, tmp, snprintf(tmp, sizeof(tmp), conv, va_arg(args, long)));
+            } else {
+                n += json_put(out, tmp, snprintf(tmp, sizeof(tmp), conv, va_arg(args, int)));
+            }
+            prev = c;
+            continue;
+        }
+        //Bare keys are quoted: an identifier after { or , followed by :
+        if((isalpha((unsigned char)*fmt) || *fmt == '_') && (prev == '{' || prev == ',' || prev == ' ' || prev == '\0')){
+            const char *end = fmt;
+            while(isalnum((unsigned char)*end) || *end == '_') end++;
+            const char *colon = end;
+            while(*colon == ' ') colon++;
+            if(*colon == ':' && strncmp(fmt, "true", 4) != 0){
+                n += json_put(out, "\"", 1);
+                n += json_put(out, fmt, end - fmt);
+                n += json_put(out, "\"", 1);
+                fmt = end;
+                prev = '"';
+                continue;
+            }
+        }
+        if(*fmt != ' ') prev = *fmt;
+        n += json_put(out, fmt++, 1);
+    }
+    va_end(args);
+    return n;
+}
+
+int json_printf(struct json_out *out, const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    int n = json_vprintf(out, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+char *json_asprintf(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    struct json_out counter = JSON_OUT_BUF(NULL, 0);
+    int len = json_vprintf(&counter, fmt, ap);
+    va_end(ap);
+    char *buf = malloc(len + 1);
+    if(buf == NULL) return NULL;
+    struct json_out out = JSON_OUT_BUF(buf, (size_t)len + 1);
+    va_start(ap, fmt);
+    json_vprintf(&out, fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+char *json_fread(const char *path){
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *buf = size >= 0 ? malloc(size + 1) : NULL;
+    if(buf != NULL){
+        if(fread(buf, 1, size, f) != (size_t)size){
+            free(buf);
+            buf = NULL;
+        } else {
+            buf[size] = '\0';
+        }
+    }
+    fclose(f);
+    return buf;
+}
+
+static const char *json_skip_ws(const char *p, const char *end){
+    while(p < end && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+//Parse the value at p into tok, returns the end of it or NULL
+static const char *json_value(const char *p, const char *end, struct json_token *tok){
+    p = json_skip_ws(p, end);
+    if(p >= end) return NULL;
+    const char *start = p;
+    if(*p == '"'){
+        for(p++; p < end && *p != '"'; p++){
+            if(*p == '\\') p++;
+        }
+        if(p >= end) return NULL;
+        tok->ptr = start + 1;
+        tok->len = (int)(p - start - 1);
+        tok->type = JSON_TYPE_STRING;
+        return p + 1;
+    }
+    if(*p == '{' || *p == '['){
+        int depth = 0;
+        bool in_str = false;
+        for(; p < end; p++){
+            if(in_str){
+                if(*p == '\\') p++;
+                else if(*p == '"') in_str = false;
+            } else if(*p == '"'){
+                in_str = true;
+            } else if(*p == '{' || *p == '['){
+                depth++;
+            } else if((*p == '}' || *p == ']') && --depth == 0){
+                tok->ptr = start;
+                tok->len = (int)(p + 1 - start);
+                tok->type = *start == '{' ? JSON_TYPE_OBJECT_END : JSON_TYPE_ARRAY_END;
+                return p + 1;
+            }
+        }
+        return NULL;
+    }
+    while(p < end && *p != ',' && *p != '}' && *p != ']' && !isspace((unsigned char)*p)) p++;
+    tok->ptr = start;
+    tok->len = (int)(p - start);
+    if(tok->len == 4 && strncmp(start, "true", 4) == 0) tok->type = JSON_TYPE_TRUE;
+    else if(tok->len == 5 && strncmp(start, "false", 5) == 0) tok->type = JSON_TYPE_FALSE;
+    else if(tok->len == 4 && strncmp(start, "null", 4) == 0) tok->type = JSON_TYPE_NULL;
+    else if(tok->len > 0) tok->type = JSON_TYPE_NUMBER;
+    else return NULL;
+    return p;
+}
+
+//Value of a top level key of the object in str
+static bool json_find_key(const char *str, int len, const char *key, int key_len, struct json_token *tok){
+    const char *end = str + len;
+    const char *p = json_skip_ws(str, end);
+    if(p >= end || *p != '{') return false;
+    p++;
+    for(;;){
+        struct json_token name;
+        p = json_skip_ws(p, end);
+        if(p >= end || *p == '}') return false;
+        if(*p == '"'){
+            p = json_value(p, end, &name);
+        } else {
+            name.ptr = p;
+            while(p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+            name.len = (int)(p - name.ptr);
+        }
+        if(p == NULL) return false;
+        p = json_skip_ws(p, end);
+        if(p >= end || *p != ':') return false;
+        p = json_value(p + 1, end, tok);
+        if(p == NULL) return false;
+        if(name.len == key_len && strncmp(name.ptr, key, key_len) == 0) return true;
+        p = json_skip_ws(p, end);
+        if(p < end && *p == ',') p++;
+    }
+}
+
+int json_scanf(const char *str, int len, const char *fmt, ...){
+    int found = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    while(*fmt != '\0'){
+        while(*fmt != '\0' && !isalnum((unsigned char)*fmt) && *fmt != '_') fmt++;
+        const char *key = fmt;
+        while(isalnum((unsigned char)*fmt) || *fmt == '_') fmt++;
+        int key_len = (int)(fmt - key);
+        while(*fmt == ' ' || *fmt == ':') fmt++;
+        if(key_len == 0 || *fmt != '%') break;
+        char conv = fmt[1];
+        fmt += 2;
+        void *target = va_arg(ap, void *);
+        struct json_token tok = JSON_INVALID_TOKEN;
+        if(!json_find_key(str, len, key, key_len, &tok)) continue;
+        found++;
+        if(conv == 'T'){
+            *(struct json_token *)target = tok;
+        } else if(conv == 'B'){
+            *(int *)target = tok.type == JSON_TYPE_TRUE;
+        } else if(conv == 'd'){
+            *(int *)target = (int)strtol(tok.ptr, NULL, 0);
+        } else if(conv == 'Q'){
+            char *s = NULL;
+            if(tok.type == JSON_TYPE_STRING && (s = malloc(tok.len + 1)) != NULL){
+                int n = 0;
+                for(int i = 0; i < tok.len; i++){
+                    if(tok.ptr[i] == '\\' && i + 1 < tok.len) i++;
+                    s[n++] = tok.ptr[i];
+                }
+                s[n] = '\0';
+            }
+            *(char **)target = s;
+        }
+    }
+    va_end(ap);
+    return found;
+}
+
+int json_scanf_array_elem(const char *s, int len, const char *path, int index, struct json_token *token){
+    const char *end = s + len;
+    const char *p = json_skip_ws(s, end);
+    if(path[0] != '\0' || p >= end || *p != '[') return -1;
+    p++;
+    for(int i = 0;; i++){
+        p = json_skip_ws(p, end);
+        if(p >= end || *p == ']') return -1;
+        p = json_value(p, end, token);
+        if(p == NULL) return -1;
+        if(i == index) return token->len;
+        p = json_skip_ws(p, end);
+        if(p < end && *p == ',') p++;
+    }
+}
+
+uint32_t cs_crc32(uint32_t crc32, const void *data, size_t len){
+    const uint8_t *p = (const uint8_t *)data;
+    crc32 = ~crc32;
+    while(len-- > 0){
+        crc32 ^= *p++;
+        for(int i = 0; i < 8; i++) crc32 = (crc32 >> 1) ^ (0xEDB88320u & (0u - (crc32 & 1)));
+    }
+    return ~crc32;
+}
@@ -0,0 +1,295 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Host side of the Mongoose OS API: logging, config, timers, mgos_invoke_cb and UDP listeners.
+//The thread calling host_advance_ms or host_run_ms is the mgos task.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+
+#define HOST_TIMERS 256
+#define HOST_INVOKE_SLOTS 4096
+#define HOST_LISTENERS 4
+
+struct host_timer {
+    mgos_timer_id id;
+    int64_t due;
+    int period_ms;
+    bool repeat;
+    timer_callback cb;
+    void *arg;
+};
+
+struct host_invoke {
+    mgos_cb_t cb;
+    void *arg;
+};
+
+struct host_listener {
+    int sock;
+    mg_event_handler_t handler;
+    void *user_data;
+    struct mg_connection conn;
+};
+
+enum cs_log_level cs_log_level = LL_NONE;
+
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct host_timer host_timers[HOST_TIMERS];
+static mgos_timer_id host_next_timer_id = 1;
+static struct host_invoke host_invokes[HOST_INVOKE_SLOTS];
+static unsigned host_invoke_head, host_invoke_tail;
+static struct host_listener host_listeners[HOST_LISTENERS];
+static int host_num_listeners;
+//Virtual clock, or offset of the monotonic one in real time mode
+static int64_t host_clock_us = 1000000;
+static bool host_real;
+
+#define ESPNOW_HOST_CFG(type, name, def) \
+    static type host_cfg_##name = def; \
+    type mgos_sys_config_get_##name(void){ return host_cfg_##name; } \
+    void mgos_sys_config_set_##name(type value){ host_cfg_##name = value; }
+#include "espnow_host_config.h"
+#undef ESPNOW_HOST_CFG
+
+__attribute__((constructor)) static void host_log_init(void){
+    const char *level = getenv("ESPNOW_HOST_LOG");
+    if(level != NULL) cs_log_level = (enum cs_log_level)atoi(level);
+}
+
+void cs_log_printf(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static int64_t host_monotonic_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t mgos_uptime_micros(void){
+    if(host_real) return host_monotonic_us() + host_clock_us;
+    return __atomic_load_n(&host_clock_us, __ATOMIC_RELAXED);
+}
+
+double mgos_uptime(void){
+    return mgos_uptime_micros() / 1e6;
+}
+
+float mgos_rand_range(float from, float to){
+    return from + (to - from) * (rand() / ((float)RAND_MAX + 1));
+}
+
+mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg){
+    mgos_timer_id id = MGOS_INVALID_TIMER_ID;
+    pthread_mutex_lock(&host_lock);
+    for(int i = 0; i < HOST_TIMERS; i++){
+        struct host_timer *t = &host_timers[i];
+        if(t->id != MGOS_INVALID_TIMER_ID) continue;
+        id = host_next_timer_id++;
+        t->id = id;
+        t->due = mgos_uptime_micros() + (int64_t)msecs * 1000;
+        t->period_ms = msecs > 0 ? msecs : 1;
+        t->repeat = (flags & MGOS_TIMER_REPEAT) != 0;
+        t->cb = cb;
+        t->arg = cb_arg;
+        break;
+    }
+    pthread_mutex_unlock(&host_lock);
+    if(id == MGOS_INVALID_TIMER_ID) LOG(LL_ERROR, ("Out of host timers"));
+    return id;
+}
+
+void mgos_clear_timer(mgos_timer_id id){
+    if(id == MGOS_INVALID_TIMER_ID) return;
+    pthread_mutex_lock(&host_lock);
+    for(int i = 0; i < HOST_TIMERS; i++){
+        if(host_timers[i].id == id) host_timers[i].id = MGOS_INVALID_TIMER_ID;
+    }
+    pthread_mutex_unlock(&host_lock);
+}
+
+int host_timers_pending(void){
+    int n = 0;
+    pthread_mutex_lock(&host_lock);
+    for(int i = 0; i < HOST_TIMERS; i++){
+        if(host_timers[i].id != MGOS_INVALID_TIMER_ID) n++;
+    }
+    pthread_mutex_unlock(&host_lock);
+    return n;
+}
+
+bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr){
+    bool ok = false;
+    pthread_mutex_lock(&host_lock);
+    if(host_invoke_tail - host_invoke_head < HOST_INVOKE_SLOTS){
+        host_invokes[host_invoke_tail++ % HOST_INVOKE_SLOTS] = (struct host_invoke){cb, arg};
+        ok = true;
+    }
+    pthread_mutex_unlock(&host_lock);
+    (void)from_isr;
+    return ok;
+}
+
+int host_run_invokes(void){
+    int n = 0;
+    for(;;){
+        pthread_mutex_lock(&host_lock);
+        if(host_invoke_head == host_invoke_tail){
+            pthread_mutex_unlock(&host_lock);
+            return n;
+        }
+        struct host_invoke inv = host_invokes[host_invoke_head++ % HOST_INVOKE_SLOTS];
+        pthread_mutex_unlock(&host_lock);
+        inv.cb(inv.arg);
+        n++;
+    }
+}
+
+//Fire the earliest timer due by limit, returns false if none
+static bool host_fire_timer(int64_t limit){
+    struct host_timer *best = NULL;
+    pthread_mutex_lock(&host_lock);
+    for(int i = 0; i < HOST_TIMERS; i++){
+        struct host_timer *t = &host_timers[i];
+        if(t->id != MGOS_INVALID_TIMER_ID && t->due <= limit && (best == NULL || t->due < best->due)) best = t;
+    }
+    if(best == NULL){
+        pthread_mutex_unlock(&host_lock);
+        return false;
+    }
+    struct host_timer fired = *best;
+    if(fired.repeat) best->due += (int64_t)fired.period_ms * 1000;
+    else best->id = MGOS_INVALID_TIMER_ID;
+    pthread_mutex_unlock(&host_lock);
+    if(!host_real && fired.due > host_clock_us) __atomic_store_n(&host_clock_us, fired.due, __ATOMIC_RELAXED);
+    fired.cb(fired.arg);
+    return true;
+}
+
+void host_advance_ms(int ms){
+    int64_t end = host_clock_us + (int64_t)ms * 1000;
+    do {
+        host_run_invokes();
+    } while(host_fire_timer(end));
+    __atomic_store_n(&host_clock_us, end, __ATOMIC_RELAXED);
+    host_run_invokes();
+}
+
+void host_real_time(void){
+    host_clock_us -= host_monotonic_us();
+    host_real = true;
+}
+
+static void host_poll_listeners(int timeout_ms){
+    struct pollfd fds[HOST_LISTENERS];
+    for(int i = 0; i < host_num_listeners; i++){
+        fds[i].fd = host_listeners[i].sock;
+        fds[i].events = POLLIN;
+    }
+    if(poll(fds, host_num_listeners, timeout_ms) <= 0) return;
+    for(int i = 0; i < host_num_listeners; i++){
+        struct host_listener *l = &host_listeners[i];
+        char buf[1500];
+        ssize_t n;
+        while((n = recv(l->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0){
+            //Each datagram arrives on its own connection, like mongoose does for UDP
+            struct mg_connection nc;
+            memset(&nc, 0, sizeof(nc));
+            nc.listener = &l->conn;
+            nc.recv_mbuf.buf = buf;
+            nc.recv_mbuf.len = (size_t)n;
+            nc.recv_mbuf.size = sizeof(buf);
+            l->handler(&nc, MG_EV_RECV, NULL, l->user_data);
+        }
+    }
+}
+
+void host_run_ms(int ms){
+    if(!host_real){
+        host_advance_ms(ms);
+        return;
+    }
+    int64_t end = mgos_uptime_micros() + (int64_t)ms * 1000;
+    for(;;){
+        do {
+            host_run_invokes();
+        } while(host_fire_timer(mgos_uptime_micros()));
+        int64_t now = mgos_uptime_micros();
+        if(now >= end) break;
+        int64_t wait = end - now;
+        pthread_mutex_lock(&host_lock);
+        for(int i = 0; i < HOST_TIMERS; i++){
+            if(host_timers[i].id != MGOS_INVALID_TIMER_ID && host_timers[i].due - now < wait) wait = host_timers[i].due - now;
+        }
+        pthread_mutex_unlock(&host_lock);
+        if(wait < 0) wait = 0;
+        if(host_num_listeners > 0) host_poll_listeners((int)((wait + 999) / 1000));
+        else if(wait > 0) usleep((useconds_t)wait);
+    }
+}
+
+struct mg_mgr *mgos_get_mgr(void){
+    return NULL;
+}
+
+struct mg_connection *mg_bind(struct mg_mgr *mgr, const char *address, mg_event_handler_t handler, void *user_data){
+    const char *port = strrchr(address, ':');
+    if(strncmp(address, "udp://", 6) != 0 || port == NULL || host_num_listeners == HOST_LISTENERS) return NULL;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if(sock < 0) return NULL;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)atoi(port + 1));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0){
+        close(sock);
+        return NULL;
+    }
+    struct host_listener *l = &host_listeners[host_num_listeners++];
+    l->sock = sock;
+    l->handler = handler;
+    l->user_data = user_data;
+    (void)mgr;
+    return &l->conn;
+}
+
+void mbuf_remove(struct mbuf *mb, size_t n){
+    if(n > mb->len) n = mb->len;
+    memmove(mb->buf, mb->buf + n, mb->len - n);
+    mb->len -= n;
+}
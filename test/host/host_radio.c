@@ -0,0 +1,216 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Mock ESP-NOW driver for unit tests and benchmarks, see host.h. Completions and loopback frames are
+//passed to the library from the event loop, the receive path can also be driven from other threads
+//with host_radio_rx.
+
+#include "host.h"
+#include "esp_now.h"
+#include "esp_wifi.h"
+
+int host_radio_capacity = ESP_NOW_MAX_TOTAL_PEER_NUM;
+int host_radio_queue_len = HOST_RADIO_QUEUE_LEN;
+int host_radio_latency_ms;
+int host_radio_loss_pct;
+bool host_radio_loopback;
+bool host_radio_manual;
+void (*host_radio_hook)(struct host_radio_frame *frame, void *ud);
+void *host_radio_hook_ud;
+esp_err_t (*host_radio_send_hook)(const uint8_t *mac, const uint8_t *data, size_t len);
+struct host_radio_stats host_radio_stats;
+
+static esp_now_recv_cb_t host_radio_recv_cb;
+static esp_now_send_cb_t host_radio_send_cb;
+static esp_now_peer_info_t host_radio_table[ESP_NOW_MAX_TOTAL_PEER_NUM * 4];
+static int host_radio_num_peers;
+static struct host_radio_frame host_radio_queue[HOST_RADIO_QUEUE_LEN];
+static int host_radio_head, host_radio_count;
+static mgos_timer_id host_radio_timer;
+
+esp_err_t esp_wifi_get_mac(wifi_interface_t ifx, uint8_t mac[6]){
+    static const uint8_t base[6] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x10};
+    memcpy(mac, base, 6);
+    mac[5] += (uint8_t)ifx;
+    return ESP_OK;
+}
+
+const char *esp_err_to_name(esp_err_t code){
+    return code == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+static int host_radio_find(const uint8_t *mac){
+    for(int i = 0; i < host_radio_num_peers; i++){
+        if(memcmp(host_radio_table[i].peer_addr, mac, 6) == 0) return i;
+    }
+    return -1;
+}
+
+int host_radio_pending(void){
+    return host_radio_count;
+}
+
+bool host_radio_complete(bool success){
+    if(host_radio_count == 0) return false;
+    struct host_radio_frame frame = host_radio_queue[host_radio_head];
+    host_radio_head = (host_radio_head + 1) % HOST_RADIO_QUEUE_LEN;
+    host_radio_count--;
+    if(host_radio_send_cb != NULL) host_radio_send_cb(frame.mac, success ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+    if(success && host_radio_loopback) host_radio_rx(frame.mac, frame.data, frame.len);
+    return true;
+}
+
+static void host_radio_timer_cb(void *arg){
+    host_radio_timer = MGOS_INVALID_TIMER_ID;
+    int64_t now = mgos_uptime_micros();
+    while(host_radio_count > 0 && !host_radio_manual){
+        struct host_radio_frame *frame = &host_radio_queue[host_radio_head];
+        if(frame->sent_at + (int64_t)host_radio_latency_ms * 1000 > now) break;
+        host_radio_complete(!frame->lost);
+    }
+    if(host_radio_count > 0 && !host_radio_manual){
+        host_radio_timer = mgos_set_timer(host_radio_latency_ms, 0, host_radio_timer_cb, NULL);
+    }
+    (void)arg;
+}
+
+static esp_err_t host_radio_queue_frame(const uint8_t *mac, const uint8_t *data, size_t len){
+    if(host_radio_count >= host_radio_queue_len || host_radio_count == HOST_RADIO_QUEUE_LEN) return ESP_ERR_ESPNOW_NO_MEM;
+    struct host_radio_frame *frame = &host_radio_queue[(host_radio_head + host_radio_count++) % HOST_RADIO_QUEUE_LEN];
+    memcpy(frame->mac, mac, 6);
+    memcpy(frame->data, data, len);
+    frame->len = (int)len;
+    frame->sent_at = mgos_uptime_micros();
+    frame->lost = host_radio_loss_pct > 0 && rand() % 100 < host_radio_loss_pct;
+    if(host_radio_hook != NULL) host_radio_hook(frame, host_radio_hook_ud);
+    host_radio_stats.frames++;
+    if(frame->lost) host_radio_stats.lost++;
+    if(!host_radio_manual && host_radio_timer == MGOS_INVALID_TIMER_ID){
+        host_radio_timer = mgos_set_timer(host_radio_latency_ms, 0, host_radio_timer_cb, NULL);
+    }
+    return ESP_OK;
+}
+
+void host_radio_rx(const uint8_t *mac, const uint8_t *data, int len){
+    if(host_radio_recv_cb != NULL) host_radio_recv_cb(mac, data, len);
+}
+
+void host_radio_tx_status(const uint8_t *mac, bool success){
+    if(host_radio_send_cb != NULL) host_radio_send_cb(mac, success ? ESP_NOW_SEND_SUCCESS : ESP_NOW_SEND_FAIL);
+}
+
+int host_radio_peers(void){
+    return host_radio_num_peers;
+}
+
+bool host_radio_has_peer(const uint8_t *mac){
+    return host_radio_find(mac) >= 0;
+}
+
+esp_err_t esp_now_init(void){
+    return ESP_OK;
+}
+
+esp_err_t esp_now_deinit(void){
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_recv_cb(esp_now_recv_cb_t cb){
+    host_radio_recv_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_register_send_cb(esp_now_send_cb_t cb){
+    host_radio_send_cb = cb;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_send(const uint8_t *peer_addr, const uint8_t *data, size_t len){
+    host_radio_stats.sends++;
+    if(data == NULL || len == 0 || len > ESP_NOW_MAX_DATA_LEN) return ESP_ERR_ESPNOW_ARG;
+    esp_err_t err = host_radio_send_hook != NULL ? host_radio_send_hook(peer_addr, data, len) : ESP_OK;
+    if(err == ESP_OK && peer_addr != NULL){
+        err = host_radio_find(peer_addr) < 0 ? ESP_ERR_ESPNOW_NOT_FOUND : host_radio_queue_frame(peer_addr, data, len);
+    } else if(err == ESP_OK){
+        //NULL goes to every peer of the table, one completion each
+        host_radio_stats.fanout_calls++;
+        if(host_radio_count + host_radio_num_peers > host_radio_queue_len) err = ESP_ERR_ESPNOW_NO_MEM;
+        for(int i = 0; err == ESP_OK && i < host_radio_num_peers; i++){
+            err = host_radio_queue_frame(host_radio_table[i].peer_addr, data, len);
+        }
+    }
+    if(err != ESP_OK) host_radio_stats.refused++;
+    return err;
+}
+
+esp_err_t esp_now_add_peer(const esp_now_peer_info_t *peer){
+    if(peer == NULL) return ESP_ERR_ESPNOW_ARG;
+    if(host_radio_find(peer->peer_addr) >= 0) return ESP_ERR_ESPNOW_EXIST;
+    if(host_radio_num_peers >= host_radio_capacity || host_radio_num_peers == (int)(sizeof(host_radio_table) / sizeof(host_radio_table[0]))){
+        return ESP_ERR_ESPNOW_FULL;
+    }
+    host_radio_table[host_radio_num_peers++] = *peer;
+    host_radio_stats.adds++;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_del_peer(const uint8_t *peer_addr){
+    int idx = host_radio_find(peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    host_radio_table[idx] = host_radio_table[--host_radio_num_peers];
+    host_radio_stats.dels++;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_mod_peer(const esp_now_peer_info_t *peer){
+    int idx = host_radio_find(peer->peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    host_radio_table[idx] = *peer;
+    return ESP_OK;
+}
+
+esp_err_t esp_now_get_peer(const uint8_t *peer_addr, esp_now_peer_info_t *peer){
+    int idx = host_radio_find(peer_addr);
+    if(idx < 0) return ESP_ERR_ESPNOW_NOT_FOUND;
+    *peer = host_radio_table[idx];
+    return ESP_OK;
+}
+
+bool esp_now_is_peer_exist(const uint8_t *peer_addr){
+    return host_radio_find(peer_addr) >= 0;
+}
+
+esp_err_t esp_now_get_peer_num(esp_now_peer_num_t *num){
+    num->total_num = host_radio_num_peers;
+    num->encrypt_num = 0;
+    for(int i = 0; i < host_radio_num_peers; i++){
+        if(host_radio_table[i].encrypt) num->encrypt_num++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_now_set_pmk(const uint8_t *pmk){
+    (void)pmk;
+    return ESP_OK;
+}
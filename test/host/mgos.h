@@ -0,0 +1,99 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//The part of the Mongoose OS API the library uses, for building it on a host with cmake.
+//Timers and mgos_invoke_cb run from host_run_ms or host_advance_ms, see host.h.
+
+#ifndef CS_ESPNOW_HOST_MGOS_H
+#define CS_ESPNOW_HOST_MGOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+    enum cs_log_level {
+        LL_NONE = -1,
+        LL_ERROR = 0,
+        LL_WARN = 1,
+        LL_INFO = 2,
+        LL_DEBUG = 3,
+        LL_VERBOSE_DEBUG = 4
+    };
+    //Log level of the host build, LL_NONE unless set with the ESPNOW_HOST_LOG environment variable
+    extern enum cs_log_level cs_log_level;
+    void cs_log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+#define LOG(l, x) do { if((l) <= cs_log_level){ cs_log_printf x; } } while(0)
+
+    typedef uintptr_t mgos_timer_id;
+#define MGOS_INVALID_TIMER_ID 0
+#define MGOS_TIMER_REPEAT 1
+    typedef void (*timer_callback)(void *param);
+    mgos_timer_id mgos_set_timer(int msecs, int flags, timer_callback cb, void *cb_arg);
+    void mgos_clear_timer(mgos_timer_id id);
+
+    typedef void (*mgos_cb_t)(void *arg);
+    bool mgos_invoke_cb(mgos_cb_t cb, void *arg, bool from_isr);
+
+    double mgos_uptime(void);
+    int64_t mgos_uptime_micros(void);
+    float mgos_rand_range(float from, float to);
+
+    //UDP listener used by the virtual radio, see host_mgos.c
+    struct mbuf {
+        char *buf;
+        size_t len;
+        size_t size;
+    };
+    struct mg_connection {
+        struct mg_connection *listener;
+        struct mbuf recv_mbuf;
+        unsigned long flags;
+    };
+    struct mg_mgr;
+#define MG_EV_RECV 3
+#define MG_F_SEND_AND_CLOSE (1 << 10)
+    typedef void (*mg_event_handler_t)(struct mg_connection *nc, int ev, void *ev_data, void *user_data);
+    struct mg_mgr *mgos_get_mgr(void);
+    struct mg_connection *mg_bind(struct mg_mgr *mgr, const char *address, mg_event_handler_t handler, void *user_data);
+    void mbuf_remove(struct mbuf *mb, size_t n);
+
+    //Config getters and setters, mos.yml config_schema plus the wifi ones the library reads
+#define ESPNOW_HOST_CFG(type, name, def) \
+    type mgos_sys_config_get_##name(void); \
+    void mgos_sys_config_set_##name(type value);
+#include "espnow_host_config.h"
+#undef ESPNOW_HOST_CFG
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
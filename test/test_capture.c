@@ -0,0 +1,260 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Frame capture. Frames sent, refused, completed, lost and received are recorded in order and saved as a
+//pcap file of radiotap and 802.11 action frames, which is parsed back here field by field. Also covers
+//disabling, the ring overwriting its oldest records, and saving while a second thread playing the WiFi
+//task records frames, where no torn record may reach the file.
+
+#include <pthread.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define CAP_FILE "test_capture.pcap"
+#define CAP_SLOTS 64
+#define CAP_SNAPLEN 32
+#define CAP_THREAD_FRAMES 20000
+
+static const uint8_t cap_self[6] = {0x24, 0x0a, 0xc4, 0x00, 0x00, 0x10};
+static const uint8_t cap_oui[3] = {0x18, 0xfe, 0x34};
+static bool cap_lose;
+
+struct cap_rec {
+    uint32_t incl_len;
+    uint32_t orig_len;
+    int64_t time;
+    const uint8_t *p;
+};
+static uint8_t cap_buf[64 * 1024];
+static struct cap_rec cap_recs[CAP_SLOTS];
+
+static void cap_lose_hook(struct host_radio_frame *frame, void *ud){
+    frame->lost = cap_lose;
+    (void)ud;
+}
+
+static esp_err_t cap_refuse_hook(const uint8_t *mac, const uint8_t *data, size_t len){
+    (void)mac;
+    (void)data;
+    (void)len;
+    return ESP_FAIL;
+}
+
+static uint32_t cap_get32(const uint8_t *p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+//Read the file back, returns the records or -1 if it is malformed
+static int cap_load(){
+    FILE *f = fopen(CAP_FILE, "rb");
+    if(f == NULL) return -1;
+    size_t len = fread(cap_buf, 1, sizeof(cap_buf), f);
+    fclose(f);
+    if(len < 24 || cap_get32(cap_buf) != 0xa1b2c3d4 || cap_get32(cap_buf + 20) != 127) return -1;
+    int num = 0;
+    for(size_t off = 24; off < len; num++){
+        if(num == CAP_SLOTS || off + 16 > len) return -1;
+        struct cap_rec *rec = &cap_recs[num];
+        rec->time = (int64_t)cap_get32(cap_buf + off) * 1000000 + cap_get32(cap_buf + off + 4);
+        rec->incl_len = cap_get32(cap_buf + off + 8);
+        rec->orig_len = cap_get32(cap_buf + off + 12);
+        rec->p = cap_buf + off + 16;
+        off += 16 + rec->incl_len;
+        if(off > len || rec->incl_len < 20 || rec->orig_len < rec->incl_len) return -1;
+    }
+    return num;
+}
+
+//Radiotap header: present word and flags of the RX or TX flags field
+static bool cap_radiotap(const struct cap_rec *rec, bool rx, bool failed){
+    const uint8_t *p = rec->p;
+    uint16_t present = rx ? 1 << 14 : 1 << 15;
+    return p[0] == 0 && p[2] == 10 && p[3] == 0 && (p[4] | (p[5] << 8)) == present && p[8] == (failed ? 1 : 0);
+}
+
+//Vendor action frame carrying an ESP-NOW element with the payload
+static bool cap_action(const struct cap_rec *rec, const uint8_t *da, const uint8_t *sa, const uint8_t *data, int len){
+    const uint8_t *p = rec->p + 10;
+    int caplen = len < CAP_SNAPLEN ? len : CAP_SNAPLEN;
+    static const uint8_t bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    if(p[0] != 0xd0 || memcmp(p + 4, da, 6) != 0 || memcmp(p + 10, sa, 6) != 0 || memcmp(p + 16, bcast, 6) != 0) return false;
+    p += 24;
+    if(p[0] != 127 || memcmp(p + 1, cap_oui, 3) != 0) return false;
+    p += 8;
+    if(p[0] != 221 || p[1] != 5 + len || memcmp(p + 2, cap_oui, 3) != 0 || p[5] != 4 || p[6] != 1) return false;
+    p += 7;
+    return memcmp(p, data, caplen) == 0 && rec->incl_len == (uint32_t)(10 + 24 + 8 + 7 + caplen) &&
+           rec->orig_len == rec->incl_len + (len - caplen);
+}
+
+//ACK from the peer, addressed to this node
+static bool cap_ack(const struct cap_rec *rec){
+    const uint8_t *p = rec->p + 10;
+    return p[0] == 0xd4 && memcmp(p + 4, cap_self, 6) == 0 && rec->incl_len == 20 && rec->orig_len == 20;
+}
+
+static void cap_rx(int i, uint32_t seq, int len){
+    uint8_t mac[6];
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+    host_peer_mac(i, mac);
+    memset(data, (uint8_t)seq, sizeof(data));
+    memcpy(data, &seq, sizeof(seq));
+    host_radio_rx(mac, data, len);
+}
+
+static void *cap_wifi_task(void *arg){
+    for(uint32_t seq = 0; seq < CAP_THREAD_FRAMES; seq++){
+        cap_rx(2, seq, 4 + seq % 60);
+        if(seq % 64 == 63) sched_yield();
+    }
+    __atomic_store_n((bool *)arg, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+//Every record saved by a reader racing the thread is whole: its payload is its sequence number followed
+//by the low byte of it repeated
+static int cap_check_torn(int num){
+    int torn = 0;
+    uint8_t mac[6];
+    host_peer_mac(2, mac);
+    for(int i = 0; i < num; i++){
+        const struct cap_rec *rec = &cap_recs[i];
+        const uint8_t *p = rec->p + 10;
+        if(rec->incl_len < 10 + 24 + 8 + 7 + 4 || memcmp(p + 10, mac, 6) != 0){
+            torn++;
+            continue;
+        }
+        int len = p[24 + 8 + 1] - 5;
+        uint32_t seq = cap_get32(p + 24 + 8 + 7);
+        if(len != 4 + (int)(seq % 60)){
+            torn++;
+            continue;
+        }
+        for(int j = 4; j < len && j < CAP_SNAPLEN; j++){
+            if(p[24 + 8 + 7 + j] != (uint8_t)seq){
+                torn++;
+                break;
+            }
+        }
+    }
+    return torn;
+}
+
+int main(void){
+    struct mgos_espnow_capture_stats st;
+    char name[16];
+    uint8_t mac[6], peer1[6], peer2[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 1; i <= 2; i++){
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+    host_peer_mac(1, peer1);
+    host_peer_mac(2, peer2);
+    host_radio_hook = cap_lose_hook;
+
+    //Off by default, nothing recorded
+    mgos_espnow_send("peer1", (const uint8_t *)"off", 3);
+    host_advance_ms(10);
+    mgos_espnow_get_capture_stats(&st);
+    TEST_CHECK(!st.enabled && st.captured == 0, "enabled %d captured %u", st.enabled, st.captured);
+    TEST_CHECK(st.slots == CAP_SLOTS && st.snaplen == CAP_SNAPLEN, "%d slots %d snaplen", st.slots, st.snaplen);
+    TEST_CHECK(mgos_espnow_capture_save(CAP_FILE) == 0 && cap_load() == 0, "empty capture");
+
+    //Sent and acknowledged, received and cut to the snap length, refused by the driver, lost
+    uint8_t big[100];
+    for(int i = 0; i < (int)sizeof(big); i++) big[i] = (uint8_t)i;
+    TEST_CHECK(mgos_espnow_capture_enable(true), "enable");
+    mgos_espnow_send("peer1", (const uint8_t *)"hello", 5);
+    host_advance_ms(10);
+    host_radio_rx(peer2, big, sizeof(big));
+    host_radio_send_hook = cap_refuse_hook;
+    mgos_sys_config_set_espnow_tx_max_retries(0);
+    mgos_espnow_send("peer1", (const uint8_t *)"refused", 7);
+    host_advance_ms(10);
+    host_radio_send_hook = NULL;
+    cap_lose = true;
+    mgos_espnow_send("peer2", (const uint8_t *)"lost", 4);
+    host_advance_ms(10);
+    cap_lose = false;
+    mgos_espnow_get_capture_stats(&st);
+    TEST_CHECK(st.enabled && st.captured == 6 && st.overwritten == 0, "enabled %d captured %u overwritten %u",
+               st.enabled, st.captured, st.overwritten);
+    TEST_CHECK(mgos_espnow_capture_save(CAP_FILE) == 6, "saved");
+    TEST_CHECK(cap_load() == 6, "loaded");
+    TEST_CHECK(cap_radiotap(&cap_recs[0], false, false) && cap_action(&cap_recs[0], peer1, cap_self, (const uint8_t *)"hello", 5), "sent frame");
+    TEST_CHECK(cap_radiotap(&cap_recs[1], false, false) && cap_ack(&cap_recs[1]), "ACK");
+    TEST_CHECK(cap_radiotap(&cap_recs[2], true, false) && cap_action(&cap_recs[2], cap_self, peer2, big, sizeof(big)), "received frame");
+    TEST_CHECK(cap_radiotap(&cap_recs[3], false, true) && cap_action(&cap_recs[3], peer1, cap_self, (const uint8_t *)"refused", 7), "refused frame");
+    TEST_CHECK(cap_radiotap(&cap_recs[4], false, false) && cap_action(&cap_recs[4], peer2, cap_self, (const uint8_t *)"lost", 4), "lost frame");
+    TEST_CHECK(cap_radiotap(&cap_recs[5], false, true) && cap_ack(&cap_recs[5]), "missing ACK");
+    for(int i = 1; i < 6; i++){
+        TEST_CHECK(cap_recs[i].time >= cap_recs[i - 1].time, "record %d goes back in time", i);
+    }
+
+    //Disabling stops recording and keeps the ring
+    TEST_CHECK(mgos_espnow_capture_enable(false), "disable");
+    host_radio_rx(peer2, big, 10);
+    mgos_espnow_get_capture_stats(&st);
+    TEST_CHECK(!st.enabled && st.captured == 6, "enabled %d captured %u after disabling", st.enabled, st.captured);
+    TEST_CHECK(mgos_espnow_capture_save(CAP_FILE) == 6, "saved after disabling");
+
+    //The oldest records are overwritten, the file has the last CAP_SLOTS in order
+    mgos_espnow_capture_enable(true);
+    for(uint32_t seq = 0; seq < CAP_SLOTS + 10; seq++) cap_rx(2, seq, 4 + seq % 60);
+    mgos_espnow_get_capture_stats(&st);
+    TEST_CHECK(st.captured == 6 + CAP_SLOTS + 10 && st.overwritten == st.captured - CAP_SLOTS, "captured %u overwritten %u",
+               st.captured, st.overwritten);
+    TEST_CHECK(mgos_espnow_capture_save(CAP_FILE) == CAP_SLOTS, "saved full ring");
+    TEST_CHECK(cap_load() == CAP_SLOTS, "loaded full ring");
+    TEST_CHECK(cap_check_torn(CAP_SLOTS) == 0, "bad records in the full ring");
+    //Records 16 on are kept, the 6 from before and the first 10 injected are gone
+    TEST_CHECK(cap_get32(cap_recs[0].p + 10 + 24 + 8 + 7) == 10, "oldest record is %u", cap_get32(cap_recs[0].p + 10 + 24 + 8 + 7));
+
+    //Saving while the WiFi task records, records being overwritten are skipped
+    bool done = false;
+    int saves = 0, torn = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, cap_wifi_task, &done);
+    while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)){
+        int num = mgos_espnow_capture_save(CAP_FILE);
+        TEST_CHECK(num >= 0 && num <= CAP_SLOTS && cap_load() == num, "save %d gave %d records", saves, num);
+        torn += cap_check_torn(num > 0 ? num : 0);
+        saves++;
+    }
+    pthread_join(thread, NULL);
+    TEST_CHECK(saves > 0, "no save during the thread");
+    TEST_CHECK(torn == 0, "%d torn records in %d saves", torn, saves);
+    mgos_espnow_get_capture_stats(&st);
+    TEST_CHECK(st.captured == 6 + CAP_SLOTS + 10 + CAP_THREAD_FRAMES, "captured %u", st.captured);
+
+    remove(CAP_FILE);
+    return test_finish("capture");
+}
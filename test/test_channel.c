@@ -0,0 +1,199 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//TX grouping on the virtual radio with a peer on each of channels 1, 6 and 11 and a cost for every
+//channel change. Round robin traffic is sent with espnow.tx_group_max_wait_ms off and on and the
+//frames, channel switches and throughput of both are printed. With a backlog on one channel, frames
+//to the others must not wait longer than tx_group_max_wait_ms for each other channel, and HIGH
+//frames must complete in the order they were sent whatever their channel.
+
+#include <unistd.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define CHAN_PEERS 3
+#define CHAN_AIRTIME_MS 1
+#define CHAN_SWITCH_MS 3
+#define CHAN_MAX_WAIT_MS 20
+#define CHAN_FRAMES 900
+#define CHAN_RUN_MS 2000
+#define CHAN_SPARSE_EVERY_MS 7
+#define CHAN_BACKLOG 16
+#define CHAN_HIGH 30
+#define CHAN_HIGH_EVERY_MS 20
+
+static const int chan_channels[CHAN_PEERS] = {1, 6, 11};
+static char chan_names[CHAN_PEERS][16];
+static int chan_done, chan_failed;
+//Frames to the channels without a backlog: how many and the longest time from send to completion
+static int chan_sparse;
+static int64_t chan_sparse_max_us, chan_sparse_sent_us[CHAN_RUN_MS / CHAN_SPARSE_EVERY_MS + 1];
+static int chan_high_order[CHAN_HIGH], chan_high_num;
+
+static void chan_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    chan_done++;
+    if(!success) chan_failed++;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+//ud carries the index of the send time
+static void chan_sparse_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    int64_t us = mgos_uptime_micros() - chan_sparse_sent_us[(intptr_t)ud];
+    chan_sparse++;
+    if(us > chan_sparse_max_us) chan_sparse_max_us = us;
+    chan_cb(handle, mac, success, NULL);
+}
+
+//ud carries the send order
+static void chan_high_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    if(chan_high_num < CHAN_HIGH) chan_high_order[chan_high_num++] = (int)(intptr_t)ud;
+    chan_cb(handle, mac, success, NULL);
+}
+
+static bool chan_send(int peer, mgos_espnow_prio_t prio, espnow_msg_cb_t cb, void *ud){
+    uint8_t msg[64];
+    memset(msg, peer, sizeof(msg));
+    mgos_espnow_result_t r = mgos_espnow_send_msg_prio(chan_names[peer], msg, sizeof(msg), prio, cb, ud, NULL);
+    if(prio == ESPNOW_PRIO_HIGH) if(r != ESPNOW_OK){ struct mgos_espnow_tx_stats st; mgos_espnow_get_tx_stats(&st); fprintf(stderr, "r=%d depth %d inflight %d slots %d\n", r, st.queue_depth, st.in_flight, st.queue_slots); }
+    return r == ESPNOW_OK;
+}
+
+static int chan_queued(void){
+    struct mgos_espnow_tx_stats st;
+    mgos_espnow_get_tx_stats(&st);
+    return st.queue_depth + st.in_flight;
+}
+
+static void chan_drain(void){
+    for(int i = 0; i < 10000 && chan_queued() > 0; i++) host_advance_ms(1);
+}
+
+//Round robin over the channels keeping the queue full, returns the ms taken by CHAN_FRAMES frames
+static int chan_throughput(int max_wait_ms, uint32_t *switches, uint32_t *avoided){
+    struct mgos_espnow_tx_stats before, after;
+    mgos_sys_config_set_espnow_tx_group_max_wait_ms(max_wait_ms);
+    mgos_espnow_get_tx_stats(&before);
+    chan_done = chan_failed = 0;
+    int64_t start = mgos_uptime_micros();
+    int sent = 0;
+    while(chan_done < CHAN_FRAMES && mgos_uptime_micros() - start < 60 * 1000000LL){
+        while(sent < CHAN_FRAMES && chan_send(sent % CHAN_PEERS, ESPNOW_PRIO_NORMAL, chan_cb, NULL)) sent++;
+        host_advance_ms(1);
+    }
+    int ms = (int)((mgos_uptime_micros() - start) / 1000);
+    mgos_espnow_get_tx_stats(&after);
+    *switches = after.channel_switches - before.channel_switches;
+    *avoided = after.switches_avoided - before.switches_avoided;
+    TEST_CHECK(chan_done == CHAN_FRAMES && chan_failed == 0, "max_wait %d: %d of %d done, %d failed", max_wait_ms, chan_done, CHAN_FRAMES, chan_failed);
+    printf("channel: grouping %s: %d frames in %d ms, %d frames/s, %u switches, %u avoided\n", max_wait_ms > 0 ? "on " : "off",
+           chan_done, ms, ms > 0 ? chan_done * 1000 / ms : 0, (unsigned)*switches, (unsigned)*avoided);
+    return ms;
+}
+
+//Backlog on channel 1, a frame to channel 6 or 11 every CHAN_SPARSE_EVERY_MS
+static void chan_bounded_wait(void){
+    mgos_sys_config_set_espnow_tx_group_max_wait_ms(CHAN_MAX_WAIT_MS);
+    chan_sparse = 0;
+    chan_sparse_max_us = 0;
+    chan_done = chan_failed = 0;
+    for(int t = 0; t < CHAN_RUN_MS; t++){
+        while(chan_queued() < CHAN_BACKLOG && chan_send(0, ESPNOW_PRIO_NORMAL, chan_cb, NULL)){
+        }
+        if(t % CHAN_SPARSE_EVERY_MS == 0){
+            int n = t / CHAN_SPARSE_EVERY_MS;
+            chan_sparse_sent_us[n] = mgos_uptime_micros();
+            TEST_CHECK(chan_send(1 + n % 2, ESPNOW_PRIO_NORMAL, chan_sparse_cb, (void *)(intptr_t)n), "sparse %d", n);
+        }
+        host_advance_ms(1);
+    }
+    chan_drain();
+    //Each other channel holds a frame up to max_wait plus the frame in the air when it ends and the switch to it,
+    //then the frames already handed to the driver go out first
+    int frame_ms = CHAN_AIRTIME_MS + CHAN_SWITCH_MS;
+    int64_t bound_ms = (CHAN_PEERS - 1) * (CHAN_MAX_WAIT_MS + frame_ms) + mgos_sys_config_get_espnow_tx_window() * frame_ms + frame_ms + 1;
+    printf("channel: backlog on channel 1, %d frames to channels 6 and 11 waited at most %d.%03d ms, bound %d ms\n", chan_sparse,
+           (int)(chan_sparse_max_us / 1000), (int)(chan_sparse_max_us % 1000), (int)bound_ms);
+    TEST_CHECK(chan_sparse >= CHAN_RUN_MS / CHAN_SPARSE_EVERY_MS - 1, "%d frames to the other channels", chan_sparse);
+    TEST_CHECK(chan_sparse_max_us <= bound_ms * 1000, "waited %lld us, bound %lld ms", (long long)chan_sparse_max_us, (long long)bound_ms);
+    TEST_CHECK(chan_failed == 0, "%d failed", chan_failed);
+}
+
+//HIGH frames across the channels on top of a NORMAL backlog on channel 1
+static void chan_high_order_kept(void){
+    mgos_sys_config_set_espnow_tx_group_max_wait_ms(CHAN_MAX_WAIT_MS);
+    chan_high_num = 0;
+    int high = 0;
+    for(int t = 0; t < 500 && chan_high_num < CHAN_HIGH; t++){
+        while(chan_queued() < CHAN_BACKLOG && chan_send(0, ESPNOW_PRIO_NORMAL, chan_cb, NULL)){
+        }
+        //Bursts of three, one per channel, starting on another channel each time
+        if(t % CHAN_HIGH_EVERY_MS == 0){
+            for(int i = 0; i < 3 && high < CHAN_HIGH; i++, high++){
+                TEST_CHECK(chan_send((high + t / CHAN_HIGH_EVERY_MS + 1) % CHAN_PEERS, ESPNOW_PRIO_HIGH, chan_high_cb, (void *)(intptr_t)high), "high %d", high);
+            }
+        }
+        host_advance_ms(1);
+    }
+    chan_drain();
+    TEST_CHECK(chan_high_num == CHAN_HIGH, "%d of %d HIGH frames", chan_high_num, CHAN_HIGH);
+    for(int i = 0; i < chan_high_num; i++){
+        TEST_CHECK(chan_high_order[i] == i, "HIGH frame %d completed as %d", chan_high_order[i], i);
+    }
+}
+
+int main(void){
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_sim_nodes(1);
+    //Clear of the ports of the other tests on the virtual radio
+    mgos_sys_config_set_espnow_sim_port(61000 + getpid() % 4000);
+    mgos_sys_config_set_espnow_sim_latency_ms(CHAN_AIRTIME_MS);
+    mgos_sys_config_set_espnow_sim_switch_ms(CHAN_SWITCH_MS);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < CHAN_PEERS; i++){
+        uint8_t mac[6];
+        host_peer_mac(i + 1, mac);
+        host_peer_name(i + 1, chan_names[i], sizeof(chan_names[i]));
+        TEST_CHECK(mgos_espnow_add_peer(chan_names[i], mac, false, chan_channels[i], false) == ESPNOW_OK, "peer %d", i);
+    }
+
+    uint32_t off_switches, off_avoided, on_switches, on_avoided;
+    int off_ms = chan_throughput(0, &off_switches, &off_avoided);
+    chan_drain();
+    int on_ms = chan_throughput(CHAN_MAX_WAIT_MS, &on_switches, &on_avoided);
+    chan_drain();
+    //Every frame changes channel in queue order, grouping leaves about one switch per max_wait
+    TEST_CHECK(off_switches >= CHAN_FRAMES - 2 && off_avoided == 0, "off: %u switches, %u avoided", (unsigned)off_switches, (unsigned)off_avoided);
+    TEST_CHECK(on_switches * 4 < off_switches && on_avoided > 0, "on: %u switches, %u avoided", (unsigned)on_switches, (unsigned)on_avoided);
+    TEST_CHECK(on_ms * 2 < off_ms, "on %d ms, off %d ms", on_ms, off_ms);
+
+    chan_bounded_wait();
+    chan_high_order_kept();
+    return test_finish("channel");
+}
@@ -0,0 +1,118 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Coalescing: small messages to a peer share frames and come back one by one, in order, through the
+//loopback radio. A lone message waits espnow.coalesce_ms, long ones flush what waits before them.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+static int co_order[256];
+static int co_received;
+static int co_done, co_done_ok;
+
+static void co_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    //First byte numbers the message, the length is checked against it
+    if(co_received < 256 && len > 0) co_order[co_received] = len == 20 + data[0] % 10 || len == 200 ? data[0] : -1;
+    co_received++;
+    (void)mac;
+    (void)ud;
+}
+
+static void co_msg_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    co_done++;
+    co_done_ok += success;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+static void co_send(int i, int len){
+    uint8_t msg[250];
+    memset(msg, 0xaa, sizeof(msg));
+    msg[0] = (uint8_t)i;
+    TEST_CHECK(mgos_espnow_send_msg("peer0", msg, len, co_msg_cb, NULL, NULL) == ESPNOW_OK, "message %d", i);
+}
+
+static bool co_in_order(int num){
+    if(co_received != num) return false;
+    for(int i = 0; i < num; i++){
+        if(co_order[i] != i) return false;
+    }
+    return true;
+}
+
+int main(void){
+    struct mgos_espnow_coalesce_stats st;
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_coalesce(true);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, co_recv_cb, NULL);
+    host_radio_loopback = true;
+
+    //A burst packs into few frames
+    for(int i = 0; i < 40; i++) co_send(i, 20 + i % 10);
+    host_advance_ms(20);
+    mgos_espnow_get_coalesce_stats(&st);
+    TEST_CHECK(co_in_order(40), "%d received", co_received);
+    TEST_CHECK(co_done == 40 && co_done_ok == 40, "%d completed, %d successful", co_done, co_done_ok);
+    TEST_CHECK(st.messages == 40 && st.frames <= 6 && st.frames_saved == 40 - st.frames, "%u messages in %u frames, %u saved", st.messages, st.frames, st.frames_saved);
+    TEST_CHECK(host_radio_stats.frames == st.frames, "%u frames on the radio, %u counted", host_radio_stats.frames, st.frames);
+    TEST_CHECK(st.saved_per_sec >= 0 && st.dropped == 0, "%f saved per second, %u dropped", st.saved_per_sec, st.dropped);
+
+    //A lone message waits for the timer
+    co_received = co_done = co_done_ok = 0;
+    co_send(0, 20);
+    host_advance_ms(mgos_sys_config_get_espnow_coalesce_ms() - 1);
+    TEST_CHECK(co_received == 0, "sent before espnow.coalesce_ms");
+    host_advance_ms(5);
+    TEST_CHECK(co_in_order(1) && co_done_ok == 1, "lone message: %d received", co_received);
+    mgos_espnow_get_coalesce_stats(&st);
+    TEST_CHECK(st.avg_delay_us > 0, "no delay counted");
+
+    //A long message is sent on its own, after the ones waiting
+    co_received = 0;
+    co_send(0, 20);
+    co_send(1, 21);
+    co_send(2, 200);
+    co_send(3, 23);
+    host_advance_ms(20);
+    TEST_CHECK(co_in_order(4), "%d received with a long message", co_received);
+
+    //A batch with a bad length delivers what comes before it
+    co_received = 0;
+    uint8_t batch[] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_BATCH, 20, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 200, 1, 2};
+    host_radio_rx(mac, batch, sizeof(batch));
+    host_run_invokes();
+    mgos_espnow_get_coalesce_stats(&st);
+    TEST_CHECK(co_in_order(1) && st.rx_malformed == 1, "%d received, %u malformed", co_received, st.rx_malformed);
+    return test_finish("coalesce");
+}
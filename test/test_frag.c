@@ -0,0 +1,176 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Fragmentation: large messages come back whole through the loopback radio, fragments out of order
+//or repeated are reassembled once, and reassembly memory stays within espnow.frag_rx_budget, with
+//partial messages dropped on timeout or when more senders than slots show up. Fragments longer than
+//MGOS_ESPNOW_FRAG_LEN are refused.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+static uint8_t frag_last[8192];
+static int frag_last_len;
+static int frag_delivered;
+static int frag_done, frag_done_ok;
+
+static void frag_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    frag_delivered++;
+    frag_last_len = len;
+    if(len <= (int)sizeof(frag_last)) memcpy(frag_last, data, len);
+    (void)mac;
+    (void)ud;
+}
+
+static void frag_msg_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    frag_done++;
+    frag_done_ok += success;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+//Fragment index of count of message msg_id from peer p, filled with its position in the message
+static void frag_rx(int p, uint8_t msg_id, int index, int count, int chunk){
+    uint8_t mac[6];
+    uint8_t frame[MGOS_ESPNOW_MAX_LEN];
+    host_peer_mac(p, mac);
+    frame[0] = ESPNOW_PROTO_MAGIC;
+    frame[1] = ESPNOW_PROTO_FRAG;
+    frame[2] = msg_id;
+    frame[3] = (uint8_t)index;
+    frame[4] = (uint8_t)count;
+    for(int i = 0; i < chunk; i++) frame[5 + i] = (uint8_t)(index * MGOS_ESPNOW_FRAG_LEN + i);
+    host_radio_rx(mac, frame, 5 + chunk);
+    host_run_invokes();
+}
+
+static bool frag_check_last(int len){
+    if(frag_last_len != len) return false;
+    for(int i = 0; i < len; i++){
+        if(frag_last[i] != (uint8_t)i) return false;
+    }
+    return true;
+}
+
+int main(void){
+    struct mgos_espnow_frag_stats st;
+    char name[16];
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < 8; i++){
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_add_peer(name, mac, false, 1, false);
+    }
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, frag_recv_cb, NULL);
+
+    //Whole messages through the loopback radio
+    host_radio_loopback = true;
+    static uint8_t msg[4096];
+    for(int i = 0; i < (int)sizeof(msg); i++) msg[i] = (uint8_t)i;
+    const int lens[] = {1, MGOS_ESPNOW_FRAG_LEN, MGOS_ESPNOW_FRAG_LEN + 1, 1000, 4096};
+    for(size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++){
+        frag_delivered = 0;
+        TEST_CHECK(mgos_espnow_send_large("peer0", msg, lens[i], frag_msg_cb, NULL, NULL) == ESPNOW_OK, "send %d bytes", lens[i]);
+        host_advance_ms(50);
+        TEST_CHECK(frag_delivered == 1 && frag_check_last(lens[i]), "%d bytes: %d delivered, last %d bytes", lens[i], frag_delivered, frag_last_len);
+    }
+    TEST_CHECK(frag_done == 5 && frag_done_ok == 5, "%d completions, %d successful", frag_done, frag_done_ok);
+    TEST_CHECK(mgos_espnow_send_large("peer0", msg, 4097, NULL, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "above espnow.frag_max_len");
+    host_radio_loopback = false;
+
+    //Out of order and repeated fragments
+    frag_delivered = 0;
+    int order[] = {3, 0, 0, 2, 3, 1};
+    for(int i = 0; i < 6; i++) frag_rx(1, 10, order[i], 4, order[i] == 3 ? 17 : MGOS_ESPNOW_FRAG_LEN);
+    TEST_CHECK(frag_delivered == 1 && frag_check_last(3 * MGOS_ESPNOW_FRAG_LEN + 17), "out of order: %d delivered, %d bytes", frag_delivered, frag_last_len);
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(st.rx_mem_used == 0, "%d bytes used after delivery", st.rx_mem_used);
+
+    //A last fragment longer than the others would write past the reassembly buffer
+    mgos_espnow_get_frag_stats(&st);
+    uint32_t invalid = st.rx_dropped;
+    frag_delivered = 0;
+    frag_rx(2, 11, 0, 2, MGOS_ESPNOW_FRAG_LEN);
+    frag_rx(2, 11, 1, 2, MGOS_ESPNOW_MAX_LEN - 5);
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(frag_delivered == 0 && st.rx_dropped == invalid + 1, "oversized fragment: %d delivered, %u dropped", frag_delivered, st.rx_dropped - invalid);
+    host_advance_ms(2 * mgos_sys_config_get_espnow_frag_timeout_ms());
+
+    //Partial messages up to the budget, one more sender is refused
+    int budget = mgos_sys_config_get_espnow_frag_rx_budget();
+    int count = 8;
+    int per_msg = count * MGOS_ESPNOW_FRAG_LEN;
+    int fit = budget / per_msg;
+    if(fit > MGOS_ESPNOW_FRAG_SLOTS) fit = MGOS_ESPNOW_FRAG_SLOTS;
+    mgos_sys_config_set_espnow_frag_rx_budget(fit * per_msg + per_msg / 2);
+    mgos_espnow_get_frag_stats(&st);
+    uint32_t dropped = st.rx_dropped;
+    for(int p = 0; p < fit; p++) frag_rx(p, 20, 0, count, MGOS_ESPNOW_FRAG_LEN);
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(st.rx_mem_used == fit * per_msg, "%d bytes used by %d partial messages", st.rx_mem_used, fit);
+    if(fit < MGOS_ESPNOW_FRAG_SLOTS){
+        frag_rx(fit, 20, 0, count, MGOS_ESPNOW_FRAG_LEN);
+        mgos_espnow_get_frag_stats(&st);
+        TEST_CHECK(st.rx_dropped == dropped + 1, "over the budget: %u dropped", st.rx_dropped - dropped);
+        TEST_CHECK(st.rx_mem_used == fit * per_msg, "%d bytes used over the budget", st.rx_mem_used);
+    }
+    TEST_CHECK(st.rx_mem_used <= mgos_sys_config_get_espnow_frag_rx_budget(), "%d bytes used", st.rx_mem_used);
+    //Partial messages time out and free their memory
+    mgos_espnow_get_frag_stats(&st);
+    uint32_t timeouts = st.rx_timeouts;
+    host_advance_ms(2 * mgos_sys_config_get_espnow_frag_timeout_ms());
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(st.rx_timeouts == timeouts + fit, "%u timed out of %d", st.rx_timeouts - timeouts, fit);
+    TEST_CHECK(st.rx_mem_used == 0, "%d bytes used after the timeout", st.rx_mem_used);
+    mgos_sys_config_set_espnow_frag_rx_budget(budget);
+
+    //More senders than slots, the oldest partial message makes room
+    mgos_espnow_get_frag_stats(&st);
+    dropped = st.rx_dropped;
+    for(int p = 0; p <= MGOS_ESPNOW_FRAG_SLOTS; p++){
+        frag_rx(p, 30, 0, 2, MGOS_ESPNOW_FRAG_LEN);
+        host_advance_ms(1);
+    }
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(st.rx_dropped == dropped + 1, "%u dropped with more senders than slots", st.rx_dropped - dropped);
+    TEST_CHECK(st.rx_mem_used == MGOS_ESPNOW_FRAG_SLOTS * 2 * MGOS_ESPNOW_FRAG_LEN, "%d bytes used by full slots", st.rx_mem_used);
+    //The newest ones still complete
+    frag_delivered = 0;
+    frag_rx(MGOS_ESPNOW_FRAG_SLOTS, 30, 1, 2, 5);
+    TEST_CHECK(frag_delivered == 1 && frag_check_last(MGOS_ESPNOW_FRAG_LEN + 5), "newest sender: %d delivered", frag_delivered);
+    //A fragment of the evicted one starts over and never completes
+    frag_rx(0, 30, 1, 2, 5);
+    TEST_CHECK(frag_delivered == 1, "evicted sender delivered");
+    host_advance_ms(2 * mgos_sys_config_get_espnow_frag_timeout_ms());
+    mgos_espnow_get_frag_stats(&st);
+    TEST_CHECK(st.rx_mem_used == 0, "%d bytes used at the end", st.rx_mem_used);
+    return test_finish("frag");
+}
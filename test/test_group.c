@@ -0,0 +1,141 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Group sends with a driver peer table smaller than the peer list. One call to all peers is only made
+//when the table holds exactly the members, otherwise every member gets its own frame and nobody else
+//gets any.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+#define GROUP_PEERS 6
+
+static int group_frames[GROUP_PEERS];
+static int group_done, group_sent, group_failed;
+
+static void group_hook(struct host_radio_frame *frame, void *ud){
+    if(frame->data[0] == 'G' && frame->mac[5] < GROUP_PEERS) group_frames[frame->mac[5]]++;
+    (void)ud;
+}
+
+static void group_cb(mgos_espnow_handle_t handle, int sent, int failed, void *ud){
+    group_done++;
+    group_sent += sent;
+    group_failed += failed;
+    (void)handle;
+    (void)ud;
+}
+
+//Send to the group and wait for its callback, returns whether it went out with one driver call
+static bool group_send(const char *group){
+    static const uint8_t msg[] = "Group";
+    uint32_t fanout_calls = host_radio_stats.fanout_calls;
+    memset(group_frames, 0, sizeof(group_frames));
+    group_done = group_sent = group_failed = 0;
+    TEST_CHECK(mgos_espnow_send_group(group, msg, sizeof(msg), group_cb, NULL, NULL) == ESPNOW_OK, "send to %s", group);
+    for(int i = 0; i < 100 && group_done == 0; i++){
+        host_advance_ms(1);
+    }
+    TEST_CHECK(group_done == 1, "group callback called %d times", group_done);
+    return host_radio_stats.fanout_calls != fanout_calls;
+}
+
+//Each of the first num peers got one frame of the last group send, the others none
+static bool group_reached(int num){
+    for(int i = 0; i < GROUP_PEERS; i++){
+        if(group_frames[i] != (i < num ? 1 : 0)) return false;
+    }
+    return group_sent == num && group_failed == 0;
+}
+
+static void group_unicast(const char *name){
+    static const uint8_t msg[] = "Unicast";
+    TEST_CHECK(mgos_espnow_send(name, msg, sizeof(msg)) == ESPNOW_OK, "send to %s", name);
+    for(int i = 0; i < 10; i++){
+        host_advance_ms(1);
+    }
+}
+
+int main(void){
+    struct mgos_espnow_peer_table_stats table;
+    struct mgos_espnow_group_stats st;
+    host_radio_capacity = 4;
+    host_radio_hook = group_hook;
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < GROUP_PEERS; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+        if(i < 4) TEST_CHECK(mgos_espnow_group_add("g", name) == ESPNOW_OK, "join %s", name);
+        if(i < 3) TEST_CHECK(mgos_espnow_group_add("h", name) == ESPNOW_OK, "join %s", name);
+    }
+    TEST_CHECK(host_radio_peers() == 4, "driver table holds %d peers", host_radio_peers());
+
+    //The table is the group: one call, and every member counts as used
+    mgos_espnow_get_peer_table_stats(&table);
+    uint32_t hits = table.hits;
+    TEST_CHECK(group_send("g"), "no single call with the table holding the group");
+    TEST_CHECK(group_reached(4), "fanout reached the wrong peers");
+    mgos_espnow_get_peer_table_stats(&table);
+    TEST_CHECK(table.hits - hits == 4, "fanout used %u members", (unsigned)(table.hits - hits));
+    mgos_espnow_get_group_stats(&st);
+    TEST_CHECK(st.fanout_sends == 1 && st.driver_calls_saved == 3, "fanout_sends %u saved %u", (unsigned)st.fanout_sends, (unsigned)st.driver_calls_saved);
+
+    //A smaller group never gets the call, the other resident peer would receive it
+    TEST_CHECK(!group_send("h"), "single call reached a peer out of the group");
+    TEST_CHECK(group_reached(3), "group h reached the wrong peers");
+
+    //peer4 takes the place of a member. The table holds as many peers as the group, but not the same ones.
+    group_unicast("peer4");
+    TEST_CHECK(host_radio_peers() == 4 && mgos_espnow_get_peer_by_name("peer4")->resident, "peer4 not installed");
+    TEST_CHECK(!group_send("g"), "single call with a member evicted");
+    TEST_CHECK(group_reached(4), "group g reached the wrong peers with a member evicted");
+
+    //Once the non members are gone the members are brought back and the single call is used again
+    mgos_espnow_remove_peer("peer4", false);
+    mgos_espnow_remove_peer("peer5", false);
+    bool fanout = false;
+    for(int i = 0; i < 3 && !fanout; i++){
+        fanout = group_send("g");
+        TEST_CHECK(group_reached(4), "group g reached the wrong peers, send %d", i);
+    }
+    TEST_CHECK(fanout, "no single call once the members are resident");
+
+    //Evicting a member for another peer drops the single call again
+    uint8_t mac[6];
+    host_peer_mac(5, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer5", mac, false, 1, false) == ESPNOW_OK, "add peer5");
+    group_unicast("peer5");
+    TEST_CHECK(!group_send("g"), "single call after peer5 evicted a member");
+    TEST_CHECK(group_reached(4), "group g reached the wrong peers after peer5");
+
+    return test_finish("group");
+}
@@ -0,0 +1,206 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Steady state traffic makes no heap calls: once warm up rounds have grown what they need, rounds of
+//plain, group, reliable, coalesced, compressed and fragmented sends, large requests, restarted
+//reliable sessions and saved peer changes run with heap calls counted, and none may happen. The warm
+//up itself may only grow the few buffers kept for large messages.
+//Then peers past MGOS_ESPNOW_MAX_PEERS move the peer pool and index to the heap, and removing and
+//adding them again takes no heap calls and leaves the heap footprint as it was.
+
+#include <unistd.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define HEAP_STORE "test_heap.bin"
+#define HEAP_OP_ECHO 1
+#define HEAP_LARGE 3000
+#define HEAP_REQ_LEN 1000
+#define HEAP_ROUNDS 20
+#define HEAP_WARM_UP_CALLS 8
+#define HEAP_CHURN_PEERS 40
+#define HEAP_CHURN_CYCLES 100
+
+static int heap_sent, heap_failed, heap_received, heap_large_received, heap_responses;
+
+static void heap_sent_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    if(success) heap_sent++;
+    else heap_failed++;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+static void heap_group_cb(mgos_espnow_handle_t handle, int sent, int failed, void *ud){
+    heap_sent += sent;
+    heap_failed += failed;
+    (void)handle;
+    (void)ud;
+}
+
+static void heap_recv_cb(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    heap_received++;
+    if(len == HEAP_LARGE) heap_large_received++;
+    (void)peer;
+    (void)data;
+    (void)ud;
+}
+
+static void heap_echo_cb(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    mgos_espnow_respond(req, ESPNOW_REQ_OK, data, len);
+    (void)ud;
+}
+
+static void heap_resp_cb(uint16_t id, const uint8_t *mac, mgos_espnow_req_status_t status, const uint8_t *data, int len, void *ud){
+    if(status == ESPNOW_REQ_OK && len == HEAP_REQ_LEN) heap_responses++;
+    (void)id;
+    (void)mac;
+    (void)data;
+    (void)ud;
+}
+
+static void heap_round(void){
+    static uint8_t text[HEAP_LARGE], noise[HEAP_LARGE], req[HEAP_REQ_LEN];
+    uint8_t small[32], mac[6];
+    uint32_t r = 1;
+    for(int i = 0; i < HEAP_LARGE; i++){
+        r = r * 1103515245 + 12345;
+        text[i] = (uint8_t)('a' + i % 5);
+        noise[i] = (uint8_t)(r >> 16);
+    }
+    memset(req, 'r', sizeof(req));
+    memset(small, 's', sizeof(small));
+    TEST_CHECK(mgos_espnow_send_msg("peer0", small, 8, heap_sent_cb, NULL, NULL) == ESPNOW_OK, "plain send");
+    TEST_CHECK(mgos_espnow_send_group("pair", small, sizeof(small), heap_group_cb, NULL, NULL) == ESPNOW_OK, "group send");
+    TEST_CHECK(mgos_espnow_send_group(NULL, small, 4, heap_group_cb, NULL, NULL) == ESPNOW_OK, "send to all");
+    //peer1 is reliable and decodes compressed frames
+    TEST_CHECK(mgos_espnow_send_msg("peer1", small, sizeof(small), heap_sent_cb, NULL, NULL) == ESPNOW_OK, "reliable send");
+    host_advance_ms(20);
+    TEST_CHECK(mgos_espnow_send_large("peer1", text, sizeof(text), heap_sent_cb, NULL, NULL) == ESPNOW_OK, "compressed large send");
+    host_advance_ms(20);
+    //Doesn't compress, goes as fragments
+    TEST_CHECK(mgos_espnow_send_large("peer0", noise, sizeof(noise), heap_sent_cb, NULL, NULL) == ESPNOW_OK, "large send");
+    mgos_sys_config_set_espnow_coalesce(true);
+    for(int i = 0; i < 6; i++){
+        TEST_CHECK(mgos_espnow_send_msg("peer0", small, 2 + i, heap_sent_cb, NULL, NULL) == ESPNOW_OK, "coalesced send %d", i);
+    }
+    host_advance_ms(20);
+    mgos_sys_config_set_espnow_coalesce(false);
+    TEST_CHECK(mgos_espnow_request("peer0", HEAP_OP_ECHO, req, sizeof(req), 1000, heap_resp_cb, NULL, NULL) == ESPNOW_OK, "request");
+    host_advance_ms(20);
+    //A new reliable session takes its window again
+    mgos_espnow_set_reliable("peer1", false);
+    TEST_CHECK(mgos_espnow_set_reliable("peer1", true) == ESPNOW_OK, "reliable again");
+    host_peer_mac(2, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer2", mac, false, 1, true) == ESPNOW_OK, "saved add");
+    mgos_espnow_remove_peer("peer2", true);
+    mgos_espnow_store_commit();
+    host_advance_ms(100);
+}
+
+int main(void){
+    uint8_t mac[6];
+    unlink(HEAP_STORE);
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename(HEAP_STORE);
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_compress(true);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_radio_loopback = true;
+    host_radio_latency_ms = 1;
+    for(int i = 0; i < 2; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+        TEST_CHECK(mgos_espnow_group_add("pair", name) == ESPNOW_OK, "join %s", name);
+        TEST_CHECK(mgos_espnow_register_recv_peer_cb(name, heap_recv_cb, NULL) == ESPNOW_OK, "callback of %s", name);
+    }
+    TEST_CHECK(mgos_espnow_set_reliable("peer1", true) == ESPNOW_OK, "reliable");
+    TEST_CHECK(mgos_espnow_register_req_cb(HEAP_OP_ECHO, heap_echo_cb, NULL) == ESPNOW_OK, "request handler");
+
+    //Grows the pools and buffers, and has peer1 answer the compression handshake
+    host_heap_count(true);
+    heap_round();
+    heap_round();
+    host_heap_count(false);
+    TEST_CHECK(host_heap_calls() <= HEAP_WARM_UP_CALLS, "%u heap calls warming up", host_heap_calls());
+    struct mgos_espnow_frag_stats frag;
+    mgos_espnow_get_frag_stats(&frag);
+    int kept = frag.rx_mem_kept;
+    uint32_t warm_up = host_heap_calls();
+    int sent = heap_sent, received = heap_received, large = heap_large_received, responses = heap_responses;
+    host_heap_count(true);
+    for(int i = 0; i < HEAP_ROUNDS; i++){
+        heap_round();
+    }
+    host_heap_count(false);
+    TEST_CHECK(host_heap_calls() == warm_up, "%u heap calls in %d rounds", host_heap_calls() - warm_up, HEAP_ROUNDS);
+    mgos_espnow_get_frag_stats(&frag);
+    TEST_CHECK(frag.rx_mem_kept == kept, "fragment buffers went from %d to %d bytes", kept, frag.rx_mem_kept);
+
+    //Every round did go through all of it
+    struct mgos_espnow_compress_stats lz;
+    mgos_espnow_get_compress_stats(&lz);
+    TEST_CHECK(heap_failed == 0, "%d sends failed", heap_failed);
+    TEST_CHECK(heap_sent - sent == HEAP_ROUNDS * 14, "%d sends completed", heap_sent - sent);
+    TEST_CHECK(heap_received - received >= HEAP_ROUNDS * 12, "%d messages received", heap_received - received);
+    TEST_CHECK(heap_large_received - large == HEAP_ROUNDS * 2, "%d large messages received", heap_large_received - large);
+    TEST_CHECK(heap_responses - responses == HEAP_ROUNDS, "%d responses", heap_responses - responses);
+    TEST_CHECK(lz.tx_compressed > 0 && lz.rx_decompressed > 0, "nothing was compressed");
+
+    //Past the static peers
+    mgos_sys_config_set_espnow_max_peers(2 * HEAP_CHURN_PEERS);
+    for(int i = 2; i < 2 + HEAP_CHURN_PEERS; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+    struct mgos_espnow_mem_stats mem;
+    mgos_espnow_get_mem_stats(&mem);
+    int heap_bytes = mem.heap_bytes;
+    TEST_CHECK(mgos_espnow_total_peers() > MGOS_ESPNOW_MAX_PEERS && heap_bytes > 0, "%d peers, %d heap bytes", mgos_espnow_total_peers(), heap_bytes);
+    uint32_t calls = host_heap_calls();
+    host_heap_count(true);
+    for(int c = 0; c < HEAP_CHURN_CYCLES; c++){
+        char name[16];
+        int i = 2 + (c * 7) % HEAP_CHURN_PEERS;
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_remove_peer(name, false);
+        TEST_CHECK(mgos_espnow_get_peer_by_name(name) == NULL, "%s still there", name);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s again", name);
+        TEST_CHECK(mgos_espnow_get_peer_by_mac(mac) == mgos_espnow_get_peer_by_name(name), "%s not found", name);
+    }
+    host_heap_count(false);
+    mgos_espnow_get_mem_stats(&mem);
+    TEST_CHECK(host_heap_calls() == calls, "%u heap calls in %d remove and add cycles", host_heap_calls() - calls, HEAP_CHURN_CYCLES);
+    TEST_CHECK(mem.heap_bytes == heap_bytes, "heap bytes went from %d to %d", heap_bytes, mem.heap_bytes);
+    TEST_CHECK(mgos_espnow_total_peers() == 2 + HEAP_CHURN_PEERS, "%d peers", mgos_espnow_total_peers());
+    unlink(HEAP_STORE);
+    return test_finish("heap");
+}
@@ -0,0 +1,198 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Link quality estimators against the mock radio with a scripted loss rate per peer. The smoothed TX
+//success follows the loss rate of each peer, a peer under espnow.link_degraded_pct is paced while the
+//others keep their rate, and it recovers once its loss stops. Ping round trips follow the radio
+//latency, ping losses the loss rate, and RSSI follows the reports.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define LINK_PEERS 3
+#define LINK_LATENCY_MS 5
+#define LINK_PACE_MS 20
+
+static int link_loss_pct[LINK_PEERS] = {0, 10, 40};
+static uint32_t link_rand = 1;
+static int link_frames[LINK_PEERS];
+static int64_t link_last_at[LINK_PEERS], link_min_gap[LINK_PEERS];
+
+//Loses frames to peer i with probability link_loss_pct[i], and records when user frames went out
+static void link_hook(struct host_radio_frame *frame, void *ud){
+    int i = frame->mac[5];
+    if(i >= LINK_PEERS) return;
+    link_rand = link_rand * 1103515245 + 12345;
+    if((int)((link_rand >> 16) % 100) < link_loss_pct[i]) frame->lost = true;
+    if(frame->len > 0 && frame->data[0] == 'u'){
+        if(link_frames[i]++ > 0 && (link_min_gap[i] == 0 || frame->sent_at - link_last_at[i] < link_min_gap[i])){
+            link_min_gap[i] = frame->sent_at - link_last_at[i];
+        }
+        link_last_at[i] = frame->sent_at;
+    }
+    (void)ud;
+}
+
+static void link_reset_gaps(void){
+    memset(link_frames, 0, sizeof(link_frames));
+    memset(link_min_gap, 0, sizeof(link_min_gap));
+}
+
+static struct mgos_espnow_link_stats link_stats(int i){
+    struct mgos_espnow_link_stats st;
+    char name[16];
+    host_peer_name(i, name, sizeof(name));
+    memset(&st, 0, sizeof(st));
+    TEST_CHECK(mgos_espnow_get_link_stats(name, &st), "stats of %s", name);
+    return st;
+}
+
+//One user frame to every peer, refused ones are fine for paced peers
+static void link_send_round(int ms){
+    for(int i = 0; i < LINK_PEERS; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_send(name, (const uint8_t *)"u", 1);
+    }
+    host_advance_ms(ms);
+}
+
+int main(void){
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_link_degraded_pct(0);
+    mgos_sys_config_set_espnow_link_pace_ms(LINK_PACE_MS);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < LINK_PEERS; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+    host_radio_loopback = true;
+    host_radio_latency_ms = 1;
+    host_radio_hook = link_hook;
+
+    //The estimate settles on the loss rate. Averaged it is unbiased, single samples stay close.
+    double sum[LINK_PEERS] = {0};
+    float worst[LINK_PEERS] = {0};
+    int samples = 0;
+    for(int round = 0; round < 1000; round++){
+        link_send_round(2);
+        if(round < 100) continue;
+        samples++;
+        for(int i = 0; i < LINK_PEERS; i++){
+            struct mgos_espnow_link_stats st = link_stats(i);
+            float err = st.tx_success - (100 - link_loss_pct[i]) / 100.0f;
+            if(err < 0) err = -err;
+            if(err > worst[i]) worst[i] = err;
+            sum[i] += st.tx_success;
+            TEST_CHECK(!st.degraded, "peer%d degraded with pacing off", i);
+        }
+    }
+    for(int i = 0; i < LINK_PEERS; i++){
+        double mean = sum[i] / samples, want = (100 - link_loss_pct[i]) / 100.0;
+        TEST_CHECK(mean > want - 0.03 && mean < want + 0.03, "peer%d: mean success %.3f at %d%% loss", i, mean, link_loss_pct[i]);
+        TEST_CHECK(worst[i] < 0.3f, "peer%d: estimate %.3f off", i, worst[i]);
+    }
+
+    //Below 70% acknowledged the peer is paced, the healthy ones are not held back
+    mgos_sys_config_set_espnow_link_degraded_pct(70);
+    link_send_round(2);
+    TEST_CHECK(link_stats(2).degraded, "peer2 not degraded");
+    link_reset_gaps();
+    struct mgos_espnow_tx_stats tx;
+    mgos_espnow_get_tx_stats(&tx);
+    uint32_t paced = tx.paced;
+    for(int round = 0; round < 500; round++){
+        link_send_round(2);
+    }
+    mgos_espnow_get_tx_stats(&tx);
+    TEST_CHECK(!link_stats(0).degraded && !link_stats(1).degraded, "healthy peers degraded");
+    TEST_CHECK(link_stats(2).degraded, "peer2 recovered at %d%% loss", link_loss_pct[2]);
+    TEST_CHECK(tx.paced > paced, "nothing paced");
+    TEST_CHECK(link_frames[0] == 500 && link_frames[1] == 500, "healthy peers sent %d and %d of 500", link_frames[0], link_frames[1]);
+    TEST_CHECK(link_min_gap[2] >= LINK_PACE_MS * 1000, "paced frames %lld us apart", (long long)link_min_gap[2]);
+    TEST_CHECK(link_frames[2] <= 1000 / LINK_PACE_MS + 1, "%d paced frames in 1 s", link_frames[2]);
+
+    //Once the loss stops the link gets back above 80% and pacing ends
+    link_loss_pct[2] = 0;
+    int rounds = 0;
+    while(link_stats(2).degraded && rounds < 500){
+        link_send_round(2);
+        rounds++;
+    }
+    TEST_CHECK(!link_stats(2).degraded, "peer2 still degraded");
+    TEST_CHECK(rounds * 2 < 40 * LINK_PACE_MS, "recovery took %d ms", rounds * 2);
+    host_advance_ms(100);
+    link_reset_gaps();
+    for(int round = 0; round < 100; round++){
+        link_send_round(2);
+    }
+    TEST_CHECK(link_frames[2] == 100 && link_min_gap[2] < LINK_PACE_MS * 1000, "peer2 still paced, %d frames", link_frames[2]);
+
+    //Round trips are the latency both ways, pings with the ping or the echo lost are counted.
+    //One ping at a time, so none waits in the TX queue behind another.
+    host_radio_latency_ms = LINK_LATENCY_MS;
+    link_loss_pct[2] = 40;
+    for(int n = 0; n < 200; n++){
+        for(int i = 0; i < LINK_PEERS; i++){
+            char name[16];
+            host_peer_name(i, name, sizeof(name));
+            TEST_CHECK(mgos_espnow_ping(name) == ESPNOW_OK, "ping %s", name);
+            host_advance_ms(20);
+        }
+    }
+    for(int i = 0; i < LINK_PEERS; i++){
+        struct mgos_espnow_link_stats st = link_stats(i);
+        TEST_CHECK(st.rtt_us >= 2 * LINK_LATENCY_MS * 1000 && st.rtt_us <= 2 * LINK_LATENCY_MS * 1000 + 2000,
+            "peer%d: round trip %d us", i, (int)st.rtt_us);
+        TEST_CHECK(st.rtt_var_us < 1000, "peer%d: round trip variation %d us", i, (int)st.rtt_var_us);
+        //The last ping is only counted lost when the next one goes
+        TEST_CHECK(st.pings == 200 && st.pings - st.echoes - st.pings_lost <= 1, "peer%d: %u pings, %u echoes, %u lost", i, st.pings, st.echoes, st.pings_lost);
+        //Both the ping and the echo have to make it
+        double keep = (100 - link_loss_pct[i]) / 100.0;
+        double echoed = (double)st.echoes / st.pings;
+        TEST_CHECK(echoed > keep * keep - 0.1 && echoed < keep * keep + 0.1, "peer%d: %.2f of the pings echoed", i, echoed);
+    }
+
+    //RSSI follows the reports, positive values are not RSSI
+    uint8_t mac[6];
+    host_peer_mac(0, mac);
+    for(int n = 0; n < 50; n++){
+        mgos_espnow_link_rssi(mac, -50);
+    }
+    TEST_CHECK(link_stats(0).rssi == -50, "RSSI %d", link_stats(0).rssi);
+    mgos_espnow_link_rssi(mac, 10);
+    TEST_CHECK(link_stats(0).rssi == -50, "RSSI %d after a positive report", link_stats(0).rssi);
+    for(int n = 0; n < 50; n++){
+        mgos_espnow_link_rssi(mac, -80);
+    }
+    TEST_CHECK(link_stats(0).rssi <= -79 && link_stats(0).rssi >= -80, "RSSI %d", link_stats(0).rssi);
+    TEST_CHECK(link_stats(1).rssi == 0, "RSSI of a peer without reports");
+    return test_finish("link");
+}
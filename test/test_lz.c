@@ -0,0 +1,191 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Compression. The codec round trip, and how a node learns what each peer decodes: with the loopback
+//radio a peer answers the CAPS frame as this node would. Covers a CAPS frame lost and asked again with
+//backoff, CAPS answers with another dictionary or without the decode flag, and which LZ frames count
+//as an answer.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+//CAPS flag and dictionary id of mgos_espnow_lz.c
+#define LZ_CAPS_DECODE 0x01
+#define LZ_DICT_ID 1
+
+static const char *lz_json = "{\"temperature\":21.50,\"humidity\":48.0,\"battery\":97,\"rssi\":-61,\"uptime\":1234}";
+
+static bool lz_drop_caps;
+static uint8_t lz_drop_mac[6];
+static int lz_caps_sent;
+static int lz_frames_sent;
+
+static void lz_hook(struct host_radio_frame *frame, void *ud){
+    if(frame->len >= 2 && frame->data[0] == ESPNOW_PROTO_MAGIC && frame->data[1] == ESPNOW_PROTO_CAPS &&
+       memcmp(frame->mac, lz_drop_mac, 6) == 0){
+        lz_caps_sent++;
+        frame->lost = lz_drop_caps;
+    }
+    if(frame->len >= 2 && frame->data[0] == ESPNOW_PROTO_MAGIC && frame->data[1] == ESPNOW_PROTO_LZ) lz_frames_sent++;
+    (void)ud;
+}
+
+static bool lz_roundtrip(const uint8_t *in, int len){
+    uint8_t packed[2048], out[1024];
+    int n = espnow_lz_compress(in, len, packed, sizeof(packed));
+    if(n <= 0) return false;
+    if(espnow_lz_decompress(packed, n, out, sizeof(out)) != len || memcmp(in, out, len) != 0) return false;
+    //An output buffer one byte short is never overrun
+    return len < 2 || espnow_lz_decompress(packed, n, out, len - 1) == -1;
+}
+
+static uint8_t lz_state(const char *name){
+    return mgos_espnow_get_peer_by_name(name)->lz;
+}
+
+static void lz_inject_caps(int i, uint8_t flags, uint8_t dict){
+    uint8_t mac[6];
+    uint8_t caps[4] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_CAPS, flags, dict};
+    host_peer_mac(i, mac);
+    host_radio_rx(mac, caps, sizeof(caps));
+    host_advance_ms(5);
+}
+
+static void lz_inject_lz(int i, uint8_t dict){
+    uint8_t mac[6], frame[MGOS_ESPNOW_MAX_LEN];
+    host_peer_mac(i, mac);
+    int n = espnow_lz_pack_msg((const uint8_t *)lz_json, strlen(lz_json), frame, sizeof(frame));
+    frame[2] = dict;
+    host_radio_rx(mac, frame, n);
+    host_advance_ms(5);
+}
+
+int main(void){
+    struct mgos_espnow_compress_stats st;
+    char name[16];
+    uint8_t mac[6];
+
+    //Codec round trip: dictionary text, incompressible bytes, runs longer than a match
+    uint8_t rnd[600], run[1000];
+    uint32_t r = 5;
+    for(int i = 0; i < (int)sizeof(rnd); i++){
+        r = r * 1103515245 + 12345;
+        rnd[i] = (uint8_t)(r >> 16);
+    }
+    for(int i = 0; i < (int)sizeof(run); i++) run[i] = "abcabcabd"[i % 9];
+    TEST_CHECK(lz_roundtrip((const uint8_t *)lz_json, strlen(lz_json)), "json round trip");
+    TEST_CHECK(lz_roundtrip(rnd, sizeof(rnd)), "random round trip");
+    TEST_CHECK(lz_roundtrip(run, sizeof(run)), "run round trip");
+    TEST_CHECK(lz_roundtrip((const uint8_t *)"x", 1), "one byte round trip");
+    uint8_t packed[256];
+    int n = espnow_lz_compress((const uint8_t *)lz_json, strlen(lz_json), packed, sizeof(packed));
+    TEST_CHECK(n > 0 && n < (int)strlen(lz_json) * 2 / 3, "json %d bytes from %d", n, (int)strlen(lz_json));
+    TEST_CHECK(espnow_lz_decompress(packed, n - 1, run, sizeof(run)) != (int)strlen(lz_json), "truncated stream decoded");
+
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 1; i <= 5; i++){
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+    host_radio_loopback = true;
+    host_radio_latency_ms = 1;
+    host_radio_hook = lz_hook;
+
+    //Off, peers are never asked
+    mgos_espnow_send("peer1", (const uint8_t *)lz_json, strlen(lz_json));
+    host_advance_ms(10);
+    TEST_CHECK(lz_state("peer1") == ESPNOW_LZ_UNKNOWN, "peer1 asked with compression off");
+
+    //The first frame goes plain and asks, the answer makes the next ones compressed
+    mgos_sys_config_set_espnow_compress(true);
+    mgos_espnow_send("peer1", (const uint8_t *)lz_json, strlen(lz_json));
+    TEST_CHECK(lz_state("peer1") == ESPNOW_LZ_ASKED, "peer1 state %d", lz_state("peer1"));
+    host_advance_ms(10);
+    TEST_CHECK(lz_state("peer1") == ESPNOW_LZ_YES, "peer1 state %d after the answer", lz_state("peer1"));
+    lz_frames_sent = 0;
+    mgos_espnow_send("peer1", (const uint8_t *)lz_json, strlen(lz_json));
+    host_advance_ms(10);
+    mgos_espnow_get_compress_stats(&st);
+    TEST_CHECK(lz_frames_sent == 1 && st.tx_compressed == 1 && st.rx_decompressed == 1, "%d LZ frames %u compressed %u decompressed",
+               lz_frames_sent, st.tx_compressed, st.rx_decompressed);
+
+    //CAPS frames to peer2 lost, asked again after 1 s, 2 s, 4 s. Frames go plain meanwhile.
+    host_peer_mac(2, lz_drop_mac);
+    lz_drop_caps = true;
+    lz_frames_sent = 0;
+    int asks[4] = {0};
+    for(int t = 0; t < 7500; t += 10){
+        mgos_espnow_send("peer2", (const uint8_t *)lz_json, strlen(lz_json));
+        host_advance_ms(10);
+        if(t == 0) asks[0] = lz_caps_sent;
+        if(t == 990) asks[1] = lz_caps_sent;
+        if(t == 2990) asks[2] = lz_caps_sent;
+        if(t == 6990) asks[3] = lz_caps_sent;
+    }
+    TEST_CHECK(asks[0] == 1 && asks[1] == 1 && asks[2] == 2 && asks[3] == 3 && lz_caps_sent == 4, "asked %d %d %d %d %d",
+               asks[0], asks[1], asks[2], asks[3], lz_caps_sent);
+    TEST_CHECK(lz_state("peer2") == ESPNOW_LZ_ASKED && lz_frames_sent == 0, "peer2 state %d, %d LZ frames",
+               lz_state("peer2"), lz_frames_sent);
+    //The next ask gets through, the answer resets the backoff
+    lz_drop_caps = false;
+    for(int t = 0; t < 10000 && lz_state("peer2") != ESPNOW_LZ_YES; t += 10){
+        mgos_espnow_send("peer2", (const uint8_t *)lz_json, strlen(lz_json));
+        host_advance_ms(10);
+    }
+    TEST_CHECK(lz_state("peer2") == ESPNOW_LZ_YES, "peer2 state %d after the loss", lz_state("peer2"));
+    TEST_CHECK(mgos_espnow_get_peer_by_name("peer2")->lz_tries == 0, "peer2 backoff kept");
+
+    //A peer with another dictionary, or not decoding, gets plain frames and is not asked again
+    lz_inject_caps(3, LZ_CAPS_DECODE, LZ_DICT_ID + 1);
+    TEST_CHECK(lz_state("peer3") == ESPNOW_LZ_NO, "peer3 state %d with another dictionary", lz_state("peer3"));
+    lz_inject_caps(4, 0, LZ_DICT_ID);
+    TEST_CHECK(lz_state("peer4") == ESPNOW_LZ_NO, "peer4 state %d without the decode flag", lz_state("peer4"));
+    host_peer_mac(3, lz_drop_mac);
+    lz_caps_sent = 0;
+    lz_frames_sent = 0;
+    mgos_espnow_send("peer3", (const uint8_t *)lz_json, strlen(lz_json));
+    host_advance_ms(3000);
+    TEST_CHECK(lz_caps_sent == 0 && lz_frames_sent == 0, "peer3 %d CAPS %d LZ frames", lz_caps_sent, lz_frames_sent);
+    //Its LZ frames don't overrule what it said
+    lz_inject_lz(3, LZ_DICT_ID);
+    TEST_CHECK(lz_state("peer3") == ESPNOW_LZ_NO, "peer3 state %d after an LZ frame", lz_state("peer3"));
+
+    //An LZ frame with our dictionary answers for a peer not asked yet, one with another does not
+    mgos_espnow_get_compress_stats(&st);
+    uint32_t errors = st.rx_errors;
+    lz_inject_lz(5, LZ_DICT_ID + 1);
+    mgos_espnow_get_compress_stats(&st);
+    TEST_CHECK(st.rx_errors == errors + 1, "%u errors for another dictionary", st.rx_errors - errors);
+    TEST_CHECK(lz_state("peer5") == ESPNOW_LZ_UNKNOWN, "peer5 state %d after another dictionary", lz_state("peer5"));
+    lz_inject_lz(5, LZ_DICT_ID);
+    TEST_CHECK(lz_state("peer5") == ESPNOW_LZ_YES, "peer5 state %d after an LZ frame", lz_state("peer5"));
+
+    return test_finish("lz");
+}
@@ -0,0 +1,273 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Mesh of 50+ nodes on the virtual radio, each a process, in a line and in a grid where only
+//neighbours hear each other. Node 0 floods frames carrying their send time, then every other node
+//sends replies to it over the routes the floods taught. Each node reports what it got over a pipe
+//and the parent checks every flood is delivered once per node over the shortest path, relays are
+//bounded by the seen cache, replies reach node 0, and prints delivery ratio, time per hop and
+//the airtime used.
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define MESH_MAX_NODES 64
+#define MESH_FLOODS 10
+#define MESH_FLOOD_MS 100
+#define MESH_REPLIES 2
+#define MESH_AIRTIME_MS 1
+//Phases from the common start, nodes wait for the others to listen first
+#define MESH_START_MS 300
+#define MESH_REPLY_MS 2000
+#define MESH_REPLY_GAP_MS 1000
+#define MESH_END_MS 4500
+
+struct mesh_result {
+    int node;
+    int floods;          //Floods delivered, each once
+    int flood_dups;      //Floods delivered again
+    int flood_hops;      //Hops over all floods delivered
+    int64_t flood_lat_us;
+    int replies;         //At node 0, replies delivered from distinct sends
+    int reply_dups;
+    int64_t reply_lat_us;
+    int gw_hops;         //Hops of the route to node 0 learnt from the floods, -1 without one
+    uint32_t flood_relayed;  //Relays by the end of the flood phase
+    uint32_t tx_frames;  //Frames put on air
+    struct mgos_espnow_mesh_stats mesh;
+};
+
+struct mesh_setup {
+    const char *topology;
+    int nodes;
+    int cols;
+    int loss_pct;
+};
+
+static const uint8_t mesh_gw[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x00};
+static struct mesh_result mesh_res;
+static uint32_t mesh_flood_seen;
+static uint8_t mesh_reply_seen[MESH_MAX_NODES];
+static int64_t mesh_start_us;
+
+static int64_t mesh_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//Hops between two nodes, neighbours of the line or the 4 around in the grid
+static int mesh_distance(const struct mesh_setup *s, int a, int b){
+    if(s->cols <= 0) return abs(a - b);
+    return abs(a / s->cols - b / s->cols) + abs(a % s->cols - b % s->cols);
+}
+
+//Frames are a kind, an index below 32 and the send time
+static void mesh_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    int64_t sent;
+    if(len != 10) return;
+    memcpy(&sent, data + 2, sizeof(sent));
+    int64_t lat = mesh_now_us() - sent;
+    if(data[0] == 'F' && data[1] < MESH_FLOODS && memcmp(mac, mesh_gw, 6) == 0){
+        if(mesh_flood_seen & (1u << data[1])){
+            mesh_res.flood_dups++;
+            return;
+        }
+        mesh_flood_seen |= 1u << data[1];
+        mesh_res.floods++;
+        mesh_res.flood_lat_us += lat;
+    }
+    if(data[0] == 'R' && data[1] < MESH_REPLIES && mac[4] == 0 && mac[5] < MESH_MAX_NODES){
+        if(mesh_reply_seen[mac[5]] & (1u << data[1])){
+            mesh_res.reply_dups++;
+            return;
+        }
+        mesh_reply_seen[mac[5]] |= 1u << data[1];
+        mesh_res.replies++;
+        mesh_res.reply_lat_us += lat;
+    }
+    (void)ud;
+}
+
+static void mesh_send(const uint8_t *dst, char kind, int i){
+    uint8_t msg[10] = {(uint8_t)kind, (uint8_t)i};
+    int64_t now = mesh_now_us();
+    memcpy(msg + 2, &now, sizeof(now));
+    TEST_CHECK(mgos_espnow_mesh_send(dst, msg, sizeof(msg)) == ESPNOW_OK, "%c %d", kind, i);
+}
+
+static void mesh_run_until(int ms){
+    int64_t end = mesh_start_us + (int64_t)ms * 1000;
+    for(int64_t now = mesh_now_us(); now < end; now = mesh_now_us()){
+        host_run_ms((int)((end - now + 999) / 1000));
+    }
+}
+
+static int mesh_node(const struct mesh_setup *s, int node, int port, int out){
+    srand((unsigned)node * 7919 + 1);
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_sim_node(node);
+    mgos_sys_config_set_espnow_sim_nodes(s->nodes);
+    mgos_sys_config_set_espnow_sim_port(port);
+    mgos_sys_config_set_espnow_sim_loss_pct(s->loss_pct);
+    mgos_sys_config_set_espnow_sim_latency_ms(MESH_AIRTIME_MS);
+    mgos_sys_config_set_espnow_sim_topology(s->topology);
+    if(s->cols > 0) mgos_sys_config_set_espnow_sim_grid_cols(s->cols);
+    mgos_sys_config_set_espnow_enable_broadcast(true);
+    mgos_sys_config_set_espnow_mesh(true);
+    mgos_sys_config_set_espnow_mesh_ttl(64);
+    host_real_time();
+    TEST_CHECK(mgos_espnow_init(), "node %d", node);
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, mesh_recv_cb, NULL);
+    mesh_res.node = node;
+    for(int f = 0; f < MESH_FLOODS; f++){
+        mesh_run_until(MESH_START_MS + f * MESH_FLOOD_MS);
+        if(node == 0) mesh_send(NULL, 'F', f);
+    }
+    mesh_run_until(MESH_REPLY_MS);
+    struct mgos_espnow_mesh_stats ms;
+    mgos_espnow_get_mesh_stats(&ms);
+    mesh_res.flood_relayed = ms.relayed;
+    mesh_res.flood_hops = (int)ms.delivered_hops;
+    mesh_res.gw_hops = -1;
+    if(node != 0) mgos_espnow_mesh_get_route(mesh_gw, NULL, &mesh_res.gw_hops);
+    //Spread over the gap so the routes to node 0 aren't all used at once
+    for(int r = 0; r < MESH_REPLIES && node != 0; r++){
+        mesh_run_until(MESH_REPLY_MS + r * MESH_REPLY_GAP_MS + node * (MESH_REPLY_GAP_MS - 200) / s->nodes);
+        mesh_send(mesh_gw, 'R', r);
+    }
+    mesh_run_until(MESH_END_MS);
+    struct mgos_espnow_stats st;
+    mgos_espnow_get_stats(&st);
+    mgos_espnow_get_mesh_stats(&mesh_res.mesh);
+    mesh_res.tx_frames = st.tx_frames + st.tx_failed;
+    TEST_CHECK(write(out, &mesh_res, sizeof(mesh_res)) == sizeof(mesh_res), "node %d result", node);
+    return test_finish("mesh node");
+}
+
+static int mesh_run(const struct mesh_setup *s, int port){
+    struct mesh_result res[MESH_MAX_NODES];
+    pid_t pids[MESH_MAX_NODES];
+    int fds[2];
+    TEST_CHECK(s->nodes <= MESH_MAX_NODES && pipe(fds) == 0, "%s", s->topology);
+    //Children start on their own time, all phases count from here
+    mesh_start_us = mesh_now_us() + 200000;
+    for(int i = 0; i < s->nodes; i++){
+        pids[i] = fork();
+        if(pids[i] == 0){
+            close(fds[0]);
+            _exit(mesh_node(s, i, port, fds[1]));
+        }
+    }
+    close(fds[1]);
+    memset(res, 0, sizeof(res));
+    int got = 0;
+    struct mesh_result r;
+    //Results are under PIPE_BUF, each arrives whole
+    while(read(fds[0], &r, sizeof(r)) == sizeof(r)){
+        if(r.node >= 0 && r.node < s->nodes){
+            res[r.node] = r;
+            got++;
+        }
+    }
+    close(fds[0]);
+    int failed = 0;
+    for(int i = 0; i < s->nodes; i++){
+        int status;
+        if(pids[i] < 0 || waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    TEST_CHECK(failed == 0 && got == s->nodes, "%s: %d nodes failed, %d of %d reported", s->topology, failed, got, s->nodes);
+    if(got != s->nodes) return 1;
+
+    int floods = 0, dups = 0, hops = 0, shortest = 0, replies = 0, routes = 0, route_ok = 0, max_distance = 0;
+    int64_t flood_lat = 0;
+    uint32_t flood_relayed = 0, relayed = 0, duplicates = 0, suppressed = 0, routed = 0, frames = 0;
+    for(int i = 0; i < s->nodes; i++){
+        const struct mesh_result *n = &res[i];
+        int d = mesh_distance(s, 0, i);
+        if(d > max_distance) max_distance = d;
+        floods += n->floods;
+        dups += n->flood_dups + n->reply_dups;
+        hops += n->flood_hops;
+        flood_lat += n->flood_lat_us;
+        relayed += n->mesh.relayed;
+        flood_relayed += n->flood_relayed;
+        duplicates += n->mesh.duplicates;
+        suppressed += n->mesh.suppressed;
+        routed += n->mesh.routed;
+        frames += n->tx_frames;
+        if(i == 0) continue;
+        shortest += d * n->floods;
+        //No path is shorter than the distance
+        TEST_CHECK(n->flood_hops >= d * n->floods, "%s node %d: %d hops for %d floods %d away", s->topology, i, n->flood_hops, n->floods, d);
+        if(n->gw_hops > 0){
+            routes++;
+            if(n->gw_hops == d) route_ok++;
+        }
+    }
+    replies = res[0].replies;
+    int want_floods = MESH_FLOODS * (s->nodes - 1), want_replies = MESH_REPLIES * (s->nodes - 1);
+    double ratio = (double)floods / want_floods, reply_ratio = (double)replies / want_replies;
+    printf("mesh %s, %d nodes, %d hops across, %d%% loss: floods %.3f delivered, %.2f hops, %.2f ms per hop, "
+        "replies %.3f delivered, %.1f ms; %u relayed (%u floods), %u duplicates, %u suppressed, %u routed, "
+        "%u frames, %u ms airtime\n",
+        s->topology, s->nodes, max_distance, s->loss_pct, ratio, floods > 0 ? (double)hops / floods : 0.0,
+        hops > 0 ? flood_lat / 1000.0 / hops : 0.0, reply_ratio, replies > 0 ? res[0].reply_lat_us / 1000.0 / replies : 0.0,
+        relayed, flood_relayed, duplicates, suppressed, routed, frames, frames * MESH_AIRTIME_MS);
+
+    //Lost frames are made up for by the other paths of the grid and by resending routed ones
+    bool lossy = s->loss_pct > 0;
+    TEST_CHECK(ratio >= (lossy ? 0.9 : 0.98), "%s: %d of %d floods delivered", s->topology, floods, want_floods);
+    TEST_CHECK(reply_ratio >= (lossy ? 0.8 : 0.95), "%s: %d of %d replies delivered", s->topology, replies, want_replies);
+    TEST_CHECK(dups == 0, "%s: %d frames delivered twice", s->topology, dups);
+    //Seen cache: each node relays a flood at most once, and some copies arrive twice to be dropped
+    TEST_CHECK(flood_relayed <= (uint32_t)want_floods, "%s: %u relays of %d floods", s->topology, flood_relayed, MESH_FLOODS);
+    TEST_CHECK(duplicates > 0, "%s: no duplicates dropped", s->topology);
+    //Floods take the shortest path but for the odd one racing ahead on a detour
+    TEST_CHECK(hops <= shortest + shortest / (lossy ? 4 : 10), "%s: %d hops, %d shortest", s->topology, hops, shortest);
+    //Replies follow the learnt routes instead of flooding
+    TEST_CHECK(routes >= (s->nodes - 1) * (lossy ? 9 : 10) / 10 && route_ok >= routes * 9 / 10,
+        "%s: %d routes to node 0, %d shortest", s->topology, routes, route_ok);
+    TEST_CHECK(routed >= (uint32_t)replies, "%s: %u routed for %d replies", s->topology, routed, replies);
+    return 0;
+}
+
+int main(void){
+    //Ports apart for runs in parallel, above those of test_sim
+    int port = 36000 + (getpid() % 128) * 3 * MESH_MAX_NODES;
+    struct mesh_setup line = {"line", 50, 0, 0};
+    struct mesh_setup grid = {"grid", 56, 8, 0};
+    struct mesh_setup lossy = {"grid", 56, 8, 10};
+    mesh_run(&line, port);
+    mesh_run(&grid, port + MESH_MAX_NODES);
+    mesh_run(&lossy, port + 2 * MESH_MAX_NODES);
+    return test_finish("mesh");
+}
@@ -0,0 +1,161 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Opcode dispatch: a message only reaches the handler of its opcode, the peer one before the global one,
+//and the opcode byte is stripped. Messages without a handler go to the receive callbacks whole and are
+//only counted as unknown when no receive callback takes them either.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+static int op_calls[4];
+static int op_last_len, op_all_calls, op_all_len, op_peer_calls;
+static uint8_t op_last_op, op_last_data, op_all_first;
+
+static void op_cb(const uint8_t *mac, uint8_t op, const uint8_t *data, int len, void *ud){
+    op_calls[(intptr_t)ud]++;
+    op_last_op = op;
+    op_last_len = len;
+    op_last_data = len > 0 ? data[0] : 0;
+    (void)mac;
+}
+
+static void op_all_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    op_all_calls++;
+    op_all_len = len;
+    op_all_first = len > 0 ? data[0] : 0;
+    (void)mac;
+    (void)ud;
+}
+
+static void op_peer_cb(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    op_peer_calls++;
+    (void)peer;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static void op_frame(int peer, const uint8_t *data, int len){
+    uint8_t mac[6];
+    host_peer_mac(peer, mac);
+    host_radio_rx(mac, data, len);
+    host_run_invokes();
+}
+
+static void op_reset(void){
+    memset(op_calls, 0, sizeof(op_calls));
+    op_all_calls = op_peer_calls = 0;
+}
+
+int main(void){
+    struct mgos_espnow_op_stats st;
+    static const uint8_t msg7[] = {7, 'x', 'y'}, msg9[] = {9, 'z'}, msg200[] = {200, 1}, op_only[] = {7};
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_op_dispatch(true);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < 2; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_add_peer(name, mac, false, 1, false);
+    }
+    TEST_CHECK(mgos_espnow_register_recv_mac_cb(NULL, ALL, op_all_cb, NULL) == ESPNOW_OK, "register ALL");
+    TEST_CHECK(mgos_espnow_register_recv_peer_cb("peer0", op_peer_cb, NULL) == ESPNOW_OK, "register peer0");
+    TEST_CHECK(mgos_espnow_register_op_cb(NULL, 7, op_cb, (void *)0) == ESPNOW_OK, "register global 7");
+    TEST_CHECK(mgos_espnow_register_op_cb(NULL, 9, op_cb, (void *)1) == ESPNOW_OK, "register global 9");
+    TEST_CHECK(mgos_espnow_register_op_cb("peer1", 7, op_cb, (void *)2) == ESPNOW_OK, "register peer1 7");
+    TEST_CHECK(mgos_espnow_register_op_cb("nobody", 7, op_cb, NULL) == ESPNOW_PEER_NOT_FOUND, "handler of an unknown peer");
+    TEST_CHECK(mgos_espnow_register_op_cb(NULL, 7, NULL, NULL) != ESPNOW_OK, "NULL handler");
+
+    //Only the handler of the opcode runs, with the payload after it. Receive callbacks are not used.
+    op_frame(0, msg7, sizeof(msg7));
+    TEST_CHECK(op_calls[0] == 1 && op_calls[1] == 0 && op_calls[2] == 0, "calls %d %d %d", op_calls[0], op_calls[1], op_calls[2]);
+    TEST_CHECK(op_last_op == 7 && op_last_len == 2 && op_last_data == 'x', "op %d len %d", op_last_op, op_last_len);
+    TEST_CHECK(op_all_calls == 0 && op_peer_calls == 0, "receive callbacks called for a handled opcode, ALL %d peer %d", op_all_calls, op_peer_calls);
+    op_reset();
+    op_frame(0, msg9, sizeof(msg9));
+    TEST_CHECK(op_calls[1] == 1 && op_calls[0] == 0, "opcode 9 calls %d", op_calls[1]);
+    op_reset();
+    op_frame(0, op_only, sizeof(op_only));
+    TEST_CHECK(op_calls[0] == 1 && op_last_len == 0, "opcode only, len %d", op_last_len);
+
+    //The peer handler comes first, other opcodes of that peer fall back to the global table
+    op_reset();
+    op_frame(1, msg7, sizeof(msg7));
+    op_frame(1, msg9, sizeof(msg9));
+    TEST_CHECK(op_calls[2] == 1 && op_calls[0] == 0 && op_calls[1] == 1, "peer1 calls %d %d %d", op_calls[0], op_calls[1], op_calls[2]);
+
+    //Opcodes without a handler and empty messages go whole to the receive callbacks
+    mgos_espnow_get_op_stats(&st);
+    uint32_t delivered = st.delivered, unknown = st.unknown;
+    op_reset();
+    op_frame(0, msg200, sizeof(msg200));
+    TEST_CHECK(op_all_calls == 1 && op_peer_calls == 1 && op_all_len == 2 && op_all_first == 200, "unhandled opcode: ALL %d peer %d, len %d",
+        op_all_calls, op_peer_calls, op_all_len);
+    op_frame(0, msg7, 0);
+    TEST_CHECK(op_all_calls == 2 && op_peer_calls == 2 && op_all_len == 0, "empty message: ALL %d peer %d", op_all_calls, op_peer_calls);
+    //peer1 has no peer callback, ALL still takes it
+    op_frame(1, msg200, sizeof(msg200));
+    TEST_CHECK(op_all_calls == 3 && op_peer_calls == 2, "peer1 unhandled opcode: ALL %d peer %d", op_all_calls, op_peer_calls);
+    mgos_espnow_get_op_stats(&st);
+    TEST_CHECK(op_calls[0] + op_calls[1] + op_calls[2] == 0, "unknown opcode passed to a handler");
+    TEST_CHECK(st.unknown == unknown && st.delivered == delivered, "taken by callbacks: unknown %u delivered %u", (unsigned)(st.unknown - unknown), (unsigned)(st.delivered - delivered));
+
+    //Only counted when nothing takes them
+    mgos_espnow_remove_recv_mac_cb(op_all_cb, NULL, ALL);
+    op_reset();
+    op_frame(1, msg200, sizeof(msg200));
+    op_frame(1, msg7, 0);
+    mgos_espnow_get_op_stats(&st);
+    TEST_CHECK(op_all_calls == 0 && op_calls[0] + op_calls[1] + op_calls[2] == 0, "unknown opcode delivered");
+    TEST_CHECK(st.unknown == unknown + 2 && st.delivered == delivered, "unknown %u delivered %u", (unsigned)(st.unknown - unknown), (unsigned)(st.delivered - delivered));
+    TEST_CHECK(mgos_espnow_register_recv_mac_cb(NULL, ALL, op_all_cb, NULL) == ESPNOW_OK, "register ALL again");
+
+    //Registering again replaces the handler, removing the peer one exposes the global one
+    TEST_CHECK(mgos_espnow_register_op_cb(NULL, 9, op_cb, (void *)3) == ESPNOW_OK, "replace 9");
+    mgos_espnow_remove_op_cb("peer1", 7);
+    op_reset();
+    op_frame(1, msg7, sizeof(msg7));
+    op_frame(1, msg9, sizeof(msg9));
+    TEST_CHECK(op_calls[0] == 1 && op_calls[2] == 0 && op_calls[1] == 0 && op_calls[3] == 1, "calls after replace %d %d %d %d",
+        op_calls[0], op_calls[1], op_calls[2], op_calls[3]);
+    mgos_espnow_remove_op_cb(NULL, 7);
+    mgos_espnow_remove_op_cb(NULL, 7);
+    op_reset();
+    op_frame(0, msg7, sizeof(msg7));
+    TEST_CHECK(op_calls[0] == 0 && op_all_calls == 1 && op_all_len == 3, "removed handler called, ALL %d", op_all_calls);
+
+    //Without espnow.op_dispatch the receive callbacks get the whole payload
+    mgos_sys_config_set_espnow_op_dispatch(false);
+    op_reset();
+    op_frame(0, msg9, sizeof(msg9));
+    TEST_CHECK(op_all_calls == 1 && op_calls[3] == 0, "op_dispatch off, ALL %d", op_all_calls);
+
+    return test_finish("op");
+}
@@ -0,0 +1,178 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Peer index: random adds, removes and replacements against a shadow table, every lookup by MAC and
+//name and the cached count must agree with it after each step. The limit is three times the static
+//peers so the peer pool and the index grow onto the heap. Some steps run inside a dispatch, where
+//removals leave tombstones. Meanwhile a thread like the WiFi task looks up peers that stay loaded,
+//none may be missed while the others are shifted around them.
+//Without a larger espnow.max_peers the table stops at MGOS_ESPNOW_MAX_PEERS.
+
+#include <pthread.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+#define INDEX_STABLE 8
+#define INDEX_LIMIT (3 * MGOS_ESPNOW_MAX_PEERS)
+#define INDEX_KEYS (4 * MGOS_ESPNOW_MAX_PEERS)
+#define INDEX_STEPS 20000
+//Every INDEX_NEST_EVERY steps, the next INDEX_NEST_STEPS run inside a dispatch
+#define INDEX_NEST_EVERY 1000
+#define INDEX_NEST_STEPS 20
+
+//Peer i of the shadow table has name peer<i> and MAC mac_of[i], or is not loaded
+static bool loaded[INDEX_KEYS];
+static int mac_of[INDEX_KEYS];
+static int num_loaded;
+static bool reader_stop;
+static int reader_lookups, reader_misses;
+
+//Peers INDEX_KEYS and on, loaded the whole time
+static void *index_reader(void *arg){
+    while(!__atomic_load_n(&reader_stop, __ATOMIC_RELAXED)){
+        for(int i = INDEX_KEYS; i < INDEX_KEYS + INDEX_STABLE; i++){
+            char name[16];
+            uint8_t mac[6];
+            host_peer_name(i, name, sizeof(name));
+            host_peer_mac(i, mac);
+            espnow_dispatch_begin();
+            struct mgos_espnow_peer *by_mac = mgos_espnow_get_peer_by_mac(mac);
+            struct mgos_espnow_peer *by_name = mgos_espnow_get_peer_by_name(name);
+            if(by_mac == NULL || by_name != by_mac || memcmp(by_mac->mac, mac, 6) != 0) reader_misses++;
+            espnow_dispatch_end();
+            reader_lookups++;
+        }
+    }
+    (void)arg;
+    return NULL;
+}
+
+static void index_check(int step){
+    TEST_CHECK(mgos_espnow_total_peers() == num_loaded + INDEX_STABLE, "step %d: %d peers, %d expected", step, mgos_espnow_total_peers(), num_loaded);
+    for(int i = 0; i < INDEX_KEYS; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+        if(!loaded[i]){
+            TEST_CHECK(peer == NULL, "step %d: %s found", step, name);
+            continue;
+        }
+        host_peer_mac(mac_of[i], mac);
+        TEST_CHECK(peer != NULL && memcmp(peer->mac, mac, 6) == 0, "step %d: %s by name", step, name);
+        TEST_CHECK(mgos_espnow_get_peer_by_mac(mac) == peer, "step %d: %s by MAC", step, name);
+    }
+    if(test_failures > 0) exit(test_finish("peer_index"));
+}
+
+int main(void){
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    //Default limit, static memory only
+    for(int i = 0; i <= MGOS_ESPNOW_MAX_PEERS; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_result_t res = mgos_espnow_add_peer(name, mac, false, 1, false);
+        TEST_CHECK(res == (i < MGOS_ESPNOW_MAX_PEERS ? ESPNOW_OK : ESPNOW_MAX_PEERS), "peer %d of the default limit gave %d", i, res);
+    }
+    struct mgos_espnow_mem_stats mem;
+    mgos_espnow_get_mem_stats(&mem);
+    TEST_CHECK(mem.heap_bytes == 0, "%d heap bytes within the static peers", mem.heap_bytes);
+    for(int i = 0; i < MGOS_ESPNOW_MAX_PEERS; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_remove_peer(name, false);
+    }
+
+    mgos_sys_config_set_espnow_max_peers(INDEX_LIMIT + INDEX_STABLE);
+    for(int i = INDEX_KEYS; i < INDEX_KEYS + INDEX_STABLE; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+    pthread_t reader;
+    pthread_create(&reader, NULL, index_reader, NULL);
+    uint32_t r = 1;
+    for(int step = 0; step < INDEX_STEPS; step++){
+        char name[16];
+        uint8_t mac[6];
+        if(step % INDEX_NEST_EVERY == INDEX_NEST_EVERY - INDEX_NEST_STEPS) espnow_dispatch_begin();
+        r = r * 1103515245 + 12345;
+        int i = (int)((r >> 8) % INDEX_KEYS);
+        host_peer_name(i, name, sizeof(name));
+        if(loaded[i] && (r >> 28) < 4){
+            mgos_espnow_remove_peer(name, false);
+            loaded[i] = false;
+            num_loaded--;
+        } else {
+            //Sometimes the MAC of another loaded peer, which replaces that one
+            int m = (r >> 28) == 15 ? (int)((r >> 4) % INDEX_KEYS) : i;
+            int victim = -1;
+            for(int k = 0; k < INDEX_KEYS; k++){
+                if(k != i && loaded[k] && mac_of[k] == m) victim = k;
+            }
+            bool full = !loaded[i] && victim < 0 && num_loaded == INDEX_LIMIT;
+            host_peer_mac(m, mac);
+            mgos_espnow_result_t res = mgos_espnow_add_peer(name, mac, false, 1, false);
+            if(full){
+                TEST_CHECK(res == ESPNOW_MAX_PEERS, "step %d: add to a full table gave %d", step, res);
+            } else {
+                TEST_CHECK(res == ESPNOW_OK, "step %d: add %s gave %d", step, name, res);
+                if(victim >= 0){
+                    loaded[victim] = false;
+                    num_loaded--;
+                }
+                if(!loaded[i]) num_loaded++;
+                loaded[i] = true;
+                mac_of[i] = m;
+            }
+        }
+        if(step % INDEX_NEST_EVERY == INDEX_NEST_EVERY - 1) espnow_dispatch_end();
+        index_check(step);
+    }
+    __atomic_store_n(&reader_stop, true, __ATOMIC_RELAXED);
+    pthread_join(reader, NULL);
+    TEST_CHECK(reader_misses == 0 && reader_lookups > 0, "%d of %d lookups missed a loaded peer", reader_misses, reader_lookups);
+    mgos_espnow_get_mem_stats(&mem);
+    TEST_CHECK(mem.peers.high_water > MGOS_ESPNOW_MAX_PEERS + 2 && mem.heap_bytes > 0, "peers never went past the static pool");
+    for(int i = 0; i < INDEX_KEYS; i++){
+        if(!loaded[i]) continue;
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_remove_peer(name, false);
+        loaded[i] = false;
+        num_loaded--;
+        index_check(INDEX_STEPS + i);
+    }
+    return test_finish("peer_index");
+}
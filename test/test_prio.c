@@ -0,0 +1,159 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//TX priority classes: HIGH frames pass a full queue of other frames, NORMAL and BULK share the airtime
+//by their weights while both are waiting, and espnow.tx_peer_rate keeps a chatty peer from holding the
+//queue. Completions are driven by hand, one frame at a time.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+static char prio_order[256];
+static int prio_num;
+
+static void prio_hook(struct host_radio_frame *frame, void *ud){
+    if(prio_num < (int)sizeof(prio_order)) prio_order[prio_num++] = (char)frame->data[0];
+    (void)ud;
+}
+
+static mgos_espnow_result_t prio_send(const char *name, char tag, mgos_espnow_prio_t prio){
+    uint8_t msg[MGOS_ESPNOW_MAX_LEN];
+    memset(msg, tag, sizeof(msg));
+    return mgos_espnow_send_prio(name, msg, sizeof(msg), prio);
+}
+
+//Send until the queue refuses, returns how many were taken
+static int prio_fill(const char *name, char tag, mgos_espnow_prio_t prio){
+    int num = 0;
+    while(num < 1000 && prio_send(name, tag, prio) == ESPNOW_OK) num++;
+    return num;
+}
+
+static void prio_complete(int num){
+    for(int i = 0; i < num && host_radio_complete(true); i++){
+        host_run_invokes();
+    }
+}
+
+static void prio_drain(void){
+    for(int i = 0; i < 1000; i++){
+        host_advance_ms(1);
+        prio_complete(1000);
+        struct mgos_espnow_tx_stats st;
+        mgos_espnow_get_tx_stats(&st);
+        if(st.queue_depth == 0 && st.in_flight == 0) break;
+    }
+    prio_num = 0;
+}
+
+static int prio_count(char tag, int from, int to){
+    int num = 0;
+    for(int i = from; i < to && i < prio_num; i++){
+        if(prio_order[i] == tag) num++;
+    }
+    return num;
+}
+
+int main(void){
+    struct mgos_espnow_tx_stats tx;
+    struct mgos_espnow_prio_stats ps;
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    host_radio_manual = true;
+    host_radio_hook = prio_hook;
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < 3; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_add_peer(name, mac, false, 1, false);
+    }
+    int window = mgos_sys_config_get_espnow_tx_window();
+
+    //A full queue of NORMAL frames leaves the HIGH slots open, and the HIGH frame is the next one sent
+    int normal = prio_fill("peer0", 'N', ESPNOW_PRIO_NORMAL);
+    TEST_CHECK(normal == MGOS_ESPNOW_TX_QUEUE_LEN - MGOS_ESPNOW_TX_HIGH_SLOTS, "%d NORMAL frames queued", normal);
+    TEST_CHECK(prio_send("peer1", 'H', ESPNOW_PRIO_HIGH) == ESPNOW_OK, "HIGH refused with a full queue");
+    TEST_CHECK(prio_num == window, "%d frames handed to the driver", prio_num);
+    prio_complete(1);
+    TEST_CHECK(prio_num == window + 1 && prio_order[window] == 'H', "HIGH frame not sent next");
+    //The completed frame left one slot, HIGH frames take it and the rest of their own
+    int high = prio_fill("peer1", 'H', ESPNOW_PRIO_HIGH);
+    TEST_CHECK(high == MGOS_ESPNOW_TX_HIGH_SLOTS, "%d more HIGH frames queued", high);
+    prio_complete(high + window);
+    TEST_CHECK(prio_count('H', window, window + 1 + high) == 1 + high, "HIGH frames sent behind NORMAL ones");
+    TEST_CHECK(mgos_espnow_get_prio_stats(ESPNOW_PRIO_HIGH, &ps) && ps.queued == (uint32_t)(1 + high), "HIGH queued %u", (unsigned)ps.queued);
+    TEST_CHECK(!mgos_espnow_get_prio_stats((mgos_espnow_prio_t)MGOS_ESPNOW_PRIO_CLASSES, &ps), "stats of an invalid class");
+    prio_drain();
+
+    //BULK only takes its share of the queue, and while both wait NORMAL gets tx_weight_normal frames
+    //for every tx_weight_bulk BULK one
+    int bulk = prio_fill("peer2", 'B', ESPNOW_PRIO_BULK);
+    int weight_normal = mgos_sys_config_get_espnow_tx_weight_normal(), weight_bulk = mgos_sys_config_get_espnow_tx_weight_bulk();
+    int share = ((MGOS_ESPNOW_TX_QUEUE_LEN - MGOS_ESPNOW_TX_HIGH_SLOTS) * weight_bulk + weight_normal + weight_bulk - 1) / (weight_normal + weight_bulk);
+    TEST_CHECK(bulk - window <= share && bulk > window, "%d BULK frames queued, share %d", bulk, share);
+    normal = prio_fill("peer0", 'N', ESPNOW_PRIO_NORMAL);
+    TEST_CHECK(normal > 0, "NORMAL frames refused next to BULK ones");
+    int start = prio_num, rounds = 10, frames = rounds * (weight_normal + weight_bulk);
+    for(int i = 0; i < frames; i++){
+        prio_complete(1);
+        prio_fill("peer2", 'B', ESPNOW_PRIO_BULK);
+        prio_fill("peer0", 'N', ESPNOW_PRIO_NORMAL);
+    }
+    int sent_normal = prio_count('N', start, start + frames), sent_bulk = prio_count('B', start, start + frames);
+    TEST_CHECK(sent_normal + sent_bulk == frames, "%d frames sent", sent_normal + sent_bulk);
+    TEST_CHECK(sent_bulk >= rounds * weight_bulk - 1 && sent_bulk <= rounds * weight_bulk + 1,
+        "%d NORMAL and %d BULK frames for weights %d:%d", sent_normal, sent_bulk, weight_normal, weight_bulk);
+    prio_drain();
+
+    //Rate limit: a chatty peer queues its burst, a quiet one is not held behind it
+    mgos_sys_config_set_espnow_tx_peer_rate(100);
+    mgos_sys_config_set_espnow_tx_peer_burst(2);
+    host_advance_ms(100);
+    mgos_espnow_get_tx_stats(&tx);
+    uint32_t rate_limited = tx.rate_limited;
+    int chatty = prio_fill("peer0", 'C', ESPNOW_PRIO_NORMAL);
+    TEST_CHECK(chatty == window + 2 && prio_num == window, "chatty peer queued %d frames, %d sent, with a burst of 2", chatty, prio_num);
+    TEST_CHECK(prio_send("peer1", 'Q', ESPNOW_PRIO_NORMAL) == ESPNOW_OK, "quiet peer refused");
+    prio_complete(window);
+    TEST_CHECK(prio_num == window + 1 && prio_order[window] == 'Q', "quiet peer held behind the chatty one");
+    mgos_espnow_get_tx_stats(&tx);
+    TEST_CHECK(tx.rate_limited > rate_limited, "rate limit not counted");
+    for(int i = 0; i < 30; i++){
+        host_advance_ms(1);
+        prio_complete(window);
+    }
+    TEST_CHECK(prio_count('C', 0, prio_num) == chatty, "%d chatty frames sent of %d", prio_count('C', 0, prio_num), chatty);
+    //HIGH frames are not rate limited
+    TEST_CHECK(prio_send("peer0", 'H', ESPNOW_PRIO_HIGH) == ESPNOW_OK, "HIGH refused by the rate limit");
+    prio_complete(window);
+    TEST_CHECK(prio_order[prio_num - 1] == 'H', "HIGH frame held by the rate limit");
+    mgos_sys_config_set_espnow_tx_peer_rate(0);
+    prio_drain();
+
+    return test_finish("prio");
+}
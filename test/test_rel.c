@@ -0,0 +1,234 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Reliable channel. With the loopback radio this node is both ends of the channel to a peer, frames
+//are lost at random in both directions and every message must be delivered exactly once. A sender
+//restarting with the sequence numbers of its old session is played by injecting its frames.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+#define REL_MESSAGES 300
+
+static uint32_t r = 7;
+static int rel_loss_pct;
+//Message never getting through, -1 for none
+static int rel_blocked = -1;
+static uint8_t rel_mute[6];
+static int rel_delivered[REL_MESSAGES];
+static int rel_done, rel_done_ok;
+//Frames sent to the muted peer
+static struct host_radio_frame rel_sent[64];
+static int rel_num_sent;
+
+static void rel_hook(struct host_radio_frame *frame, void *ud){
+    r = r * 1103515245 + 12345;
+    frame->lost = (int)((r >> 8) % 100) < rel_loss_pct;
+    if(rel_blocked >= 0 && frame->len == 8 && frame->data[1] == ESPNOW_PROTO_REL_DATA && memcmp(frame->data + 4, &rel_blocked, 4) == 0){
+        frame->lost = true;
+    }
+    if(memcmp(frame->mac, rel_mute, 6) == 0){
+        frame->lost = true;
+        if(rel_num_sent < 64) rel_sent[rel_num_sent++] = *frame;
+    }
+    (void)ud;
+}
+
+static void rel_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    int i;
+    if(len == sizeof(i)){
+        memcpy(&i, data, sizeof(i));
+        if(i >= 0 && i < REL_MESSAGES) rel_delivered[i]++;
+    }
+    (void)mac;
+    (void)ud;
+}
+
+static void rel_msg_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    rel_done++;
+    rel_done_ok += success;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+//Frames of a sender that is not this node
+static void rel_inject(int p, const uint8_t *frame, int len){
+    uint8_t mac[6];
+    host_peer_mac(p, mac);
+    host_radio_rx(mac, frame, len);
+    host_advance_ms(1);
+}
+
+static void rel_inject_data(int p, uint16_t seq, int i){
+    uint8_t frame[8] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_DATA, seq & 0xff, seq >> 8};
+    memcpy(frame + 4, &i, sizeof(i));
+    rel_inject(p, frame, sizeof(frame));
+}
+
+static void rel_inject_syn(int p, uint8_t epoch, uint16_t seq){
+    uint8_t frame[5] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_SYN, epoch, seq & 0xff, seq >> 8};
+    rel_inject(p, frame, sizeof(frame));
+}
+
+static int rel_count_sent(uint8_t type){
+    int n = 0;
+    for(int i = 0; i < rel_num_sent; i++){
+        if(rel_sent[i].data[0] == ESPNOW_PROTO_MAGIC && rel_sent[i].data[1] == type) n++;
+    }
+    return n;
+}
+
+int main(void){
+    struct mgos_espnow_rel_stats st;
+    char name[16];
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < 4; i++){
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        mgos_espnow_add_peer(name, mac, false, 1, false);
+    }
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, rel_recv_cb, NULL);
+    host_radio_loopback = true;
+    host_radio_latency_ms = 2;
+    host_radio_hook = rel_hook;
+    memset(rel_mute, 0xee, 6);
+
+    //30% of frames lost in each direction, every message arrives once and is reported acknowledged
+    rel_loss_pct = 30;
+    TEST_CHECK(mgos_espnow_set_reliable("peer0", true) == ESPNOW_OK, "enable");
+    for(int i = 0; i < REL_MESSAGES; i++){
+        mgos_espnow_result_t res;
+        while((res = mgos_espnow_send_msg("peer0", (uint8_t *)&i, sizeof(i), rel_msg_cb, NULL, NULL)) == ESPNOW_QUEUE_FULL){
+            host_advance_ms(5);
+        }
+        TEST_CHECK(res == ESPNOW_OK, "message %d gave %d", i, res);
+    }
+    for(int t = 0; t < 2000 && rel_done < REL_MESSAGES; t++) host_advance_ms(10);
+    rel_loss_pct = 0;
+    host_advance_ms(100);
+    int missing = 0, repeated = 0;
+    for(int i = 0; i < REL_MESSAGES; i++){
+        if(rel_delivered[i] == 0) missing++;
+        if(rel_delivered[i] > 1) repeated++;
+    }
+    TEST_CHECK(missing == 0 && repeated == 0, "%d missing, %d delivered more than once", missing, repeated);
+    TEST_CHECK(rel_done == REL_MESSAGES && rel_done_ok == REL_MESSAGES, "%d completed, %d acknowledged", rel_done, rel_done_ok);
+    TEST_CHECK(mgos_espnow_get_rel_stats("peer0", &st), "stats");
+    TEST_CHECK(st.retransmits > 0 && st.duplicates > 0, "%u retransmits, %u duplicates", st.retransmits, st.duplicates);
+    TEST_CHECK(st.acked == REL_MESSAGES && st.received == REL_MESSAGES && st.in_flight == 0, "%u acked, %u received, %d in flight",
+               st.acked, st.received, st.in_flight);
+    TEST_CHECK(st.sessions >= 1, "%u sessions", st.sessions);
+
+    //A sender restarted with an old epoch and sequence numbers its last session already used
+    memset(rel_delivered, 0, sizeof(rel_delivered));
+    rel_inject_syn(1, 1, 100);
+    for(int i = 0; i < 5; i++) rel_inject_data(1, 100 + i, i);
+    rel_inject_data(1, 102, 2);
+    TEST_CHECK(rel_delivered[2] == 1, "repeated frame delivered %d times", rel_delivered[2]);
+    rel_inject_syn(1, 1, 102);
+    rel_inject_data(1, 102, 10);
+    rel_inject_data(1, 103, 11);
+    TEST_CHECK(rel_delivered[10] == 1 && rel_delivered[11] == 1, "after the restart: %d and %d delivered", rel_delivered[10], rel_delivered[11]);
+    TEST_CHECK(mgos_espnow_get_rel_stats("peer1", &st) && st.sessions == 2 && st.received == 7 && st.duplicates == 1,
+               "%u sessions, %u received, %u duplicates", st.sessions, st.received, st.duplicates);
+
+    //Frames given up leave a hole, the receiver is told to move past it
+    rel_inject_syn(1, 2, 200);
+    rel_inject_data(1, 201, 20);
+    rel_inject_data(1, 233, 21);
+    TEST_CHECK(rel_delivered[20] == 1 && rel_delivered[21] == 0, "beyond the window: %d and %d delivered", rel_delivered[20], rel_delivered[21]);
+    uint8_t fwd[4] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_FWD, 201, 0};
+    rel_inject(1, fwd, sizeof(fwd));
+    rel_inject_data(1, 201, 20);
+    rel_inject_data(1, 233, 21);
+    TEST_CHECK(rel_delivered[20] == 1 && rel_delivered[21] == 1, "after moving past the hole: %d and %d delivered", rel_delivered[20], rel_delivered[21]);
+    memset(rel_delivered, 0, sizeof(rel_delivered));
+    rel_blocked = 100;
+    rel_done = rel_done_ok = 0;
+    for(int i = 100; i < 150; i++){
+        while(mgos_espnow_send_msg("peer0", (uint8_t *)&i, sizeof(i), rel_msg_cb, NULL, NULL) == ESPNOW_QUEUE_FULL) host_advance_ms(5);
+    }
+    for(int t = 0; t < 2000 && rel_done < 50; t++) host_advance_ms(10);
+    host_advance_ms(500);
+    rel_blocked = -1;
+    missing = 0;
+    for(int i = 101; i < 150; i++) missing += rel_delivered[i] != 1;
+    TEST_CHECK(rel_delivered[100] == 0 && missing == 0, "%d frames after the given up one not delivered once", missing);
+    TEST_CHECK(rel_done == 50 && rel_done_ok == 49, "%d completed, %d acknowledged", rel_done, rel_done_ok);
+    TEST_CHECK(mgos_espnow_get_rel_stats("peer0", &st) && st.in_flight == 0 && st.failed == 1, "%d in flight, %u failed", st.in_flight, st.failed);
+
+    //Frames wait for the SYN_ACK of their session, older epochs do not count
+    host_peer_mac(2, rel_mute);
+    TEST_CHECK(mgos_espnow_set_reliable("peer2", true) == ESPNOW_OK, "enable peer2");
+    rel_done = rel_done_ok = 0;
+    for(int i = 0; i < 3; i++) mgos_espnow_send_msg("peer2", (uint8_t *)&i, sizeof(i), rel_msg_cb, NULL, NULL);
+    host_advance_ms(1);
+    TEST_CHECK(rel_num_sent == 1 && rel_count_sent(ESPNOW_PROTO_REL_SYN) == 1, "%d frames before the SYN_ACK", rel_num_sent);
+    uint8_t epoch = rel_sent[0].data[2];
+    uint16_t first = rel_sent[0].data[3] | (rel_sent[0].data[4] << 8);
+    uint8_t syn_ack[3] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_SYN_ACK, (uint8_t)(epoch - 1)};
+    rel_inject(2, syn_ack, sizeof(syn_ack));
+    TEST_CHECK(rel_count_sent(ESPNOW_PROTO_REL_DATA) == 0, "data sent on the SYN_ACK of another epoch");
+    syn_ack[2] = epoch;
+    rel_inject(2, syn_ack, sizeof(syn_ack));
+    host_advance_ms(10);
+    TEST_CHECK(rel_count_sent(ESPNOW_PROTO_REL_DATA) == 3, "%d data frames after the SYN_ACK", rel_count_sent(ESPNOW_PROTO_REL_DATA));
+    for(int i = 0, k = 0; i < rel_num_sent; i++){
+        if(rel_sent[i].data[1] != ESPNOW_PROTO_REL_DATA) continue;
+        uint16_t seq = rel_sent[i].data[2] | (rel_sent[i].data[3] << 8);
+        TEST_CHECK(seq == (uint16_t)(first + k), "data frame %d has seq %u, session starts at %u", k, seq, first);
+        k++;
+    }
+    uint8_t ack[8] = {ESPNOW_PROTO_MAGIC, ESPNOW_PROTO_REL_ACK, (uint8_t)((first + 3) & 0xff), (uint8_t)((first + 3) >> 8), 0, 0, 0, 0};
+    rel_inject(2, ack, sizeof(ack));
+    TEST_CHECK(rel_done == 3 && rel_done_ok == 3, "%d completed, %d acknowledged", rel_done, rel_done_ok);
+
+    //A peer that never answers the SYN, its frames fail after the retries
+    host_peer_mac(3, rel_mute);
+    rel_num_sent = 0;
+    rel_done = rel_done_ok = 0;
+    mgos_espnow_set_reliable("peer3", true);
+    mgos_espnow_send_msg("peer3", (uint8_t *)&rel_done, sizeof(int), rel_msg_cb, NULL, NULL);
+    for(int t = 0; t < 1000 && rel_done == 0; t++) host_advance_ms(50);
+    TEST_CHECK(rel_done == 1 && rel_done_ok == 0, "%d completed, %d acknowledged without a SYN_ACK", rel_done, rel_done_ok);
+    TEST_CHECK(rel_count_sent(ESPNOW_PROTO_REL_DATA) == 0, "data sent without a SYN_ACK");
+    TEST_CHECK(rel_count_sent(ESPNOW_PROTO_REL_SYN) == mgos_sys_config_get_espnow_rel_max_retries() + 1, "%d SYNs", rel_count_sent(ESPNOW_PROTO_REL_SYN));
+
+    //The setting follows a peer replaced by a new add
+    host_peer_mac(10, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer0", mac, false, 1, false) == ESPNOW_OK, "replace peer0");
+    TEST_CHECK(mgos_espnow_get_rel_stats("peer0", &st) && st.enabled, "reliable lost on re-add");
+    mgos_espnow_remove_peer("peer0", false);
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    TEST_CHECK(!mgos_espnow_get_rel_stats("peer0", &st) || !st.enabled, "reliable kept after a remove");
+    return test_finish("rel");
+}
@@ -0,0 +1,190 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Requests over the loopback radio, the node serves its own requests as the peer. Pipelined requests
+//are matched to their responses by ID, and every request completes once: with the response, the error
+//of the handler, no handler, a timeout, or a failed send.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define REQ_OP_ECHO 1
+#define REQ_OP_LATER 2
+#define REQ_OP_SILENT 3
+
+static int req_done[64], req_len[64];
+static mgos_espnow_req_status_t req_status[64];
+static int req_bad_data;
+static struct mgos_espnow_req_info req_saved;
+static bool req_have_saved;
+
+//Answers with the request payload reversed
+static void req_echo_cb(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    uint8_t out[4096];
+    for(int i = 0; i < len; i++){
+        out[i] = data[len - 1 - i];
+    }
+    mgos_espnow_respond(req, ESPNOW_REQ_OK, out, len);
+    (void)ud;
+}
+
+static void req_later_cb(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    req_saved = *req;
+    req_have_saved = true;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static void req_silent_cb(const struct mgos_espnow_req_info *req, const uint8_t *data, int len, void *ud){
+    (void)req;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+//ud is the request index, its payload is the index repeated req_len times
+static void req_resp_cb(uint16_t id, const uint8_t *mac, mgos_espnow_req_status_t status, const uint8_t *data, int len, void *ud){
+    int i = (int)(intptr_t)ud;
+    req_done[i]++;
+    req_status[i] = status;
+    if(status == ESPNOW_REQ_OK){
+        if(len != req_len[i]) req_bad_data++;
+        for(int j = 0; j < len; j++){
+            if(data[j] != (uint8_t)i) req_bad_data++;
+        }
+    } else if(status != ESPNOW_REQ_ERROR && status != ESPNOW_REQ_NO_HANDLER && data != NULL){
+        req_bad_data++;
+    }
+    (void)id;
+    (void)mac;
+}
+
+static mgos_espnow_result_t req_send(int i, uint8_t op, int timeout_ms){
+    uint8_t data[64];
+    memset(data, (uint8_t)i, sizeof(data));
+    req_len[i] = i + 1;
+    return mgos_espnow_request("peer0", op, data, req_len[i], timeout_ms, req_resp_cb, (void *)(intptr_t)i, NULL);
+}
+
+static void req_run(int ms){
+    for(int i = 0; i < ms; i++){
+        host_advance_ms(1);
+    }
+}
+
+static esp_err_t req_refuse_hook(const uint8_t *mac, const uint8_t *data, size_t len){
+    (void)mac;
+    (void)data;
+    (void)len;
+    return ESP_FAIL;
+}
+
+int main(void){
+    struct mgos_espnow_req_stats st;
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    host_radio_loopback = true;
+    host_radio_latency_ms = 1;
+    mgos_espnow_register_req_cb(REQ_OP_ECHO, req_echo_cb, NULL);
+    mgos_espnow_register_req_cb(REQ_OP_LATER, req_later_cb, NULL);
+    mgos_espnow_register_req_cb(REQ_OP_SILENT, req_silent_cb, NULL);
+
+    //Every slot pending at once, each response reaches its own request
+    for(int i = 0; i < MGOS_ESPNOW_REQ_SLOTS; i++){
+        TEST_CHECK(req_send(i, REQ_OP_ECHO, 1000) == ESPNOW_OK, "request %d", i);
+    }
+    mgos_espnow_get_req_stats(&st);
+    TEST_CHECK(st.pending == MGOS_ESPNOW_REQ_SLOTS && st.slots == MGOS_ESPNOW_REQ_SLOTS, "pending %d", st.pending);
+    TEST_CHECK(req_send(MGOS_ESPNOW_REQ_SLOTS, REQ_OP_ECHO, 1000) == ESPNOW_QUEUE_FULL, "request beyond the slots");
+    req_run(100);
+    for(int i = 0; i < MGOS_ESPNOW_REQ_SLOTS; i++){
+        TEST_CHECK(req_done[i] == 1 && req_status[i] == ESPNOW_REQ_OK, "request %d done %d status %d", i, req_done[i], req_status[i]);
+    }
+    TEST_CHECK(req_bad_data == 0, "%d bad response bytes", req_bad_data);
+    mgos_espnow_get_req_stats(&st);
+    TEST_CHECK(st.pending == 0 && st.completed == MGOS_ESPNOW_REQ_SLOTS && st.served == MGOS_ESPNOW_REQ_SLOTS, "completed %u served %u",
+        (unsigned)st.completed, (unsigned)st.served);
+    memset(req_done, 0, sizeof(req_done));
+
+    //Requests and responses longer than a frame are fragmented
+    uint8_t big[1000];
+    memset(big, 40, sizeof(big));
+    req_len[40] = sizeof(big);
+    TEST_CHECK(mgos_espnow_request("peer0", REQ_OP_ECHO, big, sizeof(big), 1000, req_resp_cb, (void *)(intptr_t)40, NULL) == ESPNOW_OK, "long request");
+    req_run(100);
+    TEST_CHECK(req_done[40] == 1 && req_status[40] == ESPNOW_REQ_OK && req_bad_data == 0, "long request status %d", req_status[40]);
+    struct mgos_espnow_frag_stats fs;
+    mgos_espnow_get_frag_stats(&fs);
+    TEST_CHECK(fs.tx_messages == 2 && fs.rx_messages == 2, "long request and response not fragmented");
+
+    //No handler, and an error answered later from outside the handler
+    TEST_CHECK(req_send(1, 99, 1000) == ESPNOW_OK, "request without handler");
+    TEST_CHECK(req_send(2, REQ_OP_LATER, 1000) == ESPNOW_OK, "request answered later");
+    req_run(20);
+    TEST_CHECK(req_done[1] == 1 && req_status[1] == ESPNOW_REQ_NO_HANDLER, "no handler status %d", req_status[1]);
+    TEST_CHECK(req_have_saved && req_done[2] == 0, "request answered before the response");
+    TEST_CHECK(mgos_espnow_respond(&req_saved, ESPNOW_REQ_ERROR, NULL, 0) == ESPNOW_OK, "respond");
+    req_run(20);
+    TEST_CHECK(req_done[2] == 1 && req_status[2] == ESPNOW_REQ_ERROR, "late error status %d", req_status[2]);
+
+    //Timeout within a wheel tick of timeout_ms, a response after it is unmatched
+    TEST_CHECK(req_send(3, REQ_OP_SILENT, 100) == ESPNOW_OK, "silent request");
+    TEST_CHECK(req_send(4, REQ_OP_SILENT, 300) == ESPNOW_OK, "silent request");
+    req_run(90);
+    TEST_CHECK(req_done[3] == 0, "timed out early");
+    req_run(30);
+    TEST_CHECK(req_done[3] == 1 && req_status[3] == ESPNOW_REQ_TIMEOUT && req_done[4] == 0, "timeout status %d", req_status[3]);
+    req_run(200);
+    TEST_CHECK(req_done[4] == 1 && req_status[4] == ESPNOW_REQ_TIMEOUT, "second timeout status %d", req_status[4]);
+    mgos_espnow_get_req_stats(&st);
+    uint32_t unmatched = st.unmatched;
+    TEST_CHECK(req_send(5, REQ_OP_LATER, 50) == ESPNOW_OK, "request answered too late");
+    req_run(100);
+    TEST_CHECK(req_done[5] == 1 && req_status[5] == ESPNOW_REQ_TIMEOUT, "late status %d", req_status[5]);
+    mgos_espnow_respond(&req_saved, ESPNOW_REQ_OK, NULL, 0);
+    req_run(20);
+    mgos_espnow_get_req_stats(&st);
+    TEST_CHECK(req_done[5] == 1 && st.unmatched == unmatched + 1, "late response unmatched %u", (unsigned)(st.unmatched - unmatched));
+    TEST_CHECK(st.timeouts == 3, "timeouts %u", (unsigned)st.timeouts);
+
+    //A request frame the driver refuses completes once as a failed send
+    host_radio_send_hook = req_refuse_hook;
+    mgos_sys_config_set_espnow_tx_max_retries(0);
+    mgos_espnow_result_t res = req_send(6, REQ_OP_ECHO, 1000);
+    req_run(50);
+    host_radio_send_hook = NULL;
+    TEST_CHECK(req_done[6] == (res == ESPNOW_OK ? 1 : 0), "failed send done %d times", req_done[6]);
+    TEST_CHECK(res != ESPNOW_OK || req_status[6] == ESPNOW_REQ_SEND_FAILED, "failed send status %d", req_status[6]);
+    mgos_espnow_get_req_stats(&st);
+    TEST_CHECK(st.pending == 0, "%d requests left pending", st.pending);
+
+    return test_finish("req");
+}
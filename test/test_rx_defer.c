@@ -0,0 +1,133 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Deferred RX dispatch: bursts through the driver receive callback are copied to the ring, delivered
+//in order from the event loop, and counted as dropped once the ring is full. A second thread plays
+//the WiFi task against the event loop draining the ring.
+
+#include <pthread.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define RX_THREAD_FRAMES 20000
+
+static uint32_t rx_next;
+static uint32_t rx_delivered;
+static uint32_t rx_out_of_order;
+
+static void rx_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    uint32_t seq;
+    if(len < (int)sizeof(seq)) return;
+    memcpy(&seq, data, sizeof(seq));
+    if(seq < rx_next) rx_out_of_order++;
+    rx_next = seq + 1;
+    rx_delivered++;
+    //Payload after the sequence number is its low byte repeated
+    for(int i = sizeof(seq); i < len; i++){
+        if(data[i] != (uint8_t)seq){
+            rx_out_of_order++;
+            break;
+        }
+    }
+    (void)mac;
+    (void)ud;
+}
+
+static void rx_frame(uint32_t seq, int len){
+    uint8_t mac[6];
+    uint8_t data[MGOS_ESPNOW_MAX_LEN];
+    host_peer_mac(1, mac);
+    memset(data, (uint8_t)seq, sizeof(data));
+    memcpy(data, &seq, sizeof(seq));
+    host_radio_rx(mac, data, len);
+}
+
+static void *rx_wifi_task(void *arg){
+    for(uint32_t seq = 0; seq < RX_THREAD_FRAMES; seq++){
+        rx_frame(seq, 4 + seq % 200);
+        if(seq % 64 == 63) sched_yield();
+    }
+    __atomic_store_n((bool *)arg, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(void){
+    struct mgos_espnow_rx_stats st;
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_rx_defer(true);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(1, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer1", mac, false, 1, false) == ESPNOW_OK, "add");
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, rx_cb, NULL);
+
+    //A burst larger than the ring, nothing runs on the WiFi task
+    int burst = MGOS_ESPNOW_RX_RING_SLOTS + 5;
+    for(int i = 0; i < burst; i++) rx_frame(i, MGOS_ESPNOW_MAX_LEN);
+    TEST_CHECK(rx_delivered == 0, "%u delivered from the WiFi task", rx_delivered);
+    mgos_espnow_get_rx_stats(&st);
+    TEST_CHECK(st.ring_slots == MGOS_ESPNOW_RX_RING_SLOTS, "%d slots", st.ring_slots);
+    TEST_CHECK(st.ring_used == MGOS_ESPNOW_RX_RING_SLOTS, "%d used", st.ring_used);
+    TEST_CHECK(st.ring_high_water == MGOS_ESPNOW_RX_RING_SLOTS, "high water %d", st.ring_high_water);
+    TEST_CHECK(st.dropped == 5, "%u dropped", st.dropped);
+    TEST_CHECK(st.deferred == MGOS_ESPNOW_RX_RING_SLOTS, "%u deferred", st.deferred);
+    //Drained in batches of espnow.rx_batch per event loop pass
+    host_run_invokes();
+    TEST_CHECK(rx_delivered == MGOS_ESPNOW_RX_RING_SLOTS, "%u delivered", rx_delivered);
+    TEST_CHECK(rx_out_of_order == 0, "%u out of order or corrupted", rx_out_of_order);
+    mgos_espnow_get_rx_stats(&st);
+    TEST_CHECK(st.ring_used == 0, "%d used after draining", st.ring_used);
+
+    //Ring space is reused, including frames that wrap around its end
+    rx_next = 0;
+    rx_delivered = 0;
+    for(int round = 0; round < 10; round++){
+        for(int i = 0; i < 7; i++) rx_frame(round * 7 + i, 4 + i * 37);
+        host_run_invokes();
+    }
+    TEST_CHECK(rx_delivered == 70, "%u delivered in rounds", rx_delivered);
+    TEST_CHECK(rx_out_of_order == 0, "%u out of order or corrupted in rounds", rx_out_of_order);
+
+    //WiFi task against the event loop, every frame is either delivered in order or counted as dropped
+    mgos_espnow_get_rx_stats(&st);
+    uint32_t dropped = st.dropped;
+    rx_next = 0;
+    rx_delivered = 0;
+    bool done = false;
+    pthread_t thread;
+    pthread_create(&thread, NULL, rx_wifi_task, &done);
+    while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) host_run_invokes();
+    pthread_join(thread, NULL);
+    host_run_invokes();
+    mgos_espnow_get_rx_stats(&st);
+    TEST_CHECK(rx_delivered + (st.dropped - dropped) == RX_THREAD_FRAMES, "%u delivered %u dropped of %d",
+               rx_delivered, st.dropped - dropped, RX_THREAD_FRAMES);
+    TEST_CHECK(rx_delivered > 0, "nothing delivered");
+    TEST_CHECK(rx_out_of_order == 0, "%u out of order or corrupted from the thread", rx_out_of_order);
+    TEST_CHECK(st.ring_used == 0, "%d used at the end", st.ring_used);
+    return test_finish("rx_defer");
+}
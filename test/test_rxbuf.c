@@ -0,0 +1,212 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Shared RX buffers: every buffer callback of a frame gets the same copy, retained buffers outlive the
+//dispatch and go back to the pool on their last release, also from another thread. When all are
+//retained buffer callbacks miss frames and the exhaustion is counted, plain callbacks still get them.
+
+#include <pthread.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define RXBUF_THREAD_FRAMES 20000
+
+static struct mgos_espnow_rxbuf *rb_seen[2];
+static int rb_calls[2], rb_plain_calls;
+static bool rb_keep;
+static struct mgos_espnow_rxbuf *rb_kept[4 * MGOS_ESPNOW_RXBUF_SLOTS];
+static int rb_num_kept;
+
+static void rb_buf_cb(struct mgos_espnow_rxbuf *buf, void *ud){
+    int which = (int)(intptr_t)ud;
+    rb_seen[which] = buf;
+    rb_calls[which]++;
+    if(rb_keep && rb_num_kept < (int)(sizeof(rb_kept) / sizeof(rb_kept[0]))){
+        mgos_espnow_rxbuf_retain(buf);
+        rb_kept[rb_num_kept++] = buf;
+    }
+}
+
+static void rb_plain_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    rb_plain_calls++;
+    (void)mac;
+    (void)data;
+    (void)len;
+    (void)ud;
+}
+
+static void rb_frame(uint8_t tag, int len){
+    uint8_t mac[6], data[MGOS_ESPNOW_MAX_LEN];
+    host_peer_mac(0, mac);
+    memset(data, tag, sizeof(data));
+    host_radio_rx(mac, data, len);
+    host_run_invokes();
+}
+
+static void rb_release_kept(void){
+    for(int i = 0; i < rb_num_kept; i++){
+        mgos_espnow_rxbuf_release(rb_kept[i]);
+    }
+    rb_num_kept = 0;
+}
+
+//Buffers retained on the event loop, released by another task
+static struct mgos_espnow_rxbuf *rb_ring[64];
+static uint32_t rb_ring_head, rb_ring_tail;
+static uint32_t rb_bad_data;
+
+static void rb_thread_cb(struct mgos_espnow_rxbuf *buf, void *ud){
+    uint32_t head = rb_ring_head;
+    if(head - __atomic_load_n(&rb_ring_tail, __ATOMIC_ACQUIRE) == 64) return;
+    mgos_espnow_rxbuf_retain(buf);
+    rb_ring[head % 64] = buf;
+    __atomic_store_n(&rb_ring_head, head + 1, __ATOMIC_RELEASE);
+    (void)ud;
+}
+
+static void *rb_release_task(void *arg){
+    while(!__atomic_load_n((bool *)arg, __ATOMIC_ACQUIRE) ||
+          __atomic_load_n(&rb_ring_tail, __ATOMIC_RELAXED) != __atomic_load_n(&rb_ring_head, __ATOMIC_ACQUIRE)){
+        uint32_t tail = rb_ring_tail;
+        if(tail == __atomic_load_n(&rb_ring_head, __ATOMIC_ACQUIRE)){
+            sched_yield();
+            continue;
+        }
+        struct mgos_espnow_rxbuf *buf = rb_ring[tail % 64];
+        //The payload is the low byte of the length repeated, it must not change while retained
+        for(int i = 0; i < buf->len; i++){
+            if(buf->data[i] != (uint8_t)buf->len){
+                rb_bad_data++;
+                break;
+            }
+        }
+        mgos_espnow_rxbuf_release(buf);
+        __atomic_store_n(&rb_ring_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int main(void){
+    struct mgos_espnow_rxbuf_stats st;
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(0, mac);
+    mgos_espnow_add_peer("peer0", mac, false, 1, false);
+    TEST_CHECK(mgos_espnow_register_recv_buf_cb(NULL, ALL, rb_buf_cb, (void *)0) == ESPNOW_OK, "register ALL");
+    TEST_CHECK(mgos_espnow_register_recv_buf_cb(mac, MAC, rb_buf_cb, (void *)1) == ESPNOW_OK, "register MAC");
+    TEST_CHECK(mgos_espnow_register_recv_mac_cb(NULL, ALL, rb_plain_cb, NULL) == ESPNOW_OK, "register plain");
+
+    //One copy shared by both callbacks, back in the pool after the dispatch
+    rb_frame('a', 100);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(rb_calls[0] == 1 && rb_calls[1] == 1 && rb_plain_calls == 1, "calls %d %d %d", rb_calls[0], rb_calls[1], rb_plain_calls);
+    TEST_CHECK(rb_seen[0] != NULL && rb_seen[0] == rb_seen[1], "callbacks got different buffers");
+    TEST_CHECK(st.allocs == 1 && st.in_use == 0 && st.exhausted == 0, "allocs %u in use %d", (unsigned)st.allocs, st.in_use);
+    TEST_CHECK(st.pool_slots == MGOS_ESPNOW_RXBUF_SLOTS, "pool slots %d", st.pool_slots);
+
+    //Retained buffers keep their frame, the last release returns them
+    rb_keep = true;
+    rb_frame('b', 50);
+    rb_frame('c', 60);
+    rb_keep = false;
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 2 && rb_num_kept == 4, "in use %d kept %d", st.in_use, rb_num_kept);
+    TEST_CHECK(rb_kept[0] != rb_kept[2], "retained buffer reused");
+    TEST_CHECK(rb_kept[0]->len == 50 && rb_kept[0]->data[49] == 'b' && rb_kept[2]->len == 60 && rb_kept[2]->data[0] == 'c',
+        "retained frames changed");
+    TEST_CHECK(memcmp(rb_kept[0]->mac, mac, 6) == 0, "retained buffer mac");
+    mgos_espnow_rxbuf_release(rb_kept[0]);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 2, "buffer returned with a reference left");
+    rb_release_kept();
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 0, "leak, %d buffers in use", st.in_use);
+
+    //Exhaustion: buffer callbacks miss frames, plain ones don't
+    rb_calls[0] = rb_calls[1] = rb_plain_calls = 0;
+    rb_keep = true;
+    for(int i = 0; i < MGOS_ESPNOW_RXBUF_SLOTS + 3; i++){
+        rb_frame('d', 10 + i);
+    }
+    rb_keep = false;
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == MGOS_ESPNOW_RXBUF_SLOTS && st.high_water == MGOS_ESPNOW_RXBUF_SLOTS, "in use %d high water %d", st.in_use, st.high_water);
+    TEST_CHECK(st.exhausted == 3, "exhausted %u", (unsigned)st.exhausted);
+    TEST_CHECK(rb_calls[0] == MGOS_ESPNOW_RXBUF_SLOTS && rb_calls[1] == MGOS_ESPNOW_RXBUF_SLOTS, "buffer calls %d %d", rb_calls[0], rb_calls[1]);
+    TEST_CHECK(rb_plain_calls == MGOS_ESPNOW_RXBUF_SLOTS + 3, "plain calls %d", rb_plain_calls);
+    rb_release_kept();
+    rb_frame('e', 20);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 0 && st.exhausted == 3 && rb_calls[0] == MGOS_ESPNOW_RXBUF_SLOTS + 1, "pool not back after exhaustion");
+
+    //A release too many is ignored
+    rb_keep = true;
+    rb_frame('f', 30);
+    rb_keep = false;
+    struct mgos_espnow_rxbuf *extra = rb_kept[0];
+    rb_release_kept();
+    mgos_espnow_rxbuf_release(extra);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 0 && extra->refs == 0, "in use %d refs %d after an extra release", st.in_use, extra->refs);
+
+    //Removed callbacks get nothing
+    mgos_espnow_remove_recv_buf_cb(rb_buf_cb, NULL, ALL);
+    mgos_espnow_remove_recv_buf_cb(rb_buf_cb, mac, MAC);
+    rb_calls[0] = rb_calls[1] = 0;
+    uint32_t allocs = st.allocs;
+    rb_frame('g', 40);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(rb_calls[0] == 0 && rb_calls[1] == 0 && st.allocs == allocs, "removed callbacks called");
+
+    //Released from another task while the event loop takes buffers
+    TEST_CHECK(mgos_espnow_register_recv_buf_cb(NULL, ALL, rb_thread_cb, NULL) == ESPNOW_OK, "register thread cb");
+    bool done = false;
+    pthread_t thread;
+    pthread_create(&thread, NULL, rb_release_task, &done);
+    for(int i = 0; i < RXBUF_THREAD_FRAMES; i++){
+        int len = 1 + i % MGOS_ESPNOW_MAX_LEN;
+        rb_frame((uint8_t)len, len);
+    }
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 0, "leak, %d buffers in use after the threads", st.in_use);
+    TEST_CHECK(rb_bad_data == 0, "%u retained buffers changed", (unsigned)rb_bad_data);
+    TEST_CHECK(st.high_water <= MGOS_ESPNOW_RXBUF_SLOTS, "high water %d", st.high_water);
+    mgos_espnow_remove_recv_buf_cb(rb_thread_cb, NULL, ALL);
+    TEST_CHECK(mgos_espnow_register_recv_buf_cb(NULL, ALL, rb_buf_cb, (void *)0) == ESPNOW_OK, "register ALL again");
+    rb_calls[0] = 0;
+    for(int i = 0; i < MGOS_ESPNOW_RXBUF_SLOTS; i++){
+        rb_frame('h', 10);
+    }
+    mgos_espnow_get_rxbuf_stats(&st);
+    TEST_CHECK(st.in_use == 0 && rb_calls[0] == MGOS_ESPNOW_RXBUF_SLOTS, "pool not whole after the threads");
+
+    return test_finish("rxbuf");
+}
@@ -0,0 +1,204 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Sends that skip building the payload first: mgos_espnow_sendv gathers segments and frames built in
+//place with mgos_espnow_frame_alloc go out with mgos_espnow_frame_send. Payloads must arrive byte
+//for byte, on the plain path straight from the TX slot and on a reliable peer through its own frame,
+//headroom kept in front of a frame can be filled after the payload, and a total over
+//MGOS_ESPNOW_MAX_LEN or a negative length is refused without keeping a slot. All of it runs with
+//heap calls counted and none may happen.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define SENDV_HEADROOM 8
+#define SENDV_HDR_LEN 4
+
+static uint8_t sendv_rx[MGOS_ESPNOW_MAX_LEN], sendv_air[MGOS_ESPNOW_MAX_LEN];
+static int sendv_rx_len, sendv_rx_num, sendv_air_len, sendv_sent, sendv_failed;
+
+static void sendv_recv_cb(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    sendv_rx_num++;
+    sendv_rx_len = len;
+    if(len > 0 && len <= (int)sizeof(sendv_rx)) memcpy(sendv_rx, data, len);
+    (void)peer;
+    (void)ud;
+}
+
+static void sendv_sent_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    if(success) sendv_sent++;
+    else sendv_failed++;
+    (void)handle;
+    (void)mac;
+    (void)ud;
+}
+
+//Last frame put on air, to see what the plain path sends
+static void sendv_hook(struct host_radio_frame *frame, void *ud){
+    sendv_air_len = frame->len;
+    memcpy(sendv_air, frame->data, frame->len);
+    (void)ud;
+}
+
+static void sendv_fill(uint8_t *buf, int len, uint8_t seed){
+    for(int i = 0; i < len; i++){
+        buf[i] = (uint8_t)(seed + i * 7);
+    }
+}
+
+//Runs the send and checks the one message delivered is expect
+static void sendv_expect(const char *what, const uint8_t *expect, int len, bool plain){
+    int num = sendv_rx_num, sent = sendv_sent;
+    host_advance_ms(50);
+    TEST_CHECK(sendv_rx_num == num + 1, "%s: %d messages delivered", what, sendv_rx_num - num);
+    TEST_CHECK(sendv_rx_len == len && memcmp(sendv_rx, expect, len) == 0, "%s: %d bytes delivered of %d", what, sendv_rx_len, len);
+    TEST_CHECK(sendv_sent == sent + 1 && sendv_failed == 0, "%s: %d completed, %d failed", what, sendv_sent - sent, sendv_failed);
+    //Plain frames carry the payload as it is
+    if(plain) TEST_CHECK(sendv_air_len == len && memcmp(sendv_air, expect, len) == 0, "%s: %d bytes on air", what, sendv_air_len);
+    sendv_air_len = 0;
+}
+
+//Slots mgos_espnow_frame_alloc can still take, all given back before returning
+static int sendv_free_slots(void){
+    uint8_t *slots[64];
+    int num = 0;
+    while(num < 64 && (slots[num] = mgos_espnow_frame_alloc()) != NULL) num++;
+    for(int i = 0; i < num; i++){
+        mgos_espnow_frame_free(slots[i]);
+    }
+    return num;
+}
+
+static void sendv_segments(const char *name, bool plain){
+    uint8_t a[40], b[100], c[MGOS_ESPNOW_MAX_LEN], whole[MGOS_ESPNOW_MAX_LEN];
+    sendv_fill(a, sizeof(a), 1);
+    sendv_fill(b, sizeof(b), 2);
+    sendv_fill(c, sizeof(c), 3);
+    //An empty segment in the middle adds nothing
+    struct mgos_espnow_seg segs[] = {{a, sizeof(a)}, {NULL, 0}, {b, sizeof(b)}, {c, 60}};
+    memcpy(whole, a, sizeof(a));
+    memcpy(whole + sizeof(a), b, sizeof(b));
+    memcpy(whole + sizeof(a) + sizeof(b), c, 60);
+    int len = (int)sizeof(a) + (int)sizeof(b) + 60;
+    TEST_CHECK(mgos_espnow_sendv(name, segs, 4, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "%s: segments", name);
+    sendv_expect(name, whole, len, plain);
+
+    struct mgos_espnow_seg one = {c, 77};
+    TEST_CHECK(mgos_espnow_sendv(name, &one, 1, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "%s: one segment", name);
+    sendv_expect(name, c, 77, plain);
+}
+
+static void sendv_limits(void){
+    uint8_t a[MGOS_ESPNOW_MAX_LEN];
+    sendv_fill(a, sizeof(a), 4);
+    int slots = sendv_free_slots();
+    //Exactly MGOS_ESPNOW_MAX_LEN over two segments still fits
+    struct mgos_espnow_seg full[] = {{a, 100}, {a + 100, MGOS_ESPNOW_MAX_LEN - 100}};
+    TEST_CHECK(mgos_espnow_sendv("peer0", full, 2, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "max len");
+    sendv_expect("max len", a, MGOS_ESPNOW_MAX_LEN, true);
+    struct mgos_espnow_seg over[] = {{a, 100}, {a, MGOS_ESPNOW_MAX_LEN - 99}};
+    TEST_CHECK(mgos_espnow_sendv("peer0", over, 2, sendv_sent_cb, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "over max len");
+    struct mgos_espnow_seg negative[] = {{a, 10}, {a, -1}};
+    TEST_CHECK(mgos_espnow_sendv("peer0", negative, 2, sendv_sent_cb, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "negative segment");
+    struct mgos_espnow_seg wrapped[] = {{a, MGOS_ESPNOW_MAX_LEN}, {a, -MGOS_ESPNOW_MAX_LEN}};
+    TEST_CHECK(mgos_espnow_sendv("peer0", wrapped, 2, sendv_sent_cb, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "negative total");
+    TEST_CHECK(mgos_espnow_sendv("nobody", full, 2, sendv_sent_cb, NULL, NULL) == ESPNOW_PEER_NOT_FOUND, "unknown peer");
+
+    uint8_t *p = mgos_espnow_frame_alloc();
+    TEST_CHECK(p != NULL, "alloc");
+    TEST_CHECK(mgos_espnow_frame_send("peer0", p + SENDV_HEADROOM, MGOS_ESPNOW_MAX_LEN - SENDV_HEADROOM + 1, sendv_sent_cb, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "frame past the slot");
+    p = mgos_espnow_frame_alloc();
+    TEST_CHECK(mgos_espnow_frame_send("peer0", p, -1, sendv_sent_cb, NULL, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "negative frame");
+    p = mgos_espnow_frame_alloc();
+    TEST_CHECK(mgos_espnow_frame_send("nobody", p, 10, sendv_sent_cb, NULL, NULL) == ESPNOW_PEER_NOT_FOUND, "frame to unknown peer");
+    TEST_CHECK(mgos_espnow_frame_send("peer0", a, 10, sendv_sent_cb, NULL, NULL) == ESPNOW_SEND_FAILED, "not a slot");
+    host_advance_ms(50);
+    TEST_CHECK(sendv_free_slots() == slots, "%d slots free, %d before", sendv_free_slots(), slots);
+}
+
+//The payload goes in after the headroom, the header in front of it once the payload is known
+static void sendv_frames(const char *name, bool plain){
+    uint8_t expect[MGOS_ESPNOW_MAX_LEN];
+    int len = 120;
+    uint8_t *p = mgos_espnow_frame_alloc();
+    TEST_CHECK(p != NULL, "%s: alloc", name);
+    if(p == NULL) return;
+    sendv_fill(p + SENDV_HEADROOM, len, 5);
+    uint8_t *start = p + SENDV_HEADROOM - SENDV_HDR_LEN;
+    start[0] = 'H';
+    start[1] = 'D';
+    start[2] = (uint8_t)len;
+    start[3] = (uint8_t)(len >> 8);
+    memcpy(expect, start, SENDV_HDR_LEN + len);
+    TEST_CHECK(mgos_espnow_frame_send(name, start, SENDV_HDR_LEN + len, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "%s: frame", name);
+    sendv_expect(name, expect, SENDV_HDR_LEN + len, plain);
+
+    //Filling the whole slot
+    p = mgos_espnow_frame_alloc();
+    sendv_fill(p, MGOS_ESPNOW_MAX_LEN, 6);
+    memcpy(expect, p, MGOS_ESPNOW_MAX_LEN);
+    TEST_CHECK(mgos_espnow_frame_send(name, p, MGOS_ESPNOW_MAX_LEN, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "%s: full frame", name);
+    sendv_expect(name, expect, MGOS_ESPNOW_MAX_LEN, plain);
+
+    p = mgos_espnow_frame_alloc();
+    TEST_CHECK(p != NULL, "%s: alloc to free", name);
+    mgos_espnow_frame_free(p);
+}
+
+int main(void){
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_radio_loopback = true;
+    host_radio_latency_ms = 1;
+    host_radio_hook = sendv_hook;
+    for(int i = 0; i < 2; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+        TEST_CHECK(mgos_espnow_register_recv_peer_cb(name, sendv_recv_cb, NULL) == ESPNOW_OK, "callback of %s", name);
+    }
+    //peer1 is reliable, its frames are built by the reliable channel
+    TEST_CHECK(mgos_espnow_set_reliable("peer1", true) == ESPNOW_OK, "reliable");
+    host_advance_ms(50);
+    //Full frames to it go as fragments, the receiving end grows its reassembly buffer once and keeps it
+    uint8_t *p = mgos_espnow_frame_alloc();
+    TEST_CHECK(p != NULL, "warm up alloc");
+    if(p != NULL) TEST_CHECK(mgos_espnow_frame_send("peer1", p, MGOS_ESPNOW_MAX_LEN, sendv_sent_cb, NULL, NULL) == ESPNOW_OK, "warm up");
+    host_advance_ms(50);
+
+    host_heap_count(true);
+    sendv_segments("peer0", true);
+    sendv_segments("peer1", false);
+    sendv_limits();
+    sendv_frames("peer0", true);
+    sendv_frames("peer1", false);
+    host_heap_count(false);
+    TEST_CHECK(host_heap_calls() == 0, "%u heap calls", (unsigned)host_heap_calls());
+    return test_finish("sendv");
+}
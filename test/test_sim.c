@@ -0,0 +1,130 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Nodes on the virtual radio of the ubuntu platform, each a process: every node sends to every other
+//one, without loss all frames arrive and with loss the send callbacks report the frames lost.
+
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define SIM_NODES 3
+#define SIM_FRAMES 40
+
+static int sim_received[SIM_NODES];
+static int sim_sent_ok;
+static int sim_sent_fail;
+
+static void sim_recv_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    //Frames carry the sending node
+    if(len == 2 && data[0] == 0x5a && data[1] < SIM_NODES && mac[5] == data[1]) sim_received[data[1]]++;
+    (void)ud;
+}
+
+static void sim_send_cb(const uint8_t *mac, bool success, void *ud){
+    if(success) sim_sent_ok++;
+    else sim_sent_fail++;
+    (void)mac;
+    (void)ud;
+}
+
+static void sim_mac(int node, uint8_t mac[6]){
+    mac[0] = 0x02;
+    mac[1] = 0x00;
+    mac[2] = 0x00;
+    mac[3] = 0x00;
+    mac[4] = (uint8_t)(node >> 8);
+    mac[5] = (uint8_t)node;
+}
+
+static int sim_node(int node, int port, int loss_pct){
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_sim_node(node);
+    mgos_sys_config_set_espnow_sim_nodes(SIM_NODES);
+    mgos_sys_config_set_espnow_sim_port(port);
+    mgos_sys_config_set_espnow_sim_loss_pct(loss_pct);
+    mgos_sys_config_set_espnow_sim_latency_ms(1);
+    host_real_time();
+    TEST_CHECK(mgos_espnow_init(), "node %d", node);
+    for(int i = 0; i < SIM_NODES; i++){
+        char name[16];
+        uint8_t mac[6];
+        if(i == node) continue;
+        snprintf(name, sizeof(name), "node%d", i);
+        sim_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 0, false) == ESPNOW_OK, "node %d adding %s", node, name);
+    }
+    mgos_espnow_register_recv_mac_cb(NULL, ALL, sim_recv_cb, NULL);
+    mgos_espnow_register_send_mac_cb(NULL, ALL, sim_send_cb, NULL);
+    //Wait for the others to listen
+    host_run_ms(200);
+    uint8_t msg[2] = {0x5a, (uint8_t)node};
+    for(int f = 0; f < SIM_FRAMES; f++){
+        for(int i = 0; i < SIM_NODES; i++){
+            char name[16];
+            if(i == node) continue;
+            snprintf(name, sizeof(name), "node%d", i);
+            TEST_CHECK(mgos_espnow_send(name, msg, sizeof(msg)) == ESPNOW_OK, "node %d frame %d to %s", node, f, name);
+        }
+        host_run_ms(5);
+    }
+    host_run_ms(500);
+    int sent = SIM_FRAMES * (SIM_NODES - 1);
+    TEST_CHECK(sim_sent_ok + sim_sent_fail == sent, "node %d: %d ok %d failed of %d", node, sim_sent_ok, sim_sent_fail, sent);
+    for(int i = 0; i < SIM_NODES; i++){
+        if(i == node) continue;
+        if(loss_pct == 0) TEST_CHECK(sim_received[i] == SIM_FRAMES, "node %d got %d of %d from node %d", node, sim_received[i], SIM_FRAMES, i);
+        else TEST_CHECK(sim_received[i] < SIM_FRAMES, "node %d got all %d from node %d with %d%% loss", node, sim_received[i], i, loss_pct);
+    }
+    if(loss_pct == 0) TEST_CHECK(sim_sent_fail == 0, "node %d: %d failed", node, sim_sent_fail);
+    else TEST_CHECK(sim_sent_fail > 0 && sim_sent_ok > 0, "node %d: %d ok %d failed with %d%% loss", node, sim_sent_ok, sim_sent_fail, loss_pct);
+    return test_finish("sim node");
+}
+
+static int sim_run(int port, int loss_pct){
+    pid_t pids[SIM_NODES];
+    for(int i = 0; i < SIM_NODES; i++){
+        pids[i] = fork();
+        if(pids[i] == 0) _exit(sim_node(i, port, loss_pct));
+    }
+    int failed = 0;
+    for(int i = 0; i < SIM_NODES; i++){
+        int status;
+        if(pids[i] < 0 || waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) failed++;
+    }
+    return failed;
+}
+
+int main(void){
+    //Ports apart for runs in parallel
+    int port = 20000 + (getpid() % 2000) * 8;
+    TEST_CHECK(sim_run(port, 0) == 0, "nodes failed without loss");
+    TEST_CHECK(sim_run(port + SIM_NODES, 50) == 0, "nodes failed with loss");
+    return test_finish("sim");
+}
@@ -0,0 +1,200 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Binary peer store: saved adds and removes are batched into one append, replaying the file rebuilds the
+//peer list, a damaged tail is dropped, an interrupted compaction is recovered and JSON import and export
+//keep the same peers.
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+#define STORE_FILE "test_store.bin"
+#define STORE_JSON "test_store.json"
+
+static long store_file_size(const char *filename){
+    struct stat st;
+    return stat(filename, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void store_add(int first, int num, bool save){
+    for(int i = first; i < first + num; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1 + i % 13, save) == ESPNOW_OK, "add %s", name);
+    }
+}
+
+static void store_remove(int first, int num, bool save){
+    for(int i = first; i < first + num; i++){
+        char name[16];
+        host_peer_name(i, name, sizeof(name));
+        mgos_espnow_remove_peer(name, save);
+    }
+}
+
+//Peers first..first+num-1 are loaded with the values store_add gave them
+static bool store_has(int first, int num){
+    for(int i = first; i < first + num; i++){
+        char name[16];
+        uint8_t mac[6];
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        struct mgos_espnow_peer *peer = mgos_espnow_get_peer_by_name(name);
+        if(peer == NULL || memcmp(peer->mac, mac, 6) != 0 || peer->channel != 1 + i % 13 || peer->softap) return false;
+    }
+    return true;
+}
+
+//Forget every peer in memory and load them back as on boot
+static void store_reboot(void){
+    int num = mgos_espnow_total_peers();
+    while(num-- > 0){
+        struct mgos_espnow_peer *peer = SLIST_FIRST(&peer_list);
+        mgos_espnow_remove_peer(peer->name, false);
+    }
+    TEST_CHECK(mgos_espnow_total_peers() == 0, "peers left before reload");
+}
+
+int main(void){
+    struct mgos_espnow_store_stats st;
+    remove(STORE_FILE);
+    remove(STORE_FILE ".tmp");
+    remove(STORE_JSON);
+    mgos_sys_config_set_espnow_peers_filename(STORE_JSON);
+    mgos_sys_config_set_espnow_store_filename(STORE_FILE);
+    mgos_sys_config_set_espnow_store_commit_ms(500);
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+
+    //Boot without a store writes an empty one. Saves wait for the commit timer and are written with one append.
+    mgos_espnow_get_store_stats(&st);
+    uint32_t compactions = st.compactions;
+    TEST_CHECK(compactions == 1 && store_file_size(STORE_FILE) == st.file_size, "store not created on boot");
+    store_add(0, 20, true);
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(st.pending_bytes > 0 && st.commits == 0, "pending %d commits %u", st.pending_bytes, (unsigned)st.commits);
+    host_advance_ms(499);
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(st.pending_bytes > 0, "committed before espnow.store_commit_ms");
+    host_advance_ms(1);
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(st.pending_bytes == 0, "pending %d after the timer", st.pending_bytes);
+    TEST_CHECK(st.commits == 1 && st.compactions == compactions, "commits %u compactions %u", (unsigned)st.commits, (unsigned)st.compactions);
+    TEST_CHECK(st.peers == 20, "peers %d", st.peers);
+    TEST_CHECK(store_file_size(STORE_FILE) == st.file_size, "file size %ld stats %d", store_file_size(STORE_FILE), st.file_size);
+
+    //Removes are records too
+    store_remove(0, 5, true);
+    mgos_espnow_store_commit();
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(st.peers == 15 && st.pending_bytes == 0, "peers %d pending %d", st.peers, st.pending_bytes);
+    store_reboot();
+    TEST_CHECK(espnow_store_load(), "load");
+    TEST_CHECK(mgos_espnow_total_peers() == 15 && store_has(5, 15), "reloaded %d peers", mgos_espnow_total_peers());
+
+    //Churn compacts the log once it holds well more records than peers
+    compactions = st.compactions;
+    for(int round = 0; round < 10; round++){
+        store_remove(5, 15, true);
+        store_add(5, 15, true);
+        mgos_espnow_store_commit();
+    }
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(st.compactions > compactions, "no compaction after churn, %d records", st.records);
+    TEST_CHECK(st.records <= 2 * 15 + 32 && st.records >= 15, "records %d", st.records);
+    TEST_CHECK(store_file_size(STORE_FILE) == st.file_size, "file size %ld stats %d", store_file_size(STORE_FILE), st.file_size);
+    store_reboot();
+    TEST_CHECK(espnow_store_load(), "load after churn");
+    TEST_CHECK(mgos_espnow_total_peers() == 15 && store_has(5, 15), "%d peers after churn", mgos_espnow_total_peers());
+
+    //A record cut short by a reset is dropped, the ones before it kept
+    TEST_CHECK(mgos_espnow_store_compact(), "compact");
+    long good_size = store_file_size(STORE_FILE);
+    store_add(20, 1, true);
+    mgos_espnow_store_commit();
+    long full_size = store_file_size(STORE_FILE);
+    TEST_CHECK(full_size > good_size, "append of peer20");
+    TEST_CHECK(truncate(STORE_FILE, full_size - 3) == 0, "truncate");
+    store_reboot();
+    mgos_espnow_get_store_stats(&st);
+    compactions = st.compactions;
+    TEST_CHECK(espnow_store_load(), "load truncated");
+    mgos_espnow_get_store_stats(&st);
+    TEST_CHECK(mgos_espnow_total_peers() == 15 && store_has(5, 15), "%d peers from the truncated store", mgos_espnow_total_peers());
+    TEST_CHECK(st.compactions == compactions + 1 && store_file_size(STORE_FILE) == good_size, "truncated store not rewritten, size %ld", store_file_size(STORE_FILE));
+
+    //A bad CRC drops the record and everything after it
+    store_add(20, 2, true);
+    mgos_espnow_store_commit();
+    FILE *f = fopen(STORE_FILE, "r+b");
+    TEST_CHECK(f != NULL, "open store");
+    if(f != NULL){
+        fseek(f, good_size + 3, SEEK_SET);
+        int c = fgetc(f);
+        fseek(f, good_size + 3, SEEK_SET);
+        fputc(c ^ 0xff, f);
+        fclose(f);
+    }
+    store_reboot();
+    TEST_CHECK(espnow_store_load(), "load corrupted");
+    TEST_CHECK(mgos_espnow_total_peers() == 15 && store_has(5, 15), "%d peers from the corrupted store", mgos_espnow_total_peers());
+    TEST_CHECK(mgos_espnow_get_peer_by_name("peer21") == NULL, "peer21 kept after a corrupted record");
+    TEST_CHECK(store_file_size(STORE_FILE) == good_size, "corrupted store not rewritten");
+
+    //Power lost between removing the old file and renaming the new one
+    TEST_CHECK(rename(STORE_FILE, STORE_FILE ".tmp") == 0, "rename");
+    store_reboot();
+    TEST_CHECK(espnow_store_load(), "load from the temporary file");
+    TEST_CHECK(mgos_espnow_total_peers() == 15 && store_has(5, 15), "%d peers recovered", mgos_espnow_total_peers());
+    TEST_CHECK(store_file_size(STORE_FILE) == good_size && store_file_size(STORE_FILE ".tmp") < 0, "temporary file left");
+
+    //Not a store
+    f = fopen(STORE_FILE, "wb");
+    if(f != NULL){
+        fputs("{\"peers\": []}", f);
+        fclose(f);
+    }
+    store_reboot();
+    TEST_CHECK(!espnow_store_load() && mgos_espnow_total_peers() == 0, "invalid store loaded");
+
+    //JSON roundtrip, importing with save rewrites the store
+    store_add(5, 15, false);
+    TEST_CHECK(mgos_espnow_export_json(STORE_JSON), "export");
+    store_reboot();
+    TEST_CHECK(mgos_espnow_import_json(STORE_JSON, true) == 15, "import");
+    TEST_CHECK(store_has(5, 15), "imported peers differ");
+    store_reboot();
+    TEST_CHECK(espnow_store_load() && mgos_espnow_total_peers() == 15 && store_has(5, 15), "store after import");
+
+    remove(STORE_FILE);
+    remove(STORE_JSON);
+    return test_finish("store");
+}
@@ -0,0 +1,138 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//Callback tables against the WiFi task: a thread delivers frames and send statuses through the
+//driver callbacks while the event loop registers and removes receive and send callbacks, which
+//rebuilds the tables and frees the old ones once no dispatch is running. Every callback checks
+//its user data, a freed entry would show up as a wrong one. Built with -fsanitize=thread when
+//the host build has no other sanitizer, see test/CMakeLists.txt.
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define STRESS_ROUNDS 2000
+
+static int stress_magic;
+static uint32_t stress_rx;
+static uint32_t stress_tx;
+static uint32_t stress_bad;
+static bool stress_done;
+
+static void stress_check(void *ud){
+    if(ud != &stress_magic) __atomic_fetch_add(&stress_bad, 1, __ATOMIC_RELAXED);
+}
+
+static void stress_rx_mac_cb(const uint8_t *mac, const uint8_t *data, int len, void *ud){
+    stress_check(ud);
+    __atomic_fetch_add(&stress_rx, 1, __ATOMIC_RELAXED);
+    (void)mac;
+    (void)data;
+    (void)len;
+}
+
+static void stress_rx_peer_cb(struct mgos_espnow_peer *peer, const uint8_t *data, int len, void *ud){
+    stress_check(ud);
+    (void)peer;
+    (void)data;
+    (void)len;
+}
+
+static void stress_tx_mac_cb(const uint8_t *mac, bool success, void *ud){
+    stress_check(ud);
+    __atomic_fetch_add(&stress_tx, 1, __ATOMIC_RELAXED);
+    (void)mac;
+    (void)success;
+}
+
+static void stress_tx_peer_cb(struct mgos_espnow_peer *peer, bool success, void *ud){
+    stress_check(ud);
+    (void)peer;
+    (void)success;
+}
+
+static void *stress_wifi_task(void *arg){
+    uint8_t mac[6];
+    uint8_t data[32];
+    memset(data, 0x5a, sizeof(data));
+    for(int i = 0; !__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE); i++){
+        host_peer_mac(1 + i % 2, mac);
+        host_radio_rx(mac, data, sizeof(data));
+        host_radio_tx_status(mac, true);
+    }
+    (void)arg;
+    return NULL;
+}
+
+int main(void){
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_rx_defer(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(1, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer1", mac, false, 1, false) == ESPNOW_OK, "add peer1");
+    host_peer_mac(2, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer2", mac, false, 1, false) == ESPNOW_OK, "add peer2");
+    //Registered for the whole run, counts what the thread got through
+    TEST_CHECK(mgos_espnow_register_recv_mac_cb(NULL, ALL, stress_rx_mac_cb, &stress_magic) == ESPNOW_OK, "recv all");
+    TEST_CHECK(mgos_espnow_register_send_mac_cb(NULL, ALL, stress_tx_mac_cb, &stress_magic) == ESPNOW_OK, "send all");
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, stress_wifi_task, NULL);
+    host_peer_mac(1, mac);
+    for(int round = 0; round < STRESS_ROUNDS; round++){
+        mgos_espnow_register_recv_mac_cb(mac, MAC, stress_rx_mac_cb, &stress_magic);
+        mgos_espnow_register_recv_peer_cb("peer2", stress_rx_peer_cb, &stress_magic);
+        mgos_espnow_register_send_mac_cb(mac, MAC, stress_tx_mac_cb, &stress_magic);
+        mgos_espnow_register_send_peer_cb("peer1", stress_tx_peer_cb, &stress_magic);
+        mgos_espnow_register_send_mac_cb(NULL, ANY_PEER, stress_tx_mac_cb, &stress_magic);
+        if(round % 8 == 0) sched_yield();
+        mgos_espnow_remove_recv_mac_cb(stress_rx_mac_cb, mac, MAC);
+        mgos_espnow_remove_recv_peer_cb(stress_rx_peer_cb, "peer2");
+        mgos_espnow_remove_send_mac_cb(stress_tx_mac_cb, mac, MAC);
+        mgos_espnow_remove_send_peer_cb(stress_tx_peer_cb, "peer1");
+        mgos_espnow_remove_send_mac_cb(stress_tx_mac_cb, NULL, ANY_PEER);
+        host_run_invokes();
+    }
+    __atomic_store_n(&stress_done, true, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    host_run_invokes();
+
+    TEST_CHECK(__atomic_load_n(&stress_bad, __ATOMIC_RELAXED) == 0, "%u callbacks with the wrong user data", stress_bad);
+    TEST_CHECK(stress_rx > 0, "nothing received");
+    TEST_CHECK(stress_tx > 0, "no send status");
+    //The removed ones are gone, the permanent ones still run
+    uint32_t rx = stress_rx;
+    uint32_t tx = stress_tx;
+    host_radio_rx(mac, (const uint8_t *)"x", 1);
+    host_radio_tx_status(mac, true);
+    TEST_CHECK(stress_rx == rx + 1, "%u received for one frame", stress_rx - rx);
+    TEST_CHECK(stress_tx == tx + 1, "%u send callbacks for one status", stress_tx - tx);
+    return test_finish("stress");
+}
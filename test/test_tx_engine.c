@@ -0,0 +1,140 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//TX engine against a driver that refuses frames at random with ESP_ERR_ESPNOW_NO_MEM and loses
+//others: every message gets exactly one completion, the window is never exceeded, and the queue
+//reports its depth and rejects sends once full.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "test.h"
+
+#define TX_MESSAGES 2000
+#define TX_WINDOW 3
+
+static uint32_t r = 1;
+static int tx_calls[TX_MESSAGES];
+static bool tx_success[TX_MESSAGES];
+static mgos_espnow_handle_t tx_handles[TX_MESSAGES];
+static int tx_over_window;
+static int tx_refused;
+
+static uint32_t tx_rand(void){
+    r = r * 1103515245 + 12345;
+    return r >> 8;
+}
+
+static esp_err_t tx_send_hook(const uint8_t *mac, const uint8_t *data, size_t len){
+    if(host_radio_pending() >= TX_WINDOW) tx_over_window++;
+    if(tx_rand() % 100 < 30){
+        tx_refused++;
+        return ESP_ERR_ESPNOW_NO_MEM;
+    }
+    (void)mac;
+    (void)data;
+    (void)len;
+    return ESP_OK;
+}
+
+static void tx_lose_hook(struct host_radio_frame *frame, void *ud){
+    frame->lost = tx_rand() % 100 < 20;
+    (void)ud;
+}
+
+static void tx_msg_cb(mgos_espnow_handle_t handle, const uint8_t *mac, bool success, void *ud){
+    int i = (int)(intptr_t)ud;
+    TEST_CHECK(handle == tx_handles[i], "message %d completed with handle %u, %u given", i, handle, tx_handles[i]);
+    tx_calls[i]++;
+    tx_success[i] = success;
+    (void)mac;
+}
+
+int main(void){
+    struct mgos_espnow_tx_stats st;
+    char name[16];
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_tx_window(TX_WINDOW);
+    mgos_sys_config_set_espnow_coalesce(false);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    for(int i = 0; i < 4; i++){
+        host_peer_name(i, name, sizeof(name));
+        host_peer_mac(i, mac);
+        TEST_CHECK(mgos_espnow_add_peer(name, mac, false, 1, false) == ESPNOW_OK, "add %s", name);
+    }
+
+    //Backpressure: with completions held back the queue fills up and sends are rejected
+    host_radio_manual = true;
+    uint8_t msg[16] = "backpressure";
+    int accepted = 0;
+    while(accepted < 10 * MGOS_ESPNOW_TX_QUEUE_LEN && mgos_espnow_send("peer0", msg, sizeof(msg)) == ESPNOW_OK) accepted++;
+    mgos_espnow_get_tx_stats(&st);
+    TEST_CHECK(accepted >= MGOS_ESPNOW_TX_QUEUE_LEN - MGOS_ESPNOW_TX_HIGH_SLOTS && accepted < 10 * MGOS_ESPNOW_TX_QUEUE_LEN, "%d accepted", accepted);
+    TEST_CHECK(st.queue_full == 1, "%u rejected", st.queue_full);
+    TEST_CHECK(st.in_flight == TX_WINDOW && host_radio_pending() == TX_WINDOW, "%d in flight, %d in the driver", st.in_flight, host_radio_pending());
+    TEST_CHECK(st.queue_depth == accepted - TX_WINDOW, "depth %d of %d accepted", st.queue_depth, accepted);
+    TEST_CHECK(st.queue_high_water >= st.queue_depth, "high water %d, depth %d", st.queue_high_water, st.queue_depth);
+    //Each completion releases the next frame
+    for(int i = 0; i < accepted; i++){
+        TEST_CHECK(host_radio_complete(true), "completion %d", i);
+        host_run_invokes();
+    }
+    mgos_espnow_get_tx_stats(&st);
+    TEST_CHECK(st.queue_depth == 0 && st.in_flight == 0, "depth %d, %d in flight after draining", st.queue_depth, st.in_flight);
+    TEST_CHECK(st.sent == (uint32_t)accepted, "%u sent of %d", st.sent, accepted);
+
+    //Random driver failures and losses, every message completes once
+    host_radio_manual = false;
+    host_radio_latency_ms = 1;
+    host_radio_send_hook = tx_send_hook;
+    host_radio_hook = tx_lose_hook;
+    mgos_espnow_get_tx_stats(&st);
+    uint32_t sent = st.sent, failed = st.failed;
+    for(int i = 0; i < TX_MESSAGES; i++){
+        host_peer_name(tx_rand() % 4, name, sizeof(name));
+        snprintf((char *)msg, sizeof(msg), "msg %d", i);
+        mgos_espnow_result_t res;
+        while((res = mgos_espnow_send_msg(name, msg, sizeof(msg), tx_msg_cb, (void *)(intptr_t)i, &tx_handles[i])) == ESPNOW_QUEUE_FULL){
+            host_advance_ms(1);
+        }
+        TEST_CHECK(res == ESPNOW_OK, "message %d gave %d", i, res);
+        if(tx_rand() % 4 == 0) host_advance_ms(1);
+    }
+    for(int i = 0; i < 1000 && host_timers_pending() > 0; i++) host_advance_ms(10);
+    int ok = 0;
+    for(int i = 0; i < TX_MESSAGES; i++){
+        TEST_CHECK(tx_calls[i] == 1, "message %d completed %d times", i, tx_calls[i]);
+        ok += tx_success[i];
+    }
+    mgos_espnow_get_tx_stats(&st);
+    TEST_CHECK(tx_over_window == 0, "window exceeded %d times", tx_over_window);
+    TEST_CHECK(st.sent - sent == (uint32_t)ok, "%u sent, %d successful callbacks", st.sent - sent, ok);
+    TEST_CHECK(st.sent - sent + st.failed - failed == TX_MESSAGES, "%u sent %u failed", st.sent - sent, st.failed - failed);
+    TEST_CHECK(st.retries > 0 && tx_refused > 0, "%u retries, %d refused", st.retries, tx_refused);
+    TEST_CHECK(ok > TX_MESSAGES / 2 && ok < TX_MESSAGES, "%d successful", ok);
+    TEST_CHECK(st.queue_depth == 0 && st.in_flight == 0, "depth %d, %d in flight at the end", st.queue_depth, st.in_flight);
+    return test_finish("tx_engine");
+}
@@ -0,0 +1,230 @@
+/*
+MIT License
+
+Copyright (c) 2020 Juan Molero
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+//File transfer. With the loopback radio this node sends the file to a peer and receives it as that
+//peer. Covers a clean transfer, random loss in both directions, a peer that does not accept files,
+//a transfer cut off by a blackout that resumes where the receiver stopped, and a partial file that
+//changed before the resume, which the CRC check catches.
+
+#include "host.h"
+#include "mgos_espnow.h"
+#include "mgos_espnow_internal.h"
+#include "test.h"
+
+#define XFER_SRC "test_xfer_src.bin"
+#define XFER_DST "test_xfer_dst.bin"
+#define XFER_SIZE 30000
+
+static uint32_t r = 11;
+static int xfer_loss_pct;
+static bool xfer_blackout;
+static int xfer_data_frames;
+
+struct xfer_result {
+    bool done;
+    mgos_espnow_xfer_status_t status;
+    uint32_t done_bytes;
+};
+static struct xfer_result xfer_tx, xfer_rx;
+
+static void xfer_hook(struct host_radio_frame *frame, void *ud){
+    r = r * 1103515245 + 12345;
+    frame->lost = xfer_blackout || (int)((r >> 8) % 100) < xfer_loss_pct;
+    if(frame->len > 2 && frame->data[0] == ESPNOW_PROTO_MAGIC && frame->data[1] == ESPNOW_PROTO_XFER && frame->data[2] == 2){
+        xfer_data_frames++;
+    }
+    (void)ud;
+}
+
+static void xfer_cb(const struct mgos_espnow_xfer_info *info, mgos_espnow_xfer_status_t status, void *ud){
+    struct xfer_result *res = info->sender ? &xfer_tx : &xfer_rx;
+    res->done = true;
+    res->status = status;
+    res->done_bytes = info->done;
+    (void)ud;
+}
+
+static void xfer_write_src(uint32_t seed){
+    FILE *f = fopen(XFER_SRC, "wb");
+    for(int i = 0; i < XFER_SIZE; i++){
+        seed = seed * 1103515245 + 12345;
+        fputc((int)(seed >> 16) & 0xff, f);
+    }
+    fclose(f);
+}
+
+static bool xfer_same(const char *a, const char *b){
+    FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+    bool same = fa != NULL && fb != NULL;
+    while(same){
+        int ca = fgetc(fa), cb = fgetc(fb);
+        if(ca != cb) same = false;
+        if(ca == EOF) break;
+    }
+    if(fa != NULL) fclose(fa);
+    if(fb != NULL) fclose(fb);
+    return same;
+}
+
+static bool xfer_exists(const char *path){
+    FILE *f = fopen(path, "rb");
+    if(f != NULL) fclose(f);
+    return f != NULL;
+}
+
+static mgos_espnow_result_t xfer_start(){
+    memset(&xfer_tx, 0, sizeof(xfer_tx));
+    memset(&xfer_rx, 0, sizeof(xfer_rx));
+    return mgos_espnow_send_file("peer1", XFER_SRC, XFER_DST, xfer_cb, NULL);
+}
+
+//Until both ends reported, or the sender alone for a refused offer
+static void xfer_run(bool both, int max_ms){
+    for(int t = 0; t < max_ms && !(xfer_tx.done && (xfer_rx.done || !both)); t += 5) host_advance_ms(5);
+}
+
+int main(void){
+    struct mgos_espnow_xfer_stats st, before;
+    uint8_t mac[6];
+    mgos_sys_config_set_espnow_peers_filename("");
+    mgos_sys_config_set_espnow_store_filename("");
+    mgos_sys_config_set_espnow_enable_broadcast(false);
+    mgos_sys_config_set_espnow_xfer_accept(true);
+    mgos_sys_config_set_espnow_xfer_dir("");
+    mgos_sys_config_set_espnow_xfer_timeout_ms(1000);
+    TEST_CHECK(mgos_espnow_init(), "init");
+    host_peer_mac(1, mac);
+    TEST_CHECK(mgos_espnow_add_peer("peer1", mac, false, 1, false) == ESPNOW_OK, "add");
+    mgos_espnow_register_xfer_cb(xfer_cb, NULL);
+    host_radio_loopback = true;
+    host_radio_latency_ms = 2;
+    host_radio_hook = xfer_hook;
+    remove(XFER_DST);
+    remove(XFER_DST ".part");
+    remove(XFER_DST ".xfs");
+    xfer_write_src(1);
+
+    //No loss, every chunk sent once
+    TEST_CHECK(mgos_espnow_send_file("nobody", XFER_SRC, NULL, xfer_cb, NULL) == ESPNOW_PEER_NOT_FOUND, "unknown peer");
+    TEST_CHECK(mgos_espnow_send_file("peer1", XFER_SRC, "../x", xfer_cb, NULL) == ESPNOW_PAYLOAD_LEN_ERR, "bad name");
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start");
+    xfer_run(true, 10000);
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_OK, "sender %d %d", xfer_tx.done, xfer_tx.status);
+    TEST_CHECK(xfer_rx.done && xfer_rx.status == ESPNOW_XFER_OK, "receiver %d %d", xfer_rx.done, xfer_rx.status);
+    TEST_CHECK(xfer_tx.done_bytes == XFER_SIZE && xfer_rx.done_bytes == XFER_SIZE, "done %u %u", xfer_tx.done_bytes, xfer_rx.done_bytes);
+    TEST_CHECK(xfer_same(XFER_SRC, XFER_DST), "received file differs");
+    TEST_CHECK(!xfer_exists(XFER_DST ".part") && !xfer_exists(XFER_DST ".xfs"), "partial files left");
+    mgos_espnow_get_xfer_stats(&st);
+    uint32_t chunks = st.sent;
+    TEST_CHECK(chunks > 100 && st.received == chunks, "%u sent %u received", st.sent, st.received);
+    TEST_CHECK(st.resent == 0 && st.duplicates == 0, "%u resent %u duplicates", st.resent, st.duplicates);
+    TEST_CHECK(st.completed == 2 && st.failed == 0, "%u completed %u failed", st.completed, st.failed);
+
+    //15% of frames lost both ways, offers, chunks, ACKs and the END included
+    xfer_write_src(2);
+    xfer_loss_pct = 15;
+    before = st;
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start lossy");
+    xfer_run(true, 60000);
+    xfer_loss_pct = 0;
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_OK, "lossy sender %d %d", xfer_tx.done, xfer_tx.status);
+    TEST_CHECK(xfer_rx.done && xfer_rx.status == ESPNOW_XFER_OK, "lossy receiver %d %d", xfer_rx.done, xfer_rx.status);
+    TEST_CHECK(xfer_same(XFER_SRC, XFER_DST), "lossy received file differs");
+    mgos_espnow_get_xfer_stats(&st);
+    TEST_CHECK(st.sent - before.sent == chunks, "%u sent for %u chunks", st.sent - before.sent, chunks);
+    TEST_CHECK(st.resent > before.resent, "nothing resent");
+    TEST_CHECK(st.received - before.received == chunks, "%u written for %u chunks", st.received - before.received, chunks);
+    host_advance_ms(2000);
+
+    //A peer that does not take files answers the offer
+    mgos_sys_config_set_espnow_xfer_accept(false);
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start rejected");
+    xfer_run(false, 2000);
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_REJECTED, "rejected %d %d", xfer_tx.done, xfer_tx.status);
+    mgos_sys_config_set_espnow_xfer_accept(true);
+
+    //Cut off after more than ESPNOW_XFER_SAVE_EVERY chunks, both ends time out and the receiver keeps
+    //the partial file and its state
+    xfer_write_src(3);
+    remove(XFER_DST);
+    mgos_espnow_get_xfer_stats(&before);
+    xfer_data_frames = 0;
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start cut");
+    for(int t = 0; t < 10000 && xfer_data_frames < (int)(chunks * 3 / 4); t++) host_advance_ms(1);
+    xfer_blackout = true;
+    xfer_run(true, 5000);
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_TIMEOUT, "cut sender %d %d", xfer_tx.done, xfer_tx.status);
+    TEST_CHECK(xfer_rx.done && xfer_rx.status == ESPNOW_XFER_TIMEOUT, "cut receiver %d %d", xfer_rx.done, xfer_rx.status);
+    TEST_CHECK(xfer_exists(XFER_DST ".part") && xfer_exists(XFER_DST ".xfs"), "partial files missing");
+    TEST_CHECK(!xfer_exists(XFER_DST), "cut file completed");
+    uint32_t kept = xfer_rx.done_bytes;
+    TEST_CHECK(kept >= XFER_SIZE / 2 && kept < XFER_SIZE, "%u bytes kept", kept);
+    mgos_espnow_get_xfer_stats(&st);
+    TEST_CHECK(st.active == 0, "%d active after the timeouts", st.active);
+
+    //Same name and size again, only the chunks after the saved state are sent
+    xfer_blackout = false;
+    before = st;
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start resume");
+    xfer_run(true, 10000);
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_OK, "resumed sender %d %d", xfer_tx.done, xfer_tx.status);
+    TEST_CHECK(xfer_rx.done && xfer_rx.status == ESPNOW_XFER_OK, "resumed receiver %d %d", xfer_rx.done, xfer_rx.status);
+    TEST_CHECK(xfer_same(XFER_SRC, XFER_DST), "resumed file differs");
+    mgos_espnow_get_xfer_stats(&st);
+    TEST_CHECK(st.resumed == before.resumed + 1, "%u resumed", st.resumed - before.resumed);
+    uint32_t skipped = kept / (XFER_SIZE / chunks + 1);
+    TEST_CHECK(st.sent - before.sent <= chunks - skipped, "%u sent on resume, %u were kept", st.sent - before.sent, skipped);
+    TEST_CHECK(!xfer_exists(XFER_DST ".part") && !xfer_exists(XFER_DST ".xfs"), "partial files left after resume");
+    host_advance_ms(2000);
+
+    //The partial file changed while stopped, the kept chunks go into the receiver's CRC as they are on
+    //disk and the whole file fails the check
+    xfer_write_src(4);
+    remove(XFER_DST);
+    xfer_data_frames = 0;
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start corrupt");
+    for(int t = 0; t < 10000 && xfer_data_frames < (int)(chunks * 3 / 4); t++) host_advance_ms(1);
+    xfer_blackout = true;
+    xfer_run(true, 5000);
+    xfer_blackout = false;
+    TEST_CHECK(xfer_rx.status == ESPNOW_XFER_TIMEOUT, "corrupt cut %d", xfer_rx.status);
+    FILE *f = fopen(XFER_DST ".part", "r+b");
+    TEST_CHECK(f != NULL, "no partial file");
+    if(f != NULL){
+        fseek(f, 10, SEEK_SET);
+        int c = fgetc(f);
+        fseek(f, 10, SEEK_SET);
+        fputc(c ^ 0xff, f);
+        fclose(f);
+    }
+    TEST_CHECK(xfer_start() == ESPNOW_OK, "start corrupt resume");
+    xfer_run(true, 10000);
+    TEST_CHECK(xfer_tx.done && xfer_tx.status == ESPNOW_XFER_CRC_ERROR, "corrupt sender %d %d", xfer_tx.done, xfer_tx.status);
+    TEST_CHECK(xfer_rx.done && xfer_rx.status == ESPNOW_XFER_CRC_ERROR, "corrupt receiver %d %d", xfer_rx.done, xfer_rx.status);
+    TEST_CHECK(!xfer_exists(XFER_DST) && !xfer_exists(XFER_DST ".part") && !xfer_exists(XFER_DST ".xfs"), "files left after the CRC error");
+
+    remove(XFER_SRC);
+    remove(XFER_DST);
+    return test_finish("xfer");
+}